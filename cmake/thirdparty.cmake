@@ -50,6 +50,12 @@ CPMAddPackage(
     "TINYGLTF_INSTALL OFF"
 )
 
+if (tinygltf_ADDED)
+  # Images are decoded lazily by our TextureStreamer, so tinygltf shouldn't
+  # read external image files at all, it only needs to remember their URIs.
+  target_compile_definitions(tinygltf PRIVATE TINYGLTF_NO_EXTERNAL_IMAGE)
+endif ()
+
 # etna -- our wrapper around Vulkan to make life easier
 CPMAddPackage(
   NAME etna
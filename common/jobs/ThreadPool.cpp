@@ -0,0 +1,123 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include <tracy/Tracy.hpp>
+
+
+ThreadPool::ThreadPool(std::size_t thread_count)
+{
+  if (thread_count == 0)
+    thread_count = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+
+  workers.reserve(thread_count);
+  for (std::size_t i = 0; i < thread_count; ++i)
+    workers.emplace_back([this]() { workerLoop(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::unique_lock lock(mutex);
+    stopping = true;
+  }
+  hasTasks.notify_all();
+
+  for (auto& worker : workers)
+    worker.join();
+}
+
+void ThreadPool::submit(Task task)
+{
+  // Nobody to run it otherwise
+  if (workers.empty())
+  {
+    task();
+    return;
+  }
+
+  {
+    std::unique_lock lock(mutex);
+    tasks.push_back(std::move(task));
+  }
+  hasTasks.notify_one();
+}
+
+void ThreadPool::workerLoop()
+{
+  tracy::SetThreadName("ThreadPool worker");
+
+  for (;;)
+  {
+    Task task;
+    {
+      std::unique_lock lock(mutex);
+      hasTasks.wait(lock, [this]() { return stopping || !tasks.empty(); });
+      // Drain the queue before stopping, someone might be waiting on these tasks
+      if (tasks.empty())
+        return;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+
+    task();
+  }
+}
+
+void ThreadPool::parallelFor(
+  std::size_t count, std::size_t grain, fu2::function_view<void(std::size_t) const> func)
+{
+  if (count == 0)
+    return;
+
+  grain = std::max<std::size_t>(grain, 1);
+  const std::size_t chunkCount = (count + grain - 1) / grain;
+
+  if (workers.empty() || chunkCount == 1)
+  {
+    for (std::size_t i = 0; i < count; ++i)
+      func(i);
+    return;
+  }
+
+  // Helpers may start running long after we are done (e.g. when all workers are busy),
+  // so the shared state has to outlive this call. They don't touch `func` in that case.
+  struct State
+  {
+    std::atomic<std::size_t> nextChunk{0};
+    std::atomic<std::size_t> doneChunks{0};
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+  auto state = std::make_shared<State>();
+
+  auto work = [state, count, grain, chunkCount, func]() {
+    for (;;)
+    {
+      const std::size_t chunk = state->nextChunk.fetch_add(1);
+      if (chunk >= chunkCount)
+        return;
+
+      const std::size_t end = std::min(count, (chunk + 1) * grain);
+      for (std::size_t i = chunk * grain; i < end; ++i)
+        func(i);
+
+      if (state->doneChunks.fetch_add(1) + 1 == chunkCount)
+      {
+        std::unique_lock lock(state->mutex);
+        state->done.notify_all();
+      }
+    }
+  };
+
+  const std::size_t helperCount = std::min(workers.size(), chunkCount - 1);
+  for (std::size_t i = 0; i < helperCount; ++i)
+    submit(work);
+
+  work();
+
+  std::unique_lock lock(state->mutex);
+  state->done.wait(lock, [&state, chunkCount]() { return state->doneChunks == chunkCount; });
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <function2/function2.hpp>
+
+
+/**
+ * Fixed-size pool of worker threads with a single shared FIFO queue.
+ * Good enough for coarse-grained jobs like converting scene primitives,
+ * but there is no work stealing, so don't use it for tiny tasks.
+ */
+class ThreadPool
+{
+public:
+  using Task = fu2::unique_function<void()>;
+
+  // 0 means one worker per hardware thread, except for the thread that owns the pool.
+  explicit ThreadPool(std::size_t thread_count = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  std::size_t getThreadCount() const { return workers.size(); }
+
+  void submit(Task task);
+
+  template <class F>
+  std::future<std::invoke_result_t<F>> async(F&& func)
+  {
+    std::packaged_task<std::invoke_result_t<F>()> task(std::forward<F>(func));
+    auto result = task.get_future();
+    submit([task = std::move(task)]() mutable { task(); });
+    return result;
+  }
+
+  // Calls `func(i)` for every i in [0, count), in chunks of `grain` consecutive indices,
+  // and blocks until all of them are done. The calling thread participates in the work,
+  // so this is safe to call from within a task running on this very pool.
+  void parallelFor(
+    std::size_t count, std::size_t grain, fu2::function_view<void(std::size_t) const> func);
+
+private:
+  void workerLoop();
+
+private:
+  std::vector<std::thread> workers;
+
+  std::mutex mutex;
+  std::condition_variable hasTasks;
+  std::deque<Task> tasks;
+  bool stopping = false;
+};
@@ -0,0 +1,99 @@
+#include "DepthPyramid.hpp"
+
+#include <algorithm>
+
+#include <etna/GlobalContext.hpp>
+#include <etna/Etna.hpp>
+#include <etna/PipelineManager.hpp>
+#include <etna/DescriptorSet.hpp>
+#include <etna/Profiling.hpp>
+
+#include "shaders/CullingData.h"
+
+
+constexpr std::uint32_t WORKGROUP_SIZE = 8;
+
+DepthPyramid::DepthPyramid(CreateInfo info)
+  : sampler{etna::Sampler::CreateInfo{.name = "depth_pyramid_sampler"}}
+  , depthResolution{info.resolution}
+{
+  if (etna::get_program_id("depth_reduce") == etna::ShaderProgramId::Invalid)
+    etna::create_program("depth_reduce", {RENDER_UTILS_SHADERS_ROOT "depth_reduce.comp.spv"});
+
+  pipeline =
+    etna::get_context().getPipelineManager().createComputePipeline("depth_reduce", {});
+
+  glm::uvec2 size = depthResolution;
+  do
+  {
+    size = glm::max((size + 1u) / 2u, glm::uvec2(1));
+    levelSizes.push_back(size);
+  } while (size.x > 1 || size.y > 1);
+
+  image = etna::get_context().createImage(etna::Image::CreateInfo{
+    .extent = vk::Extent3D{levelSizes[0].x, levelSizes[0].y, 1},
+    .name = "depth_pyramid",
+    .format = vk::Format::eR32Sfloat,
+    .imageUsage = vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eSampled,
+    .mipLevels = levelSizes.size(),
+  });
+}
+
+void DepthPyramid::build(vk::CommandBuffer cmd_buf, const etna::Image& depth)
+{
+  ETNA_PROFILE_GPU(cmd_buf, buildDepthPyramid);
+
+  const auto& programInfo = etna::get_shader_program("depth_reduce");
+
+  cmd_buf.bindPipeline(vk::PipelineBindPoint::eCompute, pipeline.getVkPipeline());
+
+  for (std::uint32_t level = 0; level < levelSizes.size(); ++level)
+  {
+    // NOTE: the pyramid always stays in the general layout, so that one level
+    // can be read while the next one is written.
+    auto set = etna::create_descriptor_set(
+      programInfo.getDescriptorLayoutId(0),
+      cmd_buf,
+      {etna::Binding{
+         0,
+         level == 0
+           ? depth.genBinding(sampler.get(), vk::ImageLayout::eShaderReadOnlyOptimal)
+           : image.genBinding(
+               sampler.get(), vk::ImageLayout::eGeneral, {.baseMip = level - 1, .levelCount = 1})},
+       etna::Binding{
+         1, image.genBinding({}, vk::ImageLayout::eGeneral, {.baseMip = level, .levelCount = 1})}});
+
+    const DepthReduceParams params{
+      .srcSize = level == 0 ? depthResolution : levelSizes[level - 1],
+      .dstSize = levelSizes[level],
+    };
+
+    cmd_buf.bindDescriptorSets(
+      vk::PipelineBindPoint::eCompute, pipeline.getVkPipelineLayout(), 0, {set.getVkSet()}, {});
+    cmd_buf.pushConstants<DepthReduceParams>(
+      pipeline.getVkPipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, {params});
+
+    etna::flush_barriers(cmd_buf);
+
+    cmd_buf.dispatch(
+      (params.dstSize.x + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE,
+      (params.dstSize.y + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE,
+      1);
+
+    // Levels are separate subresources of the same image, make sure the next
+    // dispatch sees this one's writes regardless of how they are tracked.
+    const vk::MemoryBarrier2 barrier{
+      .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+      .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+      .dstStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+      .dstAccessMask = vk::AccessFlagBits2::eShaderSampledRead,
+    };
+    cmd_buf.pipelineBarrier2(
+      vk::DependencyInfo{.memoryBarrierCount = 1, .pMemoryBarriers = &barrier});
+  }
+}
+
+etna::ImageBinding DepthPyramid::genBinding() const
+{
+  return image.genBinding(sampler.get(), vk::ImageLayout::eGeneral);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <etna/Vulkan.hpp>
+#include <etna/Image.hpp>
+#include <etna/Sampler.hpp>
+#include <etna/ComputePipeline.hpp>
+
+
+/**
+ * Hierarchical depth buffer for occlusion culling. Level 0 is half the resolution of
+ * the depth buffer (rounded up), and every texel of a level holds the farthest depth
+ * of the 2x2 texels it covers on the previous one.
+ */
+class DepthPyramid
+{
+public:
+  struct CreateInfo
+  {
+    // Resolution of the depth buffer the pyramid will be built from
+    glm::uvec2 resolution;
+  };
+
+  explicit DepthPyramid(CreateInfo info);
+
+  // Records reduction of `depth` into the pyramid. The depth buffer has to be sampleable.
+  void build(vk::CommandBuffer cmd_buf, const etna::Image& depth);
+
+  glm::uvec2 getDepthResolution() const { return depthResolution; }
+
+  // All levels, to be fetched from in compute shaders
+  etna::ImageBinding genBinding() const;
+
+private:
+  etna::ComputePipeline pipeline;
+  etna::Sampler sampler;
+  etna::Image image;
+
+  glm::uvec2 depthResolution;
+  std::vector<glm::uvec2> levelSizes;
+
+  DepthPyramid(const DepthPyramid&) = delete;
+  DepthPyramid& operator=(const DepthPyramid&) = delete;
+};
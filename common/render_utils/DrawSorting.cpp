@@ -0,0 +1,107 @@
+#include "DrawSorting.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <utility>
+
+#include <etna/Profiling.hpp>
+
+
+constexpr std::uint32_t RADIX_BITS = 8;
+constexpr std::size_t RADIX_BUCKETS = std::size_t{1} << RADIX_BITS;
+constexpr std::size_t RADIX_PASSES = 64 / RADIX_BITS;
+
+template <std::uint32_t BITS>
+static std::uint64_t fit_bits(std::uint64_t value)
+{
+  assert(value < (std::uint64_t{1} << BITS));
+  return value & ((std::uint64_t{1} << BITS) - 1);
+}
+
+std::uint64_t make_draw_sort_key(
+  std::uint32_t pipeline, std::uint32_t material, float view_depth, std::uint32_t draw)
+{
+  // NOTE: bit patterns of non-negative floats are ordered the same way as the floats
+  // themselves, so the top bits of a float are a logarithmic quantization of it.
+  // The sign bit is always 0 here, so the depth is taken from the bits right below it.
+  const float depth = view_depth > 0.0f ? view_depth : 0.0f;
+  const std::uint64_t depthBits =
+    std::bit_cast<std::uint32_t>(depth) >> (31 - SORT_KEY_DEPTH_BITS);
+
+  return fit_bits<SORT_KEY_PIPELINE_BITS>(pipeline)
+    << (SORT_KEY_MATERIAL_BITS + SORT_KEY_DEPTH_BITS + SORT_KEY_DRAW_BITS) |
+    fit_bits<SORT_KEY_MATERIAL_BITS>(material) << (SORT_KEY_DEPTH_BITS + SORT_KEY_DRAW_BITS) |
+    depthBits << SORT_KEY_DRAW_BITS | fit_bits<SORT_KEY_DRAW_BITS>(draw);
+}
+
+void radix_sort(
+  std::span<std::uint64_t> keys,
+  std::span<std::uint64_t> scratch,
+  std::uint32_t presorted_bits)
+{
+  ZoneScoped;
+
+  assert(scratch.size() >= keys.size());
+  assert(presorted_bits % RADIX_BITS == 0 && presorted_bits <= 64);
+  // NOTE: every pass is stable, so skipping the passes for the lowest bits leaves keys
+  // that are equal otherwise in the order they came in, which is already sorted.
+  if (keys.empty() || presorted_bits == 64)
+    return;
+
+  // Only bytes that differ between keys need a pass
+  std::uint64_t anyOnes = 0;
+  std::uint64_t allOnes = ~std::uint64_t{0};
+  for (const auto key : keys)
+  {
+    anyOnes |= key;
+    allOnes &= key;
+  }
+  const std::uint64_t varying = (anyOnes ^ allOnes) >> presorted_bits << presorted_bits;
+
+  std::array<std::uint32_t, RADIX_PASSES> shifts{};
+  std::size_t passCount = 0;
+  for (std::uint32_t shift = 0; shift < 64; shift += RADIX_BITS)
+    if (((varying >> shift) & (RADIX_BUCKETS - 1)) != 0)
+      shifts[passCount++] = shift;
+  if (passCount == 0)
+    return;
+
+  // The histogram of every pass is built while the previous pass scatters the keys,
+  // so only the first one needs a read of its own
+  std::array<std::uint32_t, RADIX_BUCKETS> counts{};
+  for (const auto key : keys)
+    ++counts[(key >> shifts[0]) & (RADIX_BUCKETS - 1)];
+
+  std::span<std::uint64_t> src = keys;
+  std::span<std::uint64_t> dst = scratch.first(keys.size());
+  for (std::size_t pass = 0; pass < passCount; ++pass)
+  {
+    std::uint32_t offset = 0;
+    for (auto& count : counts)
+      offset += std::exchange(count, offset);
+
+    const std::uint32_t shift = shifts[pass];
+    if (pass + 1 == passCount)
+    {
+      for (const auto key : src)
+        dst[counts[(key >> shift) & (RADIX_BUCKETS - 1)]++] = key;
+    }
+    else
+    {
+      const std::uint32_t nextShift = shifts[pass + 1];
+      std::array<std::uint32_t, RADIX_BUCKETS> nextCounts{};
+      for (const auto key : src)
+      {
+        ++nextCounts[(key >> nextShift) & (RADIX_BUCKETS - 1)];
+        dst[counts[(key >> shift) & (RADIX_BUCKETS - 1)]++] = key;
+      }
+      counts = nextCounts;
+    }
+    std::swap(src, dst);
+  }
+
+  if (src.data() != keys.data())
+    std::ranges::copy(src, keys.begin());
+}
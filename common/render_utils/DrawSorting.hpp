@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+
+// 64 bit keys that order draws the way they should be submitted. Sorting by the key groups
+// draws by pipeline, then by material, and then goes front to back, so that state changes
+// are rare and early depth testing rejects as much as possible. Draws with the same
+// pipeline, material and quantized depth keep the order of their `draw` indices.
+//
+// | 63..60   | 59..48   | 47..32     | 31..0 |
+// | pipeline | material | view depth | draw  |
+
+constexpr std::uint32_t SORT_KEY_PIPELINE_BITS = 4;
+constexpr std::uint32_t SORT_KEY_MATERIAL_BITS = 12;
+constexpr std::uint32_t SORT_KEY_DEPTH_BITS = 16;
+constexpr std::uint32_t SORT_KEY_DRAW_BITS = 32;
+
+static_assert(
+  SORT_KEY_PIPELINE_BITS + SORT_KEY_MATERIAL_BITS + SORT_KEY_DEPTH_BITS + SORT_KEY_DRAW_BITS ==
+  64);
+// So that draw indices can be skipped by radix_sort
+static_assert(SORT_KEY_DRAW_BITS % 8 == 0);
+
+// `view_depth` is any distance that grows away from the camera, negative ones are clamped
+// to 0. It is quantized logarithmically, so the relative precision (~0.4%) is the same at
+// any distance, which is plenty for ordering draws.
+std::uint64_t make_draw_sort_key(
+  std::uint32_t pipeline, std::uint32_t material, float view_depth, std::uint32_t draw);
+
+inline std::uint32_t draw_from_sort_key(std::uint64_t key)
+{
+  return static_cast<std::uint32_t>(key & ((std::uint64_t{1} << SORT_KEY_DRAW_BITS) - 1));
+}
+
+// Sorts `keys` in increasing order with an LSD radix sort, a byte per pass. `scratch` has
+// to be at least as big as `keys`. Bytes that are the same in every key don't need a pass,
+// so the unused parts of sort keys (e.g. materials that don't exist yet) are free, and so
+// are pipelines if keys of different pipelines are sorted separately.
+// If `keys` are already sorted by their lowest `presorted_bits` bits (e.g. draw indices of
+// keys made in draw order), those aren't sorted again. Has to be a multiple of 8.
+// Costs two reads of the keys, plus a scatter for every byte that needs a pass.
+void radix_sort(
+  std::span<std::uint64_t> keys,
+  std::span<std::uint64_t> scratch,
+  std::uint32_t presorted_bits = 0);
@@ -0,0 +1,1062 @@
+#include "InstanceCuller.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <numeric>
+
+#include <etna/GlobalContext.hpp>
+#include <etna/Etna.hpp>
+#include <etna/PipelineManager.hpp>
+#include <etna/DescriptorSet.hpp>
+#include <etna/Profiling.hpp>
+
+#include "DrawSorting.hpp"
+
+
+constexpr std::uint32_t WORKGROUP_SIZE = 64;
+// NOTE: every batch is a separate indirect draw call, so they shouldn't be too small
+constexpr std::size_t DRAW_BATCH_SIZE = CULLING_DRAW_BATCH_SIZE;
+
+// NOTE: workgroup counts are limited to 65535 per dimension on some GPUs
+constexpr std::uint32_t MAX_WORKGROUPS_X = 1 << 15;
+
+static_assert(sizeof(CullingMesh) == 48 && sizeof(CullingDraw) == 32);
+static_assert(sizeof(CullingMeshlet) == 48);
+static_assert(CULLING_MAX_LODS == MAX_MESH_LODS);
+static_assert(sizeof(CullingParams) == 128 && sizeof(CullingFrustum) == 96);
+
+// NOTE: scene data only changes when a scene is selected, so it lives in host-visible
+// memory and is written once, same as the instance matrices.
+static etna::Buffer create_scene_data_buffer(std::span<const std::byte> data, const char* name)
+{
+  // Shaders can't bind empty buffers, so empty scenes get a dummy element
+  auto result = etna::get_context().createBuffer(etna::Buffer::CreateInfo{
+    .size = std::max<std::size_t>(data.size(), sizeof(std::uint32_t)),
+    .bufferUsage = vk::BufferUsageFlagBits::eStorageBuffer,
+    .memoryUsage = VMA_MEMORY_USAGE_CPU_TO_GPU,
+    .name = name,
+  });
+  result.map();
+  if (!data.empty())
+    std::memcpy(result.data(), data.data(), data.size());
+  result.unmap();
+  return result;
+}
+
+static etna::Buffer create_view_buffer(
+  std::size_t size,
+  vk::BufferUsageFlags usage,
+  VmaMemoryUsage memory_usage,
+  const char* name)
+{
+  auto result = etna::get_context().createBuffer(etna::Buffer::CreateInfo{
+    .size = std::max<std::size_t>(size, sizeof(std::uint32_t)),
+    .bufferUsage = vk::BufferUsageFlagBits::eStorageBuffer | usage,
+    .memoryUsage = memory_usage,
+    .name = name,
+  });
+  // NOTE: buffers written by the CPU stay mapped, and start out with nothing to draw
+  if (memory_usage == VMA_MEMORY_USAGE_CPU_TO_GPU)
+    std::memset(result.map(), 0, std::max<std::size_t>(size, sizeof(std::uint32_t)));
+  return result;
+}
+
+static void memory_barrier(
+  vk::CommandBuffer cmd_buf,
+  vk::PipelineStageFlags2 src_stages,
+  vk::AccessFlags2 src_access,
+  vk::PipelineStageFlags2 dst_stages,
+  vk::AccessFlags2 dst_access)
+{
+  const vk::MemoryBarrier2 barrier{
+    .srcStageMask = src_stages,
+    .srcAccessMask = src_access,
+    .dstStageMask = dst_stages,
+    .dstAccessMask = dst_access,
+  };
+  cmd_buf.pipelineBarrier2(
+    vk::DependencyInfo{.memoryBarrierCount = 1, .pMemoryBarriers = &barrier});
+}
+
+// Same as select_lod in culling.glsl
+static std::uint32_t select_lod(
+  const CullingMesh& mesh,
+  float scale,
+  const BoundingBox& bounds,
+  const InstanceCuller::LodSelection& lods)
+{
+  if (lods.errorScale <= 0)
+    return 0;
+
+  const glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+  const glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+  const float distance =
+    glm::length(glm::max(glm::abs(lods.cameraPosition - center) - extent, glm::vec3(0.0f)));
+  std::uint32_t lod = 0;
+  for (std::uint32_t i = 1; i < mesh.lodCount; ++i)
+    if (mesh.lodErrors[i] * scale * lods.errorScale <= distance)
+      lod = i;
+  return lod;
+}
+
+InstanceCuller::InstanceCuller(CreateInfo info)
+  : views(info.viewCount)
+{
+  for (const std::uint32_t view : info.layeredViews)
+    views[view].maxLayers = CULLING_MAX_LAYERS;
+
+  if (etna::get_program_id("cull_instances") == etna::ShaderProgramId::Invalid)
+    etna::create_program("cull_instances", {RENDER_UTILS_SHADERS_ROOT "cull_instances.comp.spv"});
+  if (etna::get_program_id("cull_layers") == etna::ShaderProgramId::Invalid)
+    etna::create_program("cull_layers", {RENDER_UTILS_SHADERS_ROOT "cull_layers.comp.spv"});
+  if (etna::get_program_id("occlusion_cull") == etna::ShaderProgramId::Invalid)
+    etna::create_program("occlusion_cull", {RENDER_UTILS_SHADERS_ROOT "occlusion_cull.comp.spv"});
+  if (etna::get_program_id("emit_draws") == etna::ShaderProgramId::Invalid)
+    etna::create_program("emit_draws", {RENDER_UTILS_SHADERS_ROOT "emit_draws.comp.spv"});
+  if (etna::get_program_id("cull_meshlets") == etna::ShaderProgramId::Invalid)
+    etna::create_program("cull_meshlets", {RENDER_UTILS_SHADERS_ROOT "cull_meshlets.comp.spv"});
+
+  auto& pipelineManager = etna::get_context().getPipelineManager();
+  cullPipeline = pipelineManager.createComputePipeline("cull_instances", {});
+  layeredPipeline = pipelineManager.createComputePipeline("cull_layers", {});
+  occlusionPipeline = pipelineManager.createComputePipeline("occlusion_cull", {});
+  emitPipeline = pipelineManager.createComputePipeline("emit_draws", {});
+  meshletPipeline = pipelineManager.createComputePipeline("cull_meshlets", {});
+
+  // Renderers bind the results before any scene is selected
+  createViewBuffers(0, 0, 0, 0, 0);
+}
+
+void InstanceCuller::prepare(SceneManager& scene_mgr)
+{
+  scene = &scene_mgr;
+
+  const auto sceneMeshes = scene->getMeshes();
+  const auto relems = scene->getRenderElements();
+  const auto meshInstances = scene->getMeshInstances();
+
+  auto& cullingMeshes = cpuMeshes;
+  cullingMeshes.clear();
+  cullingMeshes.reserve(sceneMeshes.size());
+  for (std::size_t i = 0; i < sceneMeshes.size(); ++i)
+  {
+    const auto& mesh = sceneMeshes[i];
+    glm::vec4 lodErrors(0.0f);
+    for (std::uint32_t lod = 0; lod < mesh.lodCount; ++lod)
+      lodErrors[lod] = mesh.lods[lod].error;
+    cullingMeshes.push_back(CullingMesh{
+      .boundsMin = mesh.bounds.min,
+      .firstInstance = i < meshInstances.size() ? meshInstances[i].firstInstance : 0,
+      .boundsMax = mesh.bounds.max,
+      .lodCount = mesh.lodCount,
+      .lodErrors = lodErrors,
+    });
+  }
+
+  // The instance buffer is grouped by mesh, see SceneManager::getMeshInstances
+  auto& cullingInstanceMeshes = cpuInstanceMeshes;
+  cullingInstanceMeshes.clear();
+  maxLodCount = 1;
+  for (std::uint32_t meshIdx = 0; meshIdx < meshInstances.size(); ++meshIdx)
+  {
+    const std::uint32_t count = meshInstances[meshIdx].instanceCount;
+    cullingInstanceMeshes.insert(cullingInstanceMeshes.end(), count, meshIdx);
+    if (count > 0)
+      maxLodCount = std::max(maxLodCount, sceneMeshes[meshIdx].lodCount);
+  }
+  instanceCount = static_cast<std::uint32_t>(cullingInstanceMeshes.size());
+
+  // 16 and 32 bit draws need different index buffer bindings, so they can't share a batch
+  std::array<std::vector<CullingDraw>, 2> drawsByIndexType;
+  for (std::uint32_t meshIdx = 0; meshIdx < meshInstances.size(); ++meshIdx)
+  {
+    const auto [firstInstance, count] = meshInstances[meshIdx];
+    if (count == 0)
+      continue;
+
+    // Every LOD gets its own copy of the instance buffer for visible instances
+    const auto& mesh = sceneMeshes[meshIdx];
+    for (std::uint32_t lod = 0; lod < mesh.lodCount; ++lod)
+    {
+      const std::uint32_t firstRelem = mesh.lods[lod].firstRelem;
+      for (std::uint32_t relemIdx = firstRelem; relemIdx < firstRelem + mesh.relemCount;
+           ++relemIdx)
+      {
+        const auto& relem = relems[relemIdx];
+        drawsByIndexType[static_cast<std::size_t>(relem.indexType)].push_back(CullingDraw{
+          .indexCount = relem.indexCount,
+          .firstIndex = relem.indexOffset,
+          .vertexOffset = relem.vertexOffset,
+          .firstInstance = lod * instanceCount + firstInstance,
+          .mesh = meshIdx,
+          .lod = lod,
+          .batch = 0,
+          .firstCommand = 0,
+        });
+      }
+    }
+  }
+
+  // Every batch gets its own range of commands, the same size as the batch
+  auto& cullingDraws = cpuDraws;
+  cullingDraws.clear();
+  batches.clear();
+  for (std::size_t type = 0; type < drawsByIndexType.size(); ++type)
+  {
+    const std::span typeDraws{drawsByIndexType[type]};
+    for (std::size_t first = 0; first < typeDraws.size(); first += DRAW_BATCH_SIZE)
+    {
+      const auto batchDraws =
+        typeDraws.subspan(first, std::min(DRAW_BATCH_SIZE, typeDraws.size() - first));
+      const Batch batch{
+        .indexType = static_cast<IndexType>(type),
+        .firstCommand = static_cast<std::uint32_t>(cullingDraws.size()),
+        .drawCount = static_cast<std::uint32_t>(batchDraws.size()),
+      };
+      for (auto draw : batchDraws)
+      {
+        draw.batch = static_cast<std::uint32_t>(batches.size());
+        draw.firstCommand = batch.firstCommand;
+        cullingDraws.push_back(draw);
+      }
+      batches.push_back(batch);
+    }
+  }
+  firstWideCommand = static_cast<std::uint32_t>(drawsByIndexType[0].size());
+
+  // Relems of a LOD of a mesh were added one after another, so every LOD is a single group
+  // per index type it uses
+  cpuDrawGroups.clear();
+  for (std::uint32_t drawIdx = 0; drawIdx < cullingDraws.size(); ++drawIdx)
+  {
+    const auto& draw = cullingDraws[drawIdx];
+    const std::uint32_t meshLod = draw.mesh * MAX_MESH_LODS + draw.lod;
+    if (
+      cpuDrawGroups.empty() || cpuDrawGroups.back().meshLod != meshLod ||
+      drawIdx == firstWideCommand)
+      cpuDrawGroups.push_back(DrawGroup{.meshLod = meshLod, .firstDraw = drawIdx});
+  }
+
+  // Meshlets are sorted by relem, and relems of a LOD of a mesh are contiguous,
+  // so meshlets of a LOD of a mesh are contiguous as well.
+  const auto sceneMeshlets = scene->getMeshlets();
+  std::vector<std::uint32_t> relemFirstMeshlet(relems.size() + 1, 0);
+  for (const auto& meshlet : sceneMeshlets)
+    ++relemFirstMeshlet[meshlet.relem + 1];
+  for (std::size_t i = 1; i < relemFirstMeshlet.size(); ++i)
+    relemFirstMeshlet[i] += relemFirstMeshlet[i - 1];
+
+  // Indexed by mesh * MAX_MESH_LODS + lod, missing LODs don't have any meshlets
+  std::vector<CullingMeshletRange> cullingMeshletRanges(sceneMeshes.size() * MAX_MESH_LODS);
+  for (std::size_t meshIdx = 0; meshIdx < sceneMeshes.size(); ++meshIdx)
+  {
+    const auto& mesh = sceneMeshes[meshIdx];
+    for (std::uint32_t lod = 0; lod < mesh.lodCount; ++lod)
+    {
+      const std::uint32_t firstRelem = mesh.lods[lod].firstRelem;
+      const std::uint32_t first = relemFirstMeshlet[firstRelem];
+      cullingMeshletRanges[meshIdx * MAX_MESH_LODS + lod] = CullingMeshletRange{
+        .firstMeshlet = first,
+        .meshletCount = relemFirstMeshlet[firstRelem + mesh.relemCount] - first,
+      };
+    }
+  }
+
+  std::vector<CullingMeshlet> cullingMeshlets;
+  cullingMeshlets.reserve(sceneMeshlets.size());
+  for (const auto& meshlet : sceneMeshlets)
+  {
+    const auto& relem = relems[meshlet.relem];
+    cullingMeshlets.push_back(CullingMeshlet{
+      .center = meshlet.center,
+      .radius = meshlet.radius,
+      .coneAxis = meshlet.coneAxis,
+      .coneCutoff = meshlet.coneCutoff,
+      .indexCount = meshlet.indexCount,
+      .firstIndex = meshlet.firstIndex,
+      .vertexOffset = relem.vertexOffset,
+      .wideIndices = relem.indexType == IndexType::Uint32 ? 1u : 0u,
+    });
+  }
+  meshletCount = static_cast<std::uint32_t>(cullingMeshlets.size());
+
+  // Every instance might have all of the meshlets of any of its LODs visible
+  meshletCommandCounts = {};
+  for (std::uint32_t meshIdx = 0; meshIdx < meshInstances.size(); ++meshIdx)
+  {
+    std::array<std::uint32_t, 2> maxCounts{};
+    for (std::uint32_t lod = 0; lod < sceneMeshes[meshIdx].lodCount; ++lod)
+    {
+      std::array<std::uint32_t, 2> counts{};
+      const auto [firstMeshlet, count] = cullingMeshletRanges[meshIdx * MAX_MESH_LODS + lod];
+      for (std::uint32_t i = firstMeshlet; i < firstMeshlet + count; ++i)
+        ++counts[cullingMeshlets[i].wideIndices];
+      for (std::size_t wide = 0; wide < counts.size(); ++wide)
+        maxCounts[wide] = std::max(maxCounts[wide], counts[wide]);
+    }
+    for (std::size_t wide = 0; wide < maxCounts.size(); ++wide)
+      meshletCommandCounts[wide] += maxCounts[wide] * meshInstances[meshIdx].instanceCount;
+  }
+
+  instanceMeshes =
+    create_scene_data_buffer(std::as_bytes(std::span{cullingInstanceMeshes}), "culling_instances");
+  meshes = create_scene_data_buffer(std::as_bytes(std::span{cullingMeshes}), "culling_meshes");
+  draws = create_scene_data_buffer(std::as_bytes(std::span{cullingDraws}), "culling_draws");
+  meshletRanges =
+    create_scene_data_buffer(std::as_bytes(std::span{cullingMeshletRanges}), "meshlet_ranges");
+  meshlets = create_scene_data_buffer(std::as_bytes(std::span{cullingMeshlets}), "meshlets");
+
+  createViewBuffers(
+    cullingMeshes.size(),
+    instanceCount,
+    cullingDraws.size(),
+    batches.size(),
+    meshletCommandCounts[0] + meshletCommandCounts[1]);
+}
+
+void InstanceCuller::createViewBuffers(
+  std::size_t mesh_count,
+  std::size_t instance_count,
+  std::size_t draw_count,
+  std::size_t batch_count,
+  std::size_t meshlet_command_count)
+{
+  // Every LOD of a mesh is counted separately, and has its own copy of the instance buffer,
+  // with room for every instance in every layer for layered views
+  const auto createResults = [&](VmaMemoryUsage memory_usage, std::uint32_t max_layers) {
+    return Results{
+      .visibleInstances = create_view_buffer(
+        instance_count * MAX_MESH_LODS * max_layers * sizeof(std::uint32_t),
+        {},
+        memory_usage,
+        "visible_instances"),
+      .commands = create_view_buffer(
+        draw_count * sizeof(vk::DrawIndexedIndirectCommand),
+        vk::BufferUsageFlagBits::eIndirectBuffer,
+        memory_usage,
+        "culled_draw_commands"),
+      .drawCounts = create_view_buffer(
+        batch_count * sizeof(std::uint32_t),
+        vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eTransferDst,
+        memory_usage,
+        "culled_draw_counts"),
+    };
+  };
+
+  for (auto& view : views)
+  {
+    view.meshVisibleCounts = create_view_buffer(
+      mesh_count * MAX_MESH_LODS * sizeof(std::uint32_t),
+      vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eTransferSrc,
+      VMA_MEMORY_USAGE_GPU_ONLY,
+      "mesh_visible_counts");
+    view.meshDepthKeys = create_view_buffer(
+      mesh_count * MAX_MESH_LODS * sizeof(std::uint32_t),
+      vk::BufferUsageFlagBits::eTransferDst,
+      VMA_MEMORY_USAGE_GPU_ONLY,
+      "mesh_depth_keys");
+    view.gpu = createResults(VMA_MEMORY_USAGE_GPU_ONLY, view.maxLayers);
+    view.gpuLate = createResults(VMA_MEMORY_USAGE_GPU_ONLY, view.maxLayers);
+    view.cpu.clear();
+    for (std::size_t i = 0; i < etna::get_context().getMainWorkCount().multiBufferingCount(); ++i)
+      view.cpu.push_back(createResults(VMA_MEMORY_USAGE_CPU_TO_GPU, view.maxLayers));
+    view.cpuIndex = 0;
+    if (view.maxLayers > 1)
+      view.layerFrusta = create_view_buffer(
+        view.maxLayers * sizeof(CullingFrustum),
+        vk::BufferUsageFlagBits::eTransferDst,
+        VMA_MEMORY_USAGE_GPU_ONLY,
+        "layer_frusta");
+    view.instanceVisibility = create_view_buffer(
+      instance_count * sizeof(std::uint32_t),
+      vk::BufferUsageFlagBits::eTransferDst,
+      VMA_MEMORY_USAGE_GPU_ONLY,
+      "instance_visibility");
+    view.visibilityCleared = false;
+    view.meshletCommands = create_view_buffer(
+      meshlet_command_count * sizeof(vk::DrawIndexedIndirectCommand),
+      vk::BufferUsageFlagBits::eIndirectBuffer,
+      VMA_MEMORY_USAGE_GPU_ONLY,
+      "meshlet_draw_commands");
+    view.meshletDrawCounts = create_view_buffer(
+      meshletCommandCounts.size() * sizeof(std::uint32_t),
+      vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eTransferDst,
+      VMA_MEMORY_USAGE_GPU_ONLY,
+      "meshlet_draw_counts");
+    view.source = ResultsSource::Gpu;
+    view.stats.reset();
+    view.readbacks.resize(etna::get_context().getMainWorkCount().multiBufferingCount());
+    for (auto& readback : view.readbacks)
+    {
+      readback.counts = create_view_buffer(
+        mesh_count * MAX_MESH_LODS * sizeof(std::uint32_t),
+        vk::BufferUsageFlagBits::eTransferDst,
+        VMA_MEMORY_USAGE_GPU_TO_CPU,
+        "mesh_visible_counts_readback");
+      readback.counts.map();
+      readback.pending = false;
+    }
+    view.cpuMeshVisibleCounts.resize(mesh_count * MAX_MESH_LODS);
+    view.cpuMeshDepths.resize(mesh_count * MAX_MESH_LODS);
+    view.cpuDrawCounts.resize(batch_count);
+  }
+}
+
+void InstanceCuller::cull(
+  vk::CommandBuffer cmd_buf,
+  std::uint32_t view,
+  const glm::mat4x4& proj_view,
+  const LodSelection& lods,
+  const InstanceFilter& filter)
+{
+  cullFrustum(cmd_buf, view, proj_view, FrustumKind::View, lods, filter);
+}
+
+void InstanceCuller::cullCasters(
+  vk::CommandBuffer cmd_buf,
+  std::uint32_t view,
+  const glm::mat4x4& light_proj_view,
+  const InstanceFilter& filter)
+{
+  // NOTE: shadow maps don't have a camera to select LODs for
+  cullFrustum(cmd_buf, view, light_proj_view, FrustumKind::Casters, {}, filter);
+}
+
+void InstanceCuller::cullFrustum(
+  vk::CommandBuffer cmd_buf,
+  std::uint32_t view_idx,
+  const glm::mat4x4& proj_view,
+  FrustumKind kind,
+  const LodSelection& lods,
+  const InstanceFilter& filter)
+{
+  auto& view = views[view_idx];
+  view.source = ResultsSource::Gpu;
+  view.stats.reset();
+
+  if (instanceCount == 0)
+    return;
+
+  ETNA_PROFILE_GPU(cmd_buf, cullInstances);
+
+  beginCulling(cmd_buf, view);
+
+  const Frustum frustum = kind == FrustumKind::Casters ? caster_frustum_from_matrix(proj_view)
+                                                       : frustum_from_matrix(proj_view);
+  CullingParams params{};
+  std::ranges::copy(frustum.planes, params.frustumPlanes);
+  params.cameraPosition = lods.cameraPosition;
+  params.count = instanceCount;
+  params.lodErrorScale = lods.errorScale;
+  params.flagsMask = filter.flagsMask;
+  params.flagsValue = filter.flagsValue;
+  params.layerStride = view.maxLayers;
+
+  {
+    auto set = etna::create_descriptor_set(
+      etna::get_shader_program("cull_instances").getDescriptorLayoutId(0),
+      cmd_buf,
+      {etna::Binding{0, scene->getInstanceBuffer().genBinding()},
+       etna::Binding{1, instanceMeshes.genBinding()},
+       etna::Binding{2, meshes.genBinding()},
+       etna::Binding{3, view.meshVisibleCounts.genBinding()},
+       etna::Binding{4, view.gpu.visibleInstances.genBinding()},
+       etna::Binding{5, view.meshDepthKeys.genBinding()}});
+
+    cmd_buf.bindPipeline(vk::PipelineBindPoint::eCompute, cullPipeline.getVkPipeline());
+    cmd_buf.bindDescriptorSets(
+      vk::PipelineBindPoint::eCompute, cullPipeline.getVkPipelineLayout(), 0, {set.getVkSet()}, {});
+    cmd_buf.pushConstants<CullingParams>(
+      cullPipeline.getVkPipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, {params});
+
+    etna::flush_barriers(cmd_buf);
+
+    cmd_buf.dispatch((instanceCount + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+  }
+
+  emitDraws(cmd_buf, view, view.gpu);
+  readBackCounts(cmd_buf, view, countInstances(filter));
+}
+
+void InstanceCuller::cullCastersLayered(
+  vk::CommandBuffer cmd_buf,
+  std::uint32_t view_idx,
+  std::span<const glm::mat4x4> light_proj_views,
+  const InstanceFilter& filter)
+{
+  auto& view = views[view_idx];
+  assert(light_proj_views.size() <= view.maxLayers);
+  view.source = ResultsSource::Gpu;
+  view.stats.reset();
+
+  if (instanceCount == 0)
+    return;
+
+  ETNA_PROFILE_GPU(cmd_buf, cullInstancesLayered);
+
+  std::array<CullingFrustum, CULLING_MAX_LAYERS> frusta{};
+  for (std::size_t layer = 0; layer < light_proj_views.size(); ++layer)
+    std::ranges::copy(
+      caster_frustum_from_matrix(light_proj_views[layer]).planes, frusta[layer].planes);
+  beginCulling(cmd_buf, view, std::span{frusta}.first(light_proj_views.size()));
+
+  const LayeredCullingParams params{
+    .count = instanceCount,
+    .layerCount = static_cast<std::uint32_t>(light_proj_views.size()),
+    .flagsMask = filter.flagsMask,
+    .flagsValue = filter.flagsValue,
+  };
+
+  {
+    auto set = etna::create_descriptor_set(
+      etna::get_shader_program("cull_layers").getDescriptorLayoutId(0),
+      cmd_buf,
+      {etna::Binding{0, scene->getInstanceBuffer().genBinding()},
+       etna::Binding{1, instanceMeshes.genBinding()},
+       etna::Binding{2, meshes.genBinding()},
+       etna::Binding{3, view.meshVisibleCounts.genBinding()},
+       etna::Binding{4, view.gpu.visibleInstances.genBinding()},
+       etna::Binding{5, view.meshDepthKeys.genBinding()},
+       etna::Binding{6, view.layerFrusta.genBinding()}});
+
+    cmd_buf.bindPipeline(vk::PipelineBindPoint::eCompute, layeredPipeline.getVkPipeline());
+    cmd_buf.bindDescriptorSets(
+      vk::PipelineBindPoint::eCompute,
+      layeredPipeline.getVkPipelineLayout(),
+      0,
+      {set.getVkSet()},
+      {});
+    cmd_buf.pushConstants<LayeredCullingParams>(
+      layeredPipeline.getVkPipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, {params});
+
+    etna::flush_barriers(cmd_buf);
+
+    cmd_buf.dispatch((instanceCount + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+  }
+
+  emitDraws(cmd_buf, view, view.gpu);
+  readBackCounts(cmd_buf, view, countInstances(filter));
+}
+
+std::uint32_t InstanceCuller::countInstances(const InstanceFilter& filter) const
+{
+  if (filter.flagsMask == 0)
+    return instanceCount;
+  return static_cast<std::uint32_t>(
+    std::ranges::count_if(scene->getInstanceFlags(), [&filter](std::uint32_t flags) {
+      return (flags & filter.flagsMask) == filter.flagsValue;
+    }));
+}
+
+void InstanceCuller::readBackCounts(vk::CommandBuffer cmd_buf, View& view, std::uint32_t instances)
+{
+  // NOTE: acquiring this frame's command buffer has waited for the frame
+  // that used this readback the last time, so its counts are ready.
+  auto& readback =
+    view.readbacks[etna::get_context().getMainWorkCount().batchIndex() % view.readbacks.size()];
+  if (readback.pending)
+  {
+    const auto* counts = reinterpret_cast<const std::uint32_t*>(readback.counts.data());
+    Stats stats{
+      .instances = readback.instances,
+      .visibleInstances = 0,
+      .draws = 0,
+      .triangles = 0,
+    };
+    for (std::size_t i = 0; i < cpuMeshes.size() * MAX_MESH_LODS; ++i)
+      stats.visibleInstances += counts[i];
+    for (const auto& draw : cpuDraws)
+    {
+      const std::uint32_t visibleCount = counts[draw.mesh * MAX_MESH_LODS + draw.lod];
+      stats.draws += visibleCount > 0 ? 1 : 0;
+      stats.triangles += std::uint64_t{draw.indexCount / 3} * visibleCount;
+    }
+    view.stats = stats;
+  }
+
+  memory_barrier(
+    cmd_buf,
+    vk::PipelineStageFlagBits2::eComputeShader,
+    vk::AccessFlagBits2::eShaderStorageWrite,
+    vk::PipelineStageFlagBits2::eCopy,
+    vk::AccessFlagBits2::eTransferRead);
+  cmd_buf.copyBuffer(
+    view.meshVisibleCounts.get(),
+    readback.counts.get(),
+    {vk::BufferCopy{
+      .srcOffset = 0,
+      .dstOffset = 0,
+      .size = cpuMeshes.size() * MAX_MESH_LODS * sizeof(std::uint32_t),
+    }});
+  memory_barrier(
+    cmd_buf,
+    vk::PipelineStageFlagBits2::eCopy,
+    vk::AccessFlagBits2::eTransferWrite,
+    vk::PipelineStageFlagBits2::eHost,
+    vk::AccessFlagBits2::eHostRead);
+  readback.instances = instances;
+  readback.pending = true;
+}
+
+void InstanceCuller::cullOcclusion(
+  vk::CommandBuffer cmd_buf,
+  std::uint32_t view_idx,
+  const glm::mat4x4& proj_view,
+  OcclusionPhase phase,
+  const DepthPyramid& pyramid,
+  const LodSelection& lods)
+{
+  auto& view = views[view_idx];
+  // NOTE: occlusion culling writes visible instances without a layer stride
+  assert(view.maxLayers == 1);
+  const bool late = phase == OcclusionPhase::Late;
+  view.source = late ? ResultsSource::GpuLate : ResultsSource::Gpu;
+  view.stats.reset();
+  for (auto& readback : view.readbacks)
+    readback.pending = false;
+
+  if (instanceCount == 0)
+    return;
+
+  ETNA_PROFILE_GPU(cmd_buf, cullInstancesOcclusion);
+
+  auto& results = late ? view.gpuLate : view.gpu;
+
+  // Nothing was visible before the first frame
+  if (!view.visibilityCleared)
+  {
+    cmd_buf.fillBuffer(view.instanceVisibility.get(), 0, vk::WholeSize, 0);
+    view.visibilityCleared = true;
+  }
+
+  beginCulling(cmd_buf, view);
+
+  const OcclusionCullingParams params{
+    .projView = proj_view,
+    .depthSize = glm::vec2(pyramid.getDepthResolution()),
+    .count = instanceCount,
+    .phase = late ? OCCLUSION_PHASE_LATE : OCCLUSION_PHASE_EARLY,
+    .cameraPosition = lods.cameraPosition,
+    .lodErrorScale = lods.errorScale,
+  };
+
+  {
+    // NOTE: the early phase doesn't read the pyramid, but it still has to be bound
+    auto set = etna::create_descriptor_set(
+      etna::get_shader_program("occlusion_cull").getDescriptorLayoutId(0),
+      cmd_buf,
+      {etna::Binding{0, scene->getInstanceBuffer().genBinding()},
+       etna::Binding{1, instanceMeshes.genBinding()},
+       etna::Binding{2, meshes.genBinding()},
+       etna::Binding{3, view.meshVisibleCounts.genBinding()},
+       etna::Binding{4, results.visibleInstances.genBinding()},
+       etna::Binding{5, view.instanceVisibility.genBinding()},
+       etna::Binding{6, pyramid.genBinding()},
+       etna::Binding{7, view.meshDepthKeys.genBinding()}});
+
+    cmd_buf.bindPipeline(vk::PipelineBindPoint::eCompute, occlusionPipeline.getVkPipeline());
+    cmd_buf.bindDescriptorSets(
+      vk::PipelineBindPoint::eCompute,
+      occlusionPipeline.getVkPipelineLayout(),
+      0,
+      {set.getVkSet()},
+      {});
+    cmd_buf.pushConstants<OcclusionCullingParams>(
+      occlusionPipeline.getVkPipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, {params});
+
+    etna::flush_barriers(cmd_buf);
+
+    cmd_buf.dispatch((instanceCount + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+  }
+
+  emitDraws(cmd_buf, view, results);
+}
+
+void InstanceCuller::beginCulling(
+  vk::CommandBuffer cmd_buf, View& view, std::span<const CullingFrustum> layer_frusta)
+{
+  // The previous frame (or phase) might still be drawing with the results of the last
+  // culling, and the previous late phase might still be writing instance visibility.
+  memory_barrier(
+    cmd_buf,
+    vk::PipelineStageFlagBits2::eComputeShader | vk::PipelineStageFlagBits2::eDrawIndirect |
+      vk::PipelineStageFlagBits2::eVertexShader | vk::PipelineStageFlagBits2::eClear |
+      vk::PipelineStageFlagBits2::eCopy,
+    vk::AccessFlagBits2::eShaderStorageWrite | vk::AccessFlagBits2::eTransferWrite,
+    vk::PipelineStageFlagBits2::eClear | vk::PipelineStageFlagBits2::eComputeShader,
+    vk::AccessFlagBits2::eTransferWrite | vk::AccessFlagBits2::eShaderStorageRead |
+      vk::AccessFlagBits2::eShaderStorageWrite);
+
+  cmd_buf.fillBuffer(view.meshVisibleCounts.get(), 0, vk::WholeSize, 0);
+  cmd_buf.fillBuffer(view.meshDepthKeys.get(), 0, vk::WholeSize, CULLING_NO_DEPTH_KEY);
+  // NOTE: updates are clear commands the same as fills, so the barrier below covers them too
+  if (!layer_frusta.empty())
+    cmd_buf.updateBuffer(
+      view.layerFrusta.get(), 0, layer_frusta.size_bytes(), layer_frusta.data());
+
+  memory_barrier(
+    cmd_buf,
+    vk::PipelineStageFlagBits2::eClear,
+    vk::AccessFlagBits2::eTransferWrite,
+    vk::PipelineStageFlagBits2::eComputeShader,
+    vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite);
+}
+
+void InstanceCuller::emitDraws(vk::CommandBuffer cmd_buf, View& view, Results& results)
+{
+  memory_barrier(
+    cmd_buf,
+    vk::PipelineStageFlagBits2::eComputeShader,
+    vk::AccessFlagBits2::eShaderStorageWrite,
+    vk::PipelineStageFlagBits2::eComputeShader,
+    vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite);
+
+  const EmitDrawsParams params{
+    .count = static_cast<std::uint32_t>(cpuDraws.size()),
+    .firstWideDraw = firstWideCommand,
+    .narrowBatchCount = static_cast<std::uint32_t>(
+      std::ranges::count(batches, IndexType::Uint16, &Batch::indexType)),
+    .layerStride = view.maxLayers,
+  };
+
+  {
+    auto set = etna::create_descriptor_set(
+      etna::get_shader_program("emit_draws").getDescriptorLayoutId(0),
+      cmd_buf,
+      {etna::Binding{0, draws.genBinding()},
+       etna::Binding{1, view.meshVisibleCounts.genBinding()},
+       etna::Binding{2, results.commands.genBinding()},
+       etna::Binding{3, results.drawCounts.genBinding()},
+       etna::Binding{4, view.meshDepthKeys.genBinding()}});
+
+    cmd_buf.bindPipeline(vk::PipelineBindPoint::eCompute, emitPipeline.getVkPipeline());
+    cmd_buf.bindDescriptorSets(
+      vk::PipelineBindPoint::eCompute, emitPipeline.getVkPipelineLayout(), 0, {set.getVkSet()}, {});
+    cmd_buf.pushConstants<EmitDrawsParams>(
+      emitPipeline.getVkPipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, {params});
+
+    etna::flush_barriers(cmd_buf);
+
+    // A workgroup per batch, every batch is sorted on its own
+    cmd_buf.dispatch(static_cast<std::uint32_t>(batches.size()), 1, 1);
+  }
+
+  memory_barrier(
+    cmd_buf,
+    vk::PipelineStageFlagBits2::eComputeShader,
+    vk::AccessFlagBits2::eShaderStorageWrite,
+    vk::PipelineStageFlagBits2::eDrawIndirect | vk::PipelineStageFlagBits2::eVertexShader,
+    vk::AccessFlagBits2::eIndirectCommandRead | vk::AccessFlagBits2::eShaderStorageRead);
+}
+
+void InstanceCuller::cullMeshlets(
+  vk::CommandBuffer cmd_buf,
+  std::uint32_t view_idx,
+  const glm::mat4x4& proj_view,
+  const glm::vec3& camera_position)
+{
+  auto& view = views[view_idx];
+  // NOTE: meshlet culling reads visible instances without a layer stride
+  assert(view.maxLayers == 1);
+
+  if (instanceCount == 0 || meshletCount == 0)
+    return;
+
+  ETNA_PROFILE_GPU(cmd_buf, cullMeshlets);
+
+  // The previous frame might still be drawing the last results
+  memory_barrier(
+    cmd_buf,
+    vk::PipelineStageFlagBits2::eComputeShader | vk::PipelineStageFlagBits2::eDrawIndirect,
+    vk::AccessFlagBits2::eShaderStorageWrite,
+    vk::PipelineStageFlagBits2::eClear | vk::PipelineStageFlagBits2::eComputeShader,
+    vk::AccessFlagBits2::eTransferWrite | vk::AccessFlagBits2::eShaderStorageWrite);
+
+  cmd_buf.fillBuffer(view.meshletDrawCounts.get(), 0, vk::WholeSize, 0);
+
+  memory_barrier(
+    cmd_buf,
+    vk::PipelineStageFlagBits2::eClear,
+    vk::AccessFlagBits2::eTransferWrite,
+    vk::PipelineStageFlagBits2::eComputeShader,
+    vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite);
+
+  MeshletCullingParams params{};
+  std::ranges::copy(frustum_from_matrix(proj_view).planes, params.frustumPlanes);
+  params.cameraPosition = camera_position;
+  params.instanceCount = instanceCount;
+  params.firstWideCommand = meshletCommandCounts[0];
+
+  {
+    const auto& results = view.results();
+    auto set = etna::create_descriptor_set(
+      etna::get_shader_program("cull_meshlets").getDescriptorLayoutId(0),
+      cmd_buf,
+      {etna::Binding{0, scene->getInstanceBuffer().genBinding()},
+       etna::Binding{1, instanceMeshes.genBinding()},
+       etna::Binding{2, meshes.genBinding()},
+       etna::Binding{3, view.meshVisibleCounts.genBinding()},
+       etna::Binding{4, results.visibleInstances.genBinding()},
+       etna::Binding{5, meshletRanges.genBinding()},
+       etna::Binding{6, meshlets.genBinding()},
+       etna::Binding{7, view.meshletCommands.genBinding()},
+       etna::Binding{8, view.meshletDrawCounts.genBinding()}});
+
+    cmd_buf.bindPipeline(vk::PipelineBindPoint::eCompute, meshletPipeline.getVkPipeline());
+    cmd_buf.bindDescriptorSets(
+      vk::PipelineBindPoint::eCompute,
+      meshletPipeline.getVkPipelineLayout(),
+      0,
+      {set.getVkSet()},
+      {});
+    cmd_buf.pushConstants<MeshletCullingParams>(
+      meshletPipeline.getVkPipelineLayout(), vk::ShaderStageFlagBits::eCompute, 0, {params});
+
+    etna::flush_barriers(cmd_buf);
+
+    // A workgroup per instance slot of every LOD, most of them exit right away
+    const std::uint32_t slotCount = instanceCount * maxLodCount;
+    const std::uint32_t groupsX = std::min(slotCount, MAX_WORKGROUPS_X);
+    cmd_buf.dispatch(groupsX, (slotCount + groupsX - 1) / groupsX, 1);
+  }
+
+  memory_barrier(
+    cmd_buf,
+    vk::PipelineStageFlagBits2::eComputeShader,
+    vk::AccessFlagBits2::eShaderStorageWrite,
+    vk::PipelineStageFlagBits2::eDrawIndirect,
+    vk::AccessFlagBits2::eIndirectCommandRead);
+}
+
+void InstanceCuller::cullOnCpu(
+  std::uint32_t view,
+  const glm::mat4x4& proj_view,
+  const LodSelection& lods,
+  const InstanceFilter& filter)
+{
+  cullFrustumOnCpu(view, {&proj_view, 1}, FrustumKind::View, lods, filter);
+}
+
+void InstanceCuller::cullCastersOnCpu(
+  std::uint32_t view, const glm::mat4x4& light_proj_view, const InstanceFilter& filter)
+{
+  cullFrustumOnCpu(view, {&light_proj_view, 1}, FrustumKind::Casters, {}, filter);
+}
+
+void InstanceCuller::cullCastersLayeredOnCpu(
+  std::uint32_t view,
+  std::span<const glm::mat4x4> light_proj_views,
+  const InstanceFilter& filter)
+{
+  assert(light_proj_views.size() <= views[view].maxLayers);
+  cullFrustumOnCpu(view, light_proj_views, FrustumKind::Casters, {}, filter);
+}
+
+void InstanceCuller::cullFrustumOnCpu(
+  std::uint32_t view_idx,
+  std::span<const glm::mat4x4> proj_views,
+  FrustumKind kind,
+  const LodSelection& lods,
+  const InstanceFilter& filter)
+{
+  ZoneScoped;
+
+  auto& view = views[view_idx];
+  view.source = ResultsSource::Cpu;
+  view.cpuIndex = etna::get_context().getMainWorkCount().batchIndex() % view.cpu.size();
+  auto& results = view.cpu[view.cpuIndex];
+  for (auto& readback : view.readbacks)
+    readback.pending = false;
+
+  // Same layout as the culling passes produce, except that instances of a mesh stay sorted
+  // by layer and then by slot
+  auto* visibleInstances = reinterpret_cast<std::uint32_t*>(results.visibleInstances.data());
+  const auto& instanceBounds = scene->getInstanceBounds();
+  const auto instanceScales = scene->getInstanceScales();
+  // NOTE: z = 0 in clip space, so distances to it grow away from the camera for
+  // perspective and orthographic projections alike. Casters still have it for sorting.
+  // Layers are expected to face the same way, so the first one orders them all.
+  const glm::vec4 nearPlane = frustum_from_matrix(proj_views.front()).planes[4];
+  std::ranges::fill(view.cpuMeshVisibleCounts, 0u);
+  std::ranges::fill(view.cpuMeshDepths, std::numeric_limits<float>::max());
+  std::uint32_t visibleTotal = 0;
+  for (std::uint32_t layer = 0; layer < proj_views.size(); ++layer)
+  {
+    const auto& projView = proj_views[layer];
+    const Frustum frustum = kind == FrustumKind::Casters ? caster_frustum_from_matrix(projView)
+                                                         : frustum_from_matrix(projView);
+    view.visibleSlots.clear();
+    if (instanceCount > 0)
+      instanceBounds.cull(frustum, view.visibleSlots);
+    if (filter.flagsMask != 0)
+    {
+      const auto instanceFlags = scene->getInstanceFlags();
+      std::erase_if(view.visibleSlots, [&filter, instanceFlags](std::uint32_t slot) {
+        return (instanceFlags[slot] & filter.flagsMask) != filter.flagsValue;
+      });
+    }
+    visibleTotal += static_cast<std::uint32_t>(view.visibleSlots.size());
+
+    for (const std::uint32_t slot : view.visibleSlots)
+    {
+      const std::uint32_t meshIdx = cpuInstanceMeshes[slot];
+      const auto& mesh = cpuMeshes[meshIdx];
+      const auto bounds = instanceBounds.get(slot);
+      const std::uint32_t lod = select_lod(mesh, instanceScales[slot], bounds, lods);
+      const std::uint32_t meshLod = meshIdx * MAX_MESH_LODS + lod;
+      auto& visibleCount = view.cpuMeshVisibleCounts[meshLod];
+      visibleInstances[(lod * instanceCount + mesh.firstInstance) * view.maxLayers +
+                       visibleCount++] = slot | (layer << CULLING_LAYER_SHIFT);
+
+      // To the closest corner of the bounds
+      const glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+      const glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+      const float depth = glm::dot(glm::vec3(nearPlane), center) + nearPlane.w -
+        glm::dot(glm::abs(glm::vec3(nearPlane)), extent);
+      view.cpuMeshDepths[meshLod] = std::min(view.cpuMeshDepths[meshLod], depth);
+    }
+  }
+
+  // Draws go front to back by the closest visible instance of their mesh. All relems of a
+  // LOD of a mesh have the same depth, so only the first draw of every group gets a key, and
+  // the rest of the group follows it. Every relem is still a single instanced draw for all
+  // visible instances of the mesh.
+  auto& sortKeys = view.sortKeys;
+  sortKeys.clear();
+  for (const auto& group : cpuDrawGroups)
+  {
+    if (view.cpuMeshVisibleCounts[group.meshLod] == 0)
+      continue;
+
+    // NOTE: there are no materials yet, and the only state that differs between draws is
+    // the index buffer binding, which is what batches are split by.
+    const std::uint32_t pipeline = group.firstDraw < firstWideCommand ? 0 : 1;
+    sortKeys.push_back(
+      make_draw_sort_key(pipeline, 0, view.cpuMeshDepths[group.meshLod], group.firstDraw));
+  }
+  // Draws with 16 bit indices go first, so keys are grouped by pipeline already, and sorting
+  // the groups separately saves a pass over the pipeline bits
+  view.sortScratch.resize(sortKeys.size());
+  const auto firstWideKey = std::ranges::partition_point(sortKeys, [this](std::uint64_t key) {
+    return draw_from_sort_key(key) < firstWideCommand;
+  });
+  const auto narrowKeyCount = static_cast<std::size_t>(firstWideKey - sortKeys.begin());
+  radix_sort(std::span{sortKeys}.first(narrowKeyCount), view.sortScratch, SORT_KEY_DRAW_BITS);
+  radix_sort(std::span{sortKeys}.subspan(narrowKeyCount), view.sortScratch, SORT_KEY_DRAW_BITS);
+
+  // Sorted draws of an index type fill the commands of its batches one after another
+  auto* commands = reinterpret_cast<vk::DrawIndexedIndirectCommand*>(results.commands.data());
+  std::array<std::uint32_t, 2> nextCommand{0, firstWideCommand};
+  std::uint64_t triangles = 0;
+  for (const auto key : sortKeys)
+  {
+    // NOTE: the group ends where the LOD or the index type changes. Checking that on draws
+    // that are read anyway is cheaper than looking the group up.
+    const std::uint32_t firstDraw = draw_from_sort_key(key);
+    const bool wide = firstDraw >= firstWideCommand;
+    const std::uint32_t groupEnd =
+      wide ? static_cast<std::uint32_t>(cpuDraws.size()) : firstWideCommand;
+    const std::uint32_t mesh = cpuDraws[firstDraw].mesh;
+    const std::uint32_t lod = cpuDraws[firstDraw].lod;
+    const std::uint32_t visibleCount = view.cpuMeshVisibleCounts[mesh * MAX_MESH_LODS + lod];
+    auto& next = nextCommand[wide ? 1 : 0];
+    for (std::uint32_t drawIdx = firstDraw; drawIdx < groupEnd; ++drawIdx)
+    {
+      const auto& draw = cpuDraws[drawIdx];
+      if (draw.mesh != mesh || draw.lod != lod)
+        break;
+      triangles += std::uint64_t{draw.indexCount / 3} * visibleCount;
+      commands[next++] = vk::DrawIndexedIndirectCommand{
+        .indexCount = draw.indexCount,
+        .instanceCount = visibleCount,
+        .firstIndex = draw.firstIndex,
+        .vertexOffset = static_cast<std::int32_t>(draw.vertexOffset),
+        .firstInstance = draw.firstInstance * view.maxLayers,
+      };
+    }
+  }
+
+  auto& drawCounts = view.cpuDrawCounts;
+  for (std::size_t batchIdx = 0; batchIdx < batches.size(); ++batchIdx)
+  {
+    const auto& batch = batches[batchIdx];
+    const std::uint32_t written = nextCommand[static_cast<std::size_t>(batch.indexType)];
+    drawCounts[batchIdx] =
+      std::clamp(written, batch.firstCommand, batch.firstCommand + batch.drawCount) -
+      batch.firstCommand;
+  }
+  std::memcpy(
+    results.drawCounts.data(), drawCounts.data(), drawCounts.size() * sizeof(std::uint32_t));
+
+  view.stats = Stats{
+    .instances = countInstances(filter),
+    .visibleInstances = visibleTotal,
+    .draws = std::reduce(drawCounts.begin(), drawCounts.end(), 0u),
+    .triangles = triangles,
+  };
+}
+
+void InstanceCuller::draw(vk::CommandBuffer cmd_buf, std::uint32_t view) const
+{
+  drawBatches(cmd_buf, view, 0, getBatchCount());
+}
+
+void InstanceCuller::drawBatches(
+  vk::CommandBuffer cmd_buf,
+  std::uint32_t view_idx,
+  std::uint32_t first_batch,
+  std::uint32_t batch_count) const
+{
+  const auto& results = views[view_idx].results();
+  constexpr std::uint32_t STRIDE = sizeof(vk::DrawIndexedIndirectCommand);
+
+  std::optional<IndexType> boundIndexType;
+  for (std::uint32_t batchIdx = first_batch; batchIdx < first_batch + batch_count; ++batchIdx)
+  {
+    const auto& batch = batches[batchIdx];
+    if (boundIndexType != batch.indexType)
+    {
+      cmd_buf.bindIndexBuffer(
+        scene->getIndexBuffer(),
+        0,
+        batch.indexType == IndexType::Uint16 ? vk::IndexType::eUint16 : vk::IndexType::eUint32);
+      boundIndexType = batch.indexType;
+    }
+
+    cmd_buf.drawIndexedIndirectCount(
+      results.commands.get(),
+      batch.firstCommand * STRIDE,
+      results.drawCounts.get(),
+      batchIdx * sizeof(std::uint32_t),
+      batch.drawCount,
+      STRIDE);
+  }
+}
+
+void InstanceCuller::drawMeshlets(vk::CommandBuffer cmd_buf, std::uint32_t view_idx) const
+{
+  const auto& view = views[view_idx];
+  constexpr std::uint32_t STRIDE = sizeof(vk::DrawIndexedIndirectCommand);
+
+  std::uint32_t firstCommand = 0;
+  for (std::uint32_t wide = 0; wide < meshletCommandCounts.size(); ++wide)
+  {
+    const std::uint32_t maxDraws = meshletCommandCounts[wide];
+    if (maxDraws == 0)
+      continue;
+
+    cmd_buf.bindIndexBuffer(
+      scene->getIndexBuffer(), 0, wide != 0 ? vk::IndexType::eUint32 : vk::IndexType::eUint16);
+    cmd_buf.drawIndexedIndirectCount(
+      view.meshletCommands.get(),
+      firstCommand * STRIDE,
+      view.meshletDrawCounts.get(),
+      wide * sizeof(std::uint32_t),
+      maxDraws,
+      STRIDE);
+    firstCommand += maxDraws;
+  }
+}
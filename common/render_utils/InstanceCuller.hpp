@@ -0,0 +1,376 @@
+#pragma once
+
+#include <array>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <etna/Vulkan.hpp>
+#include <etna/Buffer.hpp>
+#include <etna/ComputePipeline.hpp>
+
+#include "scene/SceneManager.hpp"
+#include "DepthPyramid.hpp"
+#include "shaders/CullingData.h"
+
+
+/**
+ * Frustum culling of scene instances on the GPU. A compute pass tests the bounds of
+ * every instance against the frustum of a view, and a second one turns the relems of
+ * visible instances into indirect draw commands. Everything is consumed by
+ * drawIndexedIndirectCount, so the CPU does the same amount of work for any scene.
+ * Within every batch (see getBatchCount), draws go front to back by the closest visible
+ * instance of their mesh.
+ *
+ * Views with a depth buffer can additionally be culled against the depth of the last frame
+ * in two phases, see cullOcclusion.
+ *
+ * Baked scenes come with meshlets (see Meshlets.hpp), so visible instances of those can be
+ * further split into meshlets that are culled against the frustum and their normal cones,
+ * see cullMeshlets.
+ *
+ * Meshes with LODs (see MeshLods.hpp) get a LOD selected for every visible instance while
+ * culling, and every LOD of a mesh is drawn as if it was a separate mesh.
+ *
+ * Layered views, e.g. the cascades of a shadow map, are culled against several frusta at once
+ * and their casters are drawn into every layer with a single pass, see cullCastersLayered.
+ *
+ * Alternatively, a view can be culled on the CPU with SIMD against the scene's world
+ * space instance bounds. The results are laid out exactly the same way and are drawn
+ * the same way, but, unlike with GPU culling, statistics are known right away, and draws
+ * are sorted front to back by sort keys (see DrawSorting.hpp) across all batches of an index
+ * type instead of within every batch.
+ */
+class InstanceCuller
+{
+public:
+  struct CreateInfo
+  {
+    // Every view (the main camera, a shadow map, ...) gets its own culling results
+    std::uint32_t viewCount = 1;
+    // Views that can be culled with cullCastersLayered, their visible instances take up
+    // CULLING_MAX_LAYERS times as much memory
+    std::vector<std::uint32_t> layeredViews = {};
+  };
+
+  explicit InstanceCuller(CreateInfo info);
+
+  // Has to be called every time the scene manager selects a scene
+  void prepare(SceneManager& scene_mgr);
+
+  // A LOD is selected for an instance if its error, projected from the closest point of
+  // the instance's bounds to a camera at `cameraPosition`, is small enough. `errorScale` is
+  // the size of an error of 1 at a distance of 1 relative to the largest acceptable size,
+  // e.g. the focal length in pixels divided by the acceptable error in pixels.
+  // Zero means that the full detail LOD is always used.
+  struct LodSelection
+  {
+    glm::vec3 cameraPosition;
+    float errorScale;
+  };
+
+  // Only instances with (GpuInstance::flags & flagsMask) == flagsValue are culled, the rest
+  // are never visible. Zero for both lets every instance through.
+  struct InstanceFilter
+  {
+    std::uint32_t flagsMask;
+    std::uint32_t flagsValue;
+  };
+
+  // Records culling of the scene against the `proj_view` frustum.
+  // Has to be recorded outside of rendering, before `draw` for the same view.
+  void cull(
+    vk::CommandBuffer cmd_buf,
+    std::uint32_t view,
+    const glm::mat4x4& proj_view,
+    const LodSelection& lods = {},
+    const InstanceFilter& filter = {});
+
+  enum class OcclusionPhase
+  {
+    // Instances in the frustum that passed the late phase the last frame
+    Early,
+    // Instances in the frustum that are not occluded according to `pyramid`,
+    // except for the ones the early phase has already returned.
+    Late,
+  };
+
+  // Same as `cull`, but also culls occluded instances in two phases. Results of the early
+  // phase have to be drawn before the pyramid is built from the depth buffer and the late
+  // phase is culled. Drawing both gives the same image as drawing everything.
+  void cullOcclusion(
+    vk::CommandBuffer cmd_buf,
+    std::uint32_t view,
+    const glm::mat4x4& proj_view,
+    OcclusionPhase phase,
+    const DepthPyramid& pyramid,
+    const LodSelection& lods = {});
+
+  // Same as `cull`, but done right away on the CPU. Results are written to memory of the
+  // current frame in flight, so this has to be called while recording the frame.
+  void cullOnCpu(
+    std::uint32_t view,
+    const glm::mat4x4& proj_view,
+    const LodSelection& lods = {},
+    const InstanceFilter& filter = {});
+
+  // Same as `cull`, but for shadow casters of a light with the `light_proj_view` frustum.
+  // The frustum is extended towards the light, so that casters that are outside of it,
+  // but between it and the light, still cast their shadows. Such casters have to be
+  // drawn with depth clamping, which flattens them onto the near plane.
+  void cullCasters(
+    vk::CommandBuffer cmd_buf,
+    std::uint32_t view,
+    const glm::mat4x4& light_proj_view,
+    const InstanceFilter& filter = {});
+
+  // Same as `cullCasters`, but done right away on the CPU
+  void cullCastersOnCpu(
+    std::uint32_t view, const glm::mat4x4& light_proj_view, const InstanceFilter& filter = {});
+
+  // Same as `cullCasters`, but against up to CULLING_MAX_LAYERS frusta at once, for a view
+  // from CreateInfo::layeredViews. An instance is visible once for every frustum it is in,
+  // and its entry in the visible instances keeps the index of that frustum (the layer)
+  // above CULLING_LAYER_SHIFT, so a single `draw` renders the casters of every layer.
+  void cullCastersLayered(
+    vk::CommandBuffer cmd_buf,
+    std::uint32_t view,
+    std::span<const glm::mat4x4> light_proj_views,
+    const InstanceFilter& filter = {});
+
+  // Same as `cullCastersLayered`, but done right away on the CPU
+  void cullCastersLayeredOnCpu(
+    std::uint32_t view,
+    std::span<const glm::mat4x4> light_proj_views,
+    const InstanceFilter& filter = {});
+
+  struct Stats
+  {
+    // Only the ones that pass the filter, the rest are not even tested
+    std::uint32_t instances;
+    // Once for every layer an instance is visible in
+    std::uint32_t visibleInstances;
+    std::uint32_t draws;
+    std::uint64_t triangles;
+  };
+
+  // Known right away when the last culling of the view was done on the CPU. For `cull` and
+  // `cullCasters`, these are the statistics of the GPU culling of the view that happened
+  // as many frames ago as there are frames in flight. Never known for occlusion culling.
+  const std::optional<Stats>& getStats(std::uint32_t view) const { return views[view].stats; }
+
+  // Visible instances of a mesh that use LOD `lod` start at
+  // (lod * instance count + MeshInstances::firstInstance) * layers, so shaders
+  // find their instance as instances[visibleInstances[gl_InstanceIndex]].
+  // For layered views, `layers` is CULLING_MAX_LAYERS, and the layer has to be masked
+  // out with CULLING_SLOT_MASK first, otherwise it's 1 and there are no layer bits.
+  // Like `draw`, refers to the results of the last culling of the view.
+  const etna::Buffer& getVisibleInstances(std::uint32_t view) const
+  {
+    return views[view].results().visibleInstances;
+  }
+
+  // Draws everything that survived culling. Expects the scene's vertex buffer to be bound.
+  void draw(vk::CommandBuffer cmd_buf, std::uint32_t view) const;
+
+  // Draws are grouped into batches of up to a few hundred relems,
+  // every batch is a single drawIndexedIndirectCount.
+  std::uint32_t getBatchCount() const { return static_cast<std::uint32_t>(batches.size()); }
+
+  // Same as `draw`, but only for batches in [first_batch, first_batch + batch_count),
+  // so that parts of a pass can be recorded into different command buffers in parallel.
+  void drawBatches(
+    vk::CommandBuffer cmd_buf,
+    std::uint32_t view,
+    std::uint32_t first_batch,
+    std::uint32_t batch_count) const;
+
+  bool hasMeshlets() const { return meshletCount > 0; }
+
+  // Records culling of the meshlets of instances that survived the last culling of the
+  // view, which has to be `cull` or `cullOcclusion`. Meshlets are culled against the
+  // `proj_view` frustum and back-facing ones are culled for a camera at `camera_position`.
+  void cullMeshlets(
+    vk::CommandBuffer cmd_buf,
+    std::uint32_t view,
+    const glm::mat4x4& proj_view,
+    const glm::vec3& camera_position);
+
+  // Same as `draw`, but every visible meshlet is a separate draw. Draws the same triangles,
+  // so use either this or `draw`, not both.
+  void drawMeshlets(vk::CommandBuffer cmd_buf, std::uint32_t view) const;
+
+private:
+  struct View;
+  struct Results;
+
+  enum class FrustumKind
+  {
+    View,
+    // Extended towards the viewer, see cullCasters
+    Casters,
+  };
+
+  void cullFrustum(
+    vk::CommandBuffer cmd_buf,
+    std::uint32_t view,
+    const glm::mat4x4& proj_view,
+    FrustumKind kind,
+    const LodSelection& lods,
+    const InstanceFilter& filter);
+  // Layers are culled one after another, and draws are sorted by the first one
+  void cullFrustumOnCpu(
+    std::uint32_t view,
+    std::span<const glm::mat4x4> proj_views,
+    FrustumKind kind,
+    const LodSelection& lods,
+    const InstanceFilter& filter);
+
+  // How many instances pass the filter
+  std::uint32_t countInstances(const InstanceFilter& filter) const;
+
+  // Copies the visible counts of the view to this frame's readback, and picks up the
+  // counts the same readback got the last time it was used
+  void readBackCounts(vk::CommandBuffer cmd_buf, View& view, std::uint32_t instances);
+
+  // Layered culling also uploads the frusta of its layers
+  void beginCulling(
+    vk::CommandBuffer cmd_buf, View& view, std::span<const CullingFrustum> layer_frusta = {});
+  void emitDraws(vk::CommandBuffer cmd_buf, View& view, Results& results);
+
+  void createViewBuffers(
+    std::size_t mesh_count,
+    std::size_t instance_count,
+    std::size_t draw_count,
+    std::size_t batch_count,
+    std::size_t meshlet_command_count);
+
+private:
+  // Written either by the culling passes on the GPU or by the CPU
+  struct Results
+  {
+    etna::Buffer visibleInstances;
+    etna::Buffer commands;
+    // One per batch
+    etna::Buffer drawCounts;
+  };
+
+  enum class ResultsSource
+  {
+    Gpu,
+    GpuLate,
+    Cpu,
+  };
+
+  struct View
+  {
+    etna::Buffer meshVisibleCounts;
+    // Indexed the same way, the closest visible instance, see depth_sort_key in culling.glsl
+    etna::Buffer meshDepthKeys;
+    Results gpu;
+    // Late phase of occlusion culling, the early one uses `gpu`
+    Results gpuLate;
+    // Persistently mapped, one per frame in flight
+    std::vector<Results> cpu;
+    std::size_t cpuIndex = 0;
+    ResultsSource source = ResultsSource::Gpu;
+    // Stride of visible instances, see getVisibleInstances
+    std::uint32_t maxLayers = 1;
+    // Only for layered views
+    etna::Buffer layerFrusta;
+    std::optional<Stats> stats;
+
+    // Copies of meshVisibleCounts, one per frame in flight, for statistics of GPU culling
+    struct CountsReadback
+    {
+      etna::Buffer counts;
+      // Instances that passed the filter
+      std::uint32_t instances = 0;
+      bool pending = false;
+    };
+    std::vector<CountsReadback> readbacks;
+
+    // Whether every instance passed the last late phase of occlusion culling
+    etna::Buffer instanceVisibility;
+    bool visibilityCleared = false;
+
+    // Results of meshlet culling, the 16 bit commands go first
+    etna::Buffer meshletCommands;
+    etna::Buffer meshletDrawCounts;
+
+    // Scratch space for CPU culling
+    std::vector<std::uint32_t> visibleSlots;
+    std::vector<std::uint32_t> cpuMeshVisibleCounts;
+    // Distance to the closest visible instance, indexed the same way as the counts
+    std::vector<float> cpuMeshDepths;
+    std::vector<std::uint32_t> cpuDrawCounts;
+    std::vector<std::uint64_t> sortKeys;
+    std::vector<std::uint64_t> sortScratch;
+
+    const Results& results() const
+    {
+      switch (source)
+      {
+      case ResultsSource::Gpu:
+        return gpu;
+      case ResultsSource::GpuLate:
+        return gpuLate;
+      case ResultsSource::Cpu:
+        return cpu[cpuIndex];
+      }
+      return gpu;
+    }
+  };
+
+  SceneManager* scene = nullptr;
+
+  etna::ComputePipeline cullPipeline;
+  etna::ComputePipeline layeredPipeline;
+  etna::ComputePipeline occlusionPipeline;
+  etna::ComputePipeline emitPipeline;
+  etna::ComputePipeline meshletPipeline;
+
+  etna::Buffer instanceMeshes;
+  etna::Buffer meshes;
+  etna::Buffer draws;
+  etna::Buffer meshletRanges;
+  etna::Buffer meshlets;
+  std::vector<View> views;
+
+  // Same as the buffers above, for CPU culling
+  std::vector<std::uint32_t> cpuInstanceMeshes;
+  std::vector<CullingMesh> cpuMeshes;
+  std::vector<CullingDraw> cpuDraws;
+
+  // Consecutive draws of an index type that belong to the same LOD of a mesh. They share
+  // the visible instances and the depth, so CPU culling sorts these instead of draws.
+  struct DrawGroup
+  {
+    std::uint32_t meshLod;
+    std::uint32_t firstDraw;
+  };
+  std::vector<DrawGroup> cpuDrawGroups;
+
+  struct Batch
+  {
+    IndexType indexType;
+    std::uint32_t firstCommand;
+    std::uint32_t drawCount;
+  };
+
+  std::uint32_t instanceCount = 0;
+  // Commands of draws with 32 bit indices start here, the 16 bit ones start at 0
+  std::uint32_t firstWideCommand = 0;
+  // The most LODs any mesh with instances has
+  std::uint32_t maxLodCount = 1;
+  // Batches with 16 bit indices go first, then the 32 bit ones
+  std::vector<Batch> batches;
+
+  std::uint32_t meshletCount = 0;
+  // The most meshlet draws there can be for either index type, with all instances visible
+  std::array<std::uint32_t, 2> meshletCommandCounts{};
+
+  InstanceCuller(const InstanceCuller&) = delete;
+  InstanceCuller& operator=(const InstanceCuller&) = delete;
+};
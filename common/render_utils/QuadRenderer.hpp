@@ -21,12 +21,14 @@ public:
   explicit QuadRenderer(CreateInfo info);
   ~QuadRenderer() {}
 
+  // `view_params` selects what part of the texture is drawn, e.g. a layer of an array
   void render(
     vk::CommandBuffer cmd_buff,
     vk::Image target_image,
     vk::ImageView target_image_view,
     const etna::Image& tex_to_draw,
-    const etna::Sampler& sampler);
+    const etna::Sampler& sampler,
+    etna::Image::ViewParams view_params = {});
 
 private:
   etna::GraphicsPipeline pipeline;
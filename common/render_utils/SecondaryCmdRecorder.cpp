@@ -0,0 +1,170 @@
+#include "SecondaryCmdRecorder.hpp"
+
+#include <algorithm>
+
+#include <etna/GlobalContext.hpp>
+#include <etna/Etna.hpp>
+#include <etna/Profiling.hpp>
+
+
+SecondaryCmdRecorder::SecondaryCmdRecorder(CreateInfo info)
+  : threadPool{info.threadPool}
+  , maxChunks{std::max<std::uint32_t>(info.maxChunks, 1)}
+{
+  auto& ctx = etna::get_context();
+
+  frameCount = ctx.getMainWorkCount().multiBufferingCount();
+  commands.resize(frameCount * maxChunks);
+  for (auto& chunkCommands : commands)
+    chunkCommands.pool = etna::unwrap_vk_result(ctx.getDevice().createCommandPoolUnique(
+      vk::CommandPoolCreateInfo{
+        .flags = vk::CommandPoolCreateFlagBits::eTransient,
+        .queueFamilyIndex = ctx.getQueueFamilyIdx(),
+      }));
+}
+
+void SecondaryCmdRecorder::nextFrame()
+{
+  ZoneScoped;
+
+  // NOTE: the frame that used these pools the last time had the same batch index,
+  // and acquiring the current primary command buffer already waited for it to finish.
+  frame = etna::get_context().getMainWorkCount().batchIndex() % frameCount;
+
+  const auto device = etna::get_context().getDevice();
+  for (std::uint32_t chunk = 0; chunk < maxChunks; ++chunk)
+  {
+    auto& chunkCommands = commands[frame * maxChunks + chunk];
+    ETNA_CHECK_VK_RESULT(device.resetCommandPool(chunkCommands.pool.get()));
+    chunkCommands.usedBuffers = 0;
+  }
+}
+
+vk::CommandBuffer SecondaryCmdRecorder::acquireBuffer(std::uint32_t chunk)
+{
+  auto& chunkCommands = commands[frame * maxChunks + chunk];
+  if (chunkCommands.usedBuffers == chunkCommands.buffers.size())
+  {
+    auto buffers =
+      etna::unwrap_vk_result(etna::get_context().getDevice().allocateCommandBuffers(
+        vk::CommandBufferAllocateInfo{
+          .commandPool = chunkCommands.pool.get(),
+          .level = vk::CommandBufferLevel::eSecondary,
+          .commandBufferCount = 1,
+        }));
+    chunkCommands.buffers.push_back(buffers.front());
+  }
+  return chunkCommands.buffers[chunkCommands.usedBuffers++];
+}
+
+void SecondaryCmdRecorder::render(
+  vk::CommandBuffer cmd_buf,
+  const RenderingInfo& info,
+  std::uint32_t chunk_count,
+  RecordChunk record_chunk)
+{
+  ZoneScoped;
+
+  chunk_count = std::clamp<std::uint32_t>(chunk_count, 1, maxChunks);
+
+  std::vector<vk::RenderingAttachmentInfo> colorInfos;
+  std::vector<vk::Format> colorFormats;
+  for (const auto& attachment : info.colorAttachments)
+  {
+    etna::set_state(
+      cmd_buf,
+      attachment.image,
+      vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+      vk::AccessFlagBits2::eColorAttachmentRead | vk::AccessFlagBits2::eColorAttachmentWrite,
+      vk::ImageLayout::eColorAttachmentOptimal,
+      vk::ImageAspectFlagBits::eColor);
+    vk::ClearValue clearValue{};
+    clearValue.color.float32 = attachment.clearColor;
+    colorInfos.push_back(vk::RenderingAttachmentInfo{
+      .imageView = attachment.view,
+      .imageLayout = vk::ImageLayout::eColorAttachmentOptimal,
+      .loadOp = attachment.loadOp,
+      .storeOp = vk::AttachmentStoreOp::eStore,
+      .clearValue = clearValue,
+    });
+    colorFormats.push_back(attachment.format);
+  }
+
+  std::optional<vk::RenderingAttachmentInfo> depthInfo;
+  if (info.depthAttachment)
+  {
+    etna::set_state(
+      cmd_buf,
+      info.depthAttachment->image,
+      vk::PipelineStageFlagBits2::eEarlyFragmentTests |
+        vk::PipelineStageFlagBits2::eLateFragmentTests,
+      vk::AccessFlagBits2::eDepthStencilAttachmentRead |
+        vk::AccessFlagBits2::eDepthStencilAttachmentWrite,
+      vk::ImageLayout::eDepthAttachmentOptimal,
+      vk::ImageAspectFlagBits::eDepth);
+    vk::ClearValue clearValue{};
+    clearValue.depthStencil = info.depthAttachment->clearDepthStencil;
+    depthInfo = vk::RenderingAttachmentInfo{
+      .imageView = info.depthAttachment->view,
+      .imageLayout = vk::ImageLayout::eDepthAttachmentOptimal,
+      .loadOp = info.depthAttachment->loadOp,
+      .storeOp = vk::AttachmentStoreOp::eStore,
+      .clearValue = clearValue,
+    };
+  }
+
+  etna::flush_barriers(cmd_buf);
+
+  std::vector<vk::CommandBuffer> chunkBuffers(chunk_count);
+  {
+    ZoneScopedN("recordChunks");
+
+    const vk::CommandBufferInheritanceRenderingInfo renderingInheritance{
+      .colorAttachmentCount = static_cast<std::uint32_t>(colorFormats.size()),
+      .pColorAttachmentFormats = colorFormats.data(),
+      .depthAttachmentFormat =
+        info.depthAttachment ? info.depthAttachment->format : vk::Format::eUndefined,
+      .rasterizationSamples = vk::SampleCountFlagBits::e1,
+    };
+    const vk::CommandBufferInheritanceInfo inheritance{.pNext = &renderingInheritance};
+
+    const vk::Viewport viewport{
+      .x = static_cast<float>(info.rect.offset.x),
+      .y = static_cast<float>(info.rect.offset.y),
+      .width = static_cast<float>(info.rect.extent.width),
+      .height = static_cast<float>(info.rect.extent.height),
+      .minDepth = 0.0f,
+      .maxDepth = 1.0f,
+    };
+
+    // Command buffers are acquired up front, pools of a chunk are not thread safe
+    for (std::uint32_t chunk = 0; chunk < chunk_count; ++chunk)
+      chunkBuffers[chunk] = acquireBuffer(chunk);
+
+    threadPool.parallelFor(chunk_count, 1, [&](std::size_t chunk) {
+      ZoneScopedN("recordChunk");
+
+      const auto chunkBuf = chunkBuffers[chunk];
+      ETNA_CHECK_VK_RESULT(chunkBuf.begin(vk::CommandBufferBeginInfo{
+        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit |
+          vk::CommandBufferUsageFlagBits::eRenderPassContinue,
+        .pInheritanceInfo = &inheritance,
+      }));
+      chunkBuf.setViewport(0, {viewport});
+      chunkBuf.setScissor(0, {info.rect});
+      record_chunk(chunkBuf, static_cast<std::uint32_t>(chunk));
+      ETNA_CHECK_VK_RESULT(chunkBuf.end());
+    });
+  }
+
+  cmd_buf.beginRendering(vk::RenderingInfo{
+    .flags = vk::RenderingFlagBits::eContentsSecondaryCommandBuffers,
+    .renderArea = info.rect,
+    .layerCount = info.layerCount,
+    .colorAttachmentCount = static_cast<std::uint32_t>(colorInfos.size()),
+    .pColorAttachments = colorInfos.data(),
+    .pDepthAttachment = depthInfo ? &*depthInfo : nullptr,
+  });
+  cmd_buf.executeCommands(chunkBuffers);
+  cmd_buf.endRendering();
+}
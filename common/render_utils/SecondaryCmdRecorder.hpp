@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <etna/Vulkan.hpp>
+#include <function2/function2.hpp>
+
+#include "jobs/ThreadPool.hpp"
+
+
+/**
+ * Records the contents of a dynamic rendering pass into several secondary command buffers
+ * on a thread pool, and then executes them from the primary command buffer in order.
+ * Every chunk of a pass has its own command pools (one per frame in flight), so workers
+ * never share a pool and recording doesn't need any locks.
+ *
+ * NOTE: etna's resource state tracking and descriptor set allocation are not thread safe,
+ * and barriers have to be recorded in submission order anyway. So descriptor sets have
+ * to be created on the calling thread before recording, chunks may only record commands.
+ */
+class SecondaryCmdRecorder
+{
+public:
+  struct CreateInfo
+  {
+    ThreadPool& threadPool;
+    // A pass is split into at most this many command buffers
+    std::uint32_t maxChunks = 1;
+  };
+
+  explicit SecondaryCmdRecorder(CreateInfo info);
+
+  // Has to be called once per frame before recording any passes,
+  // after the frame's primary command buffer was acquired.
+  void nextFrame();
+
+  struct Attachment
+  {
+    vk::Image image;
+    vk::ImageView view;
+    vk::Format format;
+    vk::AttachmentLoadOp loadOp = vk::AttachmentLoadOp::eClear;
+    // Only one of these is used, depending on the kind of the attachment
+    std::array<float, 4> clearColor = {0.0f, 0.0f, 0.0f, 1.0f};
+    vk::ClearDepthStencilValue clearDepthStencil = {.depth = 1.0f, .stencil = 0};
+  };
+
+  // Attachments are always stored, same as etna::RenderTargetState does by default
+  struct RenderingInfo
+  {
+    vk::Rect2D rect;
+    std::span<const Attachment> colorAttachments;
+    std::optional<Attachment> depthAttachment;
+    // Layered rendering, attachment views have to have this many layers.
+    // Shaders pick the layer of every primitive with gl_Layer.
+    std::uint32_t layerCount = 1;
+  };
+
+  // Called on worker threads with a secondary command buffer that continues the
+  // rendering and already has the viewport and scissor set.
+  using RecordChunk =
+    fu2::function_view<void(vk::CommandBuffer cmd_buf, std::uint32_t chunk) const>;
+
+  // Begins rendering into the attachments on `cmd_buf`, records `chunk_count` chunks of
+  // it in parallel, executes them in the order of chunk indices and ends rendering.
+  // The chunk count is clamped to [1, maxChunks].
+  void render(
+    vk::CommandBuffer cmd_buf,
+    const RenderingInfo& info,
+    std::uint32_t chunk_count,
+    RecordChunk record_chunk);
+
+  std::uint32_t getMaxChunks() const { return maxChunks; }
+
+private:
+  struct ChunkCommands
+  {
+    vk::UniqueCommandPool pool;
+    // Freed together with the pool, reused every time the pool is reset
+    std::vector<vk::CommandBuffer> buffers;
+    std::size_t usedBuffers = 0;
+  };
+
+  vk::CommandBuffer acquireBuffer(std::uint32_t chunk);
+
+private:
+  ThreadPool& threadPool;
+  std::uint32_t maxChunks;
+
+  // maxChunks entries per frame in flight
+  std::vector<ChunkCommands> commands;
+  std::size_t frameCount = 0;
+  std::size_t frame = 0;
+
+  SecondaryCmdRecorder(const SecondaryCmdRecorder&) = delete;
+  SecondaryCmdRecorder& operator=(const SecondaryCmdRecorder&) = delete;
+};
@@ -0,0 +1,268 @@
+#include "ShadowAtlas.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <functional>
+#include <numeric>
+
+#include <etna/Assert.hpp>
+#include <etna/GlobalContext.hpp>
+
+
+ShadowAtlas::ShadowAtlas(CreateInfo info)
+  : size{info.size}
+  , maxTileSize{info.maxTileSize}
+  , levelCount{static_cast<std::uint32_t>(std::bit_width(info.maxTileSize / info.minTileSize))}
+  , tileUpdateBudget{info.tileUpdateBudget}
+  , freeTiles(levelCount)
+{
+  ETNA_VERIFYF(
+    std::has_single_bit(info.minTileSize) && std::has_single_bit(info.maxTileSize) &&
+      info.minTileSize <= info.maxTileSize && info.size % info.maxTileSize == 0,
+    "Shadow atlas tiles have to be powers of two that fit into the atlas evenly!");
+
+  image = etna::get_context().createImage(etna::Image::CreateInfo{
+    .extent = vk::Extent3D{size, size, 1},
+    .name = "shadow_atlas",
+    .format = info.format,
+    .imageUsage =
+      vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eSampled,
+  });
+
+  // Reversed, so that tiles are handed out from the top left corner
+  for (std::uint32_t y = size; y > 0; y -= maxTileSize)
+    for (std::uint32_t x = size; x > 0; x -= maxTileSize)
+      freeTiles[0].emplace_back(x - maxTileSize, y - maxTileSize);
+}
+
+std::optional<glm::uvec2> ShadowAtlas::allocate(std::uint32_t level)
+{
+  auto& free = freeTiles[level];
+  if (!free.empty())
+  {
+    const glm::uvec2 offset = free.back();
+    free.pop_back();
+    return offset;
+  }
+
+  if (level == 0)
+    return std::nullopt;
+
+  // Split a larger tile, the first quarter is the result and the rest are free
+  const auto parent = allocate(level - 1);
+  if (!parent.has_value())
+    return std::nullopt;
+
+  const std::uint32_t half = tileSize(level);
+  free.push_back(*parent + glm::uvec2(half, half));
+  free.push_back(*parent + glm::uvec2(0, half));
+  free.push_back(*parent + glm::uvec2(half, 0));
+  return *parent;
+}
+
+void ShadowAtlas::release(std::uint32_t level, glm::uvec2 offset)
+{
+  auto& free = freeTiles[level];
+  if (level > 0)
+  {
+    const std::uint32_t parentSize = tileSize(level - 1);
+    const std::uint32_t half = tileSize(level);
+    const glm::uvec2 parent = offset / parentSize * parentSize;
+
+    const std::array<glm::uvec2, 4> quarters{
+      parent, parent + glm::uvec2(half, 0), parent + glm::uvec2(0, half), parent + half};
+    std::array<glm::uvec2, 3> siblings;
+    std::ranges::remove_copy(quarters, siblings.begin(), offset);
+
+    // All four quarters are free again, so the whole parent is
+    const bool siblingsFree = std::ranges::all_of(
+      siblings, [&free](glm::uvec2 tile) { return std::ranges::find(free, tile) != free.end(); });
+    if (siblingsFree)
+    {
+      std::erase_if(free, [&siblings](glm::uvec2 tile) {
+        return std::ranges::find(siblings, tile) != siblings.end();
+      });
+      release(level - 1, parent);
+      return;
+    }
+  }
+
+  free.push_back(offset);
+}
+
+void ShadowAtlas::update(std::span<const Request> requests)
+{
+  auto releaseTile = [this](LightTile& tile) {
+    release(tile.level, tile.offset);
+    tile = {};
+  };
+
+  for (std::size_t light = requests.size(); light < lightTiles.size(); ++light)
+    if (lightTiles[light].allocated)
+      releaseTile(lightTiles[light]);
+  lightTiles.resize(requests.size());
+
+  // Fractional, tiles are coverage * maxTileSize texels large, give or take a factor of two
+  auto wantedLevel = [this](float coverage) {
+    return std::clamp(-std::log2(coverage), 0.0f, static_cast<float>(levelCount - 1));
+  };
+
+  // NOTE: tiles are only given up once the light wants one at least twice as small, so that
+  // lights around the boundary of two sizes don't keep losing what was drawn for them.
+  for (std::size_t light = 0; light < requests.size(); ++light)
+  {
+    auto& tile = lightTiles[light];
+    const float coverage = requests[light].coverage;
+    if (tile.allocated &&
+        (coverage <= 0.0f || wantedLevel(coverage) >= static_cast<float>(tile.level) + 1.0f))
+      releaseTile(tile);
+  }
+
+  // Lights that cover more of the screen go first
+  std::vector<std::uint32_t> order(requests.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::ranges::stable_sort(
+    order, std::greater{}, [requests](std::uint32_t light) { return requests[light].coverage; });
+
+  for (const auto light : order)
+  {
+    const float coverage = requests[light].coverage;
+    if (coverage <= 0.0f)
+      break;
+
+    auto& tile = lightTiles[light];
+    const float wanted = wantedLevel(coverage);
+    const auto level = static_cast<std::uint32_t>(std::lround(wanted));
+
+    // Same as with shrinking, and only when there's space for the larger tile right away
+    if (tile.allocated)
+    {
+      if (wanted > static_cast<float>(tile.level) - 1.0f)
+        continue;
+      if (const auto offset = allocate(level); offset.has_value())
+      {
+        releaseTile(tile);
+        tile = LightTile{.allocated = true, .level = level, .offset = *offset};
+      }
+      continue;
+    }
+
+    // Smaller tiles are better than no shadows at all
+    std::optional<glm::uvec2> offset;
+    std::uint32_t tileLevel = level;
+    auto tryAllocate = [&]() {
+      for (tileLevel = level; tileLevel < levelCount; ++tileLevel)
+        if (offset = allocate(tileLevel); offset.has_value())
+          return true;
+      return false;
+    };
+
+    // When the atlas is full, lights that cover less of the screen give their tiles up
+    for (auto victim = order.rbegin(); !tryAllocate() && victim != order.rend(); ++victim)
+    {
+      if (requests[*victim].coverage >= coverage)
+        break;
+      if (lightTiles[*victim].allocated)
+        releaseTile(lightTiles[*victim]);
+    }
+
+    if (offset.has_value())
+      tile = LightTile{.allocated = true, .level = tileLevel, .offset = *offset};
+  }
+
+  std::vector<std::uint32_t> stale;
+  for (std::uint32_t light = 0; light < requests.size(); ++light)
+  {
+    const auto& tile = lightTiles[light];
+    if (
+      tile.allocated &&
+      (!tile.drawn || tile.projView != requests[light].projView ||
+       tile.casterVersion != requests[light].casterVersion))
+      stale.push_back(light);
+  }
+
+  // Lights cast no shadows at all until their tiles are drawn, so those go first
+  std::ranges::stable_sort(stale, [this, requests](std::uint32_t a, std::uint32_t b) {
+    if (lightTiles[a].drawn != lightTiles[b].drawn)
+      return !lightTiles[a].drawn;
+    return requests[a].coverage > requests[b].coverage;
+  });
+
+  updates.clear();
+  const std::size_t updateCount = std::min<std::size_t>(stale.size(), tileUpdateBudget);
+  for (std::size_t i = 0; i < updateCount; ++i)
+  {
+    auto& tile = lightTiles[stale[i]];
+    tile.drawn = true;
+    tile.projView = requests[stale[i]].projView;
+    tile.casterVersion = requests[stale[i]].casterVersion;
+
+    updates.push_back(TileUpdate{
+      .light = stale[i],
+      .rect = tileRect(tile),
+      .projView = tile.projView,
+    });
+  }
+  staleTiles = static_cast<std::uint32_t>(stale.size() - updateCount);
+}
+
+void ShadowAtlas::invalidate()
+{
+  for (auto& tile : lightTiles)
+    tile.drawn = false;
+}
+
+std::optional<ShadowAtlas::Tile> ShadowAtlas::getTile(std::uint32_t light) const
+{
+  if (light >= lightTiles.size() || !lightTiles[light].drawn)
+    return std::nullopt;
+  return Tile{.rect = tileRect(lightTiles[light]), .projView = lightTiles[light].projView};
+}
+
+vk::Rect2D ShadowAtlas::tileRect(const LightTile& tile) const
+{
+  const std::uint32_t extent = tileSize(tile.level);
+  return vk::Rect2D{
+    .offset = {static_cast<std::int32_t>(tile.offset.x), static_cast<std::int32_t>(tile.offset.y)},
+    .extent = {extent, extent},
+  };
+}
+
+glm::mat4x4 ShadowAtlas::getTileMatrix(const Tile& tile) const
+{
+  const float scale = static_cast<float>(tile.rect.extent.width) / static_cast<float>(size);
+  const glm::vec2 offset =
+    glm::vec2(tile.rect.offset.x, tile.rect.offset.y) / static_cast<float>(size);
+
+  // From [-1, 1] of the light's clip space to the tile's part of [0, 1]
+  glm::mat4x4 toTile(1.0f);
+  toTile[0][0] = 0.5f * scale;
+  toTile[1][1] = 0.5f * scale;
+  toTile[3][0] = offset.x + 0.5f * scale;
+  toTile[3][1] = offset.y + 0.5f * scale;
+  return toTile * tile.projView;
+}
+
+glm::vec4 ShadowAtlas::getTileBounds(const Tile& tile) const
+{
+  const glm::vec2 min = glm::vec2(tile.rect.offset.x, tile.rect.offset.y) + 0.5f;
+  const glm::vec2 max =
+    glm::vec2(tile.rect.offset.x, tile.rect.offset.y) +
+    glm::vec2(tile.rect.extent.width, tile.rect.extent.height) - 0.5f;
+  return glm::vec4(min, max) / static_cast<float>(size);
+}
+
+ShadowAtlas::Stats ShadowAtlas::getStats() const
+{
+  Stats stats{.tiles = 0, .staleTiles = staleTiles, .usedArea = 0.0f};
+  for (const auto& tile : lightTiles)
+    if (tile.allocated)
+    {
+      const float extent = static_cast<float>(tileSize(tile.level)) / static_cast<float>(size);
+      ++stats.tiles;
+      stats.usedArea += extent * extent;
+    }
+  return stats;
+}
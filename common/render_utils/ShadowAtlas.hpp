@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <etna/Vulkan.hpp>
+#include <etna/Image.hpp>
+
+
+/**
+ * Shadow maps of many lights packed into tiles of a single depth image, so that memory for
+ * shadows stays the same no matter how many lights there are. Tiles are squares with power
+ * of two sizes, allocated from a quadtree: every tile of the largest size can be split into
+ * four of half the size, down to the smallest one, and four free siblings are merged back.
+ *
+ * Lights get tiles according to how much of the screen they cover, and keep them as long as
+ * that doesn't change much, so that their contents can be reused. A tile is only redrawn
+ * when its light's matrix or the casters around the light change, and only so many tiles
+ * are redrawn per frame. The rest keep showing what was drawn into them before.
+ */
+class ShadowAtlas
+{
+public:
+  struct CreateInfo
+  {
+    // Width and height of the whole atlas
+    std::uint32_t size = 4096;
+    std::uint32_t minTileSize = 128;
+    std::uint32_t maxTileSize = 1024;
+    // How many tiles can be redrawn per frame at most
+    std::uint32_t tileUpdateBudget = 4;
+    vk::Format format = vk::Format::eD16Unorm;
+  };
+
+  // What a light wants from the atlas this frame
+  struct Request
+  {
+    // Roughly the fraction of the screen's height the light affects, 0 when none of it is
+    // visible. Decides the size of the tile and which lights go first when space runs out.
+    float coverage;
+    // What the tile has to be drawn with
+    glm::mat4x4 projView;
+    // Has to change whenever casters that the light might reach move
+    std::uint64_t casterVersion;
+  };
+
+  struct Tile
+  {
+    vk::Rect2D rect;
+    // What the contents of the tile were drawn with. Lags behind the request when the
+    // budget runs out, so shadows have to be looked up with this one.
+    glm::mat4x4 projView;
+  };
+
+  // A tile to be cleared and drawn this frame
+  struct TileUpdate
+  {
+    std::uint32_t light;
+    vk::Rect2D rect;
+    glm::mat4x4 projView;
+  };
+
+  struct Stats
+  {
+    std::uint32_t tiles;
+    // Tiles that are out of date, but didn't fit into this frame's budget
+    std::uint32_t staleTiles;
+    // Fraction of the atlas' area covered by tiles
+    float usedArea;
+  };
+
+  explicit ShadowAtlas(CreateInfo info);
+
+  // Requests are indexed by light. Assigns tiles to lights and decides which of them have to
+  // be redrawn, see getUpdates. Those are considered drawn from now on, so draw all of them!
+  void update(std::span<const Request> requests);
+
+  // Tiles to draw this frame, at most CreateInfo::tileUpdateBudget of them
+  std::span<const TileUpdate> getUpdates() const { return updates; }
+
+  // Forgets what all tiles were drawn with, e.g. because the scene has changed
+  void invalidate();
+
+  // Empty when the light has no tile or nothing has been drawn into it yet
+  std::optional<Tile> getTile(std::uint32_t light) const;
+
+  // Maps world space to texture coordinates of the atlas within the tile in xy and the depth
+  // stored there in z, after the perspective division
+  glm::mat4x4 getTileMatrix(const Tile& tile) const;
+
+  // Texture coordinates of the tile's corners, min in xy and max in zw. Half a texel
+  // inside, so that filtering never reaches into the neighbours.
+  glm::vec4 getTileBounds(const Tile& tile) const;
+
+  Stats getStats() const;
+
+  const etna::Image& getImage() const { return image; }
+
+private:
+  // Level 0 tiles are the largest, every next level halves the size
+  std::uint32_t tileSize(std::uint32_t level) const { return maxTileSize >> level; }
+
+  std::optional<glm::uvec2> allocate(std::uint32_t level);
+  void release(std::uint32_t level, glm::uvec2 offset);
+
+private:
+  std::uint32_t size;
+  std::uint32_t maxTileSize;
+  std::uint32_t levelCount;
+  std::uint32_t tileUpdateBudget;
+  etna::Image image;
+
+  // Offsets of free tiles of every level
+  std::vector<std::vector<glm::uvec2>> freeTiles;
+
+  struct LightTile
+  {
+    bool allocated = false;
+    std::uint32_t level = 0;
+    glm::uvec2 offset{};
+    bool drawn = false;
+    glm::mat4x4 projView{};
+    std::uint64_t casterVersion = 0;
+  };
+
+  vk::Rect2D tileRect(const LightTile& tile) const;
+
+  std::vector<LightTile> lightTiles;
+  std::vector<TileUpdate> updates;
+  std::uint32_t staleTiles = 0;
+
+  ShadowAtlas(const ShadowAtlas&) = delete;
+  ShadowAtlas& operator=(const ShadowAtlas&) = delete;
+};
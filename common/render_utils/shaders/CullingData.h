@@ -0,0 +1,149 @@
+#ifndef CULLING_DATA_H_INCLUDED
+#define CULLING_DATA_H_INCLUDED
+
+#include "cpp_glsl_compat.h"
+
+
+// Same as MAX_MESH_LODS on the C++ side
+#define CULLING_MAX_LODS 4
+
+// Draws are split into batches of up to this many, see CullingDraw
+#define CULLING_DRAW_BATCH_SIZE 256
+
+// Depth sort key of mesh LODs without visible instances, see depth_sort_key in culling.glsl
+#define CULLING_NO_DEPTH_KEY 0xFFFFFFFFu
+
+// Layered views are culled against up to this many frusta at once, and their visible
+// instances keep the index of the frustum (the layer) in the top bits, see cull_layers.comp
+#define CULLING_MAX_LAYERS 4
+#define CULLING_LAYER_SHIFT 30
+#define CULLING_SLOT_MASK ((1u << CULLING_LAYER_SHIFT) - 1u)
+
+// Bounds of a mesh and where its instances start in the scene's instance buffer
+struct CullingMesh
+{
+  shader_vec3 boundsMin;
+  shader_uint firstInstance;
+  shader_vec3 boundsMax;
+  shader_uint lodCount;
+  // In the mesh's space, increasing, see MeshLod on the C++ side
+  shader_vec4 lodErrors;
+};
+
+// A relem of a LOD of a mesh that has instances. Becomes an indirect draw
+// if at least one of the instances is visible and has this LOD selected.
+struct CullingDraw
+{
+  shader_uint indexCount;
+  shader_uint firstIndex;
+  shader_uint vertexOffset;
+  shader_uint firstInstance;
+  shader_uint mesh;
+  shader_uint lod;
+  // Draws are split into batches that are counted and stored separately, so that
+  // every batch can be drawn on its own. All draws of a batch have the same index type.
+  shader_uint batch;
+  shader_uint firstCommand;
+};
+
+// A meshlet of a relem in the space of its mesh, see Meshlet on the C++ side.
+// Every visible meshlet of a visible instance becomes a draw of its own.
+struct CullingMeshlet
+{
+  shader_vec3 center;
+  shader_float radius;
+  shader_vec3 coneAxis;
+  shader_float coneCutoff;
+  shader_uint indexCount;
+  shader_uint firstIndex;
+  shader_uint vertexOffset;
+  // Same as batches of draws, 16 and 32 bit meshlets are counted separately
+  shader_uint wideIndices;
+};
+
+// Meshlets of a LOD of a mesh are [firstMeshlet, firstMeshlet + meshletCount)
+struct CullingMeshletRange
+{
+  shader_uint firstMeshlet;
+  shader_uint meshletCount;
+};
+
+struct CullingParams
+{
+  // In world space, pointing inwards, not normalized
+  shader_vec4 frustumPlanes[6];
+  // LOD selection, see select_lod in culling.glsl
+  shader_vec3 cameraPosition;
+  shader_uint count;
+  shader_float lodErrorScale;
+  // Instances with (GpuInstance::flags & flagsMask) != flagsValue are skipped
+  shader_uint flagsMask;
+  shader_uint flagsValue;
+  // How many visible instances every instance might take up, 1 except for layered views
+  shader_uint layerStride;
+};
+
+// In world space, pointing inwards, not normalized, same as CullingParams::frustumPlanes
+struct CullingFrustum
+{
+  shader_vec4 planes[6];
+};
+
+// Frusta themselves don't fit into push constants, they come in a buffer
+struct LayeredCullingParams
+{
+  shader_uint count;
+  shader_uint layerCount;
+  // Same as in CullingParams
+  shader_uint flagsMask;
+  shader_uint flagsValue;
+};
+
+struct MeshletCullingParams
+{
+  // Same as in CullingParams
+  shader_vec4 frustumPlanes[6];
+  shader_vec3 cameraPosition;
+  // All instance slots of a single LOD, including the invisible ones
+  shader_uint instanceCount;
+  // Commands of meshlets with 32 bit indices start here, the 16 bit ones start at 0
+  shader_uint firstWideCommand;
+};
+
+// Draws with 16 bit indices go first, then the 32 bit ones, and the batches of either
+// type follow each other, each of them CULLING_DRAW_BATCH_SIZE draws except the last one.
+struct EmitDrawsParams
+{
+  shader_uint count;
+  // Draws with 32 bit indices start here
+  shader_uint firstWideDraw;
+  // How many batches the draws with 16 bit indices take up
+  shader_uint narrowBatchCount;
+  // Same as in CullingParams
+  shader_uint layerStride;
+};
+
+#define OCCLUSION_PHASE_EARLY 0u
+#define OCCLUSION_PHASE_LATE 1u
+
+// NOTE: frustum planes are derived from projView in the shader,
+// all of them together wouldn't fit into the push constant limit.
+struct OcclusionCullingParams
+{
+  shader_mat4 projView;
+  // Resolution of the depth buffer the pyramid was built from
+  shader_vec2 depthSize;
+  shader_uint count;
+  shader_uint phase;
+  // Same as in CullingParams
+  shader_vec3 cameraPosition;
+  shader_float lodErrorScale;
+};
+
+struct DepthReduceParams
+{
+  shader_uvec2 srcSize;
+  shader_uvec2 dstSize;
+};
+
+#endif // CULLING_DATA_H_INCLUDED
@@ -0,0 +1,96 @@
+#ifndef CULLING_GLSL_INCLUDED
+#define CULLING_GLSL_INCLUDED
+
+// World space box around a mesh space box transformed by `model`
+void world_bounds(mat4 model, vec3 bounds_min, vec3 bounds_max, out vec3 center, out vec3 extent)
+{
+  center = (model * vec4((bounds_min + bounds_max) * 0.5, 1.0)).xyz;
+  const vec3 halfSize = (bounds_max - bounds_min) * 0.5;
+  extent = abs(model[0].xyz) * halfSize.x + abs(model[1].xyz) * halfSize.y +
+    abs(model[2].xyz) * halfSize.z;
+}
+
+// Same as frustum_from_matrix on the C++ side
+void frustum_planes(mat4 proj_view, out vec4 planes[6])
+{
+  const mat4 rows = transpose(proj_view);
+  planes[0] = rows[3] + rows[0];
+  planes[1] = rows[3] - rows[0];
+  planes[2] = rows[3] + rows[1];
+  planes[3] = rows[3] - rows[1];
+  planes[4] = rows[2];
+  planes[5] = rows[3] - rows[2];
+}
+
+bool is_in_frustum(vec4 planes[6], vec3 center, vec3 extent)
+{
+  for (int i = 0; i < 6; ++i)
+  {
+    const vec4 plane = planes[i];
+    if (dot(plane.xyz, center) + dot(abs(plane.xyz), extent) < -plane.w)
+      return false;
+  }
+  return true;
+}
+
+// Increases with the distance from the camera to the closest point of the box. Measured from
+// the far plane, which, unlike the near one, is kept by caster frusta, and is parallel to it.
+// Comparing keys as integers compares the distances.
+uint depth_sort_key(vec4 planes[6], vec3 center, vec3 extent)
+{
+  const vec4 farPlane = planes[5];
+  const float depth = -(dot(farPlane.xyz, center) + farPlane.w + dot(abs(farPlane.xyz), extent));
+  // NOTE: bit patterns of floats are ordered the same way as the floats themselves
+  // once negative ones have all their bits flipped, and positive ones just the sign.
+  const uint bits = floatBitsToUint(depth);
+  return min((bits & 0x80000000u) != 0 ? ~bits : bits | 0x80000000u, CULLING_NO_DEPTH_KEY - 1);
+}
+
+// The largest factor by which `model` stretches distances along its axes
+float max_scale(mat4 model)
+{
+  return max(length(model[0].xyz), max(length(model[1].xyz), length(model[2].xyz)));
+}
+
+// The coarsest LOD of a mesh whose error is still small enough on screen. `error_scale`
+// turns a world space error into its size on screen at a distance of 1, relative to the
+// largest acceptable size, so a LOD is good enough if error * error_scale <= distance.
+// Same as select_lod on the C++ side.
+uint select_lod(
+  CullingMesh mesh, float scale, vec3 center, vec3 extent, vec3 camera, float error_scale)
+{
+  if (error_scale <= 0.0)
+    return 0u;
+
+  // To the closest point of the bounds, so that big meshes don't get coarse up close
+  const float distance = length(max(abs(camera - center) - extent, vec3(0.0)));
+  uint lod = 0;
+  for (uint i = 1; i < mesh.lodCount; ++i)
+    if (mesh.lodErrors[i] * scale * error_scale <= distance)
+      lod = i;
+  return lod;
+}
+
+// Spheres are used for meshlets, planes are the same as in is_in_frustum
+bool is_sphere_in_frustum(vec4 planes[6], vec3 center, float radius)
+{
+  for (int i = 0; i < 6; ++i)
+  {
+    const vec4 plane = planes[i];
+    if (dot(plane.xyz, center) + plane.w < -radius * length(plane.xyz))
+      return false;
+  }
+  return true;
+}
+
+// Same layout as VkDrawIndexedIndirectCommand
+struct DrawIndexedIndirectCommand
+{
+  uint indexCount;
+  uint instanceCount;
+  uint firstIndex;
+  int vertexOffset;
+  uint firstInstance;
+};
+
+#endif // CULLING_GLSL_INCLUDED
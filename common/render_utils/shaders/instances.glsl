@@ -0,0 +1,58 @@
+#ifndef INSTANCES_GLSL_INCLUDED
+#define INSTANCES_GLSL_INCLUDED
+
+// Records of the scene's instance buffer, see GpuInstance on the C++ side
+
+#define GPU_INSTANCE_UNIFORM_SCALE 1u
+#define GPU_INSTANCE_DYNAMIC 2u
+
+struct GpuInstance
+{
+  vec4 modelRows[3];
+  uvec3 normalColumns;
+  uint flags;
+};
+
+mat4 instance_model(GpuInstance instance)
+{
+  return transpose(mat4(instance.modelRows[0], instance.modelRows[1], instance.modelRows[2],
+    vec4(0.0, 0.0, 0.0, 1.0)));
+}
+
+// NOTE: passes that test depth for equality against each other have to get
+// positions from here, so that they come out bit for bit the same.
+vec3 instance_position(GpuInstance instance, vec3 position)
+{
+  const vec4 p = vec4(position, 1.0);
+  return vec3(
+    dot(instance.modelRows[0], p), dot(instance.modelRows[1], p), dot(instance.modelRows[2], p));
+}
+
+vec3 unpack_snorm10(uint bits)
+{
+  const ivec3 values = ivec3(bits << 22, bits << 12, bits << 2) >> 22;
+  return max(vec3(values) / 511.0, vec3(-1.0));
+}
+
+// Not normalized
+vec3 instance_direction(GpuInstance instance, vec3 direction)
+{
+  return vec3(
+    dot(instance.modelRows[0].xyz, direction),
+    dot(instance.modelRows[1].xyz, direction),
+    dot(instance.modelRows[2].xyz, direction));
+}
+
+// Not normalized
+vec3 instance_normal(GpuInstance instance, vec3 normal)
+{
+  if ((instance.flags & GPU_INSTANCE_UNIFORM_SCALE) != 0u)
+    return instance_direction(instance, normal);
+
+  return mat3(
+    unpack_snorm10(instance.normalColumns.x),
+    unpack_snorm10(instance.normalColumns.y),
+    unpack_snorm10(instance.normalColumns.z)) * normal;
+}
+
+#endif // INSTANCES_GLSL_INCLUDED
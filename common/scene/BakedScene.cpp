@@ -0,0 +1,312 @@
+#include "BakedScene.hpp"
+
+#include "TransformHierarchy.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+
+#include <spdlog/spdlog.h>
+#include <fmt/std.h>
+
+
+static std::uint64_t align_up(std::uint64_t value, std::uint64_t alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// Largest index of a relem, `indices` are its own index bytes
+template <class Index>
+static std::uint32_t max_index(std::span<const std::byte> indices)
+{
+  std::uint32_t result = 0;
+  for (std::size_t i = 0; i < indices.size(); i += sizeof(Index))
+  {
+    Index index;
+    std::memcpy(&index, indices.data() + i, sizeof(Index));
+    result = std::max<std::uint32_t>(result, index);
+  }
+  return result;
+}
+
+template <class T>
+static std::optional<std::span<const T>> get_section(
+  std::span<const std::byte> data, const BakedSceneSection& section, const char* name)
+{
+  if (
+    section.offset % BAKED_SCENE_ALIGNMENT != 0 || section.size % sizeof(T) != 0 ||
+    section.offset > data.size() || section.size > data.size() - section.offset)
+  {
+    spdlog::error("Baked scene: table '{}' is corrupted!", name);
+    return std::nullopt;
+  }
+
+  // NOTE: this is fine as long as the base address of the mapping is aligned,
+  // which is always the case as mappings are page-aligned.
+  return std::span{
+    reinterpret_cast<const T*>(data.data() + section.offset),
+    static_cast<std::size_t>(section.size / sizeof(T))};
+}
+
+std::optional<BakedSceneView> parse_baked_scene(std::span<const std::byte> data)
+{
+  if (data.size() < sizeof(BakedSceneHeader))
+  {
+    spdlog::error("Baked scene: file is too small to be a baked scene!");
+    return std::nullopt;
+  }
+
+  BakedSceneHeader header;
+  std::memcpy(&header, data.data(), sizeof(header));
+
+  if (header.magic != BAKED_SCENE_MAGIC)
+  {
+    spdlog::error("Baked scene: wrong magic, this is not a baked scene!");
+    return std::nullopt;
+  }
+
+  if (header.version != BAKED_SCENE_VERSION)
+  {
+    spdlog::error(
+      "Baked scene: version {} is not supported, expected {}. Re-bake the scene!",
+      header.version,
+      BAKED_SCENE_VERSION);
+    return std::nullopt;
+  }
+
+  if (
+    header.vertexSize != sizeof(Vertex) || header.relemSize != sizeof(RenderElement) ||
+    header.meshletSize != sizeof(Meshlet))
+  {
+    spdlog::error("Baked scene: vertex, relem or meshlet format mismatch. Re-bake the scene!");
+    return std::nullopt;
+  }
+
+  auto nodeParents = get_section<std::uint32_t>(data, header.nodeParents, "nodeParents");
+  auto nodeLocalTransforms =
+    get_section<glm::mat4x4>(data, header.nodeLocalTransforms, "nodeLocalTransforms");
+  auto nodeSources = get_section<std::uint32_t>(data, header.nodeSources, "nodeSources");
+  auto instanceNodes = get_section<std::uint32_t>(data, header.instanceNodes, "instanceNodes");
+  auto instanceMeshes = get_section<std::uint32_t>(data, header.instanceMeshes, "instanceMeshes");
+  auto meshes = get_section<Mesh>(data, header.meshes, "meshes");
+  auto relems = get_section<RenderElement>(data, header.relems, "relems");
+  auto vertices = get_section<Vertex>(data, header.vertices, "vertices");
+  auto indices = get_section<std::byte>(data, header.indices, "indices");
+  auto meshlets = get_section<Meshlet>(data, header.meshlets, "meshlets");
+
+  if (
+    !nodeParents || !nodeLocalTransforms || !nodeSources || !instanceNodes || !instanceMeshes ||
+    !meshes || !relems || !vertices || !indices || !meshlets)
+    return std::nullopt;
+
+  // The tables are tiny compared to vertex data, so validating
+  // cross-references is basically free and saves us from GPU hangs.
+  if (
+    nodeParents->size() != nodeLocalTransforms->size() ||
+    nodeParents->size() != nodeSources->size())
+  {
+    spdlog::error("Baked scene: node tables have different sizes!");
+    return std::nullopt;
+  }
+
+  if (!TransformHierarchy::isDepthFirst(*nodeParents))
+  {
+    spdlog::error("Baked scene: nodes are not in depth-first order!");
+    return std::nullopt;
+  }
+
+  if (instanceNodes->size() != instanceMeshes->size())
+  {
+    spdlog::error("Baked scene: instance tables have different sizes!");
+    return std::nullopt;
+  }
+
+  for (std::size_t i = 0; i < instanceNodes->size(); ++i)
+  {
+    const auto node = (*instanceNodes)[i];
+    if (node >= nodeParents->size() || (i > 0 && node < (*instanceNodes)[i - 1]))
+    {
+      spdlog::error("Baked scene: instance nodes are out of bounds or not sorted!");
+      return std::nullopt;
+    }
+  }
+
+  for (auto meshIdx : *instanceMeshes)
+    if (meshIdx >= meshes->size())
+    {
+      spdlog::error("Baked scene: instance references a non-existent mesh {}!", meshIdx);
+      return std::nullopt;
+    }
+
+  for (const auto& mesh : *meshes)
+  {
+    if (
+      mesh.lodCount == 0 || mesh.lodCount > MAX_MESH_LODS ||
+      mesh.lods[0].firstRelem != mesh.firstRelem)
+    {
+      spdlog::error("Baked scene: mesh has broken LODs!");
+      return std::nullopt;
+    }
+
+    for (std::uint32_t lod = 0; lod < mesh.lodCount; ++lod)
+    {
+      const auto firstRelem = mesh.lods[lod].firstRelem;
+      if (firstRelem > relems->size() || mesh.relemCount > relems->size() - firstRelem)
+      {
+        spdlog::error("Baked scene: mesh references non-existent relems!");
+        return std::nullopt;
+      }
+    }
+  }
+
+  // Vertices of a relem go up to the next relem's ones, LODs of a mesh share the vertices
+  // of the full detail relems, so several relems might start at the same vertex
+  std::vector<std::uint32_t> vertexOffsets;
+  vertexOffsets.reserve(relems->size());
+  for (const auto& relem : *relems)
+    vertexOffsets.push_back(relem.vertexOffset);
+  std::ranges::sort(vertexOffsets);
+
+  for (const auto& relem : *relems)
+  {
+    if (relem.indexType != IndexType::Uint16 && relem.indexType != IndexType::Uint32)
+    {
+      spdlog::error("Baked scene: relem has an unknown index type!");
+      return std::nullopt;
+    }
+
+    const std::uint64_t indexSize = index_size(relem.indexType);
+    const std::uint64_t indexEnd =
+      (std::uint64_t{relem.indexOffset} + relem.indexCount) * indexSize;
+    if (relem.vertexOffset > vertices->size() || indexEnd > indices->size())
+    {
+      spdlog::error("Baked scene: relem references out of bounds vertex or index data!");
+      return std::nullopt;
+    }
+
+    // NOTE: unlike the tables, this reads all of the index data, but it is about to be read
+    // for the upload anyway, and a bad index would make the GPU fetch out of bounds vertices
+    if (relem.indexCount == 0)
+      continue;
+    const auto nextOffset = std::ranges::upper_bound(vertexOffsets, relem.vertexOffset);
+    const std::uint64_t vertexCount =
+      (nextOffset != vertexOffsets.end() ? std::uint64_t{*nextOffset} : vertices->size()) -
+      relem.vertexOffset;
+    const auto relemIndices =
+      indices->subspan(relem.indexOffset * indexSize, relem.indexCount * indexSize);
+    const std::uint32_t maxIndex = relem.indexType == IndexType::Uint16
+      ? max_index<std::uint16_t>(relemIndices)
+      : max_index<std::uint32_t>(relemIndices);
+    if (maxIndex >= vertexCount)
+    {
+      spdlog::error(
+        "Baked scene: relem index {} is out of bounds of its {} vertices!", maxIndex, vertexCount);
+      return std::nullopt;
+    }
+  }
+
+  for (std::size_t i = 0; i < meshlets->size(); ++i)
+  {
+    const auto& meshlet = (*meshlets)[i];
+    if (
+      meshlet.relem >= relems->size() || (i > 0 && meshlet.relem < (*meshlets)[i - 1].relem))
+    {
+      spdlog::error("Baked scene: meshlet relems are out of bounds or not sorted!");
+      return std::nullopt;
+    }
+
+    const auto& relem = (*relems)[meshlet.relem];
+    if (
+      meshlet.firstIndex < relem.indexOffset ||
+      std::uint64_t{meshlet.firstIndex} + meshlet.indexCount >
+        std::uint64_t{relem.indexOffset} + relem.indexCount)
+    {
+      spdlog::error("Baked scene: meshlet references indices outside of its relem!");
+      return std::nullopt;
+    }
+  }
+
+  return BakedSceneView{
+    .nodeParents = *nodeParents,
+    .nodeLocalTransforms = *nodeLocalTransforms,
+    .nodeSources = *nodeSources,
+    .instanceNodes = *instanceNodes,
+    .instanceMeshes = *instanceMeshes,
+    .meshes = *meshes,
+    .relems = *relems,
+    .vertices = *vertices,
+    .indices = *indices,
+    .meshlets = *meshlets,
+  };
+}
+
+bool write_baked_scene(const std::filesystem::path& path, const BakedSceneView& scene)
+{
+  // NOTE: the header has padding after the format fields, which initializers leave alone,
+  // and it goes to the disc as is. Zeroing it first keeps baked files deterministic.
+  BakedSceneHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = BAKED_SCENE_MAGIC;
+  header.version = BAKED_SCENE_VERSION;
+  header.vertexSize = sizeof(Vertex);
+  header.relemSize = sizeof(RenderElement);
+  header.meshletSize = sizeof(Meshlet);
+
+  std::array<std::pair<BakedSceneSection*, std::span<const std::byte>>, 10> sections{{
+    {&header.nodeParents, std::as_bytes(scene.nodeParents)},
+    {&header.nodeLocalTransforms, std::as_bytes(scene.nodeLocalTransforms)},
+    {&header.nodeSources, std::as_bytes(scene.nodeSources)},
+    {&header.instanceNodes, std::as_bytes(scene.instanceNodes)},
+    {&header.instanceMeshes, std::as_bytes(scene.instanceMeshes)},
+    {&header.meshes, std::as_bytes(scene.meshes)},
+    {&header.relems, std::as_bytes(scene.relems)},
+    {&header.vertices, std::as_bytes(scene.vertices)},
+    {&header.indices, std::as_bytes(scene.indices)},
+    {&header.meshlets, std::as_bytes(scene.meshlets)},
+  }};
+
+  std::uint64_t offset = align_up(sizeof(header), BAKED_SCENE_ALIGNMENT);
+  for (auto& [section, bytes] : sections)
+  {
+    *section = BakedSceneSection{.offset = offset, .size = bytes.size()};
+    offset = align_up(offset + bytes.size(), BAKED_SCENE_ALIGNMENT);
+  }
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out)
+  {
+    spdlog::error("Baked scene: unable to open '{}' for writing!", path);
+    return false;
+  }
+
+  const std::array<char, BAKED_SCENE_ALIGNMENT> padding{};
+  auto pad = [&out, &padding](std::uint64_t to) {
+    const auto at = static_cast<std::uint64_t>(out.tellp());
+    out.write(padding.data(), static_cast<std::streamsize>(to - at));
+  };
+
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (auto& [section, bytes] : sections)
+  {
+    pad(section->offset);
+    out.write(
+      reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+  }
+  pad(offset);
+
+  if (!out)
+  {
+    spdlog::error("Baked scene: failed to write '{}'!", path);
+    return false;
+  }
+
+  return true;
+}
+
+std::filesystem::path baked_scene_path(const std::filesystem::path& gltf_path)
+{
+  auto result = gltf_path;
+  result.replace_filename(gltf_path.stem().string() + "_baked.scene");
+  return result;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+
+#include "SceneProcessing.hpp"
+#include "Meshlets.hpp"
+
+
+// Binary on-disc format for scenes that were pre-processed by the baker.
+// The file is a header followed by a bunch of tables, each table starts
+// at an offset aligned to BAKED_SCENE_ALIGNMENT, so that after memory-mapping
+// the file, all tables can be used in-place as arrays of their respective types,
+// and vertex/index tables can be handed straight to the GPU upload path.
+
+constexpr std::uint32_t BAKED_SCENE_MAGIC = 0x4e435342; // "BSCN"
+// Bump this every time something about the layout or the vertex format changes!
+constexpr std::uint32_t BAKED_SCENE_VERSION = 6;
+constexpr std::size_t BAKED_SCENE_ALIGNMENT = 64;
+
+struct BakedSceneSection
+{
+  // Both are in bytes, offset is from the start of the file
+  std::uint64_t offset;
+  std::uint64_t size;
+};
+
+struct BakedSceneHeader
+{
+  std::uint32_t magic;
+  std::uint32_t version;
+  // Sanity checks against the baker and the runtime disagreeing on sizes
+  std::uint32_t vertexSize;
+  std::uint32_t relemSize;
+  std::uint32_t meshletSize;
+
+  BakedSceneSection nodeParents;
+  BakedSceneSection nodeLocalTransforms;
+  BakedSceneSection nodeSources;
+  BakedSceneSection instanceNodes;
+  BakedSceneSection instanceMeshes;
+  BakedSceneSection meshes;
+  BakedSceneSection relems;
+  BakedSceneSection vertices;
+  BakedSceneSection indices;
+  BakedSceneSection meshlets;
+};
+
+static_assert(sizeof(BakedSceneHeader) <= BAKED_SCENE_ALIGNMENT * 4);
+
+// Typed views of the tables of a baked scene, either pointing into
+// a memory-mapped file or into vectors that are about to be written.
+struct BakedSceneView
+{
+  // Transform hierarchy in depth-first order, see TransformHierarchy
+  std::span<const std::uint32_t> nodeParents;
+  std::span<const glm::mat4x4> nodeLocalTransforms;
+  std::span<const std::uint32_t> nodeSources;
+  // Sorted by node
+  std::span<const std::uint32_t> instanceNodes;
+  std::span<const std::uint32_t> instanceMeshes;
+  std::span<const Mesh> meshes;
+  std::span<const RenderElement> relems;
+  std::span<const Vertex> vertices;
+  // Mixed 16 and 32 bit indices, see RenderElement::indexType
+  std::span<const std::byte> indices;
+  // Sorted by relem. Either empty, or covers every triangle of every relem, see Meshlets.hpp
+  std::span<const Meshlet> meshlets;
+};
+
+// Validates the header and the table bounds. Returns nullopt if the
+// data is not a baked scene, or was baked by an incompatible version.
+std::optional<BakedSceneView> parse_baked_scene(std::span<const std::byte> data);
+
+bool write_baked_scene(const std::filesystem::path& path, const BakedSceneView& scene);
+
+// Where the baker puts the result of baking the scene at `gltf_path`
+std::filesystem::path baked_scene_path(const std::filesystem::path& gltf_path);
@@ -0,0 +1,173 @@
+#include "FrustumCulling.hpp"
+
+#include <algorithm>
+#include <bit>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCENE_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+
+Frustum frustum_from_matrix(const glm::mat4x4& proj_view)
+{
+  const auto rows = glm::transpose(proj_view);
+  return Frustum{
+    .planes = {
+      rows[3] + rows[0],
+      rows[3] - rows[0],
+      rows[3] + rows[1],
+      rows[3] - rows[1],
+      rows[2],
+      rows[3] - rows[2],
+    }};
+}
+
+Frustum caster_frustum_from_matrix(const glm::mat4x4& light_proj_view)
+{
+  auto result = frustum_from_matrix(light_proj_view);
+  // Everything is in front of this one
+  result.planes[4] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+  return result;
+}
+
+BoundingBox transform_bounds(const BoundingBox& local, const glm::mat4x4& transform)
+{
+  const glm::vec3 center =
+    glm::vec3(transform * glm::vec4((local.min + local.max) * 0.5f, 1.0f));
+  const glm::vec3 halfSize = (local.max - local.min) * 0.5f;
+  // Half size of the world space box around the transformed one
+  const glm::vec3 extent = glm::abs(glm::vec3(transform[0])) * halfSize.x +
+    glm::abs(glm::vec3(transform[1])) * halfSize.y +
+    glm::abs(glm::vec3(transform[2])) * halfSize.z;
+  return BoundingBox{.min = center - extent, .max = center + extent};
+}
+
+float max_scale(const glm::mat4x4& transform)
+{
+  return std::max(
+    {glm::length(glm::vec3(transform[0])),
+     glm::length(glm::vec3(transform[1])),
+     glm::length(glm::vec3(transform[2]))});
+}
+
+void BoundingBoxes::reset(std::size_t size)
+{
+  count = size;
+  const std::size_t padded = (size + CULLING_BATCH - 1) / CULLING_BATCH * CULLING_BATCH;
+  for (auto* coords : {&minX, &minY, &minZ, &maxX, &maxY, &maxZ})
+    coords->assign(padded, 0.0f);
+}
+
+void BoundingBoxes::set(std::size_t idx, const BoundingBox& box)
+{
+  minX[idx] = box.min.x;
+  minY[idx] = box.min.y;
+  minZ[idx] = box.min.z;
+  maxX[idx] = box.max.x;
+  maxY[idx] = box.max.y;
+  maxZ[idx] = box.max.z;
+}
+
+BoundingBox BoundingBoxes::get(std::size_t idx) const
+{
+  return BoundingBox{
+    .min = glm::vec3(minX[idx], minY[idx], minZ[idx]),
+    .max = glm::vec3(maxX[idx], maxY[idx], maxZ[idx]),
+  };
+}
+
+// A box is outside of a plane iff its corner that is the furthest along the plane's normal
+// is outside. Which corner that is only depends on the signs of the normal, so coordinate
+// arrays are picked once per plane instead of once per box.
+struct PlaneTest
+{
+  glm::vec4 plane;
+  const float* x;
+  const float* y;
+  const float* z;
+};
+
+// Bit i is set if box `first + i` is completely outside of at least one of the planes
+static std::uint32_t outside_mask(std::span<const PlaneTest> tests, std::size_t first)
+{
+#if defined(__AVX2__)
+  __m256 outside = _mm256_setzero_ps();
+  for (const auto& test : tests)
+  {
+    __m256 dist = _mm256_set1_ps(test.plane.w);
+    dist = _mm256_add_ps(
+      dist, _mm256_mul_ps(_mm256_set1_ps(test.plane.x), _mm256_loadu_ps(test.x + first)));
+    dist = _mm256_add_ps(
+      dist, _mm256_mul_ps(_mm256_set1_ps(test.plane.y), _mm256_loadu_ps(test.y + first)));
+    dist = _mm256_add_ps(
+      dist, _mm256_mul_ps(_mm256_set1_ps(test.plane.z), _mm256_loadu_ps(test.z + first)));
+    outside = _mm256_or_ps(outside, _mm256_cmp_ps(dist, _mm256_setzero_ps(), _CMP_LT_OQ));
+  }
+  return static_cast<std::uint32_t>(_mm256_movemask_ps(outside));
+#elif defined(SCENE_USE_SSE2)
+  // NOTE: SSE2 registers only fit 4 boxes, so a batch is done in two halves
+  std::uint32_t result = 0;
+  for (std::size_t half = 0; half < CULLING_BATCH; half += 4)
+  {
+    const std::size_t i = first + half;
+    __m128 outside = _mm_setzero_ps();
+    for (const auto& test : tests)
+    {
+      __m128 dist = _mm_set1_ps(test.plane.w);
+      dist = _mm_add_ps(dist, _mm_mul_ps(_mm_set1_ps(test.plane.x), _mm_loadu_ps(test.x + i)));
+      dist = _mm_add_ps(dist, _mm_mul_ps(_mm_set1_ps(test.plane.y), _mm_loadu_ps(test.y + i)));
+      dist = _mm_add_ps(dist, _mm_mul_ps(_mm_set1_ps(test.plane.z), _mm_loadu_ps(test.z + i)));
+      outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, _mm_setzero_ps()));
+    }
+    result |= static_cast<std::uint32_t>(_mm_movemask_ps(outside)) << half;
+  }
+  return result;
+#else
+  std::uint32_t result = 0;
+  for (std::size_t lane = 0; lane < CULLING_BATCH; ++lane)
+  {
+    const std::size_t i = first + lane;
+    for (const auto& test : tests)
+    {
+      const float dist = test.plane.w + test.plane.x * test.x[i] + test.plane.y * test.y[i] +
+        test.plane.z * test.z[i];
+      if (dist < 0.0f)
+      {
+        result |= 1u << lane;
+        break;
+      }
+    }
+  }
+  return result;
+#endif
+}
+
+void BoundingBoxes::cull(const Frustum& frustum, std::vector<std::uint32_t>& visible) const
+{
+  std::array<PlaneTest, 6> tests;
+  for (std::size_t i = 0; i < tests.size(); ++i)
+  {
+    const auto& plane = frustum.planes[i];
+    tests[i] = PlaneTest{
+      .plane = plane,
+      .x = plane.x >= 0 ? maxX.data() : minX.data(),
+      .y = plane.y >= 0 ? maxY.data() : minY.data(),
+      .z = plane.z >= 0 ? maxZ.data() : minZ.data(),
+    };
+  }
+
+  for (std::size_t first = 0; first < count; first += CULLING_BATCH)
+  {
+    // Padding boxes at the end are dropped here
+    const auto lanes = static_cast<std::uint32_t>(std::min(CULLING_BATCH, count - first));
+    std::uint32_t inside = ~outside_mask(tests, first) & ((1u << lanes) - 1);
+    while (inside != 0)
+    {
+      visible.push_back(static_cast<std::uint32_t>(first) + std::countr_zero(inside));
+      inside &= inside - 1;
+    }
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "SceneProcessing.hpp"
+
+
+// Boxes are tested this many at a time, storage is padded to a multiple of it
+constexpr std::size_t CULLING_BATCH = 8;
+
+// World space planes of a view frustum with normals pointing inwards. A point is
+// inside if dot(plane.xyz, point) + plane.w >= 0 for every plane. Not normalized.
+struct Frustum
+{
+  std::array<glm::vec4, 6> planes;
+};
+
+// For projView matrices with the Vulkan clip space, i.e. -w <= x, y <= w and 0 <= z <= w
+Frustum frustum_from_matrix(const glm::mat4x4& proj_view);
+
+// Same as frustum_from_matrix, but without the near plane, i.e. extended to infinity towards
+// the viewer. Anything between a light and its frustum might cast a shadow into it.
+Frustum caster_frustum_from_matrix(const glm::mat4x4& light_proj_view);
+
+// Bounds of a box in `local` space transformed by `transform`. The result
+// encloses the transformed box, so it might be a bit bigger than necessary.
+BoundingBox transform_bounds(const BoundingBox& local, const glm::mat4x4& transform);
+
+// The largest factor by which `transform` stretches distances along its axes
+float max_scale(const glm::mat4x4& transform);
+
+/**
+ * Axis-aligned bounding boxes stored as separate arrays per coordinate,
+ * so that a bunch of them can be loaded into SIMD registers at once.
+ */
+class BoundingBoxes
+{
+public:
+  std::size_t size() const { return count; }
+
+  // Makes `size` degenerate boxes at the origin
+  void reset(std::size_t size);
+  void set(std::size_t idx, const BoundingBox& box);
+  BoundingBox get(std::size_t idx) const;
+
+  // Appends indices of boxes that intersect or are inside of the frustum, in increasing order
+  void cull(const Frustum& frustum, std::vector<std::uint32_t>& visible) const;
+
+private:
+  std::size_t count = 0;
+  // Padded to a multiple of CULLING_BATCH
+  std::vector<float> minX;
+  std::vector<float> minY;
+  std::vector<float> minZ;
+  std::vector<float> maxX;
+  std::vector<float> maxY;
+  std::vector<float> maxZ;
+};
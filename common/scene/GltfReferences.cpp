@@ -0,0 +1,208 @@
+#include "GltfReferences.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+
+#include <json.hpp>
+#include <spdlog/spdlog.h>
+#include <fmt/std.h>
+
+
+// NOTE: nlohmann::json throws on type mismatches, and we don't want a broken
+// file to take the whole app down, so all accesses go through these helpers.
+
+static const nlohmann::json* find_member(const nlohmann::json& object, const char* key)
+{
+  if (!object.is_object())
+    return nullptr;
+  const auto it = object.find(key);
+  return it != object.end() ? &*it : nullptr;
+}
+
+static std::optional<std::uint64_t> get_uint(const nlohmann::json& object, const char* key)
+{
+  const auto* member = find_member(object, key);
+  if (member == nullptr || !member->is_number_unsigned())
+    return std::nullopt;
+  return member->get<std::uint64_t>();
+}
+
+static const std::string* get_string(const nlohmann::json& object, const char* key)
+{
+  const auto* member = find_member(object, key);
+  if (member == nullptr || !member->is_string())
+    return nullptr;
+  return &member->get_ref<const std::string&>();
+}
+
+static const nlohmann::json& get_array(const nlohmann::json& object, const char* key)
+{
+  static const nlohmann::json EMPTY = nlohmann::json::array();
+  const auto* member = find_member(object, key);
+  return member != nullptr && member->is_array() ? *member : EMPTY;
+}
+
+static std::uint32_t read_u32(std::span<const std::byte> data, std::size_t offset)
+{
+  std::uint32_t result;
+  std::memcpy(&result, data.data() + offset, sizeof(result));
+  return result;
+}
+
+// GLB is a 12 byte header followed by a JSON chunk and an optional BIN chunk,
+// each chunk starts with its length and type.
+constexpr std::size_t GLB_JSON_OFFSET = 20;
+constexpr std::uint32_t GLB_BIN_CHUNK_TYPE = 0x004E4942;
+
+static std::string_view gltf_json(std::span<const std::byte> data, bool binary)
+{
+  if (!binary)
+    return {reinterpret_cast<const char*>(data.data()), data.size()};
+
+  if (data.size() < GLB_JSON_OFFSET)
+    return {};
+  const std::uint32_t length = read_u32(data, 12);
+  if (length > data.size() - GLB_JSON_OFFSET)
+    return {};
+  return {reinterpret_cast<const char*>(data.data() + GLB_JSON_OFFSET), length};
+}
+
+// Offset of the BIN chunk contents inside of a GLB file
+static std::optional<std::uint64_t> glb_binary_chunk(std::span<const std::byte> data)
+{
+  if (data.size() < GLB_JSON_OFFSET)
+    return std::nullopt;
+  // Chunks are padded to 4 bytes, so this is where the next one starts
+  const std::uint64_t binHeader = GLB_JSON_OFFSET + std::uint64_t{read_u32(data, 12)};
+  if (binHeader + 8 > data.size() || read_u32(data, binHeader + 4) != GLB_BIN_CHUNK_TYPE)
+    return std::nullopt;
+  return binHeader + 8;
+}
+
+static std::string decode_uri(std::string_view uri)
+{
+  std::string result;
+  result.reserve(uri.size());
+  for (std::size_t i = 0; i < uri.size(); ++i)
+  {
+    if (uri[i] == '%' && i + 2 < uri.size())
+    {
+      const std::string hex(uri.substr(i + 1, 2));
+      char* parseEnd = nullptr;
+      const auto value = std::strtol(hex.c_str(), &parseEnd, 16);
+      if (parseEnd == hex.c_str() + 2)
+      {
+        result.push_back(static_cast<char>(value));
+        i += 2;
+        continue;
+      }
+    }
+    result.push_back(uri[i]);
+  }
+  return result;
+}
+
+std::optional<GltfReferences> read_gltf_references(
+  const std::filesystem::path& gltf_path, std::span<const std::byte> data)
+{
+  const bool binary = gltf_path.extension() == ".glb";
+  const auto json = nlohmann::json::parse(gltf_json(data, binary), nullptr, false);
+  if (json.is_discarded() || !json.is_object())
+  {
+    spdlog::error("glTF: '{}' has broken JSON!", gltf_path);
+    return std::nullopt;
+  }
+
+  const auto directory = gltf_path.parent_path();
+  GltfReferences result;
+
+  // Data URIs are not supported for anything that we read lazily, so these are nullopt
+  struct BufferLocation
+  {
+    std::filesystem::path file;
+    std::uint64_t offset;
+  };
+  std::vector<std::optional<BufferLocation>> buffers;
+  for (const auto& buffer : get_array(json, "buffers"))
+  {
+    const auto* uri = get_string(buffer, "uri");
+    if (uri == nullptr)
+    {
+      const auto binChunk = binary ? glb_binary_chunk(data) : std::nullopt;
+      if (binChunk.has_value())
+        buffers.emplace_back(BufferLocation{.file = gltf_path, .offset = *binChunk});
+      else
+        buffers.emplace_back(std::nullopt);
+    }
+    else if (uri->starts_with("data:"))
+      buffers.emplace_back(std::nullopt);
+    else
+    {
+      auto file = directory / decode_uri(*uri);
+      result.bufferFiles.push_back(file);
+      buffers.emplace_back(BufferLocation{.file = std::move(file), .offset = 0});
+    }
+  }
+
+  const auto& images = get_array(json, "images");
+  const auto& textures = get_array(json, "textures");
+  const auto& bufferViews = get_array(json, "bufferViews");
+
+  // Base color and emissive textures contain colors, and colors are sRGB in glTF
+  std::vector<bool> srgbImages(images.size(), false);
+  auto markSrgb = [&](const nlohmann::json* texture_info) {
+    if (texture_info == nullptr)
+      return;
+    const auto texture = get_uint(*texture_info, "index");
+    if (!texture.has_value() || *texture >= textures.size())
+      return;
+    const auto image = get_uint(textures[*texture], "source");
+    if (image.has_value() && *image < images.size())
+      srgbImages[*image] = true;
+  };
+  for (const auto& material : get_array(json, "materials"))
+  {
+    if (const auto* pbr = find_member(material, "pbrMetallicRoughness"); pbr != nullptr)
+      markSrgb(find_member(*pbr, "baseColorTexture"));
+    markSrgb(find_member(material, "emissiveTexture"));
+  }
+
+  result.images.reserve(images.size());
+  for (std::size_t i = 0; i < images.size(); ++i)
+  {
+    const auto& image = images[i];
+
+    // NOTE: unsupported images still get an (empty) entry to keep glTF indices valid
+    auto& source = result.images.emplace_back();
+    const auto* name = get_string(image, "name");
+    source.name = name != nullptr ? *name : fmt::format("image #{}", i);
+    source.srgb = srgbImages[i];
+
+    if (const auto* uri = get_string(image, "uri"); uri != nullptr)
+    {
+      if (uri->starts_with("data:"))
+        spdlog::warn("glTF: image '{}' is a data URI, these are not supported!", source.name);
+      else
+        source.file = directory / decode_uri(*uri);
+      continue;
+    }
+
+    const auto viewIdx = get_uint(image, "bufferView");
+    if (!viewIdx.has_value() || *viewIdx >= bufferViews.size())
+      continue;
+    const auto& view = bufferViews[*viewIdx];
+    const auto bufferIdx = get_uint(view, "buffer");
+    if (!bufferIdx.has_value() || *bufferIdx >= buffers.size() || !buffers[*bufferIdx])
+    {
+      spdlog::warn("glTF: image '{}' is stored in a data URI buffer, skipping it!", source.name);
+      continue;
+    }
+
+    source.file = buffers[*bufferIdx]->file;
+    source.offset = buffers[*bufferIdx]->offset + get_uint(view, "byteOffset").value_or(0);
+    source.size = get_uint(view, "byteLength").value_or(0);
+  }
+
+  return result;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+
+// Where to find the encoded (PNG, JPEG, ...) bytes of a glTF image
+struct ImageSource
+{
+  std::string name;
+  std::filesystem::path file;
+  // Byte range inside of `file`, a size of 0 means the whole file
+  std::uint64_t offset = 0;
+  std::uint64_t size = 0;
+  // Color textures are stored in sRGB, everything else (normals, roughness...) is linear
+  bool srgb = false;
+};
+
+// Everything a glTF file references by URI or by offset. Looking these up only
+// requires parsing the JSON, which is orders of magnitude cheaper than loading
+// the whole thing with tinygltf, as that reads all the buffers and images.
+struct GltfReferences
+{
+  // External files with buffer data. Data URIs and the GLB binary chunk are not listed.
+  std::vector<std::filesystem::path> bufferFiles;
+  std::vector<ImageSource> images;
+};
+
+// `data` is the contents of the .gltf or .glb file at `gltf_path`.
+// Returns nullopt if the JSON is broken.
+std::optional<GltfReferences> read_gltf_references(
+  const std::filesystem::path& gltf_path, std::span<const std::byte> data);
@@ -0,0 +1,56 @@
+#include "GpuInstance.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+
+static std::uint32_t pack_snorm10(const glm::vec3& v)
+{
+  std::uint32_t result = 0;
+  for (int i = 0; i < 3; ++i)
+  {
+    const auto value = static_cast<std::int32_t>(std::round(std::clamp(v[i], -1.0f, 1.0f) * 511));
+    result |= (static_cast<std::uint32_t>(value) & 0x3FF) << (i * 10);
+  }
+  return result;
+}
+
+static bool is_uniform_scale(const glm::mat3& m)
+{
+  // NOTE: relative to the scale, so that tiny and huge instances are treated the same
+  constexpr float TOLERANCE = 1e-4f;
+  const float scale = glm::dot(m[0], m[0]);
+  return std::abs(glm::dot(m[1], m[1]) - scale) <= TOLERANCE * scale &&
+    std::abs(glm::dot(m[2], m[2]) - scale) <= TOLERANCE * scale &&
+    std::abs(glm::dot(m[0], m[1])) <= TOLERANCE * scale &&
+    std::abs(glm::dot(m[1], m[2])) <= TOLERANCE * scale &&
+    std::abs(glm::dot(m[2], m[0])) <= TOLERANCE * scale;
+}
+
+GpuInstance pack_gpu_instance(const glm::mat4x4& model)
+{
+  const glm::mat4x4 rows = glm::transpose(model);
+  GpuInstance result{
+    .modelRows = {rows[0], rows[1], rows[2]},
+    .normalColumns = {},
+    .flags = 0,
+  };
+
+  const glm::mat3 linear(model);
+  // Degenerate matrices flatten everything anyway, any normals will do for them
+  if (is_uniform_scale(linear) || glm::determinant(linear) == 0.0f)
+  {
+    result.flags |= GPU_INSTANCE_UNIFORM_SCALE;
+    return result;
+  }
+
+  const glm::mat3 normalMatrix = glm::transpose(glm::inverse(linear));
+  float largest = 0.0f;
+  for (int column = 0; column < 3; ++column)
+    for (int row = 0; row < 3; ++row)
+      largest = std::max(largest, std::abs(normalMatrix[column][row]));
+
+  for (int column = 0; column < 3; ++column)
+    result.normalColumns[column] = pack_snorm10(normalMatrix[column] / largest);
+  return result;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+
+// What the GPU instance buffer holds for every instance. Shaders read it with the helpers
+// from instances.glsl, which have to be kept in sync with this.
+
+// The 3x3 part of the model matrix is a rotation with the same scale along every axis,
+// so it transforms normals the same way as it transforms positions, up to length
+constexpr std::uint32_t GPU_INSTANCE_UNIFORM_SCALE = 1;
+// The instance has moved at least once since its scene was selected. Set by SceneManager,
+// so that passes can treat instances that never move separately, e.g. cache them.
+constexpr std::uint32_t GPU_INSTANCE_DYNAMIC = 2;
+
+struct GpuInstance
+{
+  // Rows of the affine part of the model matrix, the translation is in w
+  std::array<glm::vec4, 3> modelRows;
+  // Columns of the inverse transpose of the 3x3 part of the model matrix, scaled so that
+  // the largest entry is 1, and packed as 10:10:10 snorm. Normals are renormalized after
+  // the transform anyway. Unused with GPU_INSTANCE_UNIFORM_SCALE.
+  std::array<std::uint32_t, 3> normalColumns;
+  std::uint32_t flags;
+};
+
+static_assert(sizeof(GpuInstance) == 64);
+
+// NOTE: does the inversion once per instance change, instead of once per vertex
+GpuInstance pack_gpu_instance(const glm::mat4x4& model);
@@ -0,0 +1,152 @@
+#include "MappedFile.hpp"
+
+#include <utility>
+
+#include <spdlog/spdlog.h>
+#include <fmt/std.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+std::optional<MappedFile> MappedFile::open(const std::filesystem::path& path)
+{
+  MappedFile result;
+
+#ifdef _WIN32
+  HANDLE file = CreateFileW(
+    path.c_str(),
+    GENERIC_READ,
+    FILE_SHARE_READ,
+    nullptr,
+    OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+    nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    spdlog::error("Unable to open '{}' for mapping!", path);
+    return std::nullopt;
+  }
+  result.fileHandle = file;
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize))
+  {
+    spdlog::error("Unable to query size of '{}'!", path);
+    return std::nullopt;
+  }
+  result.size = static_cast<std::size_t>(fileSize.QuadPart);
+
+  // Zero-sized files can't be mapped, but they are still valid files.
+  if (result.size == 0)
+    return result;
+
+  HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping == nullptr)
+  {
+    spdlog::error("Unable to create a mapping for '{}'!", path);
+    return std::nullopt;
+  }
+  result.mappingHandle = mapping;
+
+  result.ptr = static_cast<std::byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  if (result.ptr == nullptr)
+  {
+    spdlog::error("Unable to map '{}'!", path);
+    return std::nullopt;
+  }
+#else
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    spdlog::error("Unable to open '{}' for mapping!", path);
+    return std::nullopt;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    spdlog::error("Unable to query size of '{}'!", path);
+    ::close(fd);
+    return std::nullopt;
+  }
+  result.size = static_cast<std::size_t>(st.st_size);
+
+  if (result.size == 0)
+  {
+    ::close(fd);
+    return result;
+  }
+
+  void* mapped = mmap(nullptr, result.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps a reference to the file by itself
+  ::close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    spdlog::error("Unable to map '{}'!", path);
+    result.size = 0;
+    return std::nullopt;
+  }
+
+  // We are going to stream through the whole thing, tell the kernel to read ahead.
+  madvise(mapped, result.size, MADV_WILLNEED);
+
+  result.ptr = static_cast<std::byte*>(mapped);
+#endif
+
+  return result;
+}
+
+MappedFile::~MappedFile()
+{
+  reset();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+{
+  *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+  if (this == &other)
+    return *this;
+
+  reset();
+
+  ptr = std::exchange(other.ptr, nullptr);
+  size = std::exchange(other.size, 0);
+#ifdef _WIN32
+  fileHandle = std::exchange(other.fileHandle, nullptr);
+  mappingHandle = std::exchange(other.mappingHandle, nullptr);
+#endif
+
+  return *this;
+}
+
+void MappedFile::reset()
+{
+#ifdef _WIN32
+  if (ptr != nullptr)
+    UnmapViewOfFile(ptr);
+  if (mappingHandle != nullptr)
+    CloseHandle(mappingHandle);
+  if (fileHandle != nullptr)
+    CloseHandle(fileHandle);
+  fileHandle = nullptr;
+  mappingHandle = nullptr;
+#else
+  if (ptr != nullptr)
+    munmap(ptr, size);
+#endif
+  ptr = nullptr;
+  size = 0;
+}
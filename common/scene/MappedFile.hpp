@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <span>
+
+
+/**
+ * Read-only memory mapping of a whole file. Nothing is actually read from
+ * the disc until someone touches the bytes, and when they do, the OS pages
+ * the data in straight from its file cache, without any intermediate copies.
+ */
+class MappedFile
+{
+public:
+  static std::optional<MappedFile> open(const std::filesystem::path& path);
+
+  MappedFile() = default;
+  ~MappedFile();
+
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  std::span<const std::byte> data() const { return {ptr, size}; }
+
+private:
+  void reset();
+
+private:
+  std::byte* ptr = nullptr;
+  std::size_t size = 0;
+
+#ifdef _WIN32
+  // HANDLEs, we don't want to leak windows.h into every TU.
+  void* fileHandle = nullptr;
+  void* mappingHandle = nullptr;
+#endif
+};
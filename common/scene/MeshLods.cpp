@@ -0,0 +1,373 @@
+#include "MeshLods.hpp"
+
+#include "RelemIndices.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numeric>
+#include <optional>
+#include <span>
+#include <vector>
+
+
+// Symmetric 4x4 matrix, evaluates to the sum of squared distances to a bunch of planes
+struct Quadric
+{
+  double xx, xy, xz, xw, yy, yz, yw, zz, zw, ww;
+
+  Quadric& operator+=(const Quadric& other)
+  {
+    xx += other.xx;
+    xy += other.xy;
+    xz += other.xz;
+    xw += other.xw;
+    yy += other.yy;
+    yz += other.yz;
+    yw += other.yw;
+    zz += other.zz;
+    zw += other.zw;
+    ww += other.ww;
+    return *this;
+  }
+};
+
+// The plane is dot(normal, p) + offset = 0 with a unit normal
+static Quadric plane_quadric(const glm::vec3& normal, float offset)
+{
+  const double x = normal.x;
+  const double y = normal.y;
+  const double z = normal.z;
+  const double w = offset;
+  return Quadric{
+    .xx = x * x,
+    .xy = x * y,
+    .xz = x * z,
+    .xw = x * w,
+    .yy = y * y,
+    .yz = y * z,
+    .yw = y * w,
+    .zz = z * z,
+    .zw = z * w,
+    .ww = w * w,
+  };
+}
+
+static double evaluate(const Quadric& q, const glm::vec3& point)
+{
+  const double x = point.x;
+  const double y = point.y;
+  const double z = point.z;
+  const double result = q.xx * x * x + q.yy * y * y + q.zz * z * z + q.ww +
+    2.0 * (q.xy * x * y + q.xz * x * z + q.yz * y * z + q.xw * x + q.yw * y + q.zw * z);
+  // Rounding errors can make it slightly negative
+  return std::max(result, 0.0);
+}
+
+static std::uint64_t edge_key(std::uint32_t a, std::uint32_t b)
+{
+  return (std::uint64_t{std::min(a, b)} << 32) | std::max(a, b);
+}
+
+struct SimplifiedLevel
+{
+  std::vector<std::uint32_t> indices;
+  float error;
+};
+
+/**
+ * Simplifies the triangles of a single relem with half-edge collapses, i.e. a vertex is
+ * always merged into one of its neighbours and vertices never move, so only indices change.
+ * Collapses are done in passes: every pass sorts all edges by the quadric error of
+ * collapsing them and performs the cheapest ones that don't touch each other.
+ */
+class RelemSimplifier
+{
+public:
+  RelemSimplifier(std::span<const Vertex> vertices, std::vector<std::uint32_t> triangles)
+    : indices{std::move(triangles)}
+  {
+    const std::uint32_t vertexCount = indices.empty() ? 0 : std::ranges::max(indices) + 1;
+    positions.resize(vertexCount);
+    for (std::uint32_t vertex = 0; vertex < vertexCount; ++vertex)
+      positions[vertex] = glm::vec3(vertices[vertex].positionAndNormal);
+
+    // Open and non-manifold edges are used by anything but exactly two triangles
+    std::vector<std::uint64_t> edges;
+    edges.reserve(indices.size());
+    forEachEdge([&edges](std::uint32_t a, std::uint32_t b) { edges.push_back(edge_key(a, b)); });
+    std::ranges::sort(edges);
+    locked.assign(vertexCount, false);
+    for (std::size_t first = 0; first < edges.size();)
+    {
+      std::size_t end = first + 1;
+      while (end < edges.size() && edges[end] == edges[first])
+        ++end;
+      if (end - first != 2)
+      {
+        locked[static_cast<std::uint32_t>(edges[first] >> 32)] = true;
+        locked[static_cast<std::uint32_t>(edges[first])] = true;
+      }
+      first = end;
+    }
+
+    quadrics.assign(vertexCount, Quadric{});
+    for (std::size_t i = 0; i < indices.size(); i += 3)
+    {
+      const auto p0 = positions[indices[i]];
+      glm::vec3 normal = glm::cross(positions[indices[i + 1]] - p0, positions[indices[i + 2]] - p0);
+      const float length = glm::length(normal);
+      if (length == 0.0f)
+        continue;
+      normal = normal / length;
+      const auto quadric = plane_quadric(normal, -glm::dot(normal, p0));
+      for (std::size_t corner = 0; corner < 3; ++corner)
+        quadrics[indices[i + corner]] += quadric;
+    }
+  }
+
+  // Collapses edges until at most `target_index_count` indices are left, or until
+  // any further collapse would move the surface by more than `max_error`.
+  void simplify(std::size_t target_index_count, float max_error)
+  {
+    const double maxCost = double{max_error} * max_error;
+    while (indices.size() > target_index_count && collapsePass(target_index_count, maxCost))
+      ;
+  }
+
+  const std::vector<std::uint32_t>& getIndices() const { return indices; }
+
+  // The largest error of all collapses so far
+  float getError() const { return error; }
+
+private:
+  struct Collapse
+  {
+    std::uint32_t from;
+    std::uint32_t to;
+    double cost;
+  };
+
+  template <class F>
+  void forEachEdge(F&& f) const
+  {
+    for (std::size_t i = 0; i < indices.size(); i += 3)
+      for (std::size_t corner = 0; corner < 3; ++corner)
+        f(indices[i + corner], indices[i + (corner + 1) % 3]);
+  }
+
+  bool collapsePass(std::size_t target_index_count, double max_cost)
+  {
+    std::vector<std::uint64_t> edges;
+    edges.reserve(indices.size());
+    forEachEdge([&edges](std::uint32_t a, std::uint32_t b) { edges.push_back(edge_key(a, b)); });
+    std::ranges::sort(edges);
+    const auto [uniqueEnd, _] = std::ranges::unique(edges);
+    edges.erase(uniqueEnd, edges.end());
+
+    // Every edge can be collapsed either way, the cheaper direction wins
+    std::vector<Collapse> collapses;
+    collapses.reserve(edges.size());
+    for (const auto edge : edges)
+    {
+      const auto a = static_cast<std::uint32_t>(edge >> 32);
+      const auto b = static_cast<std::uint32_t>(edge);
+      auto merged = quadrics[a];
+      merged += quadrics[b];
+
+      std::optional<Collapse> best;
+      if (!locked[a])
+        best = Collapse{.from = a, .to = b, .cost = evaluate(merged, positions[b])};
+      if (!locked[b])
+        if (const double cost = evaluate(merged, positions[a]); !best || cost < best->cost)
+          best = Collapse{.from = b, .to = a, .cost = cost};
+      if (best && best->cost <= max_cost)
+        collapses.push_back(*best);
+    }
+    std::ranges::sort(collapses, {}, &Collapse::cost);
+
+    const std::size_t vertexCount = positions.size();
+    const auto adjacency = build_triangle_adjacency(indices, vertexCount);
+
+    // Collapsing `from` into `to` must not turn any of the remaining triangles inside out
+    auto flips = [&](const Collapse& collapse) {
+      for (const auto triangleIdx : adjacency.around(collapse.from))
+      {
+        const std::uint32_t* triangle = &indices[triangleIdx * 3];
+        if (std::find(triangle, triangle + 3, collapse.to) != triangle + 3)
+          continue;
+
+        std::array<glm::vec3, 3> before;
+        std::array<glm::vec3, 3> after;
+        for (std::size_t corner = 0; corner < 3; ++corner)
+        {
+          before[corner] = positions[triangle[corner]];
+          after[corner] =
+            positions[triangle[corner] == collapse.from ? collapse.to : triangle[corner]];
+        }
+        const auto normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+        const auto normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+        if (glm::dot(normalBefore, normalAfter) <= 0.0f)
+          return true;
+      }
+      return false;
+    };
+
+    std::vector<std::uint32_t> remap(vertexCount);
+    std::iota(remap.begin(), remap.end(), 0u);
+    std::vector<bool> touched(vertexCount, false);
+
+    // Every collapse removes about two triangles, don't overshoot the target by much
+    const std::size_t collapseGoal = (indices.size() - target_index_count) / 6 + 1;
+    std::size_t collapsed = 0;
+    for (const auto& collapse : collapses)
+    {
+      if (collapsed == collapseGoal)
+        break;
+      if (touched[collapse.from] || touched[collapse.to] || flips(collapse))
+        continue;
+
+      remap[collapse.from] = collapse.to;
+      quadrics[collapse.to] += quadrics[collapse.from];
+      error = std::max(error, static_cast<float>(std::sqrt(collapse.cost)));
+      ++collapsed;
+
+      // Triangles around `from` change shape, so their other vertices can't move in this
+      // pass anymore, otherwise the flip checks above would be looking at stale triangles.
+      for (const auto triangleIdx : adjacency.around(collapse.from))
+        for (std::size_t corner = 0; corner < 3; ++corner)
+          touched[indices[triangleIdx * 3 + corner]] = true;
+    }
+
+    if (collapsed == 0)
+      return false;
+
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < indices.size(); i += 3)
+    {
+      const auto a = remap[indices[i]];
+      const auto b = remap[indices[i + 1]];
+      const auto c = remap[indices[i + 2]];
+      if (a == b || b == c || a == c)
+        continue;
+      indices[kept++] = a;
+      indices[kept++] = b;
+      indices[kept++] = c;
+    }
+    indices.resize(kept);
+
+    return true;
+  }
+
+private:
+  std::vector<std::uint32_t> indices;
+  std::vector<glm::vec3> positions;
+  std::vector<bool> locked;
+  std::vector<Quadric> quadrics;
+  float error = 0.0f;
+};
+
+static std::vector<SimplifiedLevel> simplify_relem(
+  std::span<const Vertex> vertices,
+  std::vector<std::uint32_t> indices,
+  const LodSettings& settings,
+  float max_error)
+{
+  // Leftover indices that don't form a whole triangle are never drawn anyway
+  indices.resize(indices.size() / 3 * 3);
+
+  RelemSimplifier simplifier(vertices, std::move(indices));
+  std::vector<SimplifiedLevel> result;
+  std::size_t target = simplifier.getIndices().size();
+  for (std::uint32_t lod = 1; lod < MAX_MESH_LODS; ++lod)
+  {
+    target = static_cast<std::size_t>(static_cast<float>(target) * settings.reduction) / 3 * 3;
+    simplifier.simplify(target, max_error);
+    result.push_back(SimplifiedLevel{
+      .indices = simplifier.getIndices(),
+      .error = simplifier.getError(),
+    });
+  }
+  return result;
+}
+
+void build_lods(ProcessedMeshes& meshes, ThreadPool& pool, const LodSettings& settings)
+{
+  // The error budget is the same for all relems of a mesh
+  std::vector<float> relemMaxErrors(meshes.relems.size(), 0.0f);
+  for (const auto& mesh : meshes.meshes)
+    for (std::uint32_t i = 0; i < mesh.relemCount; ++i)
+      relemMaxErrors[mesh.firstRelem + i] =
+        settings.maxError * glm::length(mesh.bounds.max - mesh.bounds.min);
+
+  std::vector<std::vector<SimplifiedLevel>> relemLevels(meshes.relems.size());
+  pool.parallelFor(meshes.relems.size(), 1, [&](std::size_t relemIdx) {
+    const auto& relem = meshes.relems[relemIdx];
+    const std::size_t indexSize = index_size(relem.indexType);
+    const auto bytes = std::span{meshes.indices}.subspan(
+      relem.indexOffset * indexSize, relem.indexCount * indexSize);
+    relemLevels[relemIdx] = simplify_relem(
+      std::span{meshes.vertices}.subspan(relem.vertexOffset),
+      relem.indexType == IndexType::Uint16 ? read_indices<std::uint16_t>(bytes)
+                                           : read_indices<std::uint32_t>(bytes),
+      settings,
+      relemMaxErrors[relemIdx]);
+  });
+
+  // NOTE: process_meshes keeps the index buffer a multiple of 4 bytes, so we do that too
+  std::size_t indexBytes = meshes.indices.size();
+  for (auto& mesh : meshes.meshes)
+  {
+    std::size_t previousIndexCount = 0;
+    for (std::uint32_t i = 0; i < mesh.relemCount; ++i)
+      previousIndexCount += meshes.relems[mesh.firstRelem + i].indexCount;
+
+    for (std::uint32_t lod = 1; lod < MAX_MESH_LODS && mesh.relemCount > 0; ++lod)
+    {
+      std::size_t indexCount = 0;
+      float error = 0.0f;
+      for (std::uint32_t i = 0; i < mesh.relemCount; ++i)
+      {
+        const auto& level = relemLevels[mesh.firstRelem + i][lod - 1];
+        indexCount += level.indices.size();
+        error = std::max(error, level.error);
+      }
+
+      // LODs that barely simplify anything are not worth the memory and the popping
+      if (indexCount * 4 > previousIndexCount * 3)
+        break;
+
+      mesh.lods[lod] = MeshLod{
+        .firstRelem = static_cast<std::uint32_t>(meshes.relems.size()),
+        .error = error,
+      };
+      for (std::uint32_t i = 0; i < mesh.relemCount; ++i)
+      {
+        const auto source = meshes.relems[mesh.firstRelem + i];
+        const auto& level = relemLevels[mesh.firstRelem + i][lod - 1].indices;
+        const std::size_t indexSize = index_size(source.indexType);
+        indexBytes = (indexBytes + indexSize - 1) / indexSize * indexSize;
+
+        meshes.indices.resize(indexBytes + level.size() * indexSize);
+        const auto bytes = std::span{meshes.indices}.subspan(indexBytes);
+        if (source.indexType == IndexType::Uint16)
+          write_indices<std::uint16_t>(level, bytes);
+        else
+          write_indices<std::uint32_t>(level, bytes);
+
+        meshes.relems.push_back(RenderElement{
+          .vertexOffset = source.vertexOffset,
+          .indexOffset = static_cast<std::uint32_t>(indexBytes / indexSize),
+          .indexCount = static_cast<std::uint32_t>(level.size()),
+          .indexType = source.indexType,
+        });
+        indexBytes += level.size() * indexSize;
+      }
+
+      mesh.lodCount = lod + 1;
+      previousIndexCount = indexCount;
+    }
+  }
+
+  meshes.indices.resize((indexBytes + 3) / 4 * 4);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "SceneProcessing.hpp"
+#include "jobs/ThreadPool.hpp"
+
+
+// Simplified LODs of meshes for drawing them far away from the camera. Every relem is
+// simplified with edge collapses ordered by the quadric error metric (Garland & Heckbert).
+// LODs only have new indices, they reference the same vertices as the full detail relem,
+// so the vertex buffer doesn't grow at all.
+
+struct LodSettings
+{
+  // The largest error any LOD may have, relative to the diagonal of the mesh's bounds
+  float maxError = 0.02f;
+  // Every LOD aims for this fraction of the triangles of the previous one
+  float reduction = 0.5f;
+};
+
+// Appends up to MAX_MESH_LODS - 1 LODs for every mesh to the relems and indices. A mesh
+// gets fewer LODs when the error budget doesn't allow simplifying it any further.
+// NOTE: vertices on open edges (including UV and normal seams) never move, so that
+// relems stay watertight where they meet, which limits how far some meshes can go.
+void build_lods(ProcessedMeshes& meshes, ThreadPool& pool, const LodSettings& settings);
@@ -0,0 +1,214 @@
+#include "Meshlets.hpp"
+
+#include "RelemIndices.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <span>
+
+
+constexpr std::uint32_t NO_MESHLET = std::numeric_limits<std::uint32_t>::max();
+constexpr std::size_t NO_TRIANGLE = std::numeric_limits<std::size_t>::max();
+
+// Bounding sphere and normal cone of a meshlet, the same ones meshoptimizer computes
+static Meshlet meshlet_bounds(
+  std::span<const std::uint32_t> triangles,
+  std::span<const std::uint32_t> unique_vertices,
+  std::span<const Vertex> vertices)
+{
+  auto position = [vertices](std::uint32_t vertex) {
+    return glm::vec3(vertices[vertex].positionAndNormal);
+  };
+
+  glm::vec3 min(std::numeric_limits<float>::max());
+  glm::vec3 max(std::numeric_limits<float>::lowest());
+  for (const auto vertex : unique_vertices)
+  {
+    min = glm::min(min, position(vertex));
+    max = glm::max(max, position(vertex));
+  }
+
+  const glm::vec3 center = (min + max) * 0.5f;
+  float radius = 0.0f;
+  for (const auto vertex : unique_vertices)
+    radius = std::max(radius, glm::length(position(vertex) - center));
+
+  auto triangleNormal = [&](std::size_t triangle) {
+    const auto p0 = position(triangles[triangle * 3 + 0]);
+    const auto p1 = position(triangles[triangle * 3 + 1]);
+    const auto p2 = position(triangles[triangle * 3 + 2]);
+    return glm::cross(p1 - p0, p2 - p0);
+  };
+
+  // Area-weighted average of the normals
+  const std::size_t triangleCount = triangles.size() / 3;
+  glm::vec3 axis(0.0f);
+  for (std::size_t triangle = 0; triangle < triangleCount; ++triangle)
+    axis += triangleNormal(triangle);
+
+  const float axisLength = glm::length(axis);
+  float minDot = 1.0f;
+  if (axisLength > 0.0f)
+  {
+    axis = axis / axisLength;
+    for (std::size_t triangle = 0; triangle < triangleCount; ++triangle)
+    {
+      const auto normal = triangleNormal(triangle);
+      // Degenerate triangles are never rasterized, so they can face anywhere
+      if (const float length = glm::length(normal); length > 0.0f)
+        minDot = std::min(minDot, glm::dot(normal, axis) / length);
+    }
+  }
+
+  // NOTE: cones wider than ~85 degrees are almost never back-facing as a whole,
+  // so they are not worth testing at all.
+  const bool cullable = axisLength > 0.0f && minDot > 0.1f;
+
+  return Meshlet{
+    .center = center,
+    .radius = radius,
+    .coneAxis = axis,
+    .coneCutoff = cullable ? std::sqrt(1.0f - minDot * minDot) : 1.0f,
+    .relem = 0,
+    .firstIndex = 0,
+    .indexCount = 0,
+  };
+}
+
+// Meshlets are grown greedily over triangle adjacency. The next triangle is the neighbour
+// of the meshlet that adds the fewest new vertices to it, and when there are no neighbours
+// left, it's the first unused triangle in index order, which is usually close by anyway.
+static std::vector<Meshlet> build_relem_meshlets(
+  std::uint32_t relem_idx,
+  const RenderElement& relem,
+  std::span<const Vertex> vertices,
+  std::span<std::byte> index_bytes)
+{
+  const auto indices = relem.indexType == IndexType::Uint16
+    ? read_indices<std::uint16_t>(index_bytes)
+    : read_indices<std::uint32_t>(index_bytes);
+  const std::size_t triangleCount = indices.size() / 3;
+  if (triangleCount == 0)
+    return {};
+
+  const auto triangleIndices = std::span{indices}.first(triangleCount * 3);
+  const std::uint32_t vertexCount = std::ranges::max(triangleIndices) + 1;
+
+  const auto adjacency = build_triangle_adjacency(triangleIndices, vertexCount);
+
+  std::vector<bool> used(triangleCount, false);
+  std::size_t usedCount = 0;
+  std::size_t nextSeed = 0;
+  // The last meshlet every vertex was added to
+  std::vector<std::uint32_t> vertexMeshlet(vertexCount, NO_MESHLET);
+
+  std::vector<std::uint32_t> reordered;
+  reordered.reserve(triangleIndices.size());
+  std::vector<std::uint32_t> meshletVertices;
+  std::vector<std::uint32_t> candidates;
+  std::vector<Meshlet> result;
+
+  while (usedCount < triangleCount)
+  {
+    const auto meshletIdx = static_cast<std::uint32_t>(result.size());
+    const std::size_t firstTriangle = reordered.size() / 3;
+    meshletVertices.clear();
+    candidates.clear();
+
+    auto newVertexCount = [&](std::size_t triangle) {
+      std::uint32_t count = 0;
+      for (std::size_t corner = 0; corner < 3; ++corner)
+        count += vertexMeshlet[triangleIndices[triangle * 3 + corner]] != meshletIdx ? 1 : 0;
+      return count;
+    };
+
+    while (
+      reordered.size() / 3 - firstTriangle < MESHLET_MAX_TRIANGLES && usedCount < triangleCount)
+    {
+      std::size_t best = NO_TRIANGLE;
+      std::uint32_t bestNewVertices = 4;
+      for (std::size_t i = 0; i < candidates.size();)
+      {
+        const auto triangle = candidates[i];
+        if (used[triangle])
+        {
+          candidates[i] = candidates.back();
+          candidates.pop_back();
+          continue;
+        }
+        if (const auto count = newVertexCount(triangle); count < bestNewVertices)
+        {
+          best = triangle;
+          bestNewVertices = count;
+          if (count == 0)
+            break;
+        }
+        ++i;
+      }
+
+      if (best == NO_TRIANGLE)
+      {
+        while (used[nextSeed])
+          ++nextSeed;
+        best = nextSeed;
+        bestNewVertices = newVertexCount(best);
+      }
+
+      if (meshletVertices.size() + bestNewVertices > MESHLET_MAX_VERTICES)
+        break;
+
+      used[best] = true;
+      ++usedCount;
+      for (std::size_t corner = 0; corner < 3; ++corner)
+      {
+        const auto vertex = triangleIndices[best * 3 + corner];
+        reordered.push_back(vertex);
+        if (vertexMeshlet[vertex] == meshletIdx)
+          continue;
+
+        vertexMeshlet[vertex] = meshletIdx;
+        meshletVertices.push_back(vertex);
+        for (const auto triangle : adjacency.around(vertex))
+          if (!used[triangle])
+            candidates.push_back(triangle);
+      }
+    }
+
+    const auto triangles = std::span{reordered}.subspan(firstTriangle * 3);
+    auto meshlet = meshlet_bounds(triangles, meshletVertices, vertices);
+    meshlet.relem = relem_idx;
+    meshlet.firstIndex = relem.indexOffset + static_cast<std::uint32_t>(firstTriangle * 3);
+    meshlet.indexCount = static_cast<std::uint32_t>(triangles.size());
+    result.push_back(meshlet);
+  }
+
+  // Leftover indices that don't form a whole triangle stay where they were
+  if (relem.indexType == IndexType::Uint16)
+    write_indices<std::uint16_t>(reordered, index_bytes);
+  else
+    write_indices<std::uint32_t>(reordered, index_bytes);
+
+  return result;
+}
+
+std::vector<Meshlet> build_meshlets(ProcessedMeshes& meshes, ThreadPool& pool)
+{
+  // Relems never share index data, so every one of them is reordered on its own
+  std::vector<std::vector<Meshlet>> relemMeshlets(meshes.relems.size());
+  pool.parallelFor(meshes.relems.size(), 1, [&meshes, &relemMeshlets](std::size_t relemIdx) {
+    const auto& relem = meshes.relems[relemIdx];
+    const std::size_t indexSize = index_size(relem.indexType);
+    relemMeshlets[relemIdx] = build_relem_meshlets(
+      static_cast<std::uint32_t>(relemIdx),
+      relem,
+      std::span{meshes.vertices}.subspan(relem.vertexOffset),
+      std::span{meshes.indices}.subspan(
+        relem.indexOffset * indexSize, relem.indexCount * indexSize));
+  });
+
+  std::vector<Meshlet> result;
+  for (const auto& meshlets : relemMeshlets)
+    result.insert(result.end(), meshlets.begin(), meshlets.end());
+  return result;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "SceneProcessing.hpp"
+#include "jobs/ThreadPool.hpp"
+
+
+// A small cluster of triangles of a relem that is culled on its own. Triangles of
+// a meshlet are a contiguous range of the relem's indices, so a visible meshlet is
+// drawn with the same drawIndexed as its relem, just with a smaller index range.
+
+constexpr std::uint32_t MESHLET_MAX_VERTICES = 64;
+constexpr std::uint32_t MESHLET_MAX_TRIANGLES = 124;
+
+struct Meshlet
+{
+  // Bounding sphere in the mesh's space
+  glm::vec3 center;
+  float radius;
+  // Normal cone of the triangles, all of them face away from a viewer at `p` if
+  // dot(center - p, coneAxis) >= coneCutoff * length(center - p) + radius.
+  // Meshlets that can never be back-facing have a cutoff of 1.
+  glm::vec3 coneAxis;
+  float coneCutoff;
+  std::uint32_t relem;
+  // Same units as RenderElement::indexOffset, from the start of the index buffer
+  std::uint32_t firstIndex;
+  std::uint32_t indexCount;
+};
+
+static_assert(sizeof(Meshlet) == sizeof(float) * 11);
+
+// Splits every relem into meshlets of at most MESHLET_MAX_VERTICES unique vertices and
+// MESHLET_MAX_TRIANGLES triangles. Triangles of every relem are reordered in place, so that
+// meshlets are contiguous, relems still draw the same set of triangles as before.
+// Meshlets are sorted by relem, relems without triangles don't have any.
+std::vector<Meshlet> build_meshlets(ProcessedMeshes& meshes, ThreadPool& pool);
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+
+// Internal helpers of the passes that rewrite index data of relems in place,
+// see Meshlets.cpp and MeshLods.cpp
+
+// Widens index data of `Index` type to 32 bits
+template <class Index>
+std::vector<std::uint32_t> read_indices(std::span<const std::byte> bytes)
+{
+  std::vector<std::uint32_t> result(bytes.size() / sizeof(Index));
+  for (std::size_t i = 0; i < result.size(); ++i)
+  {
+    Index index;
+    std::memcpy(&index, bytes.data() + i * sizeof(Index), sizeof(Index));
+    result[i] = index;
+  }
+  return result;
+}
+
+// The other way around, every index has to fit into `Index`
+template <class Index>
+void write_indices(std::span<const std::uint32_t> indices, std::span<std::byte> bytes)
+{
+  for (std::size_t i = 0; i < indices.size(); ++i)
+  {
+    const auto index = static_cast<Index>(indices[i]);
+    std::memcpy(bytes.data() + i * sizeof(Index), &index, sizeof(Index));
+  }
+}
+
+// Triangles around every vertex of a triangle list, those around v are
+// adjacent[firstAdjacent[v]..firstAdjacent[v + 1]]
+struct TriangleAdjacency
+{
+  std::vector<std::uint32_t> firstAdjacent;
+  std::vector<std::uint32_t> adjacent;
+
+  std::span<const std::uint32_t> around(std::uint32_t vertex) const
+  {
+    return std::span{adjacent}.subspan(
+      firstAdjacent[vertex], firstAdjacent[vertex + 1] - firstAdjacent[vertex]);
+  }
+};
+
+// All of `triangles` have to be below `vertex_count`
+inline TriangleAdjacency build_triangle_adjacency(
+  std::span<const std::uint32_t> triangles, std::size_t vertex_count)
+{
+  TriangleAdjacency result;
+  result.firstAdjacent.assign(vertex_count + 1, 0);
+  for (const auto vertex : triangles)
+    ++result.firstAdjacent[vertex + 1];
+  for (std::size_t i = 1; i < result.firstAdjacent.size(); ++i)
+    result.firstAdjacent[i] += result.firstAdjacent[i - 1];
+
+  result.adjacent.resize(triangles.size());
+  auto placed = result.firstAdjacent;
+  for (std::size_t i = 0; i < triangles.size(); ++i)
+    result.adjacent[placed[triangles[i]]++] = static_cast<std::uint32_t>(i / 3);
+  return result;
+}
@@ -0,0 +1,235 @@
+#include "SceneCache.hpp"
+
+#include "BakedScene.hpp"
+#include "GltfReferences.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+#include <fmt/std.h>
+
+
+// Bump this whenever scene processing starts producing different results
+// for the same input, otherwise stale cache entries will be used!
+static constexpr std::uint64_t SCENE_CACHE_VERSION = 2;
+
+// NOTE: this is XXH64, it runs at memory bandwidth, so hashing even
+// a huge scene is nothing compared to parsing and converting it.
+static constexpr std::uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static constexpr std::uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr std::uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static constexpr std::uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr std::uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+template <class T>
+static T read_unaligned(const std::byte* ptr)
+{
+  T result;
+  std::memcpy(&result, ptr, sizeof(T));
+  return result;
+}
+
+static std::uint64_t xxh64_round(std::uint64_t acc, std::uint64_t input)
+{
+  acc += input * PRIME64_2;
+  acc = std::rotl(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static std::uint64_t xxh64_merge_round(std::uint64_t acc, std::uint64_t value)
+{
+  acc ^= xxh64_round(0, value);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+static std::uint64_t xxh64(std::span<const std::byte> data, std::uint64_t seed)
+{
+  const std::byte* ptr = data.data();
+  const std::byte* const end = ptr + data.size();
+
+  std::uint64_t hash;
+  if (data.size() >= 32)
+  {
+    std::array<std::uint64_t, 4> lanes{
+      seed + PRIME64_1 + PRIME64_2, seed + PRIME64_2, seed, seed - PRIME64_1};
+    for (; end - ptr >= 32; ptr += 32)
+      for (std::size_t i = 0; i < lanes.size(); ++i)
+        lanes[i] = xxh64_round(lanes[i], read_unaligned<std::uint64_t>(ptr + 8 * i));
+
+    hash = std::rotl(lanes[0], 1) + std::rotl(lanes[1], 7) + std::rotl(lanes[2], 12) +
+      std::rotl(lanes[3], 18);
+    for (auto lane : lanes)
+      hash = xxh64_merge_round(hash, lane);
+  }
+  else
+    hash = seed + PRIME64_5;
+
+  hash += data.size();
+
+  for (; end - ptr >= 8; ptr += 8)
+  {
+    hash ^= xxh64_round(0, read_unaligned<std::uint64_t>(ptr));
+    hash = std::rotl(hash, 27) * PRIME64_1 + PRIME64_4;
+  }
+
+  if (end - ptr >= 4)
+  {
+    hash ^= read_unaligned<std::uint32_t>(ptr) * PRIME64_1;
+    hash = std::rotl(hash, 23) * PRIME64_2 + PRIME64_3;
+    ptr += 4;
+  }
+
+  for (; ptr != end; ++ptr)
+  {
+    hash ^= std::to_integer<std::uint64_t>(*ptr) * PRIME64_5;
+    hash = std::rotl(hash, 11) * PRIME64_1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= PRIME64_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+SceneCache::SceneCache(CreateInfo info)
+  : directory{std::move(info.directory)}
+  , maxSize{info.maxSize}
+  , enabled{info.enabled}
+{
+}
+
+std::optional<std::uint64_t> SceneCache::computeKey(
+  std::span<const std::byte> gltf_data, const GltfReferences& references) const
+{
+  if (!enabled)
+    return std::nullopt;
+
+  // Anything that changes the processed result has to be a part of the key
+  std::vector<std::uint64_t> hashes{
+    SCENE_CACHE_VERSION,
+    BAKED_SCENE_VERSION,
+    xxh64(gltf_data, 0),
+  };
+
+  // NOTE: data URIs and the GLB binary chunk are inside the glTF file, so they're hashed already
+  for (const auto& bufferFile : references.bufferFiles)
+  {
+    const auto buffer = MappedFile::open(bufferFile);
+    if (!buffer.has_value())
+      return std::nullopt;
+    hashes.push_back(xxh64(buffer->data(), 0));
+  }
+
+  return xxh64(std::as_bytes(std::span{hashes}), 0);
+}
+
+std::optional<MappedFile> SceneCache::find(std::uint64_t key) const
+{
+  if (!enabled)
+    return std::nullopt;
+
+  const auto path = entryPath(key);
+
+  std::error_code ec;
+  if (!std::filesystem::exists(path, ec))
+    return std::nullopt;
+
+  auto result = MappedFile::open(path);
+
+  // Modification time doubles as the last use time for LRU eviction
+  if (result.has_value())
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+
+  return result;
+}
+
+void SceneCache::store(std::uint64_t key, const BakedSceneView& scene) const
+{
+  if (!enabled)
+    return;
+
+  std::error_code ec;
+  std::filesystem::create_directories(directory, ec);
+  if (ec)
+  {
+    spdlog::warn("Scene cache: unable to create '{}': {}", directory, ec.message());
+    return;
+  }
+
+  // Write to a temporary file first, so that nobody ever sees a half-written entry
+  const auto path = entryPath(key);
+  auto tmpPath = path;
+  tmpPath += ".tmp";
+
+  if (!write_baked_scene(tmpPath, scene))
+  {
+    std::filesystem::remove(tmpPath, ec);
+    return;
+  }
+
+  std::filesystem::rename(tmpPath, path, ec);
+  if (ec)
+  {
+    spdlog::warn("Scene cache: unable to store '{}': {}", path, ec.message());
+    std::filesystem::remove(tmpPath, ec);
+    return;
+  }
+
+  evict(path);
+}
+
+std::filesystem::path SceneCache::entryPath(std::uint64_t key) const
+{
+  return directory / fmt::format("{:016x}.scene", key);
+}
+
+void SceneCache::evict(const std::filesystem::path& keep) const
+{
+  struct Entry
+  {
+    std::filesystem::path path;
+    std::uint64_t size;
+    std::filesystem::file_time_type lastUse;
+  };
+  std::vector<Entry> entries;
+  std::uint64_t totalSize = 0;
+
+  std::error_code ec;
+  for (std::filesystem::directory_iterator it(directory, ec), end; !ec && it != end;
+       it.increment(ec))
+  {
+    // Entries might be evicted by someone else while we're looking at them
+    std::error_code entryEc;
+    if (!it->is_regular_file(entryEc) || it->path().extension() != ".scene")
+      continue;
+    const auto size = it->file_size(entryEc);
+    const auto lastUse = it->last_write_time(entryEc);
+    if (entryEc)
+      continue;
+    entries.push_back(Entry{.path = it->path(), .size = size, .lastUse = lastUse});
+    totalSize += size;
+  }
+
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+    return a.lastUse < b.lastUse;
+  });
+
+  for (const auto& entry : entries)
+  {
+    if (totalSize <= maxSize)
+      break;
+    if (entry.path == keep)
+      continue;
+    if (std::filesystem::remove(entry.path, ec))
+    {
+      spdlog::info("Scene cache: evicted '{}'", entry.path);
+      totalSize -= entry.size;
+    }
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+
+#include "MappedFile.hpp"
+
+
+struct BakedSceneView;
+struct GltfReferences;
+
+/**
+ * On-disc cache of processed scenes, so that re-opening the same glTF
+ * during development doesn't re-parse and re-convert it every launch.
+ * Entries use the baked scene format and are named after a hash of the
+ * glTF file contents and all of its external buffers, so editing the
+ * source simply results in a miss, and the stale entry eventually gets
+ * evicted. The total size of the cache is bounded, least recently used
+ * entries are evicted first.
+ */
+class SceneCache
+{
+public:
+  struct CreateInfo
+  {
+    std::filesystem::path directory =
+      std::filesystem::temp_directory_path() / "graphics_course_scene_cache";
+    std::uint64_t maxSize = std::uint64_t{4} * 1024 * 1024 * 1024;
+    bool enabled = true;
+  };
+
+  explicit SceneCache(CreateInfo info);
+
+  // Hashes the glTF file contents and every buffer it references. Returns nullopt
+  // if the cache is disabled or some of the buffers couldn't be read.
+  std::optional<std::uint64_t> computeKey(
+    std::span<const std::byte> gltf_data, const GltfReferences& references) const;
+
+  // Returns the entry for `key` if there is one, and marks it as recently used
+  std::optional<MappedFile> find(std::uint64_t key) const;
+
+  // Writes an entry and evicts old ones if the cache got too big.
+  // Blocks on disc IO, so better call it from a background thread.
+  void store(std::uint64_t key, const BakedSceneView& scene) const;
+
+private:
+  std::filesystem::path entryPath(std::uint64_t key) const;
+  void evict(const std::filesystem::path& keep) const;
+
+private:
+  std::filesystem::path directory;
+  std::uint64_t maxSize;
+  bool enabled;
+};
@@ -1,399 +1,436 @@
 #include "SceneManager.hpp"
 
-#include <stack>
+#include "BakedScene.hpp"
+#include "GltfReferences.hpp"
+#include "MappedFile.hpp"
+
+#include <algorithm>
+#include <cstring>
 
 #include <spdlog/spdlog.h>
 #include <fmt/std.h>
-#include <glm/ext/matrix_transform.hpp>
-#include <glm/gtc/quaternion.hpp>
 #include <etna/GlobalContext.hpp>
-#include <etna/OneShotCmdMgr.hpp>
 
 
-SceneManager::SceneManager()
-  : oneShotCommands{etna::get_context().createOneShotCmdMgr()}
-  , transferHelper{etna::BlockingTransferHelper::CreateInfo{.stagingSize = 4096 * 4096 * 4}}
+// Positions are extracted from vertices in batches of this many,
+// so that big scenes never need a second copy of all of them
+constexpr std::size_t POSITION_BATCH_SIZE = 16 * 1024;
+
+SceneManager::SceneManager(CreateInfo info)
+  : uploader{info.upload}
+  , cache{std::move(info.cache)}
+  , textures{workers, uploader}
+  , positionStream{info.positionStream}
 {
+  setInstances({}, {}, {}, {}, {});
 }
 
-std::optional<tinygltf::Model> SceneManager::loadModel(std::filesystem::path path)
+SceneManager::~SceneManager()
 {
-  tinygltf::Model model;
-
-  std::string error;
-  std::string warning;
-  bool success = false;
-
-  auto ext = path.extension();
-  if (ext == ".gltf")
-    success = loader.LoadASCIIFromFile(&model, &error, &warning, path.string());
-  else if (ext == ".glb")
-    success = loader.LoadBinaryFromFile(&model, &error, &warning, path.string());
-  else
-  {
-    spdlog::error("glTF: Unknown glTF file extension: '{}'. Expected .gltf or .glb.", ext);
-    return std::nullopt;
-  }
+  if (pendingCacheWrite.valid())
+    pendingCacheWrite.wait();
+}
 
-  if (!success)
-  {
-    spdlog::error("glTF: Failed to load model!");
-    if (!error.empty())
-      spdlog::error("glTF: {}", error);
-    return std::nullopt;
-  }
+void SceneManager::allocateBuffers(std::size_t vertex_count, std::size_t index_bytes)
+{
+  unifiedVbuf = etna::get_context().createBuffer(etna::Buffer::CreateInfo{
+    .size = vertex_count * sizeof(Vertex),
+    .bufferUsage = vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eVertexBuffer,
+    .memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY,
+    .name = "unifiedVbuf",
+  });
 
-  if (!warning.empty())
-    spdlog::warn("glTF: {}", warning);
+  positionVbuf = {};
+  if (positionStream)
+    positionVbuf = etna::get_context().createBuffer(etna::Buffer::CreateInfo{
+      .size = vertex_count * sizeof(glm::vec3),
+      .bufferUsage =
+        vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eVertexBuffer,
+      .memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY,
+      .name = "positionVbuf",
+    });
 
-  if (
-    !model.extensions.empty() || !model.extensionsRequired.empty() || !model.extensionsUsed.empty())
-    spdlog::warn("glTF: No glTF extensions are currently implemented!");
+  unifiedIbuf = etna::get_context().createBuffer(etna::Buffer::CreateInfo{
+    .size = index_bytes,
+    .bufferUsage = vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eIndexBuffer,
+    .memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY,
+    .name = "unifiedIbuf",
+  });
 
-  return model;
+  const std::size_t positionBytes = positionStream ? vertex_count * sizeof(glm::vec3) : 0;
+  uploader.reserve(vertex_count * sizeof(Vertex) + positionBytes + index_bytes);
 }
 
-SceneManager::ProcessedInstances SceneManager::processInstances(const tinygltf::Model& model) const
+void SceneManager::uploadPositions(std::span<const Vertex> vertices, std::size_t first_vertex)
 {
-  std::vector nodeTransforms(model.nodes.size(), glm::identity<glm::mat4x4>());
+  if (!positionStream)
+    return;
 
-  for (std::size_t nodeIdx = 0; nodeIdx < model.nodes.size(); ++nodeIdx)
+  std::vector<glm::vec3> positions;
+  positions.reserve(std::min(vertices.size(), POSITION_BATCH_SIZE));
+  for (std::size_t first = 0; first < vertices.size(); first += POSITION_BATCH_SIZE)
   {
-    const auto& node = model.nodes[nodeIdx];
-    auto& transform = nodeTransforms[nodeIdx];
+    positions.clear();
+    for (const auto& vertex : vertices.subspan(first).first(
+           std::min(POSITION_BATCH_SIZE, vertices.size() - first)))
+      positions.emplace_back(vertex.positionAndNormal);
+
+    uploader.upload(
+      positionVbuf,
+      (first_vertex + first) * sizeof(glm::vec3),
+      std::as_bytes(std::span{positions}));
+  }
+}
 
-    if (!node.matrix.empty())
-    {
-      for (int i = 0; i < 4; ++i)
-        for (int j = 0; j < 4; ++j)
-          transform[i][j] = static_cast<float>(node.matrix[4 * i + j]);
-    }
-    else
-    {
-      if (!node.scale.empty())
-        transform = scale(
-          transform,
-          glm::vec3(
-            static_cast<float>(node.scale[0]),
-            static_cast<float>(node.scale[1]),
-            static_cast<float>(node.scale[2])));
-
-      if (!node.rotation.empty())
-        transform *= mat4_cast(glm::quat(
-          static_cast<float>(node.rotation[3]),
-          static_cast<float>(node.rotation[0]),
-          static_cast<float>(node.rotation[1]),
-          static_cast<float>(node.rotation[2])));
-
-      if (!node.translation.empty())
-        transform = translate(
-          transform,
-          glm::vec3(
-            static_cast<float>(node.translation[0]),
-            static_cast<float>(node.translation[1]),
-            static_cast<float>(node.translation[2])));
-    }
+void SceneManager::selectScene(std::filesystem::path path)
+{
+  // Only the JSON is parsed here, which is enough to find everything the scene references
+  std::optional<GltfReferences> references;
+  std::optional<std::uint64_t> cacheKey;
+  if (auto gltfFile = MappedFile::open(path); gltfFile.has_value())
+  {
+    references = read_gltf_references(path, gltfFile->data());
+    if (references.has_value())
+      cacheKey = cache.computeKey(gltfFile->data(), *references);
   }
 
-  std::stack<std::size_t> vertices;
-  for (auto vert : model.scenes[model.defaultScene].nodes)
-    vertices.push(vert);
+  // Images are decoded in the background while meshes are being loaded
+  textures.start(
+    references.has_value() ? std::move(references->images) : std::vector<ImageSource>{});
 
-  while (!vertices.empty())
+  if (cacheKey.has_value())
   {
-    auto vert = vertices.top();
-    vertices.pop();
-
-    for (auto child : model.nodes[vert].children)
+    if (auto cached = cache.find(*cacheKey); cached.has_value())
     {
-      nodeTransforms[child] = nodeTransforms[vert] * nodeTransforms[child];
-      vertices.push(child);
+      if (loadBakedScene(cached->data()))
+      {
+        spdlog::info("Loaded '{}' from the scene cache", path);
+        return;
+      }
+      spdlog::warn("Scene cache entry for '{}' is broken, processing the scene again", path);
     }
   }
 
-  ProcessedInstances result;
+  auto maybeModel = load_model(path);
+  if (!maybeModel.has_value())
+    return;
 
-  // Don't overallocate matrices, they are pretty chonky.
-  {
-    std::size_t totalNodesWithMeshes = 0;
-    for (std::size_t i = 0; i < model.nodes.size(); ++i)
-      if (model.nodes[i].mesh >= 0)
-        ++totalNodesWithMeshes;
-    result.matrices.reserve(totalNodesWithMeshes);
-    result.meshes.reserve(totalNodesWithMeshes);
-  }
+  auto model = std::move(*maybeModel);
 
-  for (std::size_t i = 0; i < model.nodes.size(); ++i)
-    if (model.nodes[i].mesh >= 0)
+  // By aggregating all SceneManager fields mutations here,
+  // we guarantee that we don't forget to clear something
+  // when re-loading a scene.
+
+  auto instances = process_instances(model, workers);
+  setInstances(
+    instances.nodeParents,
+    instances.nodeLocalTransforms,
+    instances.nodeSources,
+    instances.nodes,
+    instances.meshes);
+
+  // Every converted batch of vertices is sent off to the GPU right away, so copying
+  // it overlaps with converting the next one.
+  bool buffersAllocated = false;
+  std::size_t verticesUploaded = 0;
+  auto uploadReady = [this, &buffersAllocated, &verticesUploaded](
+                       const ProcessedMeshes& processed,
+                       std::size_t vertices_ready,
+                       std::size_t /*index_bytes_ready*/) {
+    if (!buffersAllocated)
     {
-      result.matrices.push_back(nodeTransforms[i]);
-      result.meshes.push_back(model.nodes[i].mesh);
+      allocateBuffers(processed.vertices.size(), processed.indices.size());
+      buffersAllocated = true;
     }
 
-  return result;
+    const auto vertices = std::span{processed.vertices}.subspan(
+      verticesUploaded, vertices_ready - verticesUploaded);
+    uploader.upload(unifiedVbuf, verticesUploaded * sizeof(Vertex), std::as_bytes(vertices));
+    uploadPositions(vertices, verticesUploaded);
+    verticesUploaded = vertices_ready;
+  };
+
+  auto processed = process_meshes(model, workers, uploadReady);
+
+  // NOTE: building meshlets reorders the triangles of every relem, so indices are only
+  // uploaded once that's done, otherwise meshlet index ranges wouldn't match the GPU copy.
+  // Indices are a fraction of the size of vertices, so little overlap is lost.
+  auto processedMeshlets = build_meshlets(processed, workers);
+  uploader.upload(unifiedIbuf, 0, processed.indices);
+
+  renderElements = processed.relems;
+  meshes = processed.meshes;
+  meshlets = processedMeshlets;
+  computeInstanceBounds();
+
+  // NOTE: renderers don't synchronize with the uploader, so we have to wait for it here.
+  // Staging memory is only needed while loading, so it's freed right away.
+  uploader.releaseStaging();
+
+  if (cacheKey.has_value())
+    storeInCache(
+      *cacheKey, std::move(instances), std::move(processed), std::move(processedMeshlets));
+}
+
+void SceneManager::storeInCache(
+  std::uint64_t key,
+  ProcessedInstances instances,
+  ProcessedMeshes meshes,
+  std::vector<Meshlet> meshlets)
+{
+  // Only one write at a time, there's no point in hammering the disc
+  if (pendingCacheWrite.valid())
+    pendingCacheWrite.wait();
+
+  auto write = [this,
+                key,
+                instances = std::move(instances),
+                meshes = std::move(meshes),
+                meshlets = std::move(meshlets)]() {
+    cache.store(
+      key,
+      BakedSceneView{
+        .nodeParents = instances.nodeParents,
+        .nodeLocalTransforms = instances.nodeLocalTransforms,
+        .nodeSources = instances.nodeSources,
+        .instanceNodes = instances.nodes,
+        .instanceMeshes = instances.meshes,
+        .meshes = meshes.meshes,
+        .relems = meshes.relems,
+        .vertices = meshes.vertices,
+        .indices = meshes.indices,
+        .meshlets = meshlets,
+      });
+  };
+  pendingCacheWrite = workers.async(std::move(write));
 }
 
-static std::uint32_t encode_normal(glm::vec3 normal)
+void SceneManager::selectBakedScene(std::filesystem::path path)
 {
-  const std::int32_t x = static_cast<std::int32_t>(normal.x * 32767.0f);
-  const std::int32_t y = static_cast<std::int32_t>(normal.y * 32767.0f);
+  // Baked scenes don't have any textures (yet)
+  textures.start({});
 
-  const std::uint32_t sign = normal.z >= 0 ? 0 : 1;
-  const std::uint32_t sx = static_cast<std::uint32_t>(x & 0xfffe) | sign;
-  const std::uint32_t sy = static_cast<std::uint32_t>(y & 0xffff) << 16;
+  auto maybeFile = MappedFile::open(path);
+  if (!maybeFile.has_value())
+    return;
 
-  return sx | sy;
+  if (!loadBakedScene(maybeFile->data()))
+    spdlog::error("Failed to load baked scene '{}'!", path);
 }
 
-SceneManager::ProcessedMeshes SceneManager::processMeshes(const tinygltf::Model& model) const
+bool SceneManager::loadBakedScene(std::span<const std::byte> data)
 {
-  // NOTE: glTF assets can have pretty wonky data layouts which are not appropriate
-  // for real-time rendering, so we have to press the data first. In serious engines
-  // this is mitigated by storing assets on the disc in an engine-specific format that
-  // is appropriate for GPU upload right after reading from disc.
-
-  ProcessedMeshes result;
+  auto maybeScene = parse_baked_scene(data);
+  if (!maybeScene.has_value())
+    return false;
+
+  const auto& scene = *maybeScene;
+
+  // These tables are tiny, but the mapping dies at the end of this function,
+  // so we have to copy them.
+  setInstances(
+    scene.nodeParents,
+    scene.nodeLocalTransforms,
+    scene.nodeSources,
+    scene.instanceNodes,
+    scene.instanceMeshes);
+  renderElements.assign(scene.relems.begin(), scene.relems.end());
+  meshes.assign(scene.meshes.begin(), scene.meshes.end());
+  meshlets.assign(scene.meshlets.begin(), scene.meshlets.end());
+  computeInstanceBounds();
+
+  // Vertex and index data on the other hand goes from the page cache to the staging
+  // ring directly. Copying a chunk overlaps with paging in the next one.
+  allocateBuffers(scene.vertices.size(), scene.indices.size());
+  uploader.upload(unifiedVbuf, 0, std::as_bytes(scene.vertices));
+  uploadPositions(scene.vertices, 0);
+  uploader.upload(unifiedIbuf, 0, scene.indices);
+  uploader.releaseStaging();
+
+  return true;
+}
 
-  // Pre-allocate enough memory so as not to hit the
-  // allocator on the memcpy hotpath
+void SceneManager::setInstances(
+  std::span<const std::uint32_t> node_parents,
+  std::span<const glm::mat4x4> node_local_transforms,
+  std::span<const std::uint32_t> node_sources,
+  std::span<const std::uint32_t> instance_nodes,
+  std::span<const std::uint32_t> instance_meshes)
+{
+  transforms = TransformHierarchy(
+    {node_parents.begin(), node_parents.end()},
+    {node_local_transforms.begin(), node_local_transforms.end()});
+  nodeSources.assign(node_sources.begin(), node_sources.end());
+  instanceNodes.assign(instance_nodes.begin(), instance_nodes.end());
+  instanceMeshes.assign(instance_meshes.begin(), instance_meshes.end());
+
+  // Instances are sorted by node, so this is a simple prefix sum
+  nodeFirstInstance.assign(transforms.size() + 1, 0);
+  for (const auto node : instanceNodes)
+    ++nodeFirstInstance[node + 1];
+  for (std::size_t i = 1; i < nodeFirstInstance.size(); ++i)
+    nodeFirstInstance[i] += nodeFirstInstance[i - 1];
+
+  instanceMatrices.resize(instanceNodes.size());
+  const auto worlds = transforms.getWorlds();
+  for (std::size_t i = 0; i < instanceNodes.size(); ++i)
+    instanceMatrices[i] = worlds[instanceNodes[i]];
+
+  // On the GPU, instances are grouped by mesh (a counting sort), so that every relem
+  // is drawn once for all of its instances. Within a mesh they stay in node order.
+  meshInstances.assign(
+    instanceMeshes.empty() ? 0 : std::ranges::max(instanceMeshes) + 1,
+    MeshInstances{.firstInstance = 0, .instanceCount = 0});
+  for (const auto mesh : instanceMeshes)
+    ++meshInstances[mesh].instanceCount;
+  for (std::size_t i = 1; i < meshInstances.size(); ++i)
+    meshInstances[i].firstInstance =
+      meshInstances[i - 1].firstInstance + meshInstances[i - 1].instanceCount;
+
+  instanceSlots.resize(instanceMeshes.size());
+  std::vector<std::uint32_t> placed(meshInstances.size(), 0);
+  for (std::size_t i = 0; i < instanceMeshes.size(); ++i)
   {
-    std::size_t vertexBytes = 0;
-    std::size_t indexBytes = 0;
-    for (const auto& bufView : model.bufferViews)
-    {
-      switch (bufView.target)
-      {
-      case TINYGLTF_TARGET_ARRAY_BUFFER:
-        vertexBytes += bufView.byteLength;
-        break;
-      case TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER:
-        indexBytes += bufView.byteLength;
-        break;
-      default:
-        break;
-      }
-    }
-    result.vertices.reserve(vertexBytes / sizeof(Vertex));
-    result.indices.reserve(indexBytes / sizeof(std::uint32_t));
+    const auto mesh = instanceMeshes[i];
+    instanceSlots[i] = meshInstances[mesh].firstInstance + placed[mesh]++;
   }
 
+  // NOTE: animated instances change every frame, so instances live in host-visible
+  // memory and are written in place instead of going through the staging ring.
+  // Every frame in flight gets its own copy, so that moving an instance never touches
+  // memory the GPU is still reading. Renderers bind these buffers unconditionally,
+  // so even an empty scene gets them.
+  const auto copyCount = etna::get_context().getMainWorkCount().multiBufferingCount();
+  instanceBufs.clear();
+  instanceBufs.reserve(copyCount);
+  for (std::size_t i = 0; i < copyCount; ++i)
   {
-    std::size_t totalPrimitives = 0;
-    for (const auto& mesh : model.meshes)
-      totalPrimitives += mesh.primitives.size();
-    result.relems.reserve(totalPrimitives);
+    instanceBufs.push_back(etna::get_context().createBuffer(etna::Buffer::CreateInfo{
+      .size = std::max<std::size_t>(instanceMatrices.size(), 1) * sizeof(GpuInstance),
+      .bufferUsage = vk::BufferUsageFlagBits::eStorageBuffer,
+      .memoryUsage = VMA_MEMORY_USAGE_CPU_TO_GPU,
+      .name = "instances",
+    }));
+    instanceBufs.back().map();
   }
+  pendingInstanceSlots.assign(copyCount, {});
+  instanceStaleCopies.assign(instanceMatrices.size(), 0);
+  packedInstances.resize(instanceMatrices.size());
+  instanceFlags.assign(instanceMatrices.size(), 0);
+  dynamicInstanceCount = 0;
+  movedBounds.clear();
+  for (std::size_t i = 0; i < instanceMatrices.size(); ++i)
+    writeInstance(i);
+  for (std::size_t i = 0; i < instanceBufs.size(); ++i)
+    flushInstances(i);
+
+  ++instanceVersion;
+  ++staticInstanceVersion;
+}
 
-  result.meshes.reserve(model.meshes.size());
+void SceneManager::writeInstance(std::size_t instance)
+{
+  const auto slot = instanceSlots[instance];
+  auto& flags = instanceFlags[slot];
+  GpuInstance packed = pack_gpu_instance(instanceMatrices[instance]);
+  packed.flags |= flags & GPU_INSTANCE_DYNAMIC;
+  flags = packed.flags;
+  packedInstances[slot] = packed;
+
+  // Every copy has to catch up, but a slot is queued at most once per copy
+  auto& stale = instanceStaleCopies[slot];
+  for (std::size_t i = 0; i < pendingInstanceSlots.size(); ++i)
+    if ((stale & (1u << i)) == 0)
+      pendingInstanceSlots[i].push_back(slot);
+  stale = (1u << pendingInstanceSlots.size()) - 1;
+}
 
-  for (const auto& mesh : model.meshes)
+void SceneManager::flushInstances(std::size_t copy)
+{
+  auto& pending = pendingInstanceSlots[copy];
+  auto& buffer = instanceBufs[copy];
+  for (const auto slot : pending)
   {
-    result.meshes.push_back(Mesh{
-      .firstRelem = static_cast<std::uint32_t>(result.relems.size()),
-      .relemCount = static_cast<std::uint32_t>(mesh.primitives.size()),
-    });
-
-    for (const auto& prim : mesh.primitives)
-    {
-      if (prim.mode != TINYGLTF_MODE_TRIANGLES)
-      {
-        spdlog::warn(
-          "Encountered a non-triangles primitive, these are not supported for now, skipping it!");
-        --result.meshes.back().relemCount;
-        continue;
-      }
-
-      const auto normalIt = prim.attributes.find("NORMAL");
-      const auto tangentIt = prim.attributes.find("TANGENT");
-      const auto texcoordIt = prim.attributes.find("TEXCOORD_0");
-
-      const bool hasNormals = normalIt != prim.attributes.end();
-      const bool hasTangents = tangentIt != prim.attributes.end();
-      const bool hasTexcoord = texcoordIt != prim.attributes.end();
-      std::array accessorIndices{
-        prim.indices,
-        prim.attributes.at("POSITION"),
-        hasNormals ? normalIt->second : -1,
-        hasTangents ? tangentIt->second : -1,
-        hasTexcoord ? texcoordIt->second : -1,
-      };
-
-      std::array accessors{
-        &model.accessors[prim.indices],
-        &model.accessors[accessorIndices[1]],
-        hasNormals ? &model.accessors[accessorIndices[2]] : nullptr,
-        hasTangents ? &model.accessors[accessorIndices[3]] : nullptr,
-        hasTexcoord ? &model.accessors[accessorIndices[4]] : nullptr,
-      };
-
-      std::array bufViews{
-        &model.bufferViews[accessors[0]->bufferView],
-        &model.bufferViews[accessors[1]->bufferView],
-        hasNormals ? &model.bufferViews[accessors[2]->bufferView] : nullptr,
-        hasTangents ? &model.bufferViews[accessors[3]->bufferView] : nullptr,
-        hasTexcoord ? &model.bufferViews[accessors[4]->bufferView] : nullptr,
-      };
-
-      result.relems.push_back(RenderElement{
-        .vertexOffset = static_cast<std::uint32_t>(result.vertices.size()),
-        .indexOffset = static_cast<std::uint32_t>(result.indices.size()),
-        .indexCount = static_cast<std::uint32_t>(accessors[0]->count),
-      });
-
-      const std::size_t vertexCount = accessors[1]->count;
-
-      std::array ptrs{
-        reinterpret_cast<const std::byte*>(model.buffers[bufViews[0]->buffer].data.data()) +
-          bufViews[0]->byteOffset + accessors[0]->byteOffset,
-        reinterpret_cast<const std::byte*>(model.buffers[bufViews[1]->buffer].data.data()) +
-          bufViews[1]->byteOffset + accessors[1]->byteOffset,
-        hasNormals
-          ? reinterpret_cast<const std::byte*>(model.buffers[bufViews[2]->buffer].data.data()) +
-            bufViews[2]->byteOffset + accessors[2]->byteOffset
-          : nullptr,
-        hasTangents
-          ? reinterpret_cast<const std::byte*>(model.buffers[bufViews[3]->buffer].data.data()) +
-            bufViews[3]->byteOffset + accessors[3]->byteOffset
-          : nullptr,
-        hasTexcoord
-          ? reinterpret_cast<const std::byte*>(model.buffers[bufViews[4]->buffer].data.data()) +
-            bufViews[4]->byteOffset + accessors[4]->byteOffset
-          : nullptr,
-      };
-
-      std::array strides{
-        bufViews[0]->byteStride != 0
-          ? bufViews[0]->byteStride
-          : tinygltf::GetComponentSizeInBytes(accessors[0]->componentType) *
-            tinygltf::GetNumComponentsInType(accessors[0]->type),
-        bufViews[1]->byteStride != 0
-          ? bufViews[1]->byteStride
-          : tinygltf::GetComponentSizeInBytes(accessors[1]->componentType) *
-            tinygltf::GetNumComponentsInType(accessors[1]->type),
-        hasNormals ? (bufViews[2]->byteStride != 0
-                        ? bufViews[2]->byteStride
-                        : tinygltf::GetComponentSizeInBytes(accessors[2]->componentType) *
-                          tinygltf::GetNumComponentsInType(accessors[2]->type))
-                   : 0,
-        hasTangents ? (bufViews[3]->byteStride != 0
-                         ? bufViews[3]->byteStride
-                         : tinygltf::GetComponentSizeInBytes(accessors[3]->componentType) *
-                           tinygltf::GetNumComponentsInType(accessors[3]->type))
-                    : 0,
-        hasTexcoord ? (bufViews[4]->byteStride != 0
-                         ? bufViews[4]->byteStride
-                         : tinygltf::GetComponentSizeInBytes(accessors[4]->componentType) *
-                           tinygltf::GetNumComponentsInType(accessors[4]->type))
-                    : 0,
-      };
-
-      for (std::size_t i = 0; i < vertexCount; ++i)
-      {
-        auto& vtx = result.vertices.emplace_back();
-        glm::vec3 pos;
-        // Fall back to 0 in case we don't have something.
-        // NOTE: if tangents are not available, one could use http://mikktspace.com/
-        // NOTE: if normals are not available, reconstructing them is possible but will look ugly
-        glm::vec3 normal{0};
-        glm::vec3 tangent{0};
-        glm::vec2 texcoord{0};
-        std::memcpy(&pos, ptrs[1], sizeof(pos));
-
-        // NOTE: it's faster to do a template here with specializations for all combinations than to
-        // do ifs at runtime. Also, SIMD should be used. Try implementing this!
-        if (hasNormals)
-          std::memcpy(&normal, ptrs[2], sizeof(normal));
-        if (hasTangents)
-          std::memcpy(&tangent, ptrs[3], sizeof(tangent));
-        if (hasTexcoord)
-          std::memcpy(&texcoord, ptrs[4], sizeof(texcoord));
-
-
-        vtx.positionAndNormal = glm::vec4(pos, std::bit_cast<float>(encode_normal(normal)));
-        vtx.texCoordAndTangentAndPadding =
-          glm::vec4(texcoord, std::bit_cast<float>(encode_normal(tangent)), 0);
-
-        ptrs[1] += strides[1];
-        if (hasNormals)
-          ptrs[2] += strides[2];
-        if (hasTangents)
-          ptrs[3] += strides[3];
-        if (hasTexcoord)
-          ptrs[4] += strides[4];
-      }
-
-      // Indices are guaranteed to have no stride
-      ETNA_VERIFY(bufViews[0]->byteStride == 0);
-      const std::size_t indexCount = accessors[0]->count;
-      if (accessors[0]->componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT)
-      {
-        for (std::size_t i = 0; i < indexCount; ++i)
-        {
-          std::uint16_t index;
-          std::memcpy(&index, ptrs[0], sizeof(index));
-          result.indices.push_back(index);
-          ptrs[0] += 2;
-        }
-      }
-      else if (accessors[0]->componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT)
-      {
-        const std::size_t lastTotalIndices = result.indices.size();
-        result.indices.resize(lastTotalIndices + indexCount);
-        std::memcpy(
-          result.indices.data() + lastTotalIndices,
-          ptrs[0],
-          sizeof(result.indices[0]) * indexCount);
-      }
-    }
+    std::memcpy(
+      buffer.data() + slot * sizeof(GpuInstance), &packedInstances[slot], sizeof(GpuInstance));
+    instanceStaleCopies[slot] &= ~(1u << copy);
   }
-
-  return result;
+  pending.clear();
 }
 
-void SceneManager::uploadData(
-  std::span<const Vertex> vertices, std::span<const std::uint32_t> indices)
+const etna::Buffer& SceneManager::getInstanceBuffer()
 {
-  unifiedVbuf = etna::get_context().createBuffer(etna::Buffer::CreateInfo{
-    .size = vertices.size_bytes(),
-    .bufferUsage = vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eVertexBuffer,
-    .memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY,
-    .name = "unifiedVbuf",
-  });
-
-  unifiedIbuf = etna::get_context().createBuffer(etna::Buffer::CreateInfo{
-    .size = indices.size_bytes(),
-    .bufferUsage = vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eIndexBuffer,
-    .memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY,
-    .name = "unifiedIbuf",
-  });
-
-  transferHelper.uploadBuffer<Vertex>(*oneShotCommands, unifiedVbuf, 0, vertices);
-  transferHelper.uploadBuffer<std::uint32_t>(*oneShotCommands, unifiedIbuf, 0, indices);
+  // NOTE: by the time a frame is recorded, the GPU is done with the frame that last
+  // used this copy, so only now is it safe to bring it up to date.
+  const auto copy = etna::get_context().getMainWorkCount().batchIndex() % instanceBufs.size();
+  flushInstances(copy);
+  return instanceBufs[copy];
 }
 
-void SceneManager::selectScene(std::filesystem::path path)
+void SceneManager::computeInstanceBounds()
 {
-  auto maybeModel = loadModel(path);
-  if (!maybeModel.has_value())
-    return;
+  // NOTE: mesh bounds are only known once meshes are processed, which is after instances
+  instanceBounds.reset(instanceMatrices.size());
+  instanceScales.assign(instanceMatrices.size(), 1.0f);
+  for (std::size_t i = 0; i < instanceMatrices.size(); ++i)
+    updateInstanceBounds(i);
+}
 
-  auto model = std::move(*maybeModel);
+void SceneManager::updateInstanceBounds(std::size_t instance)
+{
+  const auto& matrix = instanceMatrices[instance];
+  const auto slot = instanceSlots[instance];
+  instanceBounds.set(slot, transform_bounds(meshes[instanceMeshes[instance]].bounds, matrix));
+  instanceScales[slot] = max_scale(matrix);
+}
 
-  // By aggregating all SceneManager fields mutations here,
-  // we guarantee that we don't forget to clear something
-  // when re-loading a scene.
+std::optional<std::uint32_t> SceneManager::findNode(std::uint32_t gltf_node) const
+{
+  const auto it = std::ranges::find(nodeSources, gltf_node);
+  if (it == nodeSources.end())
+    return std::nullopt;
+  return static_cast<std::uint32_t>(it - nodeSources.begin());
+}
 
-  // NOTE: you might want to store these on the GPU for GPU-driven rendering.
-  auto [instMats, instMeshes] = processInstances(model);
-  instanceMatrices = std::move(instMats);
-  instanceMeshes = std::move(instMeshes);
+void SceneManager::setNodeTransform(std::uint32_t node, const glm::mat4x4& local)
+{
+  transforms.setLocal(node, local);
+}
 
-  auto [verts, inds, relems, meshs] = processMeshes(model);
+void SceneManager::updateTransforms()
+{
+  movedBounds.clear();
+  const auto worlds = transforms.getWorlds();
+  transforms.update([this, worlds](std::uint32_t first_node, std::uint32_t end_node) {
+    const std::uint32_t first = nodeFirstInstance[first_node];
+    const std::uint32_t end = nodeFirstInstance[end_node];
+    if (first == end)
+      return;
+
+    for (std::uint32_t i = first; i < end; ++i)
+    {
+      auto& flags = instanceFlags[instanceSlots[i]];
+      if ((flags & GPU_INSTANCE_DYNAMIC) == 0)
+      {
+        flags |= GPU_INSTANCE_DYNAMIC;
+        ++dynamicInstanceCount;
+        ++staticInstanceVersion;
+      }
 
-  renderElements = std::move(relems);
-  meshes = std::move(meshs);
+      instanceMatrices[i] = worlds[instanceNodes[i]];
+      writeInstance(i);
+      movedBounds.push_back(instanceBounds.get(instanceSlots[i]));
+      updateInstanceBounds(i);
+      movedBounds.push_back(instanceBounds.get(instanceSlots[i]));
+    }
+    ++instanceVersion;
+  });
+}
 
-  uploadData(verts, inds);
+void SceneManager::update()
+{
+  updateTransforms();
+  textures.update();
 }
 
 etna::VertexByteStreamFormatDescription SceneManager::getVertexFormatDescription()
@@ -411,3 +448,15 @@ etna::VertexByteStreamFormatDescription SceneManager::getVertexFormatDescription
       },
     }};
 }
+
+etna::VertexByteStreamFormatDescription SceneManager::getPositionFormatDescription()
+{
+  return etna::VertexByteStreamFormatDescription{
+    .stride = sizeof(glm::vec3),
+    .attributes = {
+      etna::VertexByteStreamFormatDescription::Attribute{
+        .format = vk::Format::eR32G32B32Sfloat,
+        .offset = 0,
+      },
+    }};
+}
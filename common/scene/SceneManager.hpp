@@ -1,98 +1,196 @@
 #pragma once
 
 #include <filesystem>
+#include <future>
+#include <optional>
 
 #include <glm/glm.hpp>
-#include <tiny_gltf.h>
 #include <etna/Buffer.hpp>
-#include <etna/BlockingTransferHelper.hpp>
 #include <etna/VertexInput.hpp>
 
+#include "jobs/ThreadPool.hpp"
+#include "FrustumCulling.hpp"
+#include "GpuInstance.hpp"
+#include "Meshlets.hpp"
+#include "SceneCache.hpp"
+#include "SceneProcessing.hpp"
+#include "StreamingUploader.hpp"
+#include "TextureStreamer.hpp"
+#include "TransformHierarchy.hpp"
 
-// A single render element (relem) corresponds to a single draw call
-// of a certain pipeline with specific bindings (including material data)
-struct RenderElement
+
+inline vk::IndexType to_vk_index_type(IndexType type)
 {
-  std::uint32_t vertexOffset;
-  std::uint32_t indexOffset;
-  std::uint32_t indexCount;
-  // Not implemented!
-  // Material* material;
-};
+  return type == IndexType::Uint16 ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+}
 
-// A mesh is a collection of relems. A scene may have the same mesh
-// located in several different places, so a scene consists of **instances**,
-// not meshes.
-struct Mesh
+// Instances of a mesh are stored consecutively in the GPU instance buffer
+struct MeshInstances
 {
-  std::uint32_t firstRelem;
-  std::uint32_t relemCount;
+  std::uint32_t firstInstance;
+  std::uint32_t instanceCount;
 };
 
 class SceneManager
 {
 public:
-  SceneManager();
+  struct CreateInfo
+  {
+    StreamingUploader::CreateInfo upload = {};
+    SceneCache::CreateInfo cache = {};
+    // Also upload a tightly packed copy of vertex positions, see getPositionBuffer
+    bool positionStream = false;
+  };
 
+  explicit SceneManager(CreateInfo info);
+  ~SceneManager();
+
+  // Processed scenes are cached on the disc, see SceneCache.hpp. On a cache hit,
+  // loading the glTF and processing it is skipped entirely.
   void selectScene(std::filesystem::path path);
 
+  // Loads a scene produced by the baker, see BakedScene.hpp. Vertex and index data
+  // goes from the memory-mapped file straight into staging memory, no re-encoding.
+  void selectBakedScene(std::filesystem::path path);
+
+  // Applies node transform changes and uploads the next portion of textures,
+  // which are streamed in over several frames after a scene is selected.
+  // Call it once per frame.
+  void update();
+
   // Every instance is a mesh drawn with a certain transform
   // NOTE: maybe you can pass some additional data through unused matrix entries?
   std::span<const glm::mat4x4> getInstanceMatrices() { return instanceMatrices; }
   std::span<const std::uint32_t> getInstanceMeshes() { return instanceMeshes; }
 
+  // Same matrices as getInstanceMatrices, but on the GPU, packed into GpuInstance records
+  // and grouped by mesh, so that all instances of a relem can be drawn with a single
+  // instanced draw. Persistently mapped, only moved instances are re-written.
+  // There is a copy per frame in flight, this returns the current frame's one.
+  const etna::Buffer& getInstanceBuffer();
+
+  // Indexed by mesh, ranges of the instance buffer. Meshes without
+  // instances might be missing at the end.
+  std::span<const MeshInstances> getMeshInstances() { return meshInstances; }
+
+  // World space bounds of instances, indexed the same way as the instance buffer
+  const BoundingBoxes& getInstanceBounds() { return instanceBounds; }
+
+  // Indexed the same way, how much every instance's transform scales the mesh at most
+  std::span<const float> getInstanceScales() { return instanceScales; }
+
+  // Indexed the same way, GpuInstance::flags of every instance
+  std::span<const std::uint32_t> getInstanceFlags() { return instanceFlags; }
+
+  // Changes every time any instance moves or a scene is selected, so that renderers
+  // can tell whether something they have drawn with the instances is still up to date.
+  std::uint64_t getInstanceVersion() const { return instanceVersion; }
+
+  // Same, but only for instances without GPU_INSTANCE_DYNAMIC. Those never move, so this
+  // only changes when a scene is selected or an instance moves for the first time.
+  std::uint64_t getStaticInstanceVersion() const { return staticInstanceVersion; }
+
+  // How many instances have GPU_INSTANCE_DYNAMIC
+  std::uint32_t getDynamicInstanceCount() const { return dynamicInstanceCount; }
+
+  // World space bounds of every instance the last update has moved, both where it was and
+  // where it is now, so that renderers can tell which of the things they have drawn moved.
+  // Selecting a scene doesn't show up here, everything is different after that anyway.
+  std::span<const BoundingBox> getMovedBounds() const { return movedBounds; }
+
+  // Instances are attached to nodes of the scene's transform hierarchy. Nodes
+  // are addressed by their hierarchy index, use findNode to look up glTF nodes.
+  const TransformHierarchy& getTransforms() { return transforms; }
+  std::optional<std::uint32_t> findNode(std::uint32_t gltf_node) const;
+
+  // Moves a node along with everything attached to it, takes effect on the next update
+  void setNodeTransform(std::uint32_t node, const glm::mat4x4& local);
+
   // Every mesh is a collection of relems
   std::span<const Mesh> getMeshes() { return meshes; }
 
   // Every relem is a single draw call
   std::span<const RenderElement> getRenderElements() { return renderElements; }
 
+  // Meshlets cover all triangles of all relems, see Meshlets.hpp. Baked scenes might have
+  // been baked without them, then this is empty.
+  std::span<const Meshlet> getMeshlets() { return meshlets; }
+
+  // Indexed the same way as glTF images. These are not resident right away, see TextureStreamer.
+  std::span<const TextureStreamer::Texture> getTextures() { return textures.getTextures(); }
+
   vk::Buffer getVertexBuffer() { return unifiedVbuf.get(); }
   vk::Buffer getIndexBuffer() { return unifiedIbuf.get(); }
 
   etna::VertexByteStreamFormatDescription getVertexFormatDescription();
 
-private:
-  std::optional<tinygltf::Model> loadModel(std::filesystem::path path);
-
-  struct ProcessedInstances
-  {
-    std::vector<glm::mat4x4> matrices;
-    std::vector<std::uint32_t> meshes;
-  };
+  // Positions of the same vertices as in the vertex buffer and nothing else, 12 bytes per
+  // vertex instead of 32, for passes that only write depth. Indices and vertex offsets of
+  // relems and meshlets work with both. Null unless CreateInfo::positionStream is set.
+  vk::Buffer getPositionBuffer() { return positionVbuf.get(); }
 
-  ProcessedInstances processInstances(const tinygltf::Model& model) const;
+  etna::VertexByteStreamFormatDescription getPositionFormatDescription();
 
-  struct Vertex
-  {
-    // First 3 floats are position, 4th float is a packed normal
-    glm::vec4 positionAndNormal;
-    // First 2 floats are tex coords, 3rd is a packed tangent, 4th is padding
-    glm::vec4 texCoordAndTangentAndPadding;
-  };
-
-  static_assert(sizeof(Vertex) == sizeof(float) * 8);
-
-  struct ProcessedMeshes
-  {
-    std::vector<Vertex> vertices;
-    std::vector<std::uint32_t> indices;
-    std::vector<RenderElement> relems;
-    std::vector<Mesh> meshes;
-  };
-  ProcessedMeshes processMeshes(const tinygltf::Model& model) const;
-  void uploadData(std::span<const Vertex> vertices, std::span<const std::uint32_t>);
+private:
+  bool loadBakedScene(std::span<const std::byte> data);
+  void setInstances(
+    std::span<const std::uint32_t> node_parents,
+    std::span<const glm::mat4x4> node_local_transforms,
+    std::span<const std::uint32_t> node_sources,
+    std::span<const std::uint32_t> instance_nodes,
+    std::span<const std::uint32_t> instance_meshes);
+  void updateTransforms();
+  void writeInstance(std::size_t instance);
+  void flushInstances(std::size_t copy);
+  void computeInstanceBounds();
+  void updateInstanceBounds(std::size_t instance);
+  void allocateBuffers(std::size_t vertex_count, std::size_t index_bytes);
+  void uploadPositions(std::span<const Vertex> vertices, std::size_t first_vertex);
+  void storeInCache(
+    std::uint64_t key,
+    ProcessedInstances instances,
+    ProcessedMeshes meshes,
+    std::vector<Meshlet> meshlets);
 
 private:
-  tinygltf::TinyGLTF loader;
-  std::unique_ptr<etna::OneShotCmdMgr> oneShotCommands;
-  etna::BlockingTransferHelper transferHelper;
+  ThreadPool workers;
+  StreamingUploader uploader;
+  SceneCache cache;
+  std::future<void> pendingCacheWrite;
+  TextureStreamer textures;
 
   std::vector<RenderElement> renderElements;
   std::vector<Mesh> meshes;
+  std::vector<Meshlet> meshlets;
   std::vector<glm::mat4x4> instanceMatrices;
   std::vector<std::uint32_t> instanceMeshes;
 
+  TransformHierarchy transforms;
+  std::vector<std::uint32_t> nodeSources;
+  std::vector<std::uint32_t> instanceNodes;
+  // Instances of nodes [a, b) are [nodeFirstInstance[a], nodeFirstInstance[b])
+  std::vector<std::uint32_t> nodeFirstInstance;
+  // Where every instance lives in the instance buffers
+  std::vector<std::uint32_t> instanceSlots;
+  std::vector<MeshInstances> meshInstances;
+  // Indexed by slot, what every copy of the instance buffer should eventually hold
+  std::vector<GpuInstance> packedInstances;
+  // One per frame in flight
+  std::vector<etna::Buffer> instanceBufs;
+  // Per copy, slots written since that copy was last brought up to date
+  std::vector<std::vector<std::uint32_t>> pendingInstanceSlots;
+  // Per slot, a bit mask of copies that are out of date
+  std::vector<std::uint32_t> instanceStaleCopies;
+  BoundingBoxes instanceBounds;
+  std::vector<float> instanceScales;
+  std::vector<std::uint32_t> instanceFlags;
+  std::uint64_t instanceVersion = 0;
+  std::uint64_t staticInstanceVersion = 0;
+  std::uint32_t dynamicInstanceCount = 0;
+  std::vector<BoundingBox> movedBounds;
+
+  bool positionStream;
   etna::Buffer unifiedVbuf;
+  etna::Buffer positionVbuf;
   etna::Buffer unifiedIbuf;
 };
@@ -0,0 +1,496 @@
+#include "SceneProcessing.hpp"
+
+#include "VertexConversion.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stack>
+#include <tuple>
+#include <type_traits>
+
+#include <spdlog/spdlog.h>
+#include <fmt/std.h>
+#include <glm/ext/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "TransformHierarchy.hpp"
+
+
+std::optional<tinygltf::Model> load_model(const std::filesystem::path& path)
+{
+  tinygltf::TinyGLTF loader;
+  tinygltf::Model model;
+
+  // NOTE: images are decoded lazily by the TextureStreamer, tinygltf only has to
+  // record them. External image files are not even opened, see thirdparty.cmake.
+  loader.SetImageLoader(
+    [](
+      tinygltf::Image*,
+      const int,
+      std::string*,
+      std::string*,
+      int,
+      int,
+      const unsigned char*,
+      int,
+      void*) { return true; },
+    nullptr);
+
+  std::string error;
+  std::string warning;
+  bool success = false;
+
+  auto ext = path.extension();
+  if (ext == ".gltf")
+    success = loader.LoadASCIIFromFile(&model, &error, &warning, path.string());
+  else if (ext == ".glb")
+    success = loader.LoadBinaryFromFile(&model, &error, &warning, path.string());
+  else
+  {
+    spdlog::error("glTF: Unknown glTF file extension: '{}'. Expected .gltf or .glb.", ext);
+    return std::nullopt;
+  }
+
+  if (!success)
+  {
+    spdlog::error("glTF: Failed to load model!");
+    if (!error.empty())
+      spdlog::error("glTF: {}", error);
+    return std::nullopt;
+  }
+
+  if (!warning.empty())
+    spdlog::warn("glTF: {}", warning);
+
+  if (
+    !model.extensions.empty() || !model.extensionsRequired.empty() || !model.extensionsUsed.empty())
+    spdlog::warn("glTF: No glTF extensions are currently implemented!");
+
+  return model;
+}
+
+ProcessedInstances process_instances(const tinygltf::Model& model, ThreadPool& pool)
+{
+  std::vector localTransforms(model.nodes.size(), glm::identity<glm::mat4x4>());
+
+  // Local transforms are independent, so they are computed in parallel
+  pool.parallelFor(model.nodes.size(), 256, [&model, &localTransforms](std::size_t nodeIdx) {
+    const auto& node = model.nodes[nodeIdx];
+    auto& transform = localTransforms[nodeIdx];
+
+    if (!node.matrix.empty())
+    {
+      for (int i = 0; i < 4; ++i)
+        for (int j = 0; j < 4; ++j)
+          transform[i][j] = static_cast<float>(node.matrix[4 * i + j]);
+    }
+    else
+    {
+      if (!node.scale.empty())
+        transform = scale(
+          transform,
+          glm::vec3(
+            static_cast<float>(node.scale[0]),
+            static_cast<float>(node.scale[1]),
+            static_cast<float>(node.scale[2])));
+
+      if (!node.rotation.empty())
+        transform *= mat4_cast(glm::quat(
+          static_cast<float>(node.rotation[3]),
+          static_cast<float>(node.rotation[0]),
+          static_cast<float>(node.rotation[1]),
+          static_cast<float>(node.rotation[2])));
+
+      if (!node.translation.empty())
+        transform = translate(
+          transform,
+          glm::vec3(
+            static_cast<float>(node.translation[0]),
+            static_cast<float>(node.translation[1]),
+            static_cast<float>(node.translation[2])));
+    }
+  });
+
+  ProcessedInstances result;
+  if (model.scenes.empty())
+    return result;
+
+  result.nodeParents.reserve(model.nodes.size());
+  result.nodeLocalTransforms.reserve(model.nodes.size());
+  result.nodeSources.reserve(model.nodes.size());
+
+  // Flatten the hierarchy. Children are pushed onto the stack right after their parent
+  // is popped, so a whole subtree is done before we get to the parent's next sibling.
+  struct Visit
+  {
+    int node;
+    std::uint32_t parent;
+  };
+  std::stack<Visit> stack;
+  const auto& scene = model.scenes[std::max(model.defaultScene, 0)];
+  for (auto it = scene.nodes.rbegin(); it != scene.nodes.rend(); ++it)
+    stack.push(Visit{.node = *it, .parent = TransformHierarchy::NO_PARENT});
+
+  std::vector<bool> visited(model.nodes.size(), false);
+  while (!stack.empty())
+  {
+    const auto [nodeIdx, parent] = stack.top();
+    stack.pop();
+
+    if (nodeIdx < 0 || static_cast<std::size_t>(nodeIdx) >= model.nodes.size() || visited[nodeIdx])
+    {
+      spdlog::warn("glTF: node {} is referenced twice or doesn't exist, skipping it!", nodeIdx);
+      continue;
+    }
+    visited[nodeIdx] = true;
+
+    const auto flatIdx = static_cast<std::uint32_t>(result.nodeParents.size());
+    result.nodeParents.push_back(parent);
+    result.nodeLocalTransforms.push_back(localTransforms[nodeIdx]);
+    result.nodeSources.push_back(static_cast<std::uint32_t>(nodeIdx));
+
+    const auto& node = model.nodes[nodeIdx];
+    if (node.mesh >= 0)
+    {
+      result.nodes.push_back(flatIdx);
+      result.meshes.push_back(static_cast<std::uint32_t>(node.mesh));
+    }
+
+    for (auto it = node.children.rbegin(); it != node.children.rend(); ++it)
+      stack.push(Visit{.node = *it, .parent = flatIdx});
+  }
+
+  return result;
+}
+
+// Start of the accessor's data and the distance between consecutive elements in bytes
+static std::pair<const std::byte*, std::size_t> accessor_data(
+  const tinygltf::Model& model, const tinygltf::Accessor& accessor)
+{
+  const auto& bufView = model.bufferViews[accessor.bufferView];
+  const auto* ptr = reinterpret_cast<const std::byte*>(model.buffers[bufView.buffer].data.data()) +
+    bufView.byteOffset + accessor.byteOffset;
+  const std::size_t stride = bufView.byteStride != 0
+    ? bufView.byteStride
+    : tinygltf::GetComponentSizeInBytes(accessor.componentType) *
+      tinygltf::GetNumComponentsInType(accessor.type);
+  return {ptr, stride};
+}
+
+static BoundingBox position_bounds(
+  const tinygltf::Model& model, const tinygltf::Accessor& accessor)
+{
+  // Required by the spec, but some exporters don't bother
+  if (accessor.minValues.size() == 3 && accessor.maxValues.size() == 3)
+    return BoundingBox{
+      .min = glm::vec3(accessor.minValues[0], accessor.minValues[1], accessor.minValues[2]),
+      .max = glm::vec3(accessor.maxValues[0], accessor.maxValues[1], accessor.maxValues[2]),
+    };
+
+  BoundingBox result{
+    .min = glm::vec3(std::numeric_limits<float>::max()),
+    .max = glm::vec3(std::numeric_limits<float>::lowest()),
+  };
+  const auto [positions, stride] = accessor_data(model, accessor);
+  for (std::size_t i = 0; i < accessor.count; ++i)
+  {
+    glm::vec3 position;
+    std::memcpy(&position, positions + i * stride, sizeof(position));
+    result.min = glm::min(result.min, position);
+    result.max = glm::max(result.max, position);
+  }
+  return result;
+}
+
+static TexcoordFormat get_texcoord_format(const tinygltf::Accessor& accessor)
+{
+  if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT)
+    return TexcoordFormat::Float;
+  if (accessor.normalized && accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE)
+    return TexcoordFormat::Unorm8;
+  if (accessor.normalized && accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT)
+    return TexcoordFormat::Unorm16;
+  return TexcoordFormat::None;
+}
+
+template <class Out, class In>
+static void convert_indices(const std::byte* src, std::span<std::byte> dst)
+{
+  const std::size_t count = dst.size() / sizeof(Out);
+  if constexpr (std::is_same_v<In, Out>)
+    std::memcpy(dst.data(), src, count * sizeof(Out));
+  else
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      In index;
+      std::memcpy(&index, src + i * sizeof(In), sizeof(In));
+      const auto converted = static_cast<Out>(index);
+      std::memcpy(dst.data() + i * sizeof(Out), &converted, sizeof(Out));
+    }
+}
+
+template <class Out>
+static void convert_indices(int component_type, const std::byte* src, std::span<std::byte> dst)
+{
+  switch (component_type)
+  {
+  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+    convert_indices<Out, std::uint8_t>(src, dst);
+    break;
+  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+    convert_indices<Out, std::uint16_t>(src, dst);
+    break;
+  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+    convert_indices<Out, std::uint32_t>(src, dst);
+    break;
+  default:
+    break;
+  }
+}
+
+static ProcessedMeshes process_meshes_in_batches(
+  const tinygltf::Model& model,
+  ThreadPool& pool,
+  std::size_t vertices_per_batch,
+  MeshProgressCallback on_progress)
+{
+  // NOTE: glTF assets can have pretty wonky data layouts which are not appropriate
+  // for real-time rendering, so we have to press the data first. In serious engines
+  // this is mitigated by storing assets on the disc in an engine-specific format that
+  // is appropriate for GPU upload right after reading from disc.
+
+  ProcessedMeshes result;
+
+  // Everything we need to know to convert a primitive, one per relem
+  struct PrimitiveSource
+  {
+    VertexStreams streams;
+    const tinygltf::Accessor* indices;
+    std::uint32_t vertexCount;
+  };
+  std::vector<PrimitiveSource> sources;
+
+  {
+    std::size_t totalPrimitives = 0;
+    for (const auto& mesh : model.meshes)
+      totalPrimitives += mesh.primitives.size();
+    result.relems.reserve(totalPrimitives);
+    sources.reserve(totalPrimitives);
+  }
+
+  result.meshes.reserve(model.meshes.size());
+
+  // First, a cheap serial pass that figures out where every primitive goes. Offsets are
+  // a prefix sum over primitive sizes, so the result does not depend on the order in which
+  // primitives are converted later on, and is the same for any number of threads.
+  std::size_t totalVertices = 0;
+  std::size_t totalIndexBytes = 0;
+  for (const auto& mesh : model.meshes)
+  {
+    const auto firstRelem = static_cast<std::uint32_t>(result.relems.size());
+    result.meshes.push_back(Mesh{
+      .firstRelem = firstRelem,
+      .relemCount = static_cast<std::uint32_t>(mesh.primitives.size()),
+      .bounds =
+        BoundingBox{
+          .min = glm::vec3(std::numeric_limits<float>::max()),
+          .max = glm::vec3(std::numeric_limits<float>::lowest()),
+        },
+      .lodCount = 1,
+      .lods = {MeshLod{.firstRelem = firstRelem, .error = 0.0f}},
+    });
+
+    for (const auto& prim : mesh.primitives)
+    {
+      if (prim.mode != TINYGLTF_MODE_TRIANGLES)
+      {
+        spdlog::warn(
+          "Encountered a non-triangles primitive, these are not supported for now, skipping it!");
+        --result.meshes.back().relemCount;
+        continue;
+      }
+
+      const auto& indexAccessor = model.accessors[prim.indices];
+      const auto& positionAccessor = model.accessors[prim.attributes.at("POSITION")];
+
+      // Indices are never strided in valid glTF files
+      if (model.bufferViews[indexAccessor.bufferView].byteStride != 0)
+      {
+        spdlog::warn("Encountered a primitive with strided indices, skipping it!");
+        --result.meshes.back().relemCount;
+        continue;
+      }
+
+      // Returns the accessor of an optional attribute, if it is present and has
+      // a format we support. Otherwise, it's treated as missing.
+      auto findAttribute = [&](const char* name, bool float_only) -> const tinygltf::Accessor* {
+        const auto it = prim.attributes.find(name);
+        if (it == prim.attributes.end())
+          return nullptr;
+        const auto& accessor = model.accessors[it->second];
+        if (float_only && accessor.componentType != TINYGLTF_COMPONENT_TYPE_FLOAT)
+        {
+          spdlog::warn("Attribute {} has an unsupported component type, ignoring it!", name);
+          return nullptr;
+        }
+        return &accessor;
+      };
+
+      const auto* normalAccessor = findAttribute("NORMAL", true);
+      const auto* tangentAccessor = findAttribute("TANGENT", true);
+      const auto* texcoordAccessor = findAttribute("TEXCOORD_0", false);
+
+      VertexStreams streams;
+      std::tie(streams.positions, streams.positionStride) = accessor_data(model, positionAccessor);
+      if (normalAccessor != nullptr)
+        std::tie(streams.normals, streams.normalStride) = accessor_data(model, *normalAccessor);
+      if (tangentAccessor != nullptr)
+        std::tie(streams.tangents, streams.tangentStride) = accessor_data(model, *tangentAccessor);
+      if (texcoordAccessor != nullptr)
+      {
+        std::tie(streams.texcoords, streams.texcoordStride) =
+          accessor_data(model, *texcoordAccessor);
+        streams.texcoordFormat = get_texcoord_format(*texcoordAccessor);
+        if (streams.texcoordFormat == TexcoordFormat::None)
+          spdlog::warn("Attribute TEXCOORD_0 has an unsupported component type, ignoring it!");
+      }
+
+      // Indices are relative to the relem's vertexOffset, so 16 bits are enough
+      // for everything but huge primitives, no matter what the source format is.
+      const auto indexType =
+        positionAccessor.count <= (1 << 16) ? IndexType::Uint16 : IndexType::Uint32;
+      const std::size_t indexSize = index_size(indexType);
+      totalIndexBytes = (totalIndexBytes + indexSize - 1) / indexSize * indexSize;
+
+      auto& bounds = result.meshes.back().bounds;
+      const auto primBounds = position_bounds(model, positionAccessor);
+      bounds.min = glm::min(bounds.min, primBounds.min);
+      bounds.max = glm::max(bounds.max, primBounds.max);
+
+      result.relems.push_back(RenderElement{
+        .vertexOffset = static_cast<std::uint32_t>(totalVertices),
+        .indexOffset = static_cast<std::uint32_t>(totalIndexBytes / indexSize),
+        .indexCount = static_cast<std::uint32_t>(indexAccessor.count),
+        .indexType = indexType,
+      });
+      sources.push_back(PrimitiveSource{
+        .streams = streams,
+        .indices = &indexAccessor,
+        .vertexCount = static_cast<std::uint32_t>(positionAccessor.count),
+      });
+
+      totalVertices += positionAccessor.count;
+      totalIndexBytes += indexAccessor.count * indexSize;
+    }
+
+    if (result.meshes.back().relemCount == 0)
+      result.meshes.back().bounds = BoundingBox{.min = glm::vec3(0), .max = glm::vec3(0)};
+  }
+
+  result.vertices.resize(totalVertices);
+  // NOTE: keep the whole buffer a multiple of 4 bytes, vkCmdFillBuffer and friends need that
+  result.indices.resize((totalIndexBytes + 3) / 4 * 4);
+
+  // Primitive sizes vary wildly, so big ones are split into several jobs
+  // to keep all threads busy until the very end.
+  constexpr std::uint32_t VERTICES_PER_JOB = 1 << 15;
+
+  struct Job
+  {
+    std::uint32_t relem;
+    std::uint32_t firstVertex;
+    std::uint32_t vertexCount;
+  };
+  std::vector<Job> jobs;
+  for (std::uint32_t relemIdx = 0; relemIdx < sources.size(); ++relemIdx)
+  {
+    const std::uint32_t vertexCount = sources[relemIdx].vertexCount;
+    // NOTE: the first job of a relem also takes care of the indices, so there's one even
+    // for primitives without vertices.
+    std::uint32_t first = 0;
+    do
+    {
+      const std::uint32_t count = std::min(VERTICES_PER_JOB, vertexCount - first);
+      jobs.push_back(Job{.relem = relemIdx, .firstVertex = first, .vertexCount = count});
+      first += count;
+    } while (first < vertexCount);
+  }
+
+  auto convertJob = [&result, &sources, &model](const Job& job) {
+    const auto& source = sources[job.relem];
+    const auto& relem = result.relems[job.relem];
+
+    auto streams = source.streams;
+    streams.positions += job.firstVertex * streams.positionStride;
+    if (streams.normals != nullptr)
+      streams.normals += job.firstVertex * streams.normalStride;
+    if (streams.tangents != nullptr)
+      streams.tangents += job.firstVertex * streams.tangentStride;
+    if (streams.texcoords != nullptr)
+      streams.texcoords += job.firstVertex * streams.texcoordStride;
+
+    convert_vertices(
+      streams,
+      std::span{result.vertices}.subspan(relem.vertexOffset + job.firstVertex, job.vertexCount));
+
+    if (job.firstVertex != 0)
+      return;
+
+    const auto& indexAccessor = *source.indices;
+    const auto indexPtr = accessor_data(model, indexAccessor).first;
+    auto indices = std::span{result.indices}.subspan(
+      relem.indexOffset * index_size(relem.indexType),
+      relem.indexCount * index_size(relem.indexType));
+    if (relem.indexType == IndexType::Uint16)
+      convert_indices<std::uint16_t>(indexAccessor.componentType, indexPtr, indices);
+    else
+      convert_indices<std::uint32_t>(indexAccessor.componentType, indexPtr, indices);
+  };
+
+  on_progress(result, 0, 0);
+
+  // Jobs go in the same order as relems, so every batch extends the converted
+  // prefix of both the vertex and the index arrays.
+  for (std::size_t firstJob = 0; firstJob < jobs.size();)
+  {
+    std::size_t lastJob = firstJob;
+    std::size_t batchVertices = 0;
+    do
+    {
+      batchVertices += jobs[lastJob].vertexCount;
+      ++lastJob;
+    } while (lastJob < jobs.size() &&
+             batchVertices + jobs[lastJob].vertexCount <= vertices_per_batch);
+
+    pool.parallelFor(lastJob - firstJob, 1, [&convertJob, &jobs, firstJob](std::size_t jobIdx) {
+      convertJob(jobs[firstJob + jobIdx]);
+    });
+
+    const auto& job = jobs[lastJob - 1];
+    const auto& relem = result.relems[job.relem];
+    on_progress(
+      result,
+      relem.vertexOffset + job.firstVertex + job.vertexCount,
+      (relem.indexOffset + relem.indexCount) * index_size(relem.indexType));
+
+    firstJob = lastJob;
+  }
+
+  return result;
+}
+
+ProcessedMeshes process_meshes(const tinygltf::Model& model, ThreadPool& pool)
+{
+  return process_meshes_in_batches(
+    model, pool, std::numeric_limits<std::size_t>::max(), [](const auto&, auto, auto) {});
+}
+
+ProcessedMeshes process_meshes(
+  const tinygltf::Model& model, ThreadPool& pool, MeshProgressCallback on_progress)
+{
+  // NOTE: ~32MiB of vertices per batch. Smaller batches mean more overlap with whoever
+  // consumes them, but also more points where worker threads go idle.
+  constexpr std::size_t VERTICES_PER_BATCH = 1 << 20;
+  return process_meshes_in_batches(model, pool, VERTICES_PER_BATCH, on_progress);
+}
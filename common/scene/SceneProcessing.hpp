@@ -0,0 +1,132 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <tiny_gltf.h>
+#include <function2/function2.hpp>
+
+#include "jobs/ThreadPool.hpp"
+
+
+// Everything that turns a glTF scene into data that is ready to be rendered.
+// None of this touches the GPU, so offline tools like the baker and benchmarks
+// use it without initializing Vulkan, and SceneManager uploads the results.
+
+enum class IndexType : std::uint32_t
+{
+  Uint16,
+  Uint32,
+};
+
+constexpr std::size_t index_size(IndexType type)
+{
+  return type == IndexType::Uint16 ? sizeof(std::uint16_t) : sizeof(std::uint32_t);
+}
+
+// A single render element (relem) corresponds to a single draw call
+// of a certain pipeline with specific bindings (including material data)
+struct RenderElement
+{
+  std::uint32_t vertexOffset;
+  // NOTE: the index buffer contains both 16 and 32 bit indices, so this is
+  // measured in elements of `indexType`, which is exactly what drawIndexed
+  // wants as long as the buffer is bound at offset 0 with the same type.
+  std::uint32_t indexOffset;
+  std::uint32_t indexCount;
+  // Small primitives get 16 bit indices to save memory and bandwidth
+  IndexType indexType;
+  // Not implemented!
+  // Material* material;
+};
+
+struct BoundingBox
+{
+  glm::vec3 min;
+  glm::vec3 max;
+};
+
+constexpr std::uint32_t MAX_MESH_LODS = 4;
+
+// A simplified version of a mesh, see MeshLods.hpp
+struct MeshLod
+{
+  // Relems of the LOD are [firstRelem, firstRelem + Mesh::relemCount)
+  std::uint32_t firstRelem;
+  // How far the surface of the LOD can be from the full detail one, in the mesh's space
+  float error;
+};
+
+// A mesh is a collection of relems. A scene may have the same mesh
+// located in several different places, so a scene consists of **instances**,
+// not meshes.
+struct Mesh
+{
+  std::uint32_t firstRelem;
+  std::uint32_t relemCount;
+  // In the mesh's own space, encloses all of its relems. Empty meshes get a degenerate
+  // box at the origin.
+  BoundingBox bounds;
+  // LOD 0 is the full detail mesh, i.e. {firstRelem, 0}. Every coarser LOD has just
+  // as many relems as the full detail one, and a bigger error. Only the baker makes LODs.
+  std::uint32_t lodCount;
+  std::array<MeshLod, MAX_MESH_LODS> lods;
+};
+
+struct Vertex
+{
+  // First 3 floats are position, 4th float is a packed normal
+  glm::vec4 positionAndNormal;
+  // First 2 floats are tex coords, 3rd is a packed tangent, 4th is padding
+  glm::vec4 texCoordAndTangentAndPadding;
+};
+
+static_assert(sizeof(Vertex) == sizeof(float) * 8);
+
+// Images are not decoded, only recorded, see TextureStreamer
+std::optional<tinygltf::Model> load_model(const std::filesystem::path& path);
+
+struct ProcessedInstances
+{
+  // Nodes of the default scene in depth-first order, see TransformHierarchy
+  std::vector<std::uint32_t> nodeParents;
+  std::vector<glm::mat4x4> nodeLocalTransforms;
+  // The glTF node every node came from
+  std::vector<std::uint32_t> nodeSources;
+
+  // Instances go in the same order as their nodes, so that every subtree
+  // of the hierarchy is a contiguous range of instances.
+  std::vector<std::uint32_t> nodes;
+  std::vector<std::uint32_t> meshes;
+};
+
+ProcessedInstances process_instances(const tinygltf::Model& model, ThreadPool& pool);
+
+struct ProcessedMeshes
+{
+  std::vector<Vertex> vertices;
+  // Mixed 16 and 32 bit indices, see RenderElement::indexType
+  std::vector<std::byte> indices;
+  std::vector<RenderElement> relems;
+  std::vector<Mesh> meshes;
+};
+
+// Primitives are converted in parallel on `pool`, but the result is
+// byte-identical to converting them one by one.
+ProcessedMeshes process_meshes(const tinygltf::Model& model, ThreadPool& pool);
+
+// Called once the layout of the result is known (with nothing ready yet), and then
+// every time a batch of primitives has been converted. Vertices before `vertices_ready`
+// and index bytes before `index_bytes_ready` are final, so they can be uploaded right away.
+using MeshProgressCallback = fu2::function_view<void(
+  const ProcessedMeshes& meshes, std::size_t vertices_ready, std::size_t index_bytes_ready) const>;
+
+// Same as above, but converts primitives in batches and reports progress after each one,
+// so that consumers can overlap their work with the conversion of the following batches.
+ProcessedMeshes process_meshes(
+  const tinygltf::Model& model, ThreadPool& pool, MeshProgressCallback on_progress);
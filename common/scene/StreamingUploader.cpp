@@ -0,0 +1,315 @@
+#include "StreamingUploader.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include <etna/Etna.hpp>
+#include <etna/GlobalContext.hpp>
+
+
+// NOTE: a chunk is submitted as soon as this much data was recorded, which gives
+// us up to 4 chunks in flight: one being filled by the CPU, the rest being copied.
+static constexpr vk::DeviceSize CHUNKS_PER_RING = 4;
+// Not worth bothering with staging buffers smaller than this
+static constexpr vk::DeviceSize MIN_STAGING_SIZE = 1024 * 1024;
+static constexpr vk::DeviceSize STAGING_ALIGNMENT = 16;
+
+static vk::DeviceSize align_up(vk::DeviceSize value, vk::DeviceSize alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+StreamingUploader::StreamingUploader(CreateInfo info)
+  : maxStagingSize{std::max(info.stagingSize, MIN_STAGING_SIZE)}
+{
+  auto& ctx = etna::get_context();
+
+  const vk::SemaphoreTypeCreateInfo timelineInfo{
+    .semaphoreType = vk::SemaphoreType::eTimeline,
+    .initialValue = 0,
+  };
+  timeline = etna::unwrap_vk_result(
+    ctx.getDevice().createSemaphoreUnique(vk::SemaphoreCreateInfo{.pNext = &timelineInfo}));
+
+  commandPool = etna::unwrap_vk_result(ctx.getDevice().createCommandPoolUnique(
+    vk::CommandPoolCreateInfo{
+      .flags = vk::CommandPoolCreateFlagBits::eTransient |
+        vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+      .queueFamilyIndex = ctx.getQueueFamilyIdx(),
+    }));
+}
+
+StreamingUploader::~StreamingUploader()
+{
+  releaseStaging();
+}
+
+void StreamingUploader::reserve(vk::DeviceSize total_size)
+{
+  const vk::DeviceSize size = std::clamp(
+    align_up(total_size, STAGING_ALIGNMENT * CHUNKS_PER_RING), MIN_STAGING_SIZE, maxStagingSize);
+
+  if (stagingData != nullptr && stagingSize >= size)
+    return;
+
+  releaseStaging();
+  createStaging(size);
+}
+
+UploadTicket StreamingUploader::upload(
+  const etna::Buffer& dst, vk::DeviceSize dst_offset, std::span<const std::byte> data)
+{
+  if (data.empty())
+    return UploadTicket{nextValue - 1};
+
+  if (stagingData == nullptr)
+    createStaging(maxStagingSize);
+
+  const vk::DeviceSize chunkSize = stagingSize / CHUNKS_PER_RING;
+
+  UploadTicket result;
+  while (!data.empty())
+  {
+    const vk::DeviceSize size = std::min<vk::DeviceSize>(data.size(), chunkSize);
+    const vk::DeviceSize offset = stage(data.first(size));
+
+    current.copyBuffer(
+      staging.get(),
+      dst.get(),
+      {vk::BufferCopy{.srcOffset = offset, .dstOffset = dst_offset, .size = size}});
+    result.value = nextValue;
+
+    data = data.subspan(size);
+    dst_offset += size;
+
+    if (currentBytes >= chunkSize)
+      flush();
+  }
+
+  return result;
+}
+
+UploadTicket StreamingUploader::uploadImage(
+  const etna::Image& dst,
+  std::uint32_t mip_level,
+  vk::Extent2D extent,
+  std::uint32_t texel_size,
+  std::span<const std::byte> data)
+{
+  const vk::DeviceSize rowSize = vk::DeviceSize{extent.width} * texel_size;
+  ETNA_VERIFY(data.size() == rowSize * extent.height);
+
+  if (data.empty())
+    return UploadTicket{nextValue - 1};
+
+  if (stagingData == nullptr)
+    createStaging(maxStagingSize);
+
+  const vk::DeviceSize chunkSize = stagingSize / CHUNKS_PER_RING;
+  ETNA_VERIFYF(rowSize <= chunkSize, "Staging memory is too small for image rows!");
+  const auto rowsPerChunk = static_cast<std::uint32_t>(chunkSize / rowSize);
+
+  // Big images are uploaded a bunch of whole rows at a time
+  UploadTicket result;
+  for (std::uint32_t y = 0; y < extent.height;)
+  {
+    const std::uint32_t rows = std::min(rowsPerChunk, extent.height - y);
+    const vk::DeviceSize offset = stage(data.subspan(y * rowSize, rows * rowSize));
+
+    etna::set_state(
+      current,
+      dst.get(),
+      vk::PipelineStageFlagBits2::eTransfer,
+      vk::AccessFlagBits2::eTransferWrite,
+      vk::ImageLayout::eTransferDstOptimal,
+      vk::ImageAspectFlagBits::eColor);
+    etna::flush_barriers(current);
+
+    current.copyBufferToImage(
+      staging.get(),
+      dst.get(),
+      vk::ImageLayout::eTransferDstOptimal,
+      {vk::BufferImageCopy{
+        .bufferOffset = offset,
+        .bufferRowLength = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource =
+          vk::ImageSubresourceLayers{
+            .aspectMask = vk::ImageAspectFlagBits::eColor,
+            .mipLevel = mip_level,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+          },
+        .imageOffset = vk::Offset3D{0, static_cast<std::int32_t>(y), 0},
+        .imageExtent = vk::Extent3D{extent.width, rows, 1},
+      }});
+
+    etna::set_state(
+      current,
+      dst.get(),
+      vk::PipelineStageFlagBits2::eFragmentShader,
+      vk::AccessFlagBits2::eShaderSampledRead,
+      vk::ImageLayout::eShaderReadOnlyOptimal,
+      vk::ImageAspectFlagBits::eColor);
+    etna::flush_barriers(current);
+    result.value = nextValue;
+
+    y += rows;
+
+    if (currentBytes >= chunkSize)
+      flush();
+  }
+
+  return result;
+}
+
+UploadTicket StreamingUploader::flush()
+{
+  if (!current)
+    return UploadTicket{nextValue - 1};
+
+  ETNA_CHECK_VK_RESULT(current.end());
+
+  const vk::CommandBufferSubmitInfo cmdBufInfo{.commandBuffer = current};
+  const vk::SemaphoreSubmitInfo signalInfo{
+    .semaphore = timeline.get(),
+    .value = nextValue,
+    .stageMask = vk::PipelineStageFlagBits2::eAllTransfer,
+  };
+
+  ETNA_CHECK_VK_RESULT(etna::get_context().getQueue().submit2(vk::SubmitInfo2{
+    .commandBufferInfoCount = 1,
+    .pCommandBufferInfos = &cmdBufInfo,
+    .signalSemaphoreInfoCount = 1,
+    .pSignalSemaphoreInfos = &signalInfo,
+  }));
+
+  submissions.push_back(Submission{.cmdBuf = current, .value = nextValue});
+  current = nullptr;
+  currentBytes = 0;
+
+  return UploadTicket{nextValue++};
+}
+
+bool StreamingUploader::isComplete(UploadTicket ticket) const
+{
+  return ticket.value < nextValue && completedValue() >= ticket.value;
+}
+
+void StreamingUploader::wait(UploadTicket ticket)
+{
+  // Waiting for something that was never submitted would hang forever
+  if (ticket.value >= nextValue)
+    flush();
+
+  const vk::Semaphore semaphore = timeline.get();
+  ETNA_CHECK_VK_RESULT(etna::get_context().getDevice().waitSemaphores(
+    vk::SemaphoreWaitInfo{
+      .semaphoreCount = 1,
+      .pSemaphores = &semaphore,
+      .pValues = &ticket.value,
+    },
+    std::numeric_limits<std::uint64_t>::max()));
+}
+
+void StreamingUploader::releaseStaging()
+{
+  wait(flush());
+
+  regions.clear();
+  staging = {};
+  stagingData = nullptr;
+  stagingSize = 0;
+  head = 0;
+}
+
+vk::DeviceSize StreamingUploader::stage(std::span<const std::byte> data)
+{
+  const vk::DeviceSize offset = allocate(data.size());
+  std::memcpy(stagingData + offset, data.data(), data.size());
+
+  if (!current)
+    current = acquireCommandBuffer();
+
+  regions.push_back(Region{.begin = offset, .end = offset + data.size(), .value = nextValue});
+  currentBytes += data.size();
+
+  return offset;
+}
+
+vk::DeviceSize StreamingUploader::allocate(vk::DeviceSize size)
+{
+  ETNA_VERIFY(size <= stagingSize);
+
+  vk::DeviceSize begin = align_up(head, STAGING_ALIGNMENT);
+  if (begin + size > stagingSize)
+    begin = 0;
+  const vk::DeviceSize end = begin + size;
+
+  // Regions are allocated in ring order, so everything that is in our way is a prefix
+  // of the queue. Waiting for the last conflicting region also waits for all previous ones.
+  std::size_t conflicting = 0;
+  for (std::size_t i = 0; i < regions.size(); ++i)
+    if (regions[i].begin < end && begin < regions[i].end)
+      conflicting = i + 1;
+
+  if (conflicting != 0)
+  {
+    wait(UploadTicket{regions[conflicting - 1].value});
+    regions.erase(regions.begin(), regions.begin() + static_cast<std::ptrdiff_t>(conflicting));
+  }
+
+  head = end;
+  return begin;
+}
+
+void StreamingUploader::createStaging(vk::DeviceSize size)
+{
+  staging = etna::get_context().createBuffer(etna::Buffer::CreateInfo{
+    .size = size,
+    .bufferUsage = vk::BufferUsageFlagBits::eTransferSrc,
+    .memoryUsage = VMA_MEMORY_USAGE_CPU_ONLY,
+    .name = "upload_staging",
+  });
+  stagingData = staging.map();
+  stagingSize = size;
+  head = 0;
+}
+
+vk::CommandBuffer StreamingUploader::acquireCommandBuffer()
+{
+  const std::uint64_t completed = completedValue();
+  while (!submissions.empty() && submissions.front().value <= completed)
+  {
+    freeCommandBuffers.push_back(submissions.front().cmdBuf);
+    submissions.pop_front();
+  }
+
+  vk::CommandBuffer cmdBuf;
+  if (!freeCommandBuffers.empty())
+  {
+    cmdBuf = freeCommandBuffers.back();
+    freeCommandBuffers.pop_back();
+    ETNA_CHECK_VK_RESULT(cmdBuf.reset());
+  }
+  else
+  {
+    cmdBuf = etna::unwrap_vk_result(etna::get_context().getDevice().allocateCommandBuffers(
+      vk::CommandBufferAllocateInfo{
+        .commandPool = commandPool.get(),
+        .level = vk::CommandBufferLevel::ePrimary,
+        .commandBufferCount = 1,
+      }))[0];
+  }
+
+  ETNA_CHECK_VK_RESULT(cmdBuf.begin(
+    vk::CommandBufferBeginInfo{.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit}));
+  return cmdBuf;
+}
+
+std::uint64_t StreamingUploader::completedValue() const
+{
+  return etna::unwrap_vk_result(
+    etna::get_context().getDevice().getSemaphoreCounterValue(timeline.get()));
+}
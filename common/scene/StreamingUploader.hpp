@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <span>
+#include <vector>
+
+#include <etna/Buffer.hpp>
+#include <etna/Image.hpp>
+#include <etna/Vulkan.hpp>
+
+
+// Identifies a bunch of uploads, becomes complete when all of them
+// have landed in their destination buffers.
+struct UploadTicket
+{
+  std::uint64_t value = 0;
+};
+
+/**
+ * Uploads data to GPU-only buffers through a ring of staging memory. Copies are
+ * recorded and submitted in chunks, and completion is tracked with a timeline
+ * semaphore, so the CPU can keep producing data while the GPU is busy copying
+ * earlier chunks. The CPU only ever blocks when the ring is full.
+ *
+ * The staging buffer is created on first use and can be released when there is
+ * nothing to upload anymore, so it doesn't sit in memory for the whole runtime.
+ * Requires the timelineSemaphore device feature.
+ */
+class StreamingUploader
+{
+public:
+  struct CreateInfo
+  {
+    // Upper bound on the amount of staging memory in use at any given time
+    vk::DeviceSize stagingSize = 32 * 1024 * 1024;
+  };
+
+  explicit StreamingUploader(CreateInfo info);
+  ~StreamingUploader();
+
+  StreamingUploader(const StreamingUploader&) = delete;
+  StreamingUploader& operator=(const StreamingUploader&) = delete;
+
+  // Hint that about `total_size` bytes are about to be uploaded, so that small
+  // scenes don't get a huge staging buffer. Waits for everything in flight.
+  void reserve(vk::DeviceSize total_size);
+
+  // Copies `data` into staging memory and records a copy to `dst` at `dst_offset`.
+  // Big uploads are split into several chunks that are submitted as soon as they
+  // are ready. The returned ticket completes once all of `data` is in `dst`, but
+  // the tail might still be unsubmitted, call `flush` when done with a batch!
+  UploadTicket upload(
+    const etna::Buffer& dst, vk::DeviceSize dst_offset, std::span<const std::byte> data);
+
+  // Uploads a whole mip level of a 2D color image with a tightly packed format that has
+  // `texel_size` bytes per texel. The image is left in the shader read only layout.
+  UploadTicket uploadImage(
+    const etna::Image& dst,
+    std::uint32_t mip_level,
+    vk::Extent2D extent,
+    std::uint32_t texel_size,
+    std::span<const std::byte> data);
+
+  // Submits everything that was recorded so far, returns a ticket for all of it
+  UploadTicket flush();
+
+  bool isComplete(UploadTicket ticket) const;
+  void wait(UploadTicket ticket);
+
+  // Waits for all uploads and frees the staging buffer, the next upload re-creates it
+  void releaseStaging();
+
+private:
+  // Copies `data` into the ring and makes sure there's a command buffer to record into
+  vk::DeviceSize stage(std::span<const std::byte> data);
+  // Returns an offset of `size` free bytes in the ring, blocks if necessary
+  vk::DeviceSize allocate(vk::DeviceSize size);
+  void createStaging(vk::DeviceSize size);
+  vk::CommandBuffer acquireCommandBuffer();
+  std::uint64_t completedValue() const;
+
+private:
+  vk::DeviceSize maxStagingSize;
+
+  vk::UniqueSemaphore timeline;
+  vk::UniqueCommandPool commandPool;
+
+  etna::Buffer staging;
+  std::byte* stagingData = nullptr;
+  vk::DeviceSize stagingSize = 0;
+  vk::DeviceSize head = 0;
+
+  // Ring ranges that can't be overwritten until the timeline reaches `value`
+  struct Region
+  {
+    vk::DeviceSize begin;
+    vk::DeviceSize end;
+    std::uint64_t value;
+  };
+  std::deque<Region> regions;
+
+  struct Submission
+  {
+    vk::CommandBuffer cmdBuf;
+    std::uint64_t value;
+  };
+  std::deque<Submission> submissions;
+  std::vector<vk::CommandBuffer> freeCommandBuffers;
+
+  // Copies recorded into this command buffer will signal `nextValue` once submitted
+  vk::CommandBuffer current;
+  vk::DeviceSize currentBytes = 0;
+  std::uint64_t nextValue = 1;
+};
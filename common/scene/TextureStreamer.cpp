@@ -0,0 +1,233 @@
+#include "TextureStreamer.hpp"
+
+#include "MappedFile.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+
+#include <stb_image.h>
+#include <spdlog/spdlog.h>
+#include <fmt/std.h>
+#include <etna/GlobalContext.hpp>
+
+
+// NOTE: a mip of a 4k texture is 64MiB, so big ones take a few frames anyway
+constexpr std::size_t BYTES_PER_UPDATE = 16 * 1024 * 1024;
+constexpr std::uint32_t TEXEL_SIZE = 4;
+
+static vk::Extent2D mip_extent(vk::Extent2D extent, std::uint32_t mip)
+{
+  return {std::max(extent.width >> mip, 1u), std::max(extent.height >> mip, 1u)};
+}
+
+// 2x2 box filter, odd sizes simply repeat the last row/column
+static std::vector<std::byte> downsample(
+  std::span<const std::byte> src, vk::Extent2D src_extent, vk::Extent2D dst_extent)
+{
+  std::vector<std::byte> dst(std::size_t{dst_extent.width} * dst_extent.height * TEXEL_SIZE);
+  auto texel = [&](std::uint32_t x, std::uint32_t y, std::uint32_t channel) {
+    x = std::min(x, src_extent.width - 1);
+    y = std::min(y, src_extent.height - 1);
+    return static_cast<std::uint32_t>(
+      src[(std::size_t{y} * src_extent.width + x) * TEXEL_SIZE + channel]);
+  };
+
+  for (std::uint32_t y = 0; y < dst_extent.height; ++y)
+    for (std::uint32_t x = 0; x < dst_extent.width; ++x)
+      for (std::uint32_t c = 0; c < TEXEL_SIZE; ++c)
+      {
+        const std::uint32_t sum = texel(2 * x, 2 * y, c) + texel(2 * x + 1, 2 * y, c) +
+          texel(2 * x, 2 * y + 1, c) + texel(2 * x + 1, 2 * y + 1, c);
+        dst[(std::size_t{y} * dst_extent.width + x) * TEXEL_SIZE + c] =
+          static_cast<std::byte>((sum + 2) / 4);
+      }
+
+  return dst;
+}
+
+static std::optional<TextureStreamer::DecodedImage> decode_image(const ImageSource& source)
+{
+  if (source.file.empty())
+    return std::nullopt;
+
+  auto file = MappedFile::open(source.file);
+  if (!file.has_value())
+  {
+    spdlog::warn("Image '{}' references a missing file '{}'!", source.name, source.file);
+    return std::nullopt;
+  }
+
+  auto data = file->data();
+  if (source.offset > data.size() || source.size > data.size() - source.offset)
+  {
+    spdlog::warn("Image '{}' is out of bounds of '{}'!", source.name, source.file);
+    return std::nullopt;
+  }
+  data = data.subspan(source.offset, source.size != 0 ? source.size : std::dynamic_extent);
+
+  int width = 0;
+  int height = 0;
+  int channels = 0;
+  stbi_uc* pixels = stbi_load_from_memory(
+    reinterpret_cast<const stbi_uc*>(data.data()),
+    static_cast<int>(data.size()),
+    &width,
+    &height,
+    &channels,
+    TEXEL_SIZE);
+  if (pixels == nullptr)
+  {
+    spdlog::warn("Failed to decode image '{}': {}", source.name, stbi_failure_reason());
+    return std::nullopt;
+  }
+
+  TextureStreamer::DecodedImage result{
+    .extent = {static_cast<std::uint32_t>(width), static_cast<std::uint32_t>(height)},
+    .srgb = source.srgb,
+    .mips = {},
+  };
+
+  const std::size_t baseSize =
+    static_cast<std::size_t>(width) * static_cast<std::size_t>(height) * TEXEL_SIZE;
+  const auto base = std::as_bytes(std::span{pixels, baseSize});
+  result.mips.emplace_back(base.begin(), base.end());
+  stbi_image_free(pixels);
+
+  // NOTE: this filters sRGB values as if they were linear, which slightly darkens
+  // high-contrast details in far away mips. Good enough until we bake textures offline.
+  const auto mipCount = std::bit_width(std::max(result.extent.width, result.extent.height));
+  for (std::uint32_t mip = 1; mip < mipCount; ++mip)
+  {
+    auto next = downsample(
+      result.mips.back(), mip_extent(result.extent, mip - 1), mip_extent(result.extent, mip));
+    result.mips.push_back(std::move(next));
+  }
+
+  return result;
+}
+
+TextureStreamer::TextureStreamer(ThreadPool& pool, StreamingUploader& uploader)
+  : pool{pool}
+  , uploader{uploader}
+{
+}
+
+TextureStreamer::~TextureStreamer()
+{
+  reset();
+}
+
+void TextureStreamer::reset()
+{
+  if (cancelled != nullptr)
+    cancelled->store(true);
+
+  // Decoding tasks reference nothing of ours, but uploads read from staging
+  // memory and write into our images, so those have to finish.
+  if (!stagingReleased)
+    uploader.releaseStaging();
+  stagingReleased = true;
+
+  streaming.clear();
+  textures.clear();
+}
+
+void TextureStreamer::start(std::vector<ImageSource> sources)
+{
+  reset();
+
+  cancelled = std::make_shared<std::atomic<bool>>(false);
+
+  textures.resize(sources.size());
+  streaming.resize(sources.size());
+  for (std::size_t i = 0; i < sources.size(); ++i)
+  {
+    textures[i].name = sources[i].name;
+    streaming[i].decoding =
+      pool.async([source = std::move(sources[i]), cancelled = cancelled]() {
+        if (cancelled->load())
+          return std::optional<DecodedImage>{};
+        return decode_image(source);
+      });
+  }
+}
+
+void TextureStreamer::update()
+{
+  std::size_t budget = BYTES_PER_UPDATE;
+  bool submitted = false;
+
+  for (std::size_t i = 0; i < textures.size(); ++i)
+  {
+    auto& texture = textures[i];
+    auto& state = streaming[i];
+
+    while (!state.inFlight.empty() && uploader.isComplete(state.inFlight.front().first))
+    {
+      texture.residentMip = state.inFlight.front().second;
+      state.inFlight.pop_front();
+    }
+
+    if (
+      state.decoding.valid() &&
+      state.decoding.wait_for(std::chrono::seconds{0}) == std::future_status::ready)
+    {
+      state.decoded = state.decoding.get();
+      if (!state.decoded.has_value())
+        continue;
+
+      const auto& decoded = *state.decoded;
+      texture.mipCount = static_cast<std::uint32_t>(decoded.mips.size());
+      texture.residentMip = texture.mipCount;
+      texture.image = etna::get_context().createImage(etna::Image::CreateInfo{
+        .extent = vk::Extent3D{decoded.extent.width, decoded.extent.height, 1},
+        .name = texture.name,
+        .format = decoded.srgb ? vk::Format::eR8G8B8A8Srgb : vk::Format::eR8G8B8A8Unorm,
+        .imageUsage = vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eTransferDst,
+        .mipLevels = texture.mipCount,
+      });
+      state.nextMip = texture.mipCount;
+    }
+
+    if (!state.decoded.has_value())
+      continue;
+
+    // Smallest mips first, so that everything gets a blurry version ASAP
+    while (state.nextMip > 0 && budget > 0)
+    {
+      const std::uint32_t mip = state.nextMip - 1;
+      auto& pixels = state.decoded->mips[mip];
+      const auto ticket = uploader.uploadImage(
+        texture.image, mip, mip_extent(state.decoded->extent, mip), TEXEL_SIZE, pixels);
+      state.inFlight.emplace_back(ticket, mip);
+      state.nextMip = mip;
+      submitted = true;
+
+      budget -= std::min(budget, pixels.size());
+      // Staged already, no need to keep it around
+      pixels = {};
+    }
+
+    if (state.nextMip == 0)
+      state.decoded.reset();
+  }
+
+  if (submitted)
+  {
+    uploader.flush();
+    stagingReleased = false;
+  }
+  else if (!stagingReleased && isDone())
+  {
+    uploader.releaseStaging();
+    stagingReleased = true;
+  }
+}
+
+bool TextureStreamer::isDone() const
+{
+  return std::ranges::all_of(streaming, [](const Streaming& state) {
+    return !state.decoding.valid() && !state.decoded.has_value() && state.inFlight.empty();
+  });
+}
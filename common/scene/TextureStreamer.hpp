@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <etna/Image.hpp>
+
+#include "jobs/ThreadPool.hpp"
+#include "GltfReferences.hpp"
+#include "StreamingUploader.hpp"
+
+
+/**
+ * Decodes scene images on a thread pool and uploads them to the GPU one mip at
+ * a time, smallest mip first, with a bounded amount of bytes per update. Nobody
+ * waits for any of this during scene loading, so the time to the first frame
+ * doesn't depend on how many textures the scene has, textures simply get
+ * sharper over the first few frames.
+ */
+class TextureStreamer
+{
+public:
+  struct Texture
+  {
+    std::string name;
+    // Empty until the image is decoded, stays empty if decoding failed
+    etna::Image image;
+    std::uint32_t mipCount = 0;
+    // Mips [residentMip, mipCount) are on the GPU and can be sampled,
+    // clamp the sampler's min LOD to this. Nothing is resident while it equals mipCount.
+    std::uint32_t residentMip = 0;
+  };
+
+  TextureStreamer(ThreadPool& pool, StreamingUploader& uploader);
+  ~TextureStreamer();
+
+  TextureStreamer(const TextureStreamer&) = delete;
+  TextureStreamer& operator=(const TextureStreamer&) = delete;
+
+  // Drops all current textures and starts decoding `sources` in the background.
+  // Textures have the same indices as their sources.
+  void start(std::vector<ImageSource> sources);
+
+  // Creates GPU images for everything that got decoded since the last
+  // call and uploads some more mips. Call this once per frame.
+  void update();
+
+  // Everything is decoded and resident
+  bool isDone() const;
+
+  std::span<const Texture> getTextures() const { return textures; }
+
+  struct DecodedImage
+  {
+    vk::Extent2D extent;
+    bool srgb;
+    // RGBA8 pixels, mips[0] is the full resolution one
+    std::vector<std::vector<std::byte>> mips;
+  };
+
+private:
+  // Waits for all uploads to finish and drops textures
+  void reset();
+
+private:
+  ThreadPool& pool;
+  StreamingUploader& uploader;
+
+  // Set when textures are dropped, so that pending decoding tasks don't waste time
+  std::shared_ptr<std::atomic<bool>> cancelled;
+
+  std::vector<Texture> textures;
+
+  // Per-texture streaming state, parallel to `textures`
+  struct Streaming
+  {
+    std::future<std::optional<DecodedImage>> decoding;
+    std::optional<DecodedImage> decoded;
+    // Mips are uploaded from the smallest one, this is the next one to go
+    std::uint32_t nextMip = 0;
+    // Uploads that are not complete yet, in the order they were submitted
+    std::deque<std::pair<UploadTicket, std::uint32_t>> inFlight;
+  };
+  std::vector<Streaming> streaming;
+  bool stagingReleased = true;
+};
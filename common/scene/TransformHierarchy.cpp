@@ -0,0 +1,97 @@
+#include "TransformHierarchy.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+
+bool TransformHierarchy::isDepthFirst(std::span<const std::uint32_t> parents)
+{
+  // Ancestors of the previous node, the parent of the next one has to be among them
+  std::vector<std::uint32_t> ancestors;
+  for (std::uint32_t node = 0; node < parents.size(); ++node)
+  {
+    const auto parent = parents[node];
+    if (parent != NO_PARENT && parent >= node)
+      return false;
+
+    while (!ancestors.empty() && ancestors.back() != parent)
+      ancestors.pop_back();
+    if (parent != NO_PARENT && ancestors.empty())
+      return false;
+
+    ancestors.push_back(node);
+  }
+  return true;
+}
+
+TransformHierarchy::TransformHierarchy(
+  std::vector<std::uint32_t> node_parents, std::vector<glm::mat4x4> node_locals)
+  : parents{std::move(node_parents)}
+  , subtreeEnds(parents.size())
+  , locals{std::move(node_locals)}
+  , worlds(parents.size())
+  , dirty(parents.size(), 0)
+{
+  // NOTE: offline tools use this without etna, hence plain asserts
+  assert(locals.size() == parents.size());
+  assert(isDepthFirst(parents));
+
+  // Children go after their parents, so walking backwards sees
+  // the whole subtree of a node before the node itself.
+  const auto count = static_cast<std::uint32_t>(parents.size());
+  for (std::uint32_t node = 0; node < count; ++node)
+    subtreeEnds[node] = node + 1;
+  for (std::uint32_t node = count; node-- > 0;)
+    if (parents[node] != NO_PARENT)
+      subtreeEnds[parents[node]] = std::max(subtreeEnds[parents[node]], subtreeEnds[node]);
+
+  recompute(0, count);
+}
+
+void TransformHierarchy::setLocal(std::uint32_t node, const glm::mat4x4& local)
+{
+  locals[node] = local;
+  if (dirty[node] == 0)
+  {
+    dirty[node] = 1;
+    dirtyNodes.push_back(node);
+  }
+}
+
+void TransformHierarchy::update(ChangeCallback on_changed)
+{
+  if (dirtyNodes.empty())
+    return;
+
+  // NOTE: sorting makes sure that a dirty node is visited before its dirty descendants,
+  // which are then skipped, as they were already recomputed as a part of its subtree.
+  std::ranges::sort(dirtyNodes);
+
+  std::uint32_t rangeFirst = dirtyNodes.front();
+  std::uint32_t rangeEnd = rangeFirst;
+  for (const auto node : dirtyNodes)
+  {
+    dirty[node] = 0;
+    if (node < rangeEnd)
+      continue;
+
+    if (node != rangeEnd)
+    {
+      on_changed(rangeFirst, rangeEnd);
+      rangeFirst = node;
+    }
+    rangeEnd = subtreeEnds[node];
+    recompute(node, rangeEnd);
+  }
+  on_changed(rangeFirst, rangeEnd);
+
+  dirtyNodes.clear();
+}
+
+void TransformHierarchy::recompute(std::uint32_t first, std::uint32_t end)
+{
+  // Parents are either outside of the range and up to date, or were recomputed right before
+  for (std::uint32_t node = first; node < end; ++node)
+    worlds[node] =
+      parents[node] == NO_PARENT ? locals[node] : worlds[parents[node]] * locals[node];
+}
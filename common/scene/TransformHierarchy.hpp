@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <function2/function2.hpp>
+
+
+/**
+ * Transforms of scene nodes, flattened into parallel arrays in depth-first order:
+ * parents always go before their children, and all descendants of a node are
+ * stored right after it. Moving a node only marks it as dirty, and `update`
+ * then recomputes world transforms of dirty subtrees and nothing else, so
+ * animating N nodes costs O(N + their descendants), not a pass over the scene.
+ */
+class TransformHierarchy
+{
+public:
+  static constexpr std::uint32_t NO_PARENT = std::numeric_limits<std::uint32_t>::max();
+
+  // Checks that `parents` describe a forest in depth-first order
+  static bool isDepthFirst(std::span<const std::uint32_t> parents);
+
+  TransformHierarchy() = default;
+  // `parents` must be in depth-first order, use NO_PARENT for roots
+  TransformHierarchy(std::vector<std::uint32_t> parents, std::vector<glm::mat4x4> locals);
+
+  std::size_t size() const { return parents.size(); }
+
+  std::span<const std::uint32_t> getParents() const { return parents; }
+  std::span<const glm::mat4x4> getLocals() const { return locals; }
+  // Stale for dirty nodes and their descendants until the next update
+  std::span<const glm::mat4x4> getWorlds() const { return worlds; }
+
+  // Nodes in [node, getSubtreeEnd(node)) are `node` and all of its descendants
+  std::uint32_t getSubtreeEnd(std::uint32_t node) const { return subtreeEnds[node]; }
+
+  void setLocal(std::uint32_t node, const glm::mat4x4& local);
+
+  // Called with [first, end) ranges of nodes whose world transforms have changed
+  using ChangeCallback = fu2::function_view<void(std::uint32_t first, std::uint32_t end) const>;
+
+  // Recomputes world transforms of all dirty subtrees. Adjacent
+  // subtrees are reported as a single range.
+  void update(ChangeCallback on_changed);
+
+private:
+  void recompute(std::uint32_t first, std::uint32_t end);
+
+private:
+  std::vector<std::uint32_t> parents;
+  std::vector<std::uint32_t> subtreeEnds;
+  std::vector<glm::mat4x4> locals;
+  std::vector<glm::mat4x4> worlds;
+
+  // NOTE: not a vector<bool>, these get poked one by one a lot
+  std::vector<std::uint8_t> dirty;
+  std::vector<std::uint32_t> dirtyNodes;
+};
@@ -0,0 +1,249 @@
+#include "VertexConversion.hpp"
+
+#include <array>
+#include <bit>
+#include <cstring>
+#include <utility>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCENE_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+
+// NOTE: 8 vertices at a time with AVX2, 4 otherwise. x86-64 guarantees SSE2,
+// and everything we need fits into SSE2, so there is no point in SSE4 here.
+#if defined(__AVX2__)
+constexpr std::size_t ENCODE_WIDTH = 8;
+#else
+constexpr std::size_t ENCODE_WIDTH = 4;
+#endif
+
+std::uint32_t encode_normal(glm::vec3 normal)
+{
+  const std::int32_t x = static_cast<std::int32_t>(normal.x * 32767.0f);
+  const std::int32_t y = static_cast<std::int32_t>(normal.y * 32767.0f);
+
+  const std::uint32_t sign = normal.z >= 0 ? 0 : 1;
+  const std::uint32_t sx = static_cast<std::uint32_t>(x & 0xfffe) | sign;
+  const std::uint32_t sy = static_cast<std::uint32_t>(y & 0xffff) << 16;
+
+  return sx | sy;
+}
+
+// SoA batch of vectors to be encoded together
+struct NormalBatch
+{
+  alignas(32) std::array<float, ENCODE_WIDTH> x;
+  alignas(32) std::array<float, ENCODE_WIDTH> y;
+  alignas(32) std::array<float, ENCODE_WIDTH> z;
+};
+
+// Vectorized version of encode_normal, must produce exactly the same bits.
+// Float to int conversion truncates in both cases, and the sign test is done
+// with a "not greater or equal" comparison so that NaNs behave the same as well.
+static void encode_normals(const NormalBatch& batch, std::uint32_t* out)
+{
+#if defined(__AVX2__)
+  const __m256 scale = _mm256_set1_ps(32767.0f);
+  const __m256i x = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_load_ps(batch.x.data()), scale));
+  const __m256i y = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_load_ps(batch.y.data()), scale));
+  const __m256 negative =
+    _mm256_cmp_ps(_mm256_load_ps(batch.z.data()), _mm256_setzero_ps(), _CMP_NGE_UQ);
+  const __m256i sign = _mm256_and_si256(_mm256_castps_si256(negative), _mm256_set1_epi32(1));
+  const __m256i sx = _mm256_or_si256(_mm256_and_si256(x, _mm256_set1_epi32(0xfffe)), sign);
+  const __m256i sy = _mm256_slli_epi32(y, 16);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_or_si256(sx, sy));
+#elif defined(SCENE_USE_SSE2)
+  const __m128 scale = _mm_set1_ps(32767.0f);
+  const __m128i x = _mm_cvttps_epi32(_mm_mul_ps(_mm_load_ps(batch.x.data()), scale));
+  const __m128i y = _mm_cvttps_epi32(_mm_mul_ps(_mm_load_ps(batch.y.data()), scale));
+  const __m128 negative = _mm_cmpnge_ps(_mm_load_ps(batch.z.data()), _mm_setzero_ps());
+  const __m128i sign = _mm_and_si128(_mm_castps_si128(negative), _mm_set1_epi32(1));
+  const __m128i sx = _mm_or_si128(_mm_and_si128(x, _mm_set1_epi32(0xfffe)), sign);
+  const __m128i sy = _mm_slli_epi32(y, 16);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_or_si128(sx, sy));
+#else
+  for (std::size_t i = 0; i < ENCODE_WIDTH; ++i)
+    out[i] = encode_normal({batch.x[i], batch.y[i], batch.z[i]});
+#endif
+}
+
+// Reference for encode_normals, one vector at a time
+static void encode_normals_scalar(const NormalBatch& batch, std::uint32_t* out)
+{
+  for (std::size_t i = 0; i < ENCODE_WIDTH; ++i)
+    out[i] = encode_normal({batch.x[i], batch.y[i], batch.z[i]});
+}
+
+const char* simd_normal_encoder_name()
+{
+#if defined(__AVX2__)
+  return "AVX2";
+#elif defined(SCENE_USE_SSE2)
+  return "SSE2";
+#else
+  return "scalar";
+#endif
+}
+
+static constexpr std::size_t texcoord_size(TexcoordFormat format)
+{
+  switch (format)
+  {
+  case TexcoordFormat::Float:
+    return sizeof(float) * 2;
+  case TexcoordFormat::Unorm8:
+    return sizeof(std::uint8_t) * 2;
+  case TexcoordFormat::Unorm16:
+    return sizeof(std::uint16_t) * 2;
+  default:
+    return 0;
+  }
+}
+
+template <TexcoordFormat Format>
+static glm::vec2 read_texcoord(const std::byte* ptr)
+{
+  if constexpr (Format == TexcoordFormat::Float)
+  {
+    glm::vec2 result;
+    std::memcpy(&result, ptr, sizeof(result));
+    return result;
+  }
+  else if constexpr (Format == TexcoordFormat::Unorm8)
+  {
+    std::array<std::uint8_t, 2> value;
+    std::memcpy(value.data(), ptr, sizeof(value));
+    return glm::vec2(static_cast<float>(value[0]), static_cast<float>(value[1])) / 255.0f;
+  }
+  else if constexpr (Format == TexcoordFormat::Unorm16)
+  {
+    std::array<std::uint16_t, 2> value;
+    std::memcpy(value.data(), ptr, sizeof(value));
+    return glm::vec2(static_cast<float>(value[0]), static_cast<float>(value[1])) / 65535.0f;
+  }
+  else
+    return glm::vec2{0};
+}
+
+static void gather_vec3(
+  NormalBatch& batch,
+  std::size_t lane,
+  const std::byte* base,
+  std::size_t index,
+  std::size_t stride)
+{
+  std::array<float, 3> value;
+  std::memcpy(value.data(), base + index * stride, sizeof(value));
+  batch.x[lane] = value[0];
+  batch.y[lane] = value[1];
+  batch.z[lane] = value[2];
+}
+
+// Packed means that every attribute is tightly packed in its own stream,
+// which is by far the most common case. Strides are compile-time constants then.
+template <bool HasNormals, bool HasTangents, TexcoordFormat Texcoords, bool Packed, bool Simd>
+static void convert_kernel(const VertexStreams& streams, std::span<Vertex> out)
+{
+  // glTF normals are vec3, tangents are vec4 with the handedness in w
+  const std::size_t positionStride = Packed ? sizeof(glm::vec3) : streams.positionStride;
+  [[maybe_unused]] const std::size_t normalStride =
+    Packed ? sizeof(glm::vec3) : streams.normalStride;
+  [[maybe_unused]] const std::size_t tangentStride =
+    Packed ? sizeof(glm::vec4) : streams.tangentStride;
+  [[maybe_unused]] const std::size_t texcoordStride =
+    Packed ? texcoord_size(Texcoords) : streams.texcoordStride;
+
+  // Processes `n <= ENCODE_WIDTH` vertices starting from `first`.
+  // For full batches `n` is a constant after inlining, so the loops get unrolled.
+  constexpr auto encode = Simd ? &encode_normals : &encode_normals_scalar;
+  auto processBatch = [&](std::size_t first, std::size_t n) {
+    // Missing attributes fall back to 0, which encodes into 0 as well.
+    // NOTE: if tangents are not available, one could use http://mikktspace.com/
+    // NOTE: if normals are not available, reconstructing them is possible but will look ugly
+    std::array<std::uint32_t, ENCODE_WIDTH> encodedNormals{};
+    std::array<std::uint32_t, ENCODE_WIDTH> encodedTangents{};
+
+    if constexpr (HasNormals)
+    {
+      NormalBatch batch{};
+      for (std::size_t j = 0; j < n; ++j)
+        gather_vec3(batch, j, streams.normals, first + j, normalStride);
+      encode(batch, encodedNormals.data());
+    }
+
+    if constexpr (HasTangents)
+    {
+      NormalBatch batch{};
+      for (std::size_t j = 0; j < n; ++j)
+        gather_vec3(batch, j, streams.tangents, first + j, tangentStride);
+      encode(batch, encodedTangents.data());
+    }
+
+    for (std::size_t j = 0; j < n; ++j)
+    {
+      const std::size_t idx = first + j;
+
+      glm::vec3 pos;
+      std::memcpy(&pos, streams.positions + idx * positionStride, sizeof(pos));
+
+      glm::vec2 texcoord{0};
+      if constexpr (Texcoords != TexcoordFormat::None)
+        texcoord = read_texcoord<Texcoords>(streams.texcoords + idx * texcoordStride);
+
+      auto& vtx = out[idx];
+      vtx.positionAndNormal = glm::vec4(pos, std::bit_cast<float>(encodedNormals[j]));
+      vtx.texCoordAndTangentAndPadding =
+        glm::vec4(texcoord, std::bit_cast<float>(encodedTangents[j]), 0);
+    }
+  };
+
+  const std::size_t count = out.size();
+  std::size_t i = 0;
+  for (; i + ENCODE_WIDTH <= count; i += ENCODE_WIDTH)
+    processBatch(i, ENCODE_WIDTH);
+  if (i < count)
+    processBatch(i, count - i);
+}
+
+using ConvertKernel = void (*)(const VertexStreams&, std::span<Vertex>);
+
+// Bit 0 -- normals, bit 1 -- tangents, bits 2-3 -- texcoord format, bit 4 -- packed,
+// bit 5 -- scalar normal encoder
+static constexpr std::size_t KERNEL_COUNT = 64;
+
+template <std::size_t... Idxs>
+static constexpr std::array<ConvertKernel, sizeof...(Idxs)> make_kernel_table(
+  std::index_sequence<Idxs...>)
+{
+  return {&convert_kernel<
+    (Idxs & 1) != 0,
+    (Idxs & 2) != 0,
+    static_cast<TexcoordFormat>((Idxs >> 2) & 3),
+    (Idxs & 16) != 0,
+    (Idxs & 32) == 0>...};
+}
+
+static constexpr auto CONVERT_KERNELS = make_kernel_table(std::make_index_sequence<KERNEL_COUNT>{});
+
+void convert_vertices(const VertexStreams& streams, std::span<Vertex> out, NormalEncoder encoder)
+{
+  const bool hasNormals = streams.normals != nullptr;
+  const bool hasTangents = streams.tangents != nullptr;
+  const auto texcoords =
+    streams.texcoords != nullptr ? streams.texcoordFormat : TexcoordFormat::None;
+
+  const bool packed = streams.positionStride == sizeof(glm::vec3) &&
+    (!hasNormals || streams.normalStride == sizeof(glm::vec3)) &&
+    (!hasTangents || streams.tangentStride == sizeof(glm::vec4)) &&
+    (texcoords == TexcoordFormat::None || streams.texcoordStride == texcoord_size(texcoords));
+
+  const std::size_t kernelIdx = (hasNormals ? 1 : 0) | (hasTangents ? 2 : 0) |
+    (static_cast<std::size_t>(texcoords) << 2) | (packed ? 16 : 0) |
+    (encoder == NormalEncoder::Scalar ? 32 : 0);
+
+  CONVERT_KERNELS[kernelIdx](streams, out);
+}
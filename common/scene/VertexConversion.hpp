@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include <glm/glm.hpp>
+
+#include "SceneProcessing.hpp"
+
+
+// Packs a unit vector into 32 bits: 16 bits per x and y, sign of z is
+// stored in the lowest bit of x. See decode_normal in unpack_attributes.glsl
+std::uint32_t encode_normal(glm::vec3 normal);
+
+enum class TexcoordFormat : std::uint8_t
+{
+  None,
+  Float,
+  // KHR_mesh_quantization allows normalized integer texture coordinates
+  Unorm8,
+  Unorm16,
+};
+
+// Raw glTF attribute streams of a single primitive. Positions, normals and
+// tangents are always float, missing attributes have null pointers.
+struct VertexStreams
+{
+  const std::byte* positions = nullptr;
+  std::size_t positionStride = 0;
+
+  const std::byte* normals = nullptr;
+  std::size_t normalStride = 0;
+
+  const std::byte* tangents = nullptr;
+  std::size_t tangentStride = 0;
+
+  const std::byte* texcoords = nullptr;
+  std::size_t texcoordStride = 0;
+  TexcoordFormat texcoordFormat = TexcoordFormat::None;
+};
+
+// How convert_vertices encodes normals and tangents. Both give exactly the same bits,
+// Scalar calls encode_normal for every vector and is only there as a reference for
+// checking and benchmarking the SIMD one.
+enum class NormalEncoder : std::uint8_t
+{
+  Simd,
+  Scalar,
+};
+
+// What NormalEncoder::Simd is compiled to: "AVX2", "SSE2" or "scalar"
+const char* simd_normal_encoder_name();
+
+// Converts `out.size()` vertices from glTF streams into our vertex format.
+// Dispatches to a kernel specialized for the exact set of attributes, texcoord
+// format and stride pattern, so there are no per-vertex branches, and normals
+// and tangents are encoded several vertices at a time with SIMD.
+void convert_vertices(
+  const VertexStreams& streams,
+  std::span<Vertex> out,
+  NormalEncoder encoder = NormalEncoder::Simd);
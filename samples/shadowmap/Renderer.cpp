@@ -26,12 +26,26 @@ void Renderer::initVulkan(std::span<const char*> instance_extensions)
 
   deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 
+  // SceneManager tracks GPU uploads with a timeline semaphore,
+  // InstanceCuller generates draws for drawIndexedIndirectCount,
+  // and shadow cascades pick their layer with gl_Layer in the vertex shader
+  // and clamp the depth of casters in front of them.
+  vk::PhysicalDeviceVulkan12Features vulkan12Features{
+    .drawIndirectCount = vk::True,
+    .timelineSemaphore = vk::True,
+    .shaderOutputLayer = vk::True,
+  };
+
   etna::initialize(etna::InitParams{
     .applicationName = "ShadowmapSample",
     .applicationVersion = VK_MAKE_VERSION(0, 1, 0),
     .instanceExtensions = instanceExtensions,
     .deviceExtensions = deviceExtensions,
-    .features = vk::PhysicalDeviceFeatures2{.features = {}},
+    .features =
+      vk::PhysicalDeviceFeatures2{
+        .pNext = &vulkan12Features,
+        .features = {.depthClamp = vk::True},
+      },
     // Replace with an index if etna detects your preferred GPU incorrectly
     .physicalDeviceIndexOverride = {},
     // How much frames we buffer on the GPU without waiting for their completion on the CPU
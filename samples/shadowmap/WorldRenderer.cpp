@@ -1,15 +1,114 @@
 #include "WorldRenderer.hpp"
 
+#include <algorithm>
+#include <array>
+
+#include <etna/Etna.hpp>
 #include <etna/GlobalContext.hpp>
 #include <etna/PipelineManager.hpp>
-#include <etna/RenderTargetStates.hpp>
 #include <etna/Profiling.hpp>
 #include <glm/ext.hpp>
 #include <imgui.h>
 
 
+// Casters of the static layer of the shadow map and the ones drawn on top of it
+constexpr InstanceCuller::InstanceFilter STATIC_CASTERS{
+  .flagsMask = GPU_INSTANCE_DYNAMIC,
+  .flagsValue = 0,
+};
+constexpr InstanceCuller::InstanceFilter DYNAMIC_CASTERS{
+  .flagsMask = GPU_INSTANCE_DYNAMIC,
+  .flagsValue = GPU_INSTANCE_DYNAMIC,
+};
+constexpr vk::Extent3D SHADOW_MAP_EXTENT{2048, 2048, 1};
+constexpr float SPOT_RING_RADIUS = 8.0f;
+constexpr float SPOT_RING_HEIGHT = 6.0f;
+
+// All cascades are culled at once, see InstanceCuller::cullCastersLayered
+static_assert(SHADOW_CASCADE_COUNT <= CULLING_MAX_LAYERS);
+
+// The "practical" split scheme, a blend of logarithmic splits, which keep the size of a texel
+// on the screen the same for all cascades, and uniform ones, which don't spend as much
+// resolution right in front of the camera
+static std::array<float, SHADOW_CASCADE_COUNT + 1> cascade_splits(
+  float near, float far, float lambda)
+{
+  std::array<float, SHADOW_CASCADE_COUNT + 1> result;
+  for (std::size_t i = 0; i < result.size(); ++i)
+  {
+    const float t = static_cast<float>(i) / SHADOW_CASCADE_COUNT;
+    result[i] = glm::mix(near + (far - near) * t, near * std::pow(far / near, t), lambda);
+  }
+  return result;
+}
+
+// Orthographic projection along `light_cam`'s direction that contains the bounding sphere of
+// the [near, far] slice of `cam`'s frustum. Casters in front of it are culled against an
+// extended frustum and clamped to its near plane, so it doesn't have to reach the light.
+static glm::mat4x4 fit_cascade(
+  const Camera& cam, float aspect, float near, float far, const Camera& light_cam)
+{
+  const float tanHalfFov = std::tan(glm::radians(cam.fov) * 0.5f);
+  std::array<glm::vec3, 8> corners;
+  glm::vec3 center(0.0f);
+  for (std::size_t i = 0; i < corners.size(); ++i)
+  {
+    const float depth = i < 4 ? near : far;
+    const float up = ((i & 1) != 0 ? 1.0f : -1.0f) * depth * tanHalfFov;
+    const float right = ((i & 2) != 0 ? 1.0f : -1.0f) * depth * tanHalfFov * aspect;
+    corners[i] = cam.position + cam.forward() * depth + cam.up() * up + cam.right() * right;
+    center += corners[i] / static_cast<float>(corners.size());
+  }
+
+  float radius = 0.0f;
+  for (const auto& corner : corners)
+    radius = std::max(radius, glm::length(corner - center));
+  // NOTE: unlike a tight box, the sphere doesn't change its size when the camera turns,
+  // and rounding keeps it from changing because of float noise when the camera moves.
+  radius = std::ceil(radius * 16.0f) / 16.0f;
+
+  Camera cascadeCam = light_cam;
+  cascadeCam.position = center - light_cam.forward() * radius;
+  const glm::mat4x4 view = cascadeCam.viewTm();
+  glm::mat4x4 proj = glm::orthoLH_ZO(+radius, -radius, +radius, -radius, 0.0f, 2.0f * radius);
+
+  // Moving the cascade by whole texels only keeps edges of shadows from crawling
+  const glm::vec2 halfExtent = glm::vec2(SHADOW_MAP_EXTENT.width, SHADOW_MAP_EXTENT.height) * 0.5f;
+  const glm::vec2 origin = glm::vec2(proj * view * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)) * halfExtent;
+  const glm::vec2 offset = (glm::round(origin) - origin) / halfExtent;
+  proj[3][0] += offset.x;
+  proj[3][1] += offset.y;
+
+  return proj * view;
+}
+
+// Roughly the fraction of the screen's height a sphere covers, 0 when it's out of view.
+// Spheres shrink with the distance, so lights far away get smaller tiles in the atlas.
+static float screen_coverage(
+  const glm::vec3& center, float radius, const Frustum& frustum, const Camera& cam)
+{
+  for (const auto& plane : frustum.planes)
+    if (glm::dot(glm::vec3(plane), center) + plane.w < -radius * glm::length(glm::vec3(plane)))
+      return 0.0f;
+
+  const float distance = glm::length(center - cam.position);
+  if (distance <= radius)
+    return 1.0f;
+  return std::min(radius / (distance * std::tan(glm::radians(cam.fov) * 0.5f)), 1.0f);
+}
+
+static bool sphere_intersects_box(const glm::vec3& center, float radius, const BoundingBox& box)
+{
+  const glm::vec3 offset = glm::clamp(center, box.min, box.max) - center;
+  return glm::dot(offset, offset) <= radius * radius;
+}
+
 WorldRenderer::WorldRenderer()
-  : sceneMgr{std::make_unique<SceneManager>()}
+  : sceneMgr{std::make_unique<SceneManager>(SceneManager::CreateInfo{.positionStream = true})}
+  , cmdRecorder{std::make_unique<SecondaryCmdRecorder>(SecondaryCmdRecorder::CreateInfo{
+      .threadPool = recordingWorkers,
+      .maxChunks = RECORDING_THREADS + 1,
+    })}
 {
 }
 
@@ -23,15 +122,31 @@ void WorldRenderer::allocateResources(glm::uvec2 swapchain_resolution)
     .extent = vk::Extent3D{resolution.x, resolution.y, 1},
     .name = "main_view_depth",
     .format = vk::Format::eD32Sfloat,
-    .imageUsage = vk::ImageUsageFlagBits::eDepthStencilAttachment,
+    .imageUsage =
+      vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eSampled,
   });
+  depthPyramid = std::make_unique<DepthPyramid>(DepthPyramid::CreateInfo{.resolution = resolution});
 
   shadowMap = ctx.createImage(etna::Image::CreateInfo{
-    .extent = vk::Extent3D{2048, 2048, 1},
+    .extent = SHADOW_MAP_EXTENT,
     .name = "shadow_map",
     .format = vk::Format::eD16Unorm,
+    .imageUsage = vk::ImageUsageFlagBits::eDepthStencilAttachment |
+      vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eTransferDst,
+    .layers = SHADOW_CASCADE_COUNT,
+  });
+  staticShadowMap = ctx.createImage(etna::Image::CreateInfo{
+    .extent = SHADOW_MAP_EXTENT,
+    .name = "static_shadow_map",
+    .format = vk::Format::eD16Unorm,
     .imageUsage =
-      vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eSampled,
+      vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eTransferSrc,
+    .layers = SHADOW_CASCADE_COUNT,
+  });
+  shadowMapCache = {};
+  staticShadowMapCache = {};
+  shadowAtlas = std::make_unique<ShadowAtlas>(ShadowAtlas::CreateInfo{
+    .tileUpdateBudget = SPOT_SHADOW_UPDATES,
   });
 
   defaultSampler = etna::Sampler(etna::Sampler::CreateInfo{.name = "default_sampler"});
@@ -48,6 +163,8 @@ void WorldRenderer::allocateResources(glm::uvec2 swapchain_resolution)
 void WorldRenderer::loadScene(std::filesystem::path path)
 {
   sceneMgr->selectScene(path);
+  culler->prepare(*sceneMgr);
+  shadowAtlas->invalidate();
 }
 
 void WorldRenderer::loadShaders()
@@ -55,11 +172,19 @@ void WorldRenderer::loadShaders()
   etna::create_program(
     "simple_material",
     {SHADOWMAP_SHADERS_ROOT "simple_shadow.frag.spv", SHADOWMAP_SHADERS_ROOT "simple.vert.spv"});
-  etna::create_program("simple_shadow", {SHADOWMAP_SHADERS_ROOT "simple.vert.spv"});
+  etna::create_program("simple_shadow", {SHADOWMAP_SHADERS_ROOT "shadow.vert.spv"});
+  etna::create_program("depth_prepass", {SHADOWMAP_SHADERS_ROOT "depth_prepass.vert.spv"});
+
+  culler = std::make_unique<InstanceCuller>(InstanceCuller::CreateInfo{
+    .viewCount = VIEW_COUNT,
+    .layeredViews = {SHADOW_VIEW, DYNAMIC_SHADOW_VIEW},
+  });
 }
 
 void WorldRenderer::setupPipelines(vk::Format swapchain_format)
 {
+  swapchainFormat = swapchain_format;
+
   quadRenderer = std::make_unique<QuadRenderer>(QuadRenderer::CreateInfo{
     .format = swapchain_format,
     .rect = {{0, 0}, {512, 512}},
@@ -71,6 +196,20 @@ void WorldRenderer::setupPipelines(vk::Format swapchain_format)
     }},
   };
 
+  // Depth-only passes fetch positions and nothing else
+  etna::VertexShaderInputDescription positionVertexInputDesc{
+    .bindings = {etna::VertexShaderInputDescription::Binding{
+      .byteStreamDescription = sceneMgr->getPositionFormatDescription(),
+    }},
+  };
+
+
+  const vk::PipelineRasterizationStateCreateInfo sceneRasterization{
+    .polygonMode = vk::PolygonMode::eFill,
+    .cullMode = vk::CullModeFlagBits::eBack,
+    .frontFace = vk::FrontFace::eCounterClockwise,
+    .lineWidth = 1.f,
+  };
 
   auto& pipelineManager = etna::get_context().getPipelineManager();
 
@@ -79,12 +218,38 @@ void WorldRenderer::setupPipelines(vk::Format swapchain_format)
     "simple_material",
     etna::GraphicsPipeline::CreateInfo{
       .vertexShaderInput = sceneVertexInputDesc,
-      .rasterizationConfig =
-        vk::PipelineRasterizationStateCreateInfo{
-          .polygonMode = vk::PolygonMode::eFill,
-          .cullMode = vk::CullModeFlagBits::eBack,
-          .frontFace = vk::FrontFace::eCounterClockwise,
-          .lineWidth = 1.f,
+      .rasterizationConfig = sceneRasterization,
+      .fragmentShaderOutput =
+        {
+          .colorAttachmentFormats = {swapchain_format},
+          .depthAttachmentFormat = vk::Format::eD32Sfloat,
+        },
+    });
+
+  depthPrepassPipeline = {};
+  depthPrepassPipeline = pipelineManager.createGraphicsPipeline(
+    "depth_prepass",
+    etna::GraphicsPipeline::CreateInfo{
+      .vertexShaderInput = positionVertexInputDesc,
+      .rasterizationConfig = sceneRasterization,
+      .fragmentShaderOutput =
+        {
+          .depthAttachmentFormat = vk::Format::eD32Sfloat,
+        },
+    });
+
+  prepassForwardPipeline = {};
+  prepassForwardPipeline = pipelineManager.createGraphicsPipeline(
+    "simple_material",
+    etna::GraphicsPipeline::CreateInfo{
+      .vertexShaderInput = sceneVertexInputDesc,
+      .rasterizationConfig = sceneRasterization,
+      .depthConfig =
+        vk::PipelineDepthStencilStateCreateInfo{
+          .depthTestEnable = vk::True,
+          .depthWriteEnable = vk::False,
+          .depthCompareOp = vk::CompareOp::eEqual,
+          .maxDepthBounds = 1.f,
         },
       .fragmentShaderOutput =
         {
@@ -93,18 +258,17 @@ void WorldRenderer::setupPipelines(vk::Format swapchain_format)
         },
     });
 
+  // Casters between the light and a cascade are flattened onto its near plane instead of
+  // being clipped, see InstanceCuller::cullCasters
+  vk::PipelineRasterizationStateCreateInfo shadowRasterization = sceneRasterization;
+  shadowRasterization.depthClampEnable = vk::True;
+
   shadowPipeline = {};
   shadowPipeline = pipelineManager.createGraphicsPipeline(
     "simple_shadow",
     etna::GraphicsPipeline::CreateInfo{
-      .vertexShaderInput = sceneVertexInputDesc,
-      .rasterizationConfig =
-        vk::PipelineRasterizationStateCreateInfo{
-          .polygonMode = vk::PolygonMode::eFill,
-          .cullMode = vk::CullModeFlagBits::eBack,
-          .frontFace = vk::FrontFace::eCounterClockwise,
-          .lineWidth = 1.f,
-        },
+      .vertexShaderInput = positionVertexInputDesc,
+      .rasterizationConfig = shadowRasterization,
       .fragmentShaderOutput =
         {
           .depthAttachmentFormat = vk::Format::eD16Unorm,
@@ -116,82 +280,178 @@ void WorldRenderer::debugInput(const Keyboard& kb)
 {
   if (kb[KeyboardKey::kQ] == ButtonState::Falling)
     drawDebugFSQuad = !drawDebugFSQuad;
-
-  if (kb[KeyboardKey::kP] == ButtonState::Falling)
-    lightProps.usePerspectiveM = !lightProps.usePerspectiveM;
 }
 
 void WorldRenderer::update(const FramePacket& packet)
 {
   ZoneScoped;
 
+  sceneMgr->update();
+
+  const float aspect = float(resolution.x) / float(resolution.y);
+
   // calc camera matrix
   {
-    const float aspect = float(resolution.x) / float(resolution.y);
     worldViewProj = packet.mainCam.projTm(aspect) * packet.mainCam.viewTm();
   }
 
-  // calc light matrix
+  // calc light matrices
   {
-    const auto mProj = lightProps.usePerspectiveM
-      ? glm::perspectiveLH_ZO(
-          -glm::radians(packet.shadowCam.fov), 1.0f, 1.0f, lightProps.lightTargetDist * 2.0f)
-      : glm::orthoLH_ZO(
-          +lightProps.radius,
-          -lightProps.radius,
-          +lightProps.radius,
-          -lightProps.radius,
-          0.0f,
-          lightProps.lightTargetDist);
-
-    lightMatrix = mProj * packet.shadowCam.viewTm();
+    const auto splits = cascade_splits(
+      packet.mainCam.zNear,
+      std::min(lightProps.shadowDistance, packet.mainCam.zFar),
+      lightProps.splitLambda);
+    for (std::size_t i = 0; i < cascadeMatrices.size(); ++i)
+      cascadeMatrices[i] =
+        fit_cascade(packet.mainCam, aspect, splits[i], splits[i + 1], packet.shadowCam);
 
     lightPos = packet.shadowCam.position;
   }
 
+  updateSpotLights(packet);
+
   // Upload everything to GPU-mapped memory
   {
-    uniformParams.lightMatrix = lightMatrix;
+    std::ranges::copy(cascadeMatrices, uniformParams.cascadeMatrices);
     uniformParams.lightPos = lightPos;
     uniformParams.time = packet.currentTime;
 
     std::memcpy(constants.data(), &uniformParams, sizeof(uniformParams));
   }
+
+  // Find out which parts of the shadow map are out of date
+  {
+    auto isStale = [this](const ShadowCache& cache, std::uint64_t instance_version) {
+      return !cacheShadowMap || !cache.valid || cache.cascadeMatrices != cascadeMatrices ||
+        cache.instanceVersion != instance_version;
+    };
+    // NOTE: without anything dynamic, the static layer would just be copied as is
+    const bool split =
+      cacheShadowMap && splitDynamicCasters && sceneMgr->getDynamicInstanceCount() > 0;
+    shadowMapWork = ShadowMapWork{
+      .staticLayer =
+        split && isStale(staticShadowMapCache, sceneMgr->getStaticInstanceVersion()),
+      .casters = isStale(shadowMapCache, sceneMgr->getInstanceVersion()),
+      .onTopOfStaticLayer = split,
+    };
+
+    if (shadowMapWork.staticLayer)
+      staticShadowMapCache = ShadowCache{
+        .valid = true,
+        .cascadeMatrices = cascadeMatrices,
+        .instanceVersion = sceneMgr->getStaticInstanceVersion(),
+      };
+    if (shadowMapWork.casters)
+      shadowMapCache = ShadowCache{
+        .valid = true,
+        .cascadeMatrices = cascadeMatrices,
+        .instanceVersion = sceneMgr->getInstanceVersion(),
+      };
+  }
 }
 
-void WorldRenderer::renderScene(
-  vk::CommandBuffer cmd_buf, const glm::mat4x4& glob_tm, vk::PipelineLayout pipeline_layout)
+void WorldRenderer::updateSpotLights(const FramePacket& packet)
 {
-  if (!sceneMgr->getVertexBuffer())
-    return;
+  const auto count = static_cast<std::uint32_t>(spotLightProps.count);
+  spotCasterVersions.resize(count, 0);
+  atlasRequests.resize(count);
 
-  cmd_buf.bindVertexBuffers(0, {sceneMgr->getVertexBuffer()}, {0});
-  cmd_buf.bindIndexBuffer(sceneMgr->getIndexBuffer(), 0, vk::IndexType::eUint32);
+  const Frustum viewFrustum = frustum_from_matrix(worldViewProj);
+  const float spin = spotLightProps.animate ? packet.currentTime * 0.2f : 0.0f;
+  for (std::uint32_t i = 0; i < count; ++i)
+  {
+    const float angle =
+      spin + glm::two_pi<float>() * static_cast<float>(i) / static_cast<float>(count);
+    const glm::vec3 ringDir(std::cos(angle), 0.0f, std::sin(angle));
+
+    Camera lightCam{
+      .position = {},
+      .rotation = {},
+      .fov = 2.0f * spotLightProps.outerAngle,
+      .zNear = spotLightProps.range * 0.05f,
+      .zFar = spotLightProps.range,
+    };
+    lightCam.lookAt(
+      ringDir * SPOT_RING_RADIUS + glm::vec3(0.0f, SPOT_RING_HEIGHT, 0.0f),
+      ringDir * SPOT_RING_RADIUS * 0.5f,
+      glm::vec3(0.0f, 1.0f, 0.0f));
+
+    for (const auto& box : sceneMgr->getMovedBounds())
+      if (sphere_intersects_box(lightCam.position, spotLightProps.range, box))
+      {
+        ++spotCasterVersions[i];
+        break;
+      }
+
+    atlasRequests[i] = ShadowAtlas::Request{
+      .coverage =
+        screen_coverage(lightCam.position, spotLightProps.range, viewFrustum, packet.mainCam),
+      .projView = lightCam.projTm(1.0f) * lightCam.viewTm(),
+      .casterVersion = spotCasterVersions[i],
+    };
+
+    auto& light = uniformParams.spotLights[i];
+    light.position = lightCam.position;
+    light.range = spotLightProps.range;
+    light.direction = lightCam.forward();
+    light.cosOuterAngle = std::cos(glm::radians(spotLightProps.outerAngle));
+    light.color = 0.5f + 0.5f * glm::cos(angle + glm::vec3(0.0f, 2.1f, 4.2f));
+  }
 
-  pushConst2M.projView = glob_tm;
+  shadowAtlas->update(atlasRequests);
 
-  auto instanceMeshes = sceneMgr->getInstanceMeshes();
-  auto instanceMatrices = sceneMgr->getInstanceMatrices();
+  // Tiles that are out of date are looked up with the matrices they were drawn with
+  for (std::uint32_t i = 0; i < count; ++i)
+  {
+    auto& light = uniformParams.spotLights[i];
+    const auto tile = shadowAtlas->getTile(i);
+    light.hasShadow = tile.has_value();
+    if (tile.has_value())
+    {
+      light.shadowMatrix = shadowAtlas->getTileMatrix(*tile);
+      light.shadowRect = shadowAtlas->getTileBounds(*tile);
+    }
+  }
+  uniformParams.spotLightCount = count;
+}
 
-  auto meshes = sceneMgr->getMeshes();
-  auto relems = sceneMgr->getRenderElements();
+void WorldRenderer::bindScene(
+  vk::CommandBuffer cmd_buf,
+  const etna::GraphicsPipeline& pipeline,
+  vk::DescriptorSet set,
+  vk::Buffer vertex_buffer)
+{
+  cmd_buf.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline.getVkPipeline());
+  cmd_buf.bindDescriptorSets(
+    vk::PipelineBindPoint::eGraphics, pipeline.getVkPipelineLayout(), 0, {set}, {});
+  cmd_buf.bindVertexBuffers(0, {vertex_buffer}, {0});
+}
 
-  for (std::size_t instIdx = 0; instIdx < instanceMeshes.size(); ++instIdx)
-  {
-    pushConst2M.model = instanceMatrices[instIdx];
+void WorldRenderer::renderScene(
+  vk::CommandBuffer cmd_buf,
+  const glm::mat4x4& glob_tm,
+  const etna::GraphicsPipeline& pipeline,
+  vk::DescriptorSet set,
+  vk::Buffer vertex_buffer,
+  std::uint32_t view,
+  std::uint32_t chunk,
+  std::uint32_t chunk_count)
+{
+  if (!vertex_buffer)
+    return;
 
-    cmd_buf.pushConstants<PushConstants>(
-      pipeline_layout, vk::ShaderStageFlagBits::eVertex, 0, {pushConst2M});
+  bindScene(cmd_buf, pipeline, set, vertex_buffer);
 
-    const auto meshIdx = instanceMeshes[instIdx];
+  const PushConstants pushConst{.projView = glob_tm};
+  cmd_buf.pushConstants<PushConstants>(
+    pipeline.getVkPipelineLayout(), vk::ShaderStageFlagBits::eVertex, 0, {pushConst});
 
-    for (std::size_t j = 0; j < meshes[meshIdx].relemCount; ++j)
-    {
-      const auto relemIdx = meshes[meshIdx].firstRelem + j;
-      const auto& relem = relems[relemIdx];
-      cmd_buf.drawIndexed(relem.indexCount, 1, relem.indexOffset, relem.vertexOffset, 0);
-    }
-  }
+  // Draw commands and instance counts were generated by the culler,
+  // every chunk draws its own range of the culler's batches.
+  const std::uint32_t batchCount = culler->getBatchCount();
+  const std::uint32_t firstBatch = batchCount * chunk / chunk_count;
+  const std::uint32_t lastBatch = batchCount * (chunk + 1) / chunk_count;
+  culler->drawBatches(cmd_buf, view, firstBatch, lastBatch - firstBatch);
 }
 
 void WorldRenderer::renderWorld(
@@ -199,54 +459,340 @@ void WorldRenderer::renderWorld(
 {
   ETNA_PROFILE_GPU(cmd_buf, renderWorld);
 
+  cmdRecorder->nextFrame();
+
+  // NOTE: the shadow map can't use the main view's depth, casters hidden from
+  // the camera might still cast visible shadows.
+  const bool cullOcclusion = occlusionCulling && !cullOnCpu;
+  if (cullOnCpu)
+  {
+    if (shadowMapWork.staticLayer)
+      culler->cullCastersLayeredOnCpu(SHADOW_VIEW, cascadeMatrices, STATIC_CASTERS);
+    if (shadowMapWork.casters && shadowMapWork.onTopOfStaticLayer)
+      culler->cullCastersLayeredOnCpu(DYNAMIC_SHADOW_VIEW, cascadeMatrices, DYNAMIC_CASTERS);
+    else if (shadowMapWork.casters)
+      culler->cullCastersLayeredOnCpu(SHADOW_VIEW, cascadeMatrices);
+    const auto tileUpdates = shadowAtlas->getUpdates();
+    for (std::uint32_t i = 0; i < tileUpdates.size(); ++i)
+      culler->cullCastersOnCpu(SPOT_SHADOW_VIEW + i, tileUpdates[i].projView);
+    culler->cullOnCpu(MAIN_VIEW, worldViewProj);
+  }
+  else
+  {
+    if (shadowMapWork.staticLayer)
+      culler->cullCastersLayered(cmd_buf, SHADOW_VIEW, cascadeMatrices, STATIC_CASTERS);
+    if (shadowMapWork.casters && shadowMapWork.onTopOfStaticLayer)
+      culler->cullCastersLayered(cmd_buf, DYNAMIC_SHADOW_VIEW, cascadeMatrices, DYNAMIC_CASTERS);
+    else if (shadowMapWork.casters)
+      culler->cullCastersLayered(cmd_buf, SHADOW_VIEW, cascadeMatrices);
+    const auto tileUpdates = shadowAtlas->getUpdates();
+    for (std::uint32_t i = 0; i < tileUpdates.size(); ++i)
+      culler->cullCasters(cmd_buf, SPOT_SHADOW_VIEW + i, tileUpdates[i].projView);
+    if (cullOcclusion)
+      culler->cullOcclusion(
+        cmd_buf,
+        MAIN_VIEW,
+        worldViewProj,
+        InstanceCuller::OcclusionPhase::Early,
+        *depthPyramid);
+    else
+      culler->cull(cmd_buf, MAIN_VIEW, worldViewProj);
+  }
+
+  // Chunks without any batches to draw are not worth a command buffer
+  const std::uint32_t chunkCount =
+    std::clamp<std::uint32_t>(culler->getBatchCount(), 1, cmdRecorder->getMaxChunks());
+
   // draw scene to shadowmap
 
+  renderShadowMap(cmd_buf, chunkCount);
+  renderShadowAtlas(cmd_buf, chunkCount);
+
+  // draw final scene to screen
+
+  renderForward(
+    cmd_buf, target_image, target_image_view, vk::AttachmentLoadOp::eClear, chunkCount);
+
+  // Draw whatever became visible since the last frame on top of what was visible back then
+
+  if (cullOcclusion)
   {
-    ETNA_PROFILE_GPU(cmd_buf, renderShadowMap);
+    depthPyramid->build(cmd_buf, mainViewDepth);
+    culler->cullOcclusion(
+      cmd_buf, MAIN_VIEW, worldViewProj, InstanceCuller::OcclusionPhase::Late, *depthPyramid);
+    renderForward(
+      cmd_buf, target_image, target_image_view, vk::AttachmentLoadOp::eLoad, chunkCount);
+  }
 
-    etna::RenderTargetState renderTargets(
+  if (drawDebugFSQuad && debugAtlas)
+    quadRenderer->render(
+      cmd_buf, target_image, target_image_view, shadowAtlas->getImage(), defaultSampler);
+  else if (drawDebugFSQuad)
+    quadRenderer->render(
       cmd_buf,
-      {{0, 0}, {2048, 2048}},
-      {},
-      {.image = shadowMap.get(), .view = shadowMap.getView({})});
+      target_image,
+      target_image_view,
+      shadowMap,
+      defaultSampler,
+      {.baseLayer = static_cast<std::uint32_t>(debugCascade), .layerCount = 1});
+}
 
-    cmd_buf.bindPipeline(vk::PipelineBindPoint::eGraphics, shadowPipeline.getVkPipeline());
-    renderScene(cmd_buf, lightMatrix, shadowPipeline.getVkPipelineLayout());
-  }
+void WorldRenderer::renderShadowMap(vk::CommandBuffer cmd_buf, std::uint32_t chunk_count)
+{
+  if (!shadowMapWork.staticLayer && !shadowMapWork.casters)
+    return;
 
-  // draw final scene to screen
+  ETNA_PROFILE_GPU(cmd_buf, renderShadowMap);
+
+  if (shadowMapWork.staticLayer)
+    renderShadowCasters(
+      cmd_buf, staticShadowMap, vk::AttachmentLoadOp::eClear, SHADOW_VIEW, chunk_count);
+
+  if (!shadowMapWork.casters)
+    return;
 
+  if (!shadowMapWork.onTopOfStaticLayer)
   {
-    ETNA_PROFILE_GPU(cmd_buf, renderForward);
+    renderShadowCasters(cmd_buf, shadowMap, vk::AttachmentLoadOp::eClear, SHADOW_VIEW, chunk_count);
+    return;
+  }
 
-    auto simpleMaterialInfo = etna::get_shader_program("simple_material");
+  etna::set_state(
+    cmd_buf,
+    staticShadowMap.get(),
+    vk::PipelineStageFlagBits2::eTransfer,
+    vk::AccessFlagBits2::eTransferRead,
+    vk::ImageLayout::eTransferSrcOptimal,
+    vk::ImageAspectFlagBits::eDepth);
+  etna::set_state(
+    cmd_buf,
+    shadowMap.get(),
+    vk::PipelineStageFlagBits2::eTransfer,
+    vk::AccessFlagBits2::eTransferWrite,
+    vk::ImageLayout::eTransferDstOptimal,
+    vk::ImageAspectFlagBits::eDepth);
+  etna::flush_barriers(cmd_buf);
+
+  const vk::ImageSubresourceLayers depthLayers{
+    .aspectMask = vk::ImageAspectFlagBits::eDepth,
+    .mipLevel = 0,
+    .baseArrayLayer = 0,
+    .layerCount = SHADOW_CASCADE_COUNT,
+  };
+  cmd_buf.copyImage(
+    staticShadowMap.get(),
+    vk::ImageLayout::eTransferSrcOptimal,
+    shadowMap.get(),
+    vk::ImageLayout::eTransferDstOptimal,
+    {vk::ImageCopy{
+      .srcSubresource = depthLayers,
+      .srcOffset = {},
+      .dstSubresource = depthLayers,
+      .dstOffset = {},
+      .extent = SHADOW_MAP_EXTENT,
+    }});
+
+  renderShadowCasters(
+    cmd_buf, shadowMap, vk::AttachmentLoadOp::eLoad, DYNAMIC_SHADOW_VIEW, chunk_count);
+}
 
+void WorldRenderer::renderShadowCasters(
+  vk::CommandBuffer cmd_buf,
+  etna::Image& target,
+  vk::AttachmentLoadOp load_op,
+  std::uint32_t view,
+  std::uint32_t chunk_count)
+{
+  auto set = etna::create_descriptor_set(
+    etna::get_shader_program("simple_shadow").getDescriptorLayoutId(0),
+    cmd_buf,
+    {etna::Binding{0, constants.genBinding()},
+     etna::Binding{2, sceneMgr->getInstanceBuffer().genBinding()},
+     etna::Binding{3, culler->getVisibleInstances(view).genBinding()}});
+
+  cmdRecorder->render(
+    cmd_buf,
+    {
+      .rect = {{0, 0}, {SHADOW_MAP_EXTENT.width, SHADOW_MAP_EXTENT.height}},
+      .colorAttachments = {},
+      .depthAttachment =
+        SecondaryCmdRecorder::Attachment{
+          .image = target.get(),
+          .view = target.getView({}),
+          .format = vk::Format::eD16Unorm,
+          .loadOp = load_op,
+        },
+      .layerCount = SHADOW_CASCADE_COUNT,
+    },
+    chunk_count,
+    [&](vk::CommandBuffer chunk_buf, std::uint32_t chunk) {
+      if (!sceneMgr->getPositionBuffer())
+        return;
+
+      bindScene(chunk_buf, shadowPipeline, set.getVkSet(), sceneMgr->getPositionBuffer());
+
+      // A caster in several cascades is an instance of the draw for every one of them,
+      // and shadow.vert picks the cascade's matrix and layer by the instance
+      const ShadowPushConstants pushConst{.projView = glm::mat4x4(1.0f), .cascaded = 1};
+      chunk_buf.pushConstants<ShadowPushConstants>(
+        shadowPipeline.getVkPipelineLayout(), vk::ShaderStageFlagBits::eVertex, 0, {pushConst});
+
+      const std::uint32_t batchCount = culler->getBatchCount();
+      const std::uint32_t firstBatch = batchCount * chunk / chunk_count;
+      const std::uint32_t lastBatch = batchCount * (chunk + 1) / chunk_count;
+      culler->drawBatches(chunk_buf, view, firstBatch, lastBatch - firstBatch);
+    });
+}
+
+void WorldRenderer::renderShadowAtlas(vk::CommandBuffer cmd_buf, std::uint32_t chunk_count)
+{
+  const auto tileUpdates = shadowAtlas->getUpdates();
+  if (tileUpdates.empty())
+    return;
+
+  ETNA_PROFILE_GPU(cmd_buf, renderShadowAtlas);
+
+  const auto& atlas = shadowAtlas->getImage();
+  // NOTE: every tile is a pass of its own, so that clearing it leaves the others alone
+  for (std::uint32_t i = 0; i < tileUpdates.size(); ++i)
+  {
+    const std::uint32_t view = SPOT_SHADOW_VIEW + i;
     auto set = etna::create_descriptor_set(
-      simpleMaterialInfo.getDescriptorLayoutId(0),
+      etna::get_shader_program("simple_shadow").getDescriptorLayoutId(0),
       cmd_buf,
       {etna::Binding{0, constants.genBinding()},
-       etna::Binding{
-         1, shadowMap.genBinding(defaultSampler.get(), vk::ImageLayout::eShaderReadOnlyOptimal)}});
+       etna::Binding{2, sceneMgr->getInstanceBuffer().genBinding()},
+       etna::Binding{3, culler->getVisibleInstances(view).genBinding()}});
 
-    etna::RenderTargetState renderTargets(
+    cmdRecorder->render(
       cmd_buf,
-      {{0, 0}, {resolution.x, resolution.y}},
-      {{.image = target_image, .view = target_image_view}},
-      {.image = mainViewDepth.get(), .view = mainViewDepth.getView({})});
-
-    cmd_buf.bindPipeline(vk::PipelineBindPoint::eGraphics, basicForwardPipeline.getVkPipeline());
-    cmd_buf.bindDescriptorSets(
-      vk::PipelineBindPoint::eGraphics,
-      basicForwardPipeline.getVkPipelineLayout(),
-      0,
-      {set.getVkSet()},
-      {});
-
-    renderScene(cmd_buf, worldViewProj, basicForwardPipeline.getVkPipelineLayout());
+      {
+        .rect = tileUpdates[i].rect,
+        .colorAttachments = {},
+        .depthAttachment =
+          SecondaryCmdRecorder::Attachment{
+            .image = atlas.get(),
+            .view = atlas.getView({}),
+            .format = vk::Format::eD16Unorm,
+            .loadOp = vk::AttachmentLoadOp::eClear,
+          },
+      },
+      chunk_count,
+      [&](vk::CommandBuffer chunk_buf, std::uint32_t chunk) {
+        if (!sceneMgr->getPositionBuffer())
+          return;
+
+        bindScene(chunk_buf, shadowPipeline, set.getVkSet(), sceneMgr->getPositionBuffer());
+
+        // Tiles are plain 2D, always the first layer
+        const ShadowPushConstants pushConst{.projView = tileUpdates[i].projView, .cascaded = 0};
+        chunk_buf.pushConstants<ShadowPushConstants>(
+          shadowPipeline.getVkPipelineLayout(), vk::ShaderStageFlagBits::eVertex, 0, {pushConst});
+
+        const std::uint32_t batchCount = culler->getBatchCount();
+        const std::uint32_t firstBatch = batchCount * chunk / chunk_count;
+        const std::uint32_t lastBatch = batchCount * (chunk + 1) / chunk_count;
+        culler->drawBatches(chunk_buf, view, firstBatch, lastBatch - firstBatch);
+      });
   }
+}
 
-  if (drawDebugFSQuad)
-    quadRenderer->render(cmd_buf, target_image, target_image_view, shadowMap, defaultSampler);
+void WorldRenderer::renderForward(
+  vk::CommandBuffer cmd_buf,
+  vk::Image target_image,
+  vk::ImageView target_image_view,
+  vk::AttachmentLoadOp load_op,
+  std::uint32_t chunk_count)
+{
+  if (depthPrepass)
+    renderDepthPrepass(cmd_buf, load_op, chunk_count);
+
+  ETNA_PROFILE_GPU(cmd_buf, renderForward);
+
+  auto simpleMaterialInfo = etna::get_shader_program("simple_material");
+
+  auto set = etna::create_descriptor_set(
+    simpleMaterialInfo.getDescriptorLayoutId(0),
+    cmd_buf,
+    {etna::Binding{0, constants.genBinding()},
+     etna::Binding{
+       1, shadowMap.genBinding(defaultSampler.get(), vk::ImageLayout::eShaderReadOnlyOptimal)},
+     etna::Binding{2, sceneMgr->getInstanceBuffer().genBinding()},
+     etna::Binding{3, culler->getVisibleInstances(MAIN_VIEW).genBinding()},
+     etna::Binding{
+       4,
+       shadowAtlas->getImage().genBinding(
+         defaultSampler.get(), vk::ImageLayout::eShaderReadOnlyOptimal)}});
+
+  const std::array colorAttachments{SecondaryCmdRecorder::Attachment{
+    .image = target_image,
+    .view = target_image_view,
+    .format = swapchainFormat,
+    .loadOp = load_op,
+  }};
+  cmdRecorder->render(
+    cmd_buf,
+    {
+      .rect = {{0, 0}, {resolution.x, resolution.y}},
+      .colorAttachments = colorAttachments,
+      .depthAttachment =
+        SecondaryCmdRecorder::Attachment{
+          .image = mainViewDepth.get(),
+          .view = mainViewDepth.getView({}),
+          .format = vk::Format::eD32Sfloat,
+          .loadOp = depthPrepass ? vk::AttachmentLoadOp::eLoad : load_op,
+        },
+    },
+    chunk_count,
+    [&](vk::CommandBuffer chunk_buf, std::uint32_t chunk) {
+      renderScene(
+        chunk_buf,
+        worldViewProj,
+        depthPrepass ? prepassForwardPipeline : basicForwardPipeline,
+        set.getVkSet(),
+        sceneMgr->getVertexBuffer(),
+        MAIN_VIEW,
+        chunk,
+        chunk_count);
+    });
+}
+
+void WorldRenderer::renderDepthPrepass(
+  vk::CommandBuffer cmd_buf, vk::AttachmentLoadOp load_op, std::uint32_t chunk_count)
+{
+  ETNA_PROFILE_GPU(cmd_buf, renderDepthPrepass);
+
+  auto set = etna::create_descriptor_set(
+    etna::get_shader_program("depth_prepass").getDescriptorLayoutId(0),
+    cmd_buf,
+    {etna::Binding{2, sceneMgr->getInstanceBuffer().genBinding()},
+     etna::Binding{3, culler->getVisibleInstances(MAIN_VIEW).genBinding()}});
+
+  cmdRecorder->render(
+    cmd_buf,
+    {
+      .rect = {{0, 0}, {resolution.x, resolution.y}},
+      .colorAttachments = {},
+      .depthAttachment =
+        SecondaryCmdRecorder::Attachment{
+          .image = mainViewDepth.get(),
+          .view = mainViewDepth.getView({}),
+          .format = vk::Format::eD32Sfloat,
+          .loadOp = load_op,
+        },
+    },
+    chunk_count,
+    [&](vk::CommandBuffer chunk_buf, std::uint32_t chunk) {
+      renderScene(
+        chunk_buf,
+        worldViewProj,
+        depthPrepassPipeline,
+        set.getVkSet(),
+        sceneMgr->getPositionBuffer(),
+        MAIN_VIEW,
+        chunk,
+        chunk_count);
+    });
 }
 
 void WorldRenderer::drawGui()
@@ -267,6 +813,61 @@ void WorldRenderer::drawGui()
     1000.0f / ImGui::GetIO().Framerate,
     ImGui::GetIO().Framerate);
 
+  ImGui::Checkbox("Cull on the CPU", &cullOnCpu);
+  ImGui::Checkbox("Occlusion culling on the GPU", &occlusionCulling);
+  ImGui::Checkbox("Depth pre-pass", &depthPrepass);
+  ImGui::SliderFloat("Shadow distance", &lightProps.shadowDistance, 1.0f, 500.0f);
+  ImGui::SliderFloat("Cascade split lambda", &lightProps.splitLambda, 0.0f, 1.0f);
+  ImGui::SliderInt("Cascade on the debug quad", &debugCascade, 0, SHADOW_CASCADE_COUNT - 1);
+  ImGui::Checkbox("Cache the shadow map", &cacheShadowMap);
+  ImGui::Checkbox("Keep casters that never move in a separate layer", &splitDynamicCasters);
+  ImGui::SliderInt("Spot lights", &spotLightProps.count, 0, MAX_SPOT_LIGHTS);
+  ImGui::SliderFloat("Spot light range", &spotLightProps.range, 1.0f, 50.0f);
+  ImGui::SliderFloat("Spot light angle", &spotLightProps.outerAngle, 5.0f, 60.0f);
+  ImGui::Checkbox("Animate spot lights", &spotLightProps.animate);
+  ImGui::Checkbox("Show the shadow atlas on the debug quad", &debugAtlas);
+  ImGui::Text(
+    "Shadow map: %s, %u dynamic instances",
+    shadowMapWork.casters || shadowMapWork.staticLayer ? "redrawn" : "cached",
+    sceneMgr->getDynamicInstanceCount());
+  const auto atlasStats = shadowAtlas->getStats();
+  ImGui::Text(
+    "Shadow atlas: %u tiles, %.0f%% used, %zu redrawn, %u out of date",
+    atlasStats.tiles,
+    atlasStats.usedArea * 100.0f,
+    shadowAtlas->getUpdates().size(),
+    atlasStats.staleTiles);
+  for (std::uint32_t view = 0; view < VIEW_COUNT; ++view)
+    if (const auto& stats = culler->getStats(view))
+    {
+      if (view == MAIN_VIEW)
+        ImGui::Text("Main view:");
+      else if (view >= SPOT_SHADOW_VIEW)
+        ImGui::Text("Atlas tile update %u:", view - SPOT_SHADOW_VIEW);
+      else
+        ImGui::Text("%s:", view == SHADOW_VIEW ? "Cascades" : "Dynamic casters of cascades");
+      ImGui::SameLine();
+      // Casters are counted once for every cascade they are kept in, so all of them
+      // together might keep more casters than there are
+      if (view == SHADOW_VIEW || view == DYNAMIC_SHADOW_VIEW)
+        ImGui::Text(
+          "%u casters kept by %u cascades out of %u, %u draws, %llu triangles",
+          stats->visibleInstances,
+          SHADOW_CASCADE_COUNT,
+          stats->instances,
+          stats->draws,
+          static_cast<unsigned long long>(stats->triangles));
+      else
+        ImGui::Text(
+          "%u of %u %s, %u rejected, %u draws, %llu triangles",
+          stats->visibleInstances,
+          stats->instances,
+          view == MAIN_VIEW ? "instances visible" : "casters kept",
+          stats->instances - stats->visibleInstances,
+          stats->draws,
+          static_cast<unsigned long long>(stats->triangles));
+    }
+
   ImGui::NewLine();
 
   ImGui::TextColored(ImVec4(1.0f, 1.0f, 0.0f, 1.0f), "Press 'B' to recompile and reload shaders");
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+
 #include <etna/Image.hpp>
 #include <etna/Sampler.hpp>
 #include <etna/Buffer.hpp>
@@ -9,6 +11,11 @@
 #include "shaders/UniformParams.h"
 #include "scene/SceneManager.hpp"
 #include "render_utils/QuadRenderer.hpp"
+#include "render_utils/InstanceCuller.hpp"
+#include "render_utils/SecondaryCmdRecorder.hpp"
+#include "render_utils/DepthPyramid.hpp"
+#include "render_utils/ShadowAtlas.hpp"
+#include "jobs/ThreadPool.hpp"
 #include "wsi/Keyboard.hpp"
 
 #include "FramePacket.hpp"
@@ -36,47 +43,184 @@ public:
     vk::CommandBuffer cmd_buf, vk::Image target_image, vk::ImageView target_image_view);
 
 private:
+  // Places the spot lights and decides which of their tiles in the shadow atlas to redraw
+  void updateSpotLights(const FramePacket& packet);
+
+  void renderForward(
+    vk::CommandBuffer cmd_buf,
+    vk::Image target_image,
+    vk::ImageView target_image_view,
+    vk::AttachmentLoadOp load_op,
+    std::uint32_t chunk_count);
+
+  // Fills the main view's depth, so that the forward pass shades every pixel only once
+  void renderDepthPrepass(
+    vk::CommandBuffer cmd_buf, vk::AttachmentLoadOp load_op, std::uint32_t chunk_count);
+
+  // Brings the shadow map up to date, redrawing only what has changed since it was drawn
+  void renderShadowMap(vk::CommandBuffer cmd_buf, std::uint32_t chunk_count);
+
+  // Draws the casters of all cascades culled into the layered `view` into the layers
+  // of `target` with a single pass, every batch is drawn once for all cascades
+  void renderShadowCasters(
+    vk::CommandBuffer cmd_buf,
+    etna::Image& target,
+    vk::AttachmentLoadOp load_op,
+    std::uint32_t view,
+    std::uint32_t chunk_count);
+
+  // Draws the tiles of the shadow atlas that are out of date, as many as the budget allows
+  void renderShadowAtlas(vk::CommandBuffer cmd_buf, std::uint32_t chunk_count);
+
+  // Secondary command buffers don't inherit any bindings from the primary one,
+  // so every chunk of a pass has to bind everything it draws with.
+  // Depth-only pipelines take the position stream as their vertex buffer.
+  void bindScene(
+    vk::CommandBuffer cmd_buf,
+    const etna::GraphicsPipeline& pipeline,
+    vk::DescriptorSet set,
+    vk::Buffer vertex_buffer);
+
+  // Records a chunk of the scene's draws, see SecondaryCmdRecorder
   void renderScene(
-    vk::CommandBuffer cmd_buf, const glm::mat4x4& glob_tm, vk::PipelineLayout pipeline_layout);
+    vk::CommandBuffer cmd_buf,
+    const glm::mat4x4& glob_tm,
+    const etna::GraphicsPipeline& pipeline,
+    vk::DescriptorSet set,
+    vk::Buffer vertex_buffer,
+    std::uint32_t view,
+    std::uint32_t chunk,
+    std::uint32_t chunk_count);
 
 
 private:
   std::unique_ptr<SceneManager> sceneMgr;
 
+  // Every view is culled separately, see InstanceCuller
+  static constexpr std::uint32_t MAIN_VIEW = 0;
+  // All cascades of the shadow map are culled into the same layered view, see
+  // InstanceCuller::cullCastersLayered, and the same goes for the dynamic ones.
+  static constexpr std::uint32_t SHADOW_VIEW = 1;
+  // Casters drawn on top of the static layer of the shadow map, see ShadowCache
+  static constexpr std::uint32_t DYNAMIC_SHADOW_VIEW = 2;
+  // Every tile of the shadow atlas redrawn in a frame has its own view
+  static constexpr std::uint32_t SPOT_SHADOW_VIEW = 3;
+  static constexpr std::uint32_t SPOT_SHADOW_UPDATES = 4;
+  static constexpr std::uint32_t VIEW_COUNT = SPOT_SHADOW_VIEW + SPOT_SHADOW_UPDATES;
+  std::unique_ptr<InstanceCuller> culler;
+  bool cullOnCpu = false;
+  // Only for the main view, and only when culling on the GPU
+  bool occlusionCulling = true;
+  std::unique_ptr<DepthPyramid> depthPyramid;
+
+  // Passes are recorded into secondary command buffers by the calling thread and these
+  static constexpr std::size_t RECORDING_THREADS = 3;
+  ThreadPool recordingWorkers{RECORDING_THREADS};
+  std::unique_ptr<SecondaryCmdRecorder> cmdRecorder;
+
   etna::Image mainViewDepth;
+  // One layer per cascade
   etna::Image shadowMap;
+  // Only casters that have never moved, see GPU_INSTANCE_DYNAMIC
+  etna::Image staticShadowMap;
+  // Shared by all spot lights, the same size no matter how many of them there are
+  std::unique_ptr<ShadowAtlas> shadowAtlas;
   etna::Sampler defaultSampler;
   etna::Buffer constants;
 
+  // Model matrices come from the scene's instance buffer
   struct PushConstants
   {
     glm::mat4x4 projView;
-    glm::mat4x4 model;
-  } pushConst2M;
+  };
+
+  // Same as in shadow.vert
+  struct ShadowPushConstants
+  {
+    glm::mat4x4 projView;
+    // Cascades come from the visible instances, and their matrices from the constants
+    std::uint32_t cascaded;
+  };
+
+  using CascadeMatrices = std::array<glm::mat4x4, SHADOW_CASCADE_COUNT>;
 
   glm::mat4x4 worldViewProj;
-  glm::mat4x4 lightMatrix;
+  CascadeMatrices cascadeMatrices;
   glm::vec3 lightPos;
 
+  // Cascades are orthographic projections along the shadow camera's direction, every one
+  // of them covers a slice of the main camera's frustum
   struct ShadowMapCam
   {
-    float radius = 10;
-    float lightTargetDist = 24;
-    bool usePerspectiveM = false;
+    // Nothing farther from the main camera than this casts shadows
+    float shadowDistance = 60;
+    // 0 makes all slices the same length, 1 makes their lengths grow geometrically
+    float splitLambda = 0.75f;
   } lightProps;
 
+  // What a shadow map image was last drawn with. Nothing else affects the
+  // depth of the casters, so the image is reused as long as these stay the same.
+  struct ShadowCache
+  {
+    bool valid = false;
+    CascadeMatrices cascadeMatrices;
+    std::uint64_t instanceVersion = 0;
+  };
+
+  // With the split, only casters that have moved are drawn every time something moves,
+  // on top of a copy of the static layer. The static layer is redrawn when the light
+  // moves or an instance moves for the first time.
+  bool cacheShadowMap = true;
+  bool splitDynamicCasters = true;
+  ShadowCache shadowMapCache;
+  ShadowCache staticShadowMapCache;
+
+  // Decided in `update`, so that culling on the CPU is skipped along with everything else
+  struct ShadowMapWork
+  {
+    bool staticLayer;
+    bool casters;
+    // Otherwise all casters are drawn from scratch with SHADOW_VIEW
+    bool onTopOfStaticLayer;
+  } shadowMapWork{};
+
+  // Spot lights stand in a ring above the scene and shine down and inwards
+  struct SpotLightProps
+  {
+    int count = 8;
+    float range = 16;
+    // Half of the cone's angle, in degrees
+    float outerAngle = 35;
+    bool animate = false;
+  } spotLightProps;
+
+  // Bumped for a light whenever instances within its range move
+  std::vector<std::uint64_t> spotCasterVersions;
+  std::vector<ShadowAtlas::Request> atlasRequests;
+
   UniformParams uniformParams{
-    .lightMatrix = {},
+    .cascadeMatrices = {},
     .lightPos = {},
     .time = {},
     .baseColor = {0.9f, 0.92f, 1.0f},
+    .spotLightCount = 0,
+    .spotLights = {},
   };
 
   etna::GraphicsPipeline basicForwardPipeline{};
   etna::GraphicsPipeline shadowPipeline{};
+  // With the pre-pass, the forward pass only shades fragments with exactly the depth
+  // the pre-pass left, and doesn't write depth itself
+  etna::GraphicsPipeline depthPrepassPipeline{};
+  etna::GraphicsPipeline prepassForwardPipeline{};
+  bool depthPrepass = false;
 
   std::unique_ptr<QuadRenderer> quadRenderer;
   bool drawDebugFSQuad = false;
+  // The debug quad shows a single cascade, or the whole atlas
+  int debugCascade = 0;
+  bool debugAtlas = false;
 
   glm::uvec2 resolution;
+  vk::Format swapchainFormat = vk::Format::eUndefined;
 };
@@ -4,12 +4,36 @@
 #include "cpp_glsl_compat.h"
 
 
+// Every cascade is a layer of the shadow map, the first one is the closest to the camera
+#define SHADOW_CASCADE_COUNT 4
+
+// Spot lights share the tiles of the shadow atlas, see ShadowAtlas
+#define MAX_SPOT_LIGHTS 32
+
+struct SpotLight
+{
+  // From world space to texture coordinates of the light's tile in the atlas and depth,
+  // after the perspective division
+  shader_mat4 shadowMatrix;
+  // Texture coordinates of the tile's corners, shadows are never looked up outside of it
+  shader_vec4 shadowRect;
+  shader_vec3 position;
+  shader_float range;
+  shader_vec3 direction;
+  shader_float cosOuterAngle;
+  shader_vec3 color;
+  // False until something is drawn into the light's tile, the light casts no shadows then
+  shader_bool hasShadow;
+};
+
 struct UniformParams
 {
-  shader_mat4 lightMatrix;
+  shader_mat4 cascadeMatrices[SHADOW_CASCADE_COUNT];
   shader_vec3 lightPos;
   shader_float time;
   shader_vec3 baseColor;
+  shader_uint spotLightCount;
+  SpotLight spotLights[MAX_SPOT_LIGHTS];
 };
 
 
@@ -0,0 +1,53 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shader_viewport_layer_array : require
+#extension GL_GOOGLE_include_directive : require
+
+#include "instances.glsl"
+#include "CullingData.h"
+#include "UniformParams.h"
+
+
+// The shadow map only has depth, so this reads the position stream
+// (see SceneManager::getPositionBuffer) instead of whole vertices
+layout(location = 0) in vec3 vPos;
+
+// All cascades are drawn in the same pass and with the same draws. Their visible instances
+// come from layered culling, which keeps the cascade of every one of them (see
+// CULLING_LAYER_SHIFT), and every cascade is drawn into its own layer. Atlas tiles aren't
+// layered, they are drawn with mProjView into the first layer.
+layout(push_constant) uniform params_t
+{
+  mat4 mProjView;
+  uint cascaded;
+} params;
+
+layout(binding = 0, set = 0) uniform AppData
+{
+  UniformParams constants;
+};
+
+// Same bindings as in simple.vert
+layout(binding = 2, set = 0) readonly buffer Instances_t
+{
+  GpuInstance instances[];
+};
+
+layout(binding = 3, set = 0) readonly buffer VisibleInstances_t
+{
+  uint visibleInstances[];
+};
+
+
+void main(void)
+{
+  const uint visible = visibleInstances[gl_InstanceIndex];
+  const GpuInstance instance = instances[visible & CULLING_SLOT_MASK];
+  const vec3 wPos = instance_position(instance, vPos);
+
+  const uint cascade = params.cascaded != 0 ? visible >> CULLING_LAYER_SHIFT : 0;
+  const mat4 projView =
+    params.cascaded != 0 ? constants.cascadeMatrices[cascade] : params.mProjView;
+  gl_Position = projView * vec4(wPos, 1.0);
+  gl_Layer = int(cascade);
+}
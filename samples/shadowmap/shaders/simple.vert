@@ -3,6 +3,7 @@
 #extension GL_GOOGLE_include_directive : require
 
 #include "unpack_attributes.glsl"
+#include "instances.glsl"
 
 
 layout(location = 0) in vec4 vPosNorm;
@@ -11,9 +12,19 @@ layout(location = 1) in vec4 vTexCoordAndTang;
 layout(push_constant) uniform params_t
 {
   mat4 mProjView;
-  mat4 mModel;
 } params;
 
+layout(binding = 2, set = 0) readonly buffer Instances_t
+{
+  GpuInstance instances[];
+};
+
+// Written by the culler, instanced draws start at the first instance of their mesh
+layout(binding = 3, set = 0) readonly buffer VisibleInstances_t
+{
+  uint visibleInstances[];
+};
+
 
 layout (location = 0 ) out VS_OUT
 {
@@ -24,14 +35,20 @@ layout (location = 0 ) out VS_OUT
 } vOut;
 
 out gl_PerVertex { vec4 gl_Position; };
+
+// Same as in depth_prepass.vert
+invariant gl_Position;
+
 void main(void)
 {
-  const vec4 wNorm = vec4(decode_normal(floatBitsToInt(vPosNorm.w)),     0.0f);
-  const vec4 wTang = vec4(decode_normal(floatBitsToInt(vTexCoordAndTang.z)), 0.0f);
+  const GpuInstance instance = instances[visibleInstances[gl_InstanceIndex]];
+
+  const vec3 norm = decode_normal(floatBitsToInt(vPosNorm.w));
+  const vec3 tang = decode_normal(floatBitsToInt(vTexCoordAndTang.z));
 
-  vOut.wPos = (params.mModel * vec4(vPosNorm.xyz, 1.0f)).xyz;
-  vOut.wNorm = normalize(mat3(transpose(inverse(params.mModel))) * wNorm.xyz);
-  vOut.wTangent = normalize(mat3(transpose(inverse(params.mModel))) * wTang.xyz);
+  vOut.wPos = instance_position(instance, vPosNorm.xyz);
+  vOut.wNorm = normalize(instance_normal(instance, norm));
+  vOut.wTangent = normalize(instance_direction(instance, tang));
   vOut.texCoord = vTexCoordAndTang.xy;
 
   gl_Position   = params.mProjView * vec4(vOut.wPos, 1.0);
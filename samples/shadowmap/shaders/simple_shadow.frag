@@ -20,20 +20,77 @@ layout(binding = 0, set = 0) uniform AppData
   UniformParams params;
 };
 
-layout(binding = 1) uniform sampler2D shadowMap;
+layout(binding = 1) uniform sampler2DArray shadowMap;
 
-void main()
+layout(binding = 4) uniform sampler2D shadowAtlas;
+
+// Cascades overlap, the first one that contains the point has the most texels around it
+float cascade_shadow(vec3 pos)
+{
+  for (int cascade = 0; cascade < SHADOW_CASCADE_COUNT; ++cascade)
+  {
+    // orthographic, so no perspective division needed
+    const vec3 posLightSpaceNDC = (params.cascadeMatrices[cascade] * vec4(pos, 1.0f)).xyz;
+
+    // just shift coords from [-1,1] to [0,1]
+    const vec2 shadowTexCoord = posLightSpaceNDC.xy*0.5f + vec2(0.5f, 0.5f);
+
+    const bool outOfView = (shadowTexCoord.x < 0.0001f || shadowTexCoord.x > 0.9999f ||
+      shadowTexCoord.y < 0.0001f || shadowTexCoord.y > 0.9999f);
+    if (outOfView)
+      continue;
+
+    const float depth = textureLod(shadowMap, vec3(shadowTexCoord, cascade), 0).x;
+    return posLightSpaceNDC.z < depth + 0.001f ? 1.0f : 0.0f;
+  }
+  // Farther than the last cascade reaches
+  return 1.0f;
+}
+
+// Spot lights without a tile in the atlas don't cast shadows at all
+float spot_shadow(SpotLight light, vec3 pos)
+{
+  if (!light.hasShadow)
+    return 1.0f;
+
+  const vec4 posTile = light.shadowMatrix * vec4(pos, 1.0f);
+  // Behind the light, which doesn't shine there anyway
+  if (posTile.w <= 0.0f)
+    return 1.0f;
+
+  const vec3 coord = posTile.xyz / posTile.w;
+  const bool outOfTile =
+    any(lessThan(coord.xy, light.shadowRect.xy)) || any(greaterThan(coord.xy, light.shadowRect.zw));
+  if (outOfTile)
+    return 1.0f;
+
+  const float depth = textureLod(shadowAtlas, coord.xy, 0).x;
+  return coord.z < depth + 0.0005f ? 1.0f : 0.0f;
+}
+
+vec3 spot_light(SpotLight light, vec3 pos, vec3 norm)
 {
-  const vec4 posLightClipSpace = params.lightMatrix*vec4(surf.wPos, 1.0f);
+  const vec3 toLight = light.position - pos;
+  const float dist = length(toLight);
+  const vec3 dir = toLight / dist;
 
-  // for orto matrix, we don't need perspective division, you can remove it if you want; this is general case;
-  const vec3 posLightSpaceNDC = posLightClipSpace.xyz/posLightClipSpace.w;
+  // Soft edge over the outer fifth of the cone, fading out towards the range
+  const float cosAngle = dot(-dir, light.direction);
+  const float cone =
+    smoothstep(light.cosOuterAngle, mix(light.cosOuterAngle, 1.0f, 0.2f), cosAngle);
+  const float falloff = clamp(1.0f - dist / light.range, 0.0f, 1.0f);
 
-  // just shift coords from [-1,1] to [0,1]
-  const vec2 shadowTexCoord = posLightSpaceNDC.xy*0.5f + vec2(0.5f, 0.5f);
+  return light.color * max(dot(norm, dir), 0.0f) * cone * falloff * falloff;
+}
+
+void main()
+{
+  const float shadow = cascade_shadow(surf.wPos);
 
-  const bool  outOfView = (shadowTexCoord.x < 0.0001f || shadowTexCoord.x > 0.9999f || shadowTexCoord.y < 0.0091f || shadowTexCoord.y > 0.9999f);
-  const float shadow    = ((posLightSpaceNDC.z < textureLod(shadowMap, shadowTexCoord, 0).x + 0.001f) || outOfView) ? 1.0f : 0.0f;
+  vec3 spotLights = vec3(0.0f);
+  for (uint i = 0u; i < params.spotLightCount; ++i)
+    spotLights += spot_light(params.spotLights[i], surf.wPos, surf.wNorm) *
+      spot_shadow(params.spotLights[i], surf.wPos);
 
   const vec4 dark_violet = vec4(0.59f, 0.0f, 0.82f, 1.0f);
   const vec4 chartreuse  = vec4(0.5f, 1.0f, 0.0f, 1.0f);
@@ -45,5 +102,6 @@ void main()
   const vec4 lightColor = max(dot(surf.wNorm, lightDir), 0.0f) * lightColor1;
   const float ambient = 0.05;
   // Light formula is pretty arbitrary and most definitely wrong
-  out_fragColor = (lightColor * shadow + ambient) * vec4(params.baseColor, 1.0f);
+  out_fragColor =
+    (lightColor * shadow + vec4(spotLights, 0.0f) + ambient) * vec4(params.baseColor, 1.0f);
 }
@@ -1,4 +1,85 @@
-int main()
+#include <charconv>
+#include <filesystem>
+#include <string_view>
+
+#include <spdlog/spdlog.h>
+#include <fmt/std.h>
+
+#include "scene/SceneProcessing.hpp"
+#include "scene/BakedScene.hpp"
+#include "scene/Meshlets.hpp"
+#include "scene/MeshLods.hpp"
+#include "jobs/ThreadPool.hpp"
+
+
+int main(int argc, char** argv)
 {
+  if (argc != 2 && argc != 3)
+  {
+    spdlog::error(
+      "Usage: {} <path to .gltf or .glb scene> [max LOD error relative to mesh size]",
+      argc > 0 ? argv[0] : "baker");
+    return 1;
+  }
+
+  const std::filesystem::path inputPath = argv[1];
+
+  LodSettings lodSettings;
+  if (argc == 3)
+  {
+    const std::string_view arg = argv[2];
+    const auto* argEnd = arg.data() + arg.size();
+    const auto [end, ec] = std::from_chars(arg.data(), argEnd, lodSettings.maxError);
+    if (ec != std::errc{} || end != argEnd || lodSettings.maxError < 0.0f)
+    {
+      spdlog::error("Max LOD error has to be a non-negative number, got '{}'", arg);
+      return 1;
+    }
+  }
+
+  auto maybeModel = load_model(inputPath);
+  if (!maybeModel.has_value())
+    return 1;
+
+  ThreadPool pool;
+  const auto instances = process_instances(*maybeModel, pool);
+  auto meshes = process_meshes(*maybeModel, pool);
+  build_lods(meshes, pool, lodSettings);
+  // NOTE: this reorders triangles of every relem, so it has to happen before writing indices.
+  // LODs are relems too, so they get their own meshlets.
+  const auto meshlets = build_meshlets(meshes, pool);
+
+  const auto outputPath = baked_scene_path(inputPath);
+
+  const bool success = write_baked_scene(
+    outputPath,
+    BakedSceneView{
+      .nodeParents = instances.nodeParents,
+      .nodeLocalTransforms = instances.nodeLocalTransforms,
+      .nodeSources = instances.nodeSources,
+      .instanceNodes = instances.nodes,
+      .instanceMeshes = instances.meshes,
+      .meshes = meshes.meshes,
+      .relems = meshes.relems,
+      .vertices = meshes.vertices,
+      .indices = meshes.indices,
+      .meshlets = meshlets,
+    });
+
+  if (!success)
+    return 1;
+
+  spdlog::info(
+    "Baked {} nodes, {} instances, {} meshes, {} relems (including LODs), {} meshlets, "
+    "{} vertices and {} bytes of indices into '{}'",
+    instances.nodeParents.size(),
+    instances.meshes.size(),
+    meshes.meshes.size(),
+    meshes.relems.size(),
+    meshlets.size(),
+    meshes.vertices.size(),
+    meshes.indices.size(),
+    outputPath);
+
   return 0;
 }
@@ -1,6 +1,9 @@
 #include "App.hpp"
 
 #include <tracy/Tracy.hpp>
+#include <fmt/std.h>
+
+#include "scene/BakedScene.hpp"
 
 
 App::App()
@@ -21,7 +24,17 @@ App::App()
 
   mainCam.lookAt({0, 10, 10}, {0, 0, 0}, {0, 1, 0});
 
-  renderer->loadScene(GRAPHICS_COURSE_RESOURCES_ROOT "/scenes/low_poly_dark_town/scene.gltf");
+  const std::filesystem::path scene =
+    GRAPHICS_COURSE_RESOURCES_ROOT "/scenes/low_poly_dark_town/scene.gltf";
+
+  // Prefer the baked version of the scene, as it loads way faster
+  if (const auto baked = baked_scene_path(scene); std::filesystem::exists(baked))
+    renderer->loadScene(baked);
+  else
+  {
+    spdlog::warn("No baked version of '{}' found, run the baker to speed up loading!", scene);
+    renderer->loadScene(scene);
+  }
 }
 
 void App::run()
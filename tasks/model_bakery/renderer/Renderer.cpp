@@ -23,12 +23,19 @@ void Renderer::initVulkan(std::span<const char*> instance_extensions)
 
   deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 
+  // SceneManager tracks GPU uploads with a timeline semaphore,
+  // and InstanceCuller generates draws for drawIndexedIndirectCount
+  vk::PhysicalDeviceVulkan12Features vulkan12Features{
+    .drawIndirectCount = vk::True,
+    .timelineSemaphore = vk::True,
+  };
+
   etna::initialize(etna::InitParams{
     .applicationName = "model_bakery_renderer",
     .applicationVersion = VK_MAKE_VERSION(0, 1, 0),
     .instanceExtensions = instanceExtensions,
     .deviceExtensions = deviceExtensions,
-    .features = vk::PhysicalDeviceFeatures2{.features = {}},
+    .features = vk::PhysicalDeviceFeatures2{.pNext = &vulkan12Features, .features = {}},
     .physicalDeviceIndexOverride = {},
     .numFramesInFlight = 2,
   });
@@ -1,14 +1,23 @@
 #include "WorldRenderer.hpp"
 
+#include <algorithm>
+#include <cmath>
+
 #include <etna/GlobalContext.hpp>
 #include <etna/PipelineManager.hpp>
-#include <etna/RenderTargetStates.hpp>
 #include <etna/Profiling.hpp>
 #include <glm/ext.hpp>
 
 
+// LODs are selected so that they are at most this many pixels off from the full detail mesh
+constexpr float MAX_LOD_PIXEL_ERROR = 1.0f;
+
 WorldRenderer::WorldRenderer()
-  : sceneMgr{std::make_unique<SceneManager>()}
+  : sceneMgr{std::make_unique<SceneManager>(SceneManager::CreateInfo{.positionStream = true})}
+  , cmdRecorder{std::make_unique<SecondaryCmdRecorder>(SecondaryCmdRecorder::CreateInfo{
+      .threadPool = recordingWorkers,
+      .maxChunks = RECORDING_THREADS + 1,
+    })}
 {
 }
 
@@ -28,7 +37,12 @@ void WorldRenderer::allocateResources(glm::uvec2 swapchain_resolution)
 
 void WorldRenderer::loadScene(std::filesystem::path path)
 {
-  sceneMgr->selectScene(path);
+  if (path.extension() == ".scene")
+    sceneMgr->selectBakedScene(path);
+  else
+    sceneMgr->selectScene(path);
+
+  culler->prepare(*sceneMgr);
 }
 
 void WorldRenderer::loadShaders()
@@ -38,16 +52,36 @@ void WorldRenderer::loadShaders()
     {MODEL_BAKERY_RENDERER_SHADERS_ROOT "static_mesh.frag.spv",
      MODEL_BAKERY_RENDERER_SHADERS_ROOT "static_mesh.vert.spv"});
   etna::create_program("static_mesh", {MODEL_BAKERY_RENDERER_SHADERS_ROOT "static_mesh.vert.spv"});
+  etna::create_program(
+    "depth_prepass", {MODEL_BAKERY_RENDERER_SHADERS_ROOT "depth_prepass.vert.spv"});
+
+  culler = std::make_unique<InstanceCuller>(InstanceCuller::CreateInfo{});
 }
 
 void WorldRenderer::setupPipelines(vk::Format swapchain_format)
 {
+  swapchainFormat = swapchain_format;
+
   etna::VertexShaderInputDescription sceneVertexInputDesc{
     .bindings = {etna::VertexShaderInputDescription::Binding{
       .byteStreamDescription = sceneMgr->getVertexFormatDescription(),
     }},
   };
 
+  // The depth pre-pass fetches positions and nothing else
+  etna::VertexShaderInputDescription positionVertexInputDesc{
+    .bindings = {etna::VertexShaderInputDescription::Binding{
+      .byteStreamDescription = sceneMgr->getPositionFormatDescription(),
+    }},
+  };
+
+  const vk::PipelineRasterizationStateCreateInfo sceneRasterization{
+    .polygonMode = vk::PolygonMode::eFill,
+    .cullMode = vk::CullModeFlagBits::eBack,
+    .frontFace = vk::FrontFace::eCounterClockwise,
+    .lineWidth = 1.f,
+  };
+
   auto& pipelineManager = etna::get_context().getPipelineManager();
 
   staticMeshPipeline = {};
@@ -55,12 +89,39 @@ void WorldRenderer::setupPipelines(vk::Format swapchain_format)
     "static_mesh_material",
     etna::GraphicsPipeline::CreateInfo{
       .vertexShaderInput = sceneVertexInputDesc,
-      .rasterizationConfig =
-        vk::PipelineRasterizationStateCreateInfo{
-          .polygonMode = vk::PolygonMode::eFill,
-          .cullMode = vk::CullModeFlagBits::eBack,
-          .frontFace = vk::FrontFace::eCounterClockwise,
-          .lineWidth = 1.f,
+      .rasterizationConfig = sceneRasterization,
+      .fragmentShaderOutput =
+        {
+          .colorAttachmentFormats = {swapchain_format},
+          .depthAttachmentFormat = vk::Format::eD32Sfloat,
+        },
+    });
+
+  depthPrepassPipeline = {};
+  depthPrepassPipeline = pipelineManager.createGraphicsPipeline(
+    "depth_prepass",
+    etna::GraphicsPipeline::CreateInfo{
+      .vertexShaderInput = positionVertexInputDesc,
+      .rasterizationConfig = sceneRasterization,
+      .fragmentShaderOutput =
+        {
+          .depthAttachmentFormat = vk::Format::eD32Sfloat,
+        },
+    });
+
+  // Depth is already there, every fragment that isn't the closest one is rejected
+  prepassStaticMeshPipeline = {};
+  prepassStaticMeshPipeline = pipelineManager.createGraphicsPipeline(
+    "static_mesh_material",
+    etna::GraphicsPipeline::CreateInfo{
+      .vertexShaderInput = sceneVertexInputDesc,
+      .rasterizationConfig = sceneRasterization,
+      .depthConfig =
+        vk::PipelineDepthStencilStateCreateInfo{
+          .depthTestEnable = vk::True,
+          .depthWriteEnable = vk::False,
+          .depthCompareOp = vk::CompareOp::eEqual,
+          .maxDepthBounds = 1.f,
         },
       .fragmentShaderOutput =
         {
@@ -70,52 +131,104 @@ void WorldRenderer::setupPipelines(vk::Format swapchain_format)
     });
 }
 
-void WorldRenderer::debugInput(const Keyboard&) {}
+void WorldRenderer::debugInput(const Keyboard& kb)
+{
+  if (kb[KeyboardKey::kM] == ButtonState::Falling)
+    meshletCulling = !meshletCulling;
+  if (kb[KeyboardKey::kL] == ButtonState::Falling)
+    lodSelection = !lodSelection;
+  if (kb[KeyboardKey::kZ] == ButtonState::Falling)
+    depthPrepass = !depthPrepass;
+}
 
 void WorldRenderer::update(const FramePacket& packet)
 {
   ZoneScoped;
 
+  sceneMgr->update();
+
   // calc camera matrix
   {
     const float aspect = float(resolution.x) / float(resolution.y);
     worldViewProj = packet.mainCam.projTm(aspect) * packet.mainCam.viewTm();
+    cameraPosition = packet.mainCam.position;
+
+    // Focal length in pixels, so that errors are measured in pixels on screen
+    const float focalLength =
+      float(resolution.y) / (2.0f * std::tan(glm::radians(packet.mainCam.fov) * 0.5f));
+    lodErrorScale = focalLength / MAX_LOD_PIXEL_ERROR;
   }
 }
 
 void WorldRenderer::renderScene(
-  vk::CommandBuffer cmd_buf, const glm::mat4x4& glob_tm, vk::PipelineLayout pipeline_layout)
+  vk::CommandBuffer cmd_buf,
+  const glm::mat4x4& glob_tm,
+  const etna::GraphicsPipeline& pipeline,
+  vk::DescriptorSet set,
+  vk::Buffer vertex_buffer,
+  std::uint32_t chunk,
+  std::uint32_t chunk_count)
 {
-  if (!sceneMgr->getVertexBuffer())
+  if (!vertex_buffer)
     return;
 
-  cmd_buf.bindVertexBuffers(0, {sceneMgr->getVertexBuffer()}, {0});
-  cmd_buf.bindIndexBuffer(sceneMgr->getIndexBuffer(), 0, vk::IndexType::eUint32);
+  cmd_buf.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline.getVkPipeline());
+  cmd_buf.bindDescriptorSets(
+    vk::PipelineBindPoint::eGraphics, pipeline.getVkPipelineLayout(), 0, {set}, {});
+  cmd_buf.bindVertexBuffers(0, {vertex_buffer}, {0});
 
-  pushConst2M.projView = glob_tm;
+  const PushConstants pushConst{.projView = glob_tm};
+  cmd_buf.pushConstants<PushConstants>(
+    pipeline.getVkPipelineLayout(), vk::ShaderStageFlagBits::eVertex, 0, {pushConst});
 
-  auto instanceMeshes = sceneMgr->getInstanceMeshes();
-  auto instanceMatrices = sceneMgr->getInstanceMatrices();
-
-  auto meshes = sceneMgr->getMeshes();
-  auto relems = sceneMgr->getRenderElements();
-
-  for (std::size_t instIdx = 0; instIdx < instanceMeshes.size(); ++instIdx)
+  // Draw commands and instance counts were generated on the GPU by the culler.
+  // Meshlets are always drawn by a single chunk, see renderWorld.
+  if (meshletCulling && culler->hasMeshlets())
   {
-    pushConst2M.model = instanceMatrices[instIdx];
+    culler->drawMeshlets(cmd_buf, 0);
+    return;
+  }
+
+  // Every chunk draws its own range of the culler's batches
+  const std::uint32_t batchCount = culler->getBatchCount();
+  const std::uint32_t firstBatch = batchCount * chunk / chunk_count;
+  const std::uint32_t lastBatch = batchCount * (chunk + 1) / chunk_count;
+  culler->drawBatches(cmd_buf, 0, firstBatch, lastBatch - firstBatch);
+}
 
-    cmd_buf.pushConstants<PushConstants>(
-      pipeline_layout, vk::ShaderStageFlagBits::eVertex, 0, {pushConst2M});
+void WorldRenderer::renderDepthPrepass(vk::CommandBuffer cmd_buf, std::uint32_t chunk_count)
+{
+  ETNA_PROFILE_GPU(cmd_buf, renderDepthPrepass);
 
-    const auto meshIdx = instanceMeshes[instIdx];
+  auto set = etna::create_descriptor_set(
+    etna::get_shader_program("depth_prepass").getDescriptorLayoutId(0),
+    cmd_buf,
+    {etna::Binding{0, sceneMgr->getInstanceBuffer().genBinding()},
+     etna::Binding{1, culler->getVisibleInstances(0).genBinding()}});
 
-    for (std::size_t j = 0; j < meshes[meshIdx].relemCount; ++j)
+  cmdRecorder->render(
+    cmd_buf,
     {
-      const auto relemIdx = meshes[meshIdx].firstRelem + j;
-      const auto& relem = relems[relemIdx];
-      cmd_buf.drawIndexed(relem.indexCount, 1, relem.indexOffset, relem.vertexOffset, 0);
-    }
-  }
+      .rect = {{0, 0}, {resolution.x, resolution.y}},
+      .colorAttachments = {},
+      .depthAttachment =
+        SecondaryCmdRecorder::Attachment{
+          .image = mainViewDepth.get(),
+          .view = mainViewDepth.getView({}),
+          .format = vk::Format::eD32Sfloat,
+        },
+    },
+    chunk_count,
+    [&](vk::CommandBuffer chunk_buf, std::uint32_t chunk) {
+      renderScene(
+        chunk_buf,
+        worldViewProj,
+        depthPrepassPipeline,
+        set.getVkSet(),
+        sceneMgr->getPositionBuffer(),
+        chunk,
+        chunk_count);
+    });
 }
 
 void WorldRenderer::renderWorld(
@@ -123,17 +236,63 @@ void WorldRenderer::renderWorld(
 {
   ETNA_PROFILE_GPU(cmd_buf, renderWorld);
 
+  cmdRecorder->nextFrame();
+
+  culler->cull(
+    cmd_buf,
+    0,
+    worldViewProj,
+    {.cameraPosition = cameraPosition, .errorScale = lodSelection ? lodErrorScale : 0.0f});
+  if (meshletCulling && culler->hasMeshlets())
+    culler->cullMeshlets(cmd_buf, 0, worldViewProj, cameraPosition);
+
+  // Meshlets are drawn with a single indirect draw per index type, so there is nothing to
+  // split, and chunks without any batches to draw are not worth a command buffer.
+  const std::uint32_t chunkCount = meshletCulling && culler->hasMeshlets()
+    ? 1
+    : std::clamp<std::uint32_t>(culler->getBatchCount(), 1, cmdRecorder->getMaxChunks());
+
+  if (depthPrepass)
+    renderDepthPrepass(cmd_buf, chunkCount);
+
   // draw final scene to screen
   {
     ETNA_PROFILE_GPU(cmd_buf, renderForward);
 
-    etna::RenderTargetState renderTargets(
+    auto set = etna::create_descriptor_set(
+      etna::get_shader_program("static_mesh_material").getDescriptorLayoutId(0),
       cmd_buf,
-      {{0, 0}, {resolution.x, resolution.y}},
-      {{.image = target_image, .view = target_image_view}},
-      {.image = mainViewDepth.get(), .view = mainViewDepth.getView({})});
+      {etna::Binding{0, sceneMgr->getInstanceBuffer().genBinding()},
+       etna::Binding{1, culler->getVisibleInstances(0).genBinding()}});
 
-    cmd_buf.bindPipeline(vk::PipelineBindPoint::eGraphics, staticMeshPipeline.getVkPipeline());
-    renderScene(cmd_buf, worldViewProj, staticMeshPipeline.getVkPipelineLayout());
+    const std::array colorAttachments{SecondaryCmdRecorder::Attachment{
+      .image = target_image,
+      .view = target_image_view,
+      .format = swapchainFormat,
+    }};
+    cmdRecorder->render(
+      cmd_buf,
+      {
+        .rect = {{0, 0}, {resolution.x, resolution.y}},
+        .colorAttachments = colorAttachments,
+        .depthAttachment =
+          SecondaryCmdRecorder::Attachment{
+            .image = mainViewDepth.get(),
+            .view = mainViewDepth.getView({}),
+            .format = vk::Format::eD32Sfloat,
+            .loadOp = depthPrepass ? vk::AttachmentLoadOp::eLoad : vk::AttachmentLoadOp::eClear,
+          },
+      },
+      chunkCount,
+      [&](vk::CommandBuffer chunk_buf, std::uint32_t chunk) {
+        renderScene(
+          chunk_buf,
+          worldViewProj,
+          depthPrepass ? prepassStaticMeshPipeline : staticMeshPipeline,
+          set.getVkSet(),
+          sceneMgr->getVertexBuffer(),
+          chunk,
+          chunkCount);
+      });
   }
 }
@@ -7,6 +7,9 @@
 #include <glm/glm.hpp>
 
 #include "scene/SceneManager.hpp"
+#include "render_utils/InstanceCuller.hpp"
+#include "render_utils/SecondaryCmdRecorder.hpp"
+#include "jobs/ThreadPool.hpp"
 #include "wsi/Keyboard.hpp"
 
 #include "FramePacket.hpp"
@@ -30,26 +33,54 @@ public:
     vk::CommandBuffer cmd_buf, vk::Image target_image, vk::ImageView target_image_view);
 
 private:
+  // Records a chunk of the scene's draws, see SecondaryCmdRecorder. Secondary command
+  // buffers don't inherit any bindings, so every chunk binds everything it draws with.
   void renderScene(
-    vk::CommandBuffer cmd_buf, const glm::mat4x4& glob_tm, vk::PipelineLayout pipeline_layout);
+    vk::CommandBuffer cmd_buf,
+    const glm::mat4x4& glob_tm,
+    const etna::GraphicsPipeline& pipeline,
+    vk::DescriptorSet set,
+    vk::Buffer vertex_buffer,
+    std::uint32_t chunk,
+    std::uint32_t chunk_count);
+  void renderDepthPrepass(vk::CommandBuffer cmd_buf, std::uint32_t chunk_count);
 
 
 private:
   std::unique_ptr<SceneManager> sceneMgr;
+  std::unique_ptr<InstanceCuller> culler;
+
+  // Passes are recorded into secondary command buffers by the calling thread and these
+  static constexpr std::size_t RECORDING_THREADS = 3;
+  ThreadPool recordingWorkers{RECORDING_THREADS};
+  std::unique_ptr<SecondaryCmdRecorder> cmdRecorder;
 
   etna::Image mainViewDepth;
   etna::Buffer constants;
 
+  // Model matrices come from the scene's instance buffer
   struct PushConstants
   {
     glm::mat4x4 projView;
-    glm::mat4x4 model;
-  } pushConst2M;
+  };
 
   glm::mat4x4 worldViewProj;
+  glm::vec3 cameraPosition;
+  // See InstanceCuller::LodSelection
+  float lodErrorScale = 0;
   glm::mat4x4 lightMatrix;
 
+  // Toggled with M
+  bool meshletCulling = true;
+  // Toggled with L, only baked scenes have LODs
+  bool lodSelection = true;
+  // Toggled with Z, the main pass only shades fragments the pre-pass left visible
+  bool depthPrepass = false;
+
   etna::GraphicsPipeline staticMeshPipeline{};
+  etna::GraphicsPipeline depthPrepassPipeline{};
+  etna::GraphicsPipeline prepassStaticMeshPipeline{};
 
   glm::uvec2 resolution;
+  vk::Format swapchainFormat = vk::Format::eUndefined;
 };
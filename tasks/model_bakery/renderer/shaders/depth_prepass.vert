@@ -0,0 +1,41 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_GOOGLE_include_directive : require
+
+#include "instances.glsl"
+
+
+// Depth is all the pre-pass writes, so it reads the position stream
+// (see SceneManager::getPositionBuffer) instead of whole vertices
+layout(location = 0) in vec3 vPos;
+
+layout(push_constant) uniform params_t
+{
+  mat4 mProjView;
+} params;
+
+// Same bindings as in static_mesh.vert, so that the same descriptor set layout fits both
+layout(binding = 0, set = 0) readonly buffer Instances_t
+{
+  GpuInstance instances[];
+};
+
+layout(binding = 1, set = 0) readonly buffer VisibleInstances_t
+{
+  uint visibleInstances[];
+};
+
+
+out gl_PerVertex { vec4 gl_Position; };
+
+// NOTE: the forward pass tests depth for equality, so positions have to come out bit for
+// bit the same as in static_mesh.vert, which gets them from instance_position as well.
+invariant gl_Position;
+
+void main(void)
+{
+  const GpuInstance instance = instances[visibleInstances[gl_InstanceIndex]];
+  const vec3 wPos = instance_position(instance, vPos);
+
+  gl_Position = params.mProjView * vec4(wPos, 1.0);
+}
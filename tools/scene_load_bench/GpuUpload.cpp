@@ -0,0 +1,60 @@
+#include "GpuUpload.hpp"
+
+#include <etna/Etna.hpp>
+#include <etna/GlobalContext.hpp>
+
+#include "scene/StreamingUploader.hpp"
+
+
+GpuUpload::GpuUpload()
+{
+  // StreamingUploader tracks copies with a timeline semaphore
+  vk::PhysicalDeviceVulkan12Features vulkan12Features{
+    .timelineSemaphore = vk::True,
+  };
+
+  etna::initialize(etna::InitParams{
+    .applicationName = "SceneLoadBench",
+    .applicationVersion = VK_MAKE_VERSION(0, 1, 0),
+    .features = vk::PhysicalDeviceFeatures2{.pNext = &vulkan12Features, .features = {}},
+  });
+
+  uploader = std::make_unique<StreamingUploader>(StreamingUploader::CreateInfo{});
+}
+
+GpuUpload::~GpuUpload()
+{
+  uploader.reset();
+  etna::shutdown();
+}
+
+void GpuUpload::upload(const ProcessedMeshes& meshes)
+{
+  auto& ctx = etna::get_context();
+  const auto vertexBytes = std::as_bytes(std::span{meshes.vertices});
+
+  etna::Buffer vertexBuffer;
+  etna::Buffer indexBuffer;
+  if (!vertexBytes.empty())
+    vertexBuffer = ctx.createBuffer(etna::Buffer::CreateInfo{
+      .size = vertexBytes.size(),
+      .bufferUsage =
+        vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eVertexBuffer,
+      .memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY,
+      .name = "benchVbuf",
+    });
+  if (!meshes.indices.empty())
+    indexBuffer = ctx.createBuffer(etna::Buffer::CreateInfo{
+      .size = meshes.indices.size(),
+      .bufferUsage = vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eIndexBuffer,
+      .memoryUsage = VMA_MEMORY_USAGE_GPU_ONLY,
+      .name = "benchIbuf",
+    });
+
+  uploader->reserve(vertexBytes.size() + meshes.indices.size());
+  if (!vertexBytes.empty())
+    uploader->upload(vertexBuffer, 0, vertexBytes);
+  if (!meshes.indices.empty())
+    uploader->upload(indexBuffer, 0, meshes.indices);
+  uploader->releaseStaging();
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <memory>
+
+#include "scene/SceneProcessing.hpp"
+
+
+class StreamingUploader;
+
+// Uploads processed meshes the same way SceneManager does, but without overlapping the
+// upload with processing, so that both can be measured separately. Vulkan is initialized
+// for as long as this exists. Only scene_load_bench has this, scene_load_bench_cpu
+// doesn't link etna or the Vulkan loader at all.
+class GpuUpload
+{
+public:
+  GpuUpload();
+  ~GpuUpload();
+
+  GpuUpload(const GpuUpload&) = delete;
+  GpuUpload& operator=(const GpuUpload&) = delete;
+
+  // Waits for the GPU, so the copies are included in the measurement
+  void upload(const ProcessedMeshes& meshes);
+
+private:
+  std::unique_ptr<StreamingUploader> uploader;
+};
@@ -0,0 +1,263 @@
+#include "VertexKernelBench.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "scene/VertexConversion.hpp"
+
+
+// NOTE: not a multiple of any SIMD width, so that the tail batch is checked as well
+static constexpr std::size_t VERTEX_COUNT = (1 << 20) + 3;
+
+// Interleaved layout: position, normal, tangent, texcoord
+static constexpr std::size_t INTERLEAVED_STRIDE = 48;
+static constexpr std::size_t NORMAL_OFFSET = 12;
+static constexpr std::size_t TANGENT_OFFSET = 24;
+static constexpr std::size_t TEXCOORD_OFFSET = 40;
+
+// Values that a vectorized float to int conversion and sign test are the most likely
+// to disagree with the scalar ones on
+static constexpr std::array SPECIAL_VALUES{
+  std::numeric_limits<float>::quiet_NaN(),
+  -std::numeric_limits<float>::quiet_NaN(),
+  std::numeric_limits<float>::signaling_NaN(),
+  std::numeric_limits<float>::infinity(),
+  -std::numeric_limits<float>::infinity(),
+  0.0f,
+  -0.0f,
+  std::numeric_limits<float>::denorm_min(),
+  -std::numeric_limits<float>::denorm_min(),
+  1.0f,
+  -1.0f,
+  1.0001f,
+  -1.0001f,
+  0.5f,
+};
+
+// Every combination of special values for x, y and z
+static constexpr std::size_t SPECIAL_VECTORS =
+  SPECIAL_VALUES.size() * SPECIAL_VALUES.size() * SPECIAL_VALUES.size();
+
+static std::array<float, 3> special_vector(std::size_t idx)
+{
+  const std::size_t n = SPECIAL_VALUES.size();
+  return {SPECIAL_VALUES[idx % n], SPECIAL_VALUES[idx / n % n], SPECIAL_VALUES[idx / n / n]};
+}
+
+// Every attribute both in its own tightly packed stream and interleaved with the others
+struct SyntheticStreams
+{
+  std::vector<std::byte> positions;
+  std::vector<std::byte> normals;
+  std::vector<std::byte> tangents;
+  // Indexed with TexcoordFormat, None is left empty
+  std::array<std::vector<std::byte>, 4> texcoords;
+  std::vector<std::byte> interleaved;
+};
+
+template <class T>
+static void store(std::vector<std::byte>& bytes, std::size_t offset, const T& value)
+{
+  std::memcpy(bytes.data() + offset, &value, sizeof(value));
+}
+
+static SyntheticStreams make_streams()
+{
+  SyntheticStreams result;
+  result.positions.resize(VERTEX_COUNT * 12);
+  result.normals.resize(VERTEX_COUNT * 12);
+  result.tangents.resize(VERTEX_COUNT * 16);
+  result.texcoords[static_cast<std::size_t>(TexcoordFormat::Float)].resize(VERTEX_COUNT * 8);
+  result.texcoords[static_cast<std::size_t>(TexcoordFormat::Unorm8)].resize(VERTEX_COUNT * 2);
+  result.texcoords[static_cast<std::size_t>(TexcoordFormat::Unorm16)].resize(VERTEX_COUNT * 4);
+  result.interleaved.resize(VERTEX_COUNT * INTERLEAVED_STRIDE);
+
+  // Fixed seed, so that every run converts exactly the same data
+  std::mt19937 rng{1337};
+  std::uniform_real_distribution<float> unit{0.0f, 1.0f};
+  std::normal_distribution<float> gaussian;
+  auto randomDirection = [&]() {
+    const std::array<float, 3> v{gaussian(rng), gaussian(rng), gaussian(rng)};
+    const float length = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    return std::array<float, 3>{v[0] / length, v[1] / length, v[2] / length};
+  };
+
+  for (std::size_t i = 0; i < VERTEX_COUNT; ++i)
+  {
+    const std::array<float, 3> position{unit(rng) * 100.0f, unit(rng) * 100.0f, unit(rng)};
+    // Special vectors go through tangents in the opposite order, so that every lane of a
+    // batch sees them with different neighbours
+    const auto normal = i < SPECIAL_VECTORS ? special_vector(i) : randomDirection();
+    const auto tangentDirection =
+      i < SPECIAL_VECTORS ? special_vector(SPECIAL_VECTORS - 1 - i) : randomDirection();
+    const float handedness = unit(rng) < 0.5f ? -1.0f : 1.0f;
+    const std::array<float, 4> tangent{
+      tangentDirection[0], tangentDirection[1], tangentDirection[2], handedness};
+    const std::array<float, 2> texcoord{unit(rng), unit(rng)};
+    const std::array<std::uint8_t, 2> texcoord8{
+      static_cast<std::uint8_t>(rng()), static_cast<std::uint8_t>(rng())};
+    const std::array<std::uint16_t, 2> texcoord16{
+      static_cast<std::uint16_t>(rng()), static_cast<std::uint16_t>(rng())};
+
+    store(result.positions, i * sizeof(position), position);
+    store(result.normals, i * sizeof(normal), normal);
+    store(result.tangents, i * sizeof(tangent), tangent);
+    store(
+      result.texcoords[static_cast<std::size_t>(TexcoordFormat::Float)],
+      i * sizeof(texcoord),
+      texcoord);
+    store(
+      result.texcoords[static_cast<std::size_t>(TexcoordFormat::Unorm8)],
+      i * sizeof(texcoord8),
+      texcoord8);
+    store(
+      result.texcoords[static_cast<std::size_t>(TexcoordFormat::Unorm16)],
+      i * sizeof(texcoord16),
+      texcoord16);
+
+    const std::size_t base = i * INTERLEAVED_STRIDE;
+    store(result.interleaved, base, position);
+    store(result.interleaved, base + NORMAL_OFFSET, normal);
+    store(result.interleaved, base + TANGENT_OFFSET, tangent);
+    // Only one texcoord format is used at a time, so they can share the same bytes
+    store(result.interleaved, base + TEXCOORD_OFFSET, texcoord);
+  }
+
+  return result;
+}
+
+static VertexStreams make_vertex_streams(
+  const SyntheticStreams& data,
+  bool normals,
+  bool tangents,
+  TexcoordFormat texcoords,
+  bool packed)
+{
+  VertexStreams result;
+  if (packed)
+  {
+    result.positions = data.positions.data();
+    result.positionStride = 12;
+    result.normals = normals ? data.normals.data() : nullptr;
+    result.normalStride = 12;
+    result.tangents = tangents ? data.tangents.data() : nullptr;
+    result.tangentStride = 16;
+    result.texcoords = data.texcoords[static_cast<std::size_t>(texcoords)].data();
+    result.texcoordStride = data.texcoords[static_cast<std::size_t>(texcoords)].size() /
+      VERTEX_COUNT;
+  }
+  else
+  {
+    const std::byte* base = data.interleaved.data();
+    result.positions = base;
+    result.positionStride = INTERLEAVED_STRIDE;
+    result.normals = normals ? base + NORMAL_OFFSET : nullptr;
+    result.normalStride = INTERLEAVED_STRIDE;
+    result.tangents = tangents ? base + TANGENT_OFFSET : nullptr;
+    result.tangentStride = INTERLEAVED_STRIDE;
+    result.texcoords = base + TEXCOORD_OFFSET;
+    result.texcoordStride = INTERLEAVED_STRIDE;
+  }
+  if (texcoords == TexcoordFormat::None)
+  {
+    result.texcoords = nullptr;
+    result.texcoordStride = 0;
+  }
+  result.texcoordFormat = texcoords;
+  return result;
+}
+
+static bool check_identical(const SyntheticStreams& data)
+{
+  std::vector<Vertex> scalar(VERTEX_COUNT);
+  std::vector<Vertex> simd(VERTEX_COUNT);
+  const float garbage = std::bit_cast<float>(~0u);
+
+  for (const bool packed : {true, false})
+    for (const bool normals : {false, true})
+      for (const bool tangents : {false, true})
+        for (const auto texcoords :
+             {TexcoordFormat::None,
+              TexcoordFormat::Float,
+              TexcoordFormat::Unorm8,
+              TexcoordFormat::Unorm16})
+        {
+          const auto streams = make_vertex_streams(data, normals, tangents, texcoords, packed);
+
+          // Different garbage in both, so that a byte left unwritten is a mismatch too
+          std::ranges::fill(scalar, Vertex{glm::vec4{0}, glm::vec4{0}});
+          std::ranges::fill(simd, Vertex{glm::vec4{garbage}, glm::vec4{garbage}});
+          convert_vertices(streams, scalar, NormalEncoder::Scalar);
+          convert_vertices(streams, simd, NormalEncoder::Simd);
+
+          for (std::size_t i = 0; i < VERTEX_COUNT; ++i)
+            if (std::memcmp(&scalar[i], &simd[i], sizeof(Vertex)) != 0)
+            {
+              spdlog::error(
+                "Vertex {} differs between the scalar and {} normal encoders "
+                "(normals: {}, tangents: {}, texcoord format: {}, packed: {})!",
+                i,
+                simd_normal_encoder_name(),
+                normals,
+                tangents,
+                static_cast<int>(texcoords),
+                packed);
+              return false;
+            }
+        }
+
+  return true;
+}
+
+static double measure_vertices_per_second(
+  const VertexStreams& streams,
+  NormalEncoder encoder,
+  std::uint32_t repetitions,
+  std::uint32_t warmup)
+{
+  using Clock = std::chrono::steady_clock;
+
+  std::vector<Vertex> out(VERTEX_COUNT);
+  std::vector<double> seconds;
+  for (std::uint32_t run = 0; run < warmup + repetitions; ++run)
+  {
+    const auto start = Clock::now();
+    convert_vertices(streams, out, encoder);
+    const auto end = Clock::now();
+    if (run >= warmup)
+      seconds.push_back(std::chrono::duration<double>(end - start).count());
+  }
+
+  std::ranges::sort(seconds);
+  const double median = seconds[seconds.size() / 2];
+  return median > 0 ? static_cast<double>(VERTEX_COUNT) / median : 0.0;
+}
+
+std::optional<VertexKernelResult> bench_vertex_kernels(
+  std::uint32_t repetitions, std::uint32_t warmup)
+{
+  const auto data = make_streams();
+  if (!check_identical(data))
+    return std::nullopt;
+
+  // What almost every glTF exporter produces
+  const auto streams = make_vertex_streams(data, true, true, TexcoordFormat::Float, true);
+
+  return VertexKernelResult{
+    .simd = simd_normal_encoder_name(),
+    .vertices = VERTEX_COUNT,
+    .scalarVerticesPerSecond =
+      measure_vertices_per_second(streams, NormalEncoder::Scalar, repetitions, warmup),
+    .simdVerticesPerSecond =
+      measure_vertices_per_second(streams, NormalEncoder::Simd, repetitions, warmup),
+  };
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+
+struct VertexKernelResult
+{
+  // What the SIMD normal encoder was compiled to, see simd_normal_encoder_name
+  const char* simd = nullptr;
+  std::size_t vertices = 0;
+  double scalarVerticesPerSecond = 0;
+  double simdVerticesPerSecond = 0;
+};
+
+// Converts synthetic vertices with both the scalar and the SIMD normal encoder and
+// checks that they produce byte-identical vertices for every kind of stream layout,
+// NaN, infinite and denormal normals included. Then measures both on the most common
+// layout. Returns nothing if the encoders disagree.
+std::optional<VertexKernelResult> bench_vertex_kernels(
+  std::uint32_t repetitions, std::uint32_t warmup);
@@ -0,0 +1,443 @@
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <json.hpp>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include <fmt/std.h>
+
+#include "scene/SceneProcessing.hpp"
+#include "jobs/ThreadPool.hpp"
+#include "GpuUpload.hpp"
+#include "VertexKernelBench.hpp"
+
+
+// Measures how long every stage of loading a glTF scene takes, so that
+// load-time regressions can be caught by comparing the output of two builds.
+// scene_load_bench_cpu is built with SCENE_LOAD_BENCH_GPU=0 and is always CPU only.
+
+enum class Stage
+{
+  Parse,
+  Instances,
+  Meshes,
+  Upload,
+  Total,
+};
+
+constexpr std::size_t STAGE_COUNT = 5;
+constexpr std::array<const char*, STAGE_COUNT> STAGE_NAMES{
+  "parse",
+  "instances",
+  "meshes",
+  "upload",
+  "total",
+};
+
+enum class OutputFormat
+{
+  Json,
+  Csv,
+};
+
+struct Options
+{
+  std::vector<std::filesystem::path> scenes;
+  std::uint32_t repetitions = 10;
+  // Runs that are not measured, these warm up the OS file cache and allocators
+  std::uint32_t warmup = 1;
+  bool cpuOnly = !SCENE_LOAD_BENCH_GPU;
+  // Compare the scalar and SIMD vertex conversion instead of loading scenes
+  bool vertexKernels = false;
+  OutputFormat format = OutputFormat::Json;
+  std::optional<std::filesystem::path> output;
+};
+
+struct StageStats
+{
+  double medianMs = 0;
+  double p95Ms = 0;
+};
+
+struct SceneResult
+{
+  std::filesystem::path path;
+  std::size_t vertices = 0;
+  std::size_t indexBytes = 0;
+  std::size_t instances = 0;
+  std::array<StageStats, STAGE_COUNT> stages;
+};
+
+static void print_usage(const char* argv0)
+{
+  fmt::print(
+    "Usage: {} [options] [scenes...]\n"
+    "Loads every scene (by default, every glTF file under {}) several times\n"
+    "and reports how long each loading stage took.\n"
+    "Options:\n"
+    "  --repetitions N   measured runs per scene (default 10)\n"
+    "  --warmup N        unmeasured runs per scene before the measured ones (default 1)\n"
+    "  --cpu-only        skip the GPU upload, no Vulkan device is required\n"
+    "                    (always on for scene_load_bench_cpu, which doesn't link Vulkan)\n"
+    "  --vertex-kernels  instead of loading scenes, check that the scalar and SIMD vertex\n"
+    "                    conversion produce identical vertices and measure both\n"
+    "  --format F        json or csv (default json)\n"
+    "  --output FILE     write the report to FILE instead of stdout\n",
+    argv0,
+    GRAPHICS_COURSE_RESOURCES_ROOT "/scenes");
+}
+
+static std::optional<std::uint32_t> parse_count(std::string_view str)
+{
+  std::uint32_t result = 0;
+  const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), result);
+  if (ec != std::errc{} || ptr != str.data() + str.size())
+    return std::nullopt;
+  return result;
+}
+
+static std::optional<Options> parse_options(int argc, char** argv)
+{
+  Options result;
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string_view arg = argv[i];
+    auto value = [&]() -> std::optional<std::string_view> {
+      if (i + 1 >= argc)
+      {
+        spdlog::error("Option {} requires a value!", arg);
+        return std::nullopt;
+      }
+      return argv[++i];
+    };
+
+    if (arg == "--repetitions" || arg == "--warmup")
+    {
+      const auto str = value();
+      const auto count = str.has_value() ? parse_count(*str) : std::nullopt;
+      if (!count.has_value() || (arg == "--repetitions" && *count == 0))
+      {
+        spdlog::error("Option {} requires a positive number!", arg);
+        return std::nullopt;
+      }
+      (arg == "--repetitions" ? result.repetitions : result.warmup) = *count;
+    }
+    else if (arg == "--cpu-only")
+      result.cpuOnly = true;
+    else if (arg == "--vertex-kernels")
+      result.vertexKernels = true;
+    else if (arg == "--format")
+    {
+      const auto str = value();
+      if (str == "json")
+        result.format = OutputFormat::Json;
+      else if (str == "csv")
+        result.format = OutputFormat::Csv;
+      else
+      {
+        spdlog::error("Unknown output format, expected json or csv!");
+        return std::nullopt;
+      }
+    }
+    else if (arg == "--output")
+    {
+      const auto str = value();
+      if (!str.has_value())
+        return std::nullopt;
+      result.output = std::filesystem::path{*str};
+    }
+    else if (arg.starts_with("--"))
+    {
+      spdlog::error("Unknown option {}!", arg);
+      return std::nullopt;
+    }
+    else
+      result.scenes.emplace_back(arg);
+  }
+
+  if (result.scenes.empty() && !result.vertexKernels)
+  {
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(
+           GRAPHICS_COURSE_RESOURCES_ROOT "/scenes"))
+      if (
+        entry.is_regular_file() &&
+        (entry.path().extension() == ".gltf" || entry.path().extension() == ".glb"))
+        result.scenes.push_back(entry.path());
+    // Directory iteration order is unspecified, but reports should be diffable
+    std::ranges::sort(result.scenes);
+  }
+
+  return result;
+}
+
+// Nearest-rank percentile
+static double percentile(std::vector<double> samples, double p)
+{
+  std::ranges::sort(samples);
+  const auto rank = static_cast<std::size_t>(std::ceil(p * static_cast<double>(samples.size())));
+  return samples[std::clamp<std::size_t>(rank, 1, samples.size()) - 1];
+}
+
+static std::optional<SceneResult> bench_scene(
+  const std::filesystem::path& path,
+  const Options& options,
+  ThreadPool& pool,
+  [[maybe_unused]] GpuUpload* gpu)
+{
+  using Clock = std::chrono::steady_clock;
+  auto elapsedMs = [](Clock::time_point from, Clock::time_point to) {
+    return std::chrono::duration<double, std::milli>(to - from).count();
+  };
+
+  SceneResult result;
+  result.path = path;
+  std::array<std::vector<double>, STAGE_COUNT> samples;
+
+  for (std::uint32_t run = 0; run < options.warmup + options.repetitions; ++run)
+  {
+    const auto start = Clock::now();
+    auto model = load_model(path);
+    if (!model.has_value())
+      return std::nullopt;
+    const auto parsed = Clock::now();
+    const auto instances = process_instances(*model, pool);
+    const auto instancesDone = Clock::now();
+    const auto meshes = process_meshes(*model, pool);
+    const auto meshesDone = Clock::now();
+#if SCENE_LOAD_BENCH_GPU
+    if (gpu != nullptr)
+      gpu->upload(meshes);
+#endif
+    const auto uploaded = Clock::now();
+
+    result.vertices = meshes.vertices.size();
+    result.indexBytes = meshes.indices.size();
+    result.instances = instances.meshes.size();
+
+    if (run < options.warmup)
+      continue;
+
+    samples[static_cast<std::size_t>(Stage::Parse)].push_back(elapsedMs(start, parsed));
+    samples[static_cast<std::size_t>(Stage::Instances)].push_back(
+      elapsedMs(parsed, instancesDone));
+    samples[static_cast<std::size_t>(Stage::Meshes)].push_back(
+      elapsedMs(instancesDone, meshesDone));
+    samples[static_cast<std::size_t>(Stage::Upload)].push_back(elapsedMs(meshesDone, uploaded));
+    samples[static_cast<std::size_t>(Stage::Total)].push_back(elapsedMs(start, uploaded));
+  }
+
+  for (std::size_t stage = 0; stage < STAGE_COUNT; ++stage)
+    result.stages[stage] = StageStats{
+      .medianMs = percentile(samples[stage], 0.5),
+      .p95Ms = percentile(samples[stage], 0.95),
+    };
+
+  return result;
+}
+
+// Throughput of the meshes stage in vertices per second, and of the upload in MiB/s,
+// both computed from the median so that a single hiccup doesn't skew them.
+static double vertices_per_second(const SceneResult& scene)
+{
+  const double ms = scene.stages[static_cast<std::size_t>(Stage::Meshes)].medianMs;
+  return ms > 0 ? static_cast<double>(scene.vertices) / (ms / 1000.0) : 0.0;
+}
+
+static double upload_mebibytes_per_second(const SceneResult& scene)
+{
+  const double ms = scene.stages[static_cast<std::size_t>(Stage::Upload)].medianMs;
+  const double bytes =
+    static_cast<double>(scene.vertices * sizeof(Vertex) + scene.indexBytes);
+  return ms > 0 ? bytes / (1024.0 * 1024.0) / (ms / 1000.0) : 0.0;
+}
+
+static std::string format_json(const Options& options, std::span<const SceneResult> results)
+{
+  nlohmann::json scenes = nlohmann::json::array();
+  for (const auto& scene : results)
+  {
+    nlohmann::json stages = nlohmann::json::object();
+    for (std::size_t stage = 0; stage < STAGE_COUNT; ++stage)
+    {
+      if (options.cpuOnly && stage == static_cast<std::size_t>(Stage::Upload))
+        continue;
+      stages[STAGE_NAMES[stage]] = {
+        {"median_ms", scene.stages[stage].medianMs},
+        {"p95_ms", scene.stages[stage].p95Ms},
+      };
+    }
+
+    nlohmann::json entry{
+      {"scene", scene.path.generic_string()},
+      {"instances", scene.instances},
+      {"vertices", scene.vertices},
+      {"index_bytes", scene.indexBytes},
+      {"stages", std::move(stages)},
+      {"vertices_per_second", vertices_per_second(scene)},
+    };
+    if (!options.cpuOnly)
+      entry["upload_mib_per_second"] = upload_mebibytes_per_second(scene);
+    scenes.push_back(std::move(entry));
+  }
+
+  const nlohmann::json report{
+    {"repetitions", options.repetitions},
+    {"warmup", options.warmup},
+    {"cpu_only", options.cpuOnly},
+    {"scenes", std::move(scenes)},
+  };
+  return report.dump(2) + "\n";
+}
+
+static std::string format_csv(const Options& options, std::span<const SceneResult> results)
+{
+  // One row per scene, so that the whole thing can be pasted into a spreadsheet as is
+  std::string result = "scene,instances,vertices,index_bytes";
+  for (std::size_t stage = 0; stage < STAGE_COUNT; ++stage)
+    if (!options.cpuOnly || stage != static_cast<std::size_t>(Stage::Upload))
+      result += fmt::format(",{0}_median_ms,{0}_p95_ms", STAGE_NAMES[stage]);
+  result += ",vertices_per_second";
+  if (!options.cpuOnly)
+    result += ",upload_mib_per_second";
+  result += "\n";
+
+  for (const auto& scene : results)
+  {
+    result += fmt::format(
+      "\"{}\",{},{},{}",
+      scene.path.generic_string(),
+      scene.instances,
+      scene.vertices,
+      scene.indexBytes);
+    for (std::size_t stage = 0; stage < STAGE_COUNT; ++stage)
+      if (!options.cpuOnly || stage != static_cast<std::size_t>(Stage::Upload))
+        result +=
+          fmt::format(",{:.3f},{:.3f}", scene.stages[stage].medianMs, scene.stages[stage].p95Ms);
+    result += fmt::format(",{:.0f}", vertices_per_second(scene));
+    if (!options.cpuOnly)
+      result += fmt::format(",{:.1f}", upload_mebibytes_per_second(scene));
+    result += "\n";
+  }
+
+  return result;
+}
+
+static std::string format_vertex_kernels(
+  const Options& options, const VertexKernelResult& result)
+{
+  const double speedup = result.scalarVerticesPerSecond > 0
+    ? result.simdVerticesPerSecond / result.scalarVerticesPerSecond
+    : 0.0;
+
+  if (options.format == OutputFormat::Csv)
+    return fmt::format(
+      "simd,vertices,scalar_vertices_per_second,simd_vertices_per_second,speedup\n"
+      "{},{},{:.0f},{:.0f},{:.2f}\n",
+      result.simd,
+      result.vertices,
+      result.scalarVerticesPerSecond,
+      result.simdVerticesPerSecond,
+      speedup);
+
+  const nlohmann::json report{
+    {"repetitions", options.repetitions},
+    {"warmup", options.warmup},
+    {"vertex_kernels",
+     {
+       {"simd", result.simd},
+       {"vertices", result.vertices},
+       {"identical", true},
+       {"scalar_vertices_per_second", result.scalarVerticesPerSecond},
+       {"simd_vertices_per_second", result.simdVerticesPerSecond},
+       {"speedup", speedup},
+     }},
+  };
+  return report.dump(2) + "\n";
+}
+
+static bool write_report(const Options& options, const std::string& report)
+{
+  if (!options.output.has_value())
+  {
+    std::cout << report;
+    return true;
+  }
+
+  std::ofstream out(*options.output, std::ios::trunc);
+  out << report;
+  if (!out)
+  {
+    spdlog::error("Failed to write the report to '{}'!", *options.output);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  // The report might go to stdout, keep logs out of its way
+  spdlog::set_default_logger(spdlog::stderr_color_mt("stderr"));
+
+  if (argc > 1 && (std::string_view{argv[1]} == "--help" || std::string_view{argv[1]} == "-h"))
+  {
+    print_usage(argv[0]);
+    return 0;
+  }
+
+  const auto options = parse_options(argc, argv);
+  if (!options.has_value())
+  {
+    print_usage(argc > 0 ? argv[0] : "scene_load_bench");
+    return 1;
+  }
+
+  if (options->vertexKernels)
+  {
+    // A mismatch has already been reported, there is nothing to measure then
+    const auto result = bench_vertex_kernels(options->repetitions, options->warmup);
+    if (!result.has_value())
+      return 1;
+    return write_report(*options, format_vertex_kernels(*options, *result)) ? 0 : 1;
+  }
+
+  std::vector<SceneResult> results;
+  {
+    ThreadPool pool;
+    GpuUpload* gpu = nullptr;
+#if SCENE_LOAD_BENCH_GPU
+    // Initializes Vulkan, so only when the upload is measured
+    std::optional<GpuUpload> gpuUpload;
+    if (!options->cpuOnly)
+      gpu = &gpuUpload.emplace();
+#endif
+
+    for (const auto& scene : options->scenes)
+    {
+      spdlog::info("Benchmarking '{}'", scene);
+      auto result = bench_scene(scene, *options, pool, gpu);
+      if (!result.has_value())
+      {
+        spdlog::error("Failed to load '{}', skipping it!", scene);
+        continue;
+      }
+      results.push_back(std::move(*result));
+    }
+  }
+
+  const auto report = options->format == OutputFormat::Json ? format_json(*options, results)
+                                                            : format_csv(*options, results);
+  if (!write_report(*options, report))
+    return 1;
+
+  return results.size() == options->scenes.size() ? 0 : 1;
+}